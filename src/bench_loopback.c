@@ -0,0 +1,465 @@
+// SPDX-License-Identifier: GPL-3.0-only
+//
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free Software Foundation, version 3.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+// See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with this program.
+// If not, see <https://www.gnu.org/licenses/>.
+
+// End to end benchmark (make bench)
+// mqtt_wss_client publishes to in-process TLS + WebSocket + MQTT peer
+// listening on 127.0.0.1. The peer implements just enough of a broker
+// to accept the connection and answer PUBLISH (PUBACK), PINGREQ and DISCONNECT.
+// Latency is time from mqtt_wss_publish5 call until the peer parsed
+// the message (QOS0) or until PUBACK was processed by the client (QOS1).
+// CPU per message is CPU time of the publishing thread only.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <openssl/ssl.h>
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+
+#include "mqtt_wss_client.h"
+
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define PEER_BUF_SIZE (4 * 1024 * 1024)
+#define MAX_INFLIGHT 32768
+#define BENCH_TOPIC "bench/loopback"
+#define PAYLOAD_TS_SIZE sizeof(uint64_t)
+
+static const size_t msg_sizes[] = { 16, 256, 4096, 65536 };
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t thread_cpu_ns(void)
+{
+    struct rusage ru;
+    getrusage(RUSAGE_THREAD, &ru);
+    return ((uint64_t)ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000
+        + ((uint64_t)ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000;
+}
+
+// state of single benchmark run shared between peer and publisher
+static struct {
+    uint64_t *latencies;
+    size_t latencies_count; // updated atomically
+    uint64_t publish_ts[UINT16_MAX + 1];
+    size_t acked;
+    int qos;
+} run;
+
+static void record_latency(uint64_t ns)
+{
+    size_t idx = __atomic_fetch_add(&run.latencies_count, 1, __ATOMIC_RELAXED);
+    run.latencies[idx] = ns;
+}
+
+// ---------- loopback peer ----------
+
+static SSL_CTX *peer_ssl_ctx(void)
+{
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+    EVP_PKEY *pkey = NULL;
+    EVP_PKEY_CTX *pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+    X509 *cert = X509_new();
+    if (!ctx || !pctx || !cert)
+        goto err;
+
+    if (EVP_PKEY_keygen_init(pctx) <= 0 ||
+        EVP_PKEY_CTX_set_ec_paramgen_curve_nid(pctx, NID_X9_62_prime256v1) <= 0 ||
+        EVP_PKEY_keygen(pctx, &pkey) <= 0)
+        goto err;
+
+    // throwaway self signed certificate (client doesn't check it)
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+    X509_gmtime_adj(X509_get_notBefore(cert), 0);
+    X509_gmtime_adj(X509_get_notAfter(cert), 3600);
+    X509_set_pubkey(cert, pkey);
+    X509_NAME *name = X509_get_subject_name(cert);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char *)"localhost", -1, -1, 0);
+    X509_set_issuer_name(cert, name);
+    if (!X509_sign(cert, pkey, EVP_sha256()) ||
+        SSL_CTX_use_certificate(ctx, cert) != 1 ||
+        SSL_CTX_use_PrivateKey(ctx, pkey) != 1)
+        goto err;
+
+    X509_free(cert);
+    EVP_PKEY_free(pkey);
+    EVP_PKEY_CTX_free(pctx);
+    return ctx;
+err:
+    fprintf(stderr, "Failed to create TLS context for loopback peer\n");
+    X509_free(cert);
+    EVP_PKEY_free(pkey);
+    EVP_PKEY_CTX_free(pctx);
+    SSL_CTX_free(ctx);
+    return NULL;
+}
+
+static int peer_ws_handshake(SSL *ssl)
+{
+    char req[4096];
+    size_t len = 0;
+    char *end;
+    do {
+        int ret = SSL_read(ssl, req + len, sizeof(req) - 1 - len);
+        if (ret <= 0)
+            return 1;
+        len += ret;
+        req[len] = 0;
+    } while (!(end = strstr(req, "\r\n\r\n")) && len < sizeof(req) - 1);
+
+    char *key = strcasestr(req, "Sec-WebSocket-Key:");
+    if (!end || !key)
+        return 1;
+    key += strlen("Sec-WebSocket-Key:");
+    while (*key == ' ')
+        key++;
+    char *key_end = strstr(key, "\r\n");
+
+    char concat[256];
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_len;
+    char accept[64];
+    snprintf(concat, sizeof(concat), "%.*s%s", (int)(key_end - key), key, WS_GUID);
+    EVP_Digest(concat, strlen(concat), digest, &digest_len, EVP_sha1(), NULL);
+    EVP_EncodeBlock((unsigned char *)accept, digest, digest_len);
+
+    char reply[512];
+    int reply_len = snprintf(reply, sizeof(reply),
+        "HTTP/1.1 101 Switching Protocols\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Protocol: mqtt\r\n"
+        "Sec-WebSocket-Accept: %s\r\n\r\n", accept);
+    return SSL_write(ssl, reply, reply_len) != reply_len;
+}
+
+// appends unmasked WebSocket binary frame payloads from ws to mqtt
+// returns bytes of ws consumed
+static size_t peer_ws_unframe(unsigned char *ws, size_t len, unsigned char *mqtt, size_t *mqtt_len)
+{
+    size_t pos = 0;
+    while (len - pos >= 2) {
+        unsigned char *hdr = ws + pos;
+        size_t payload = hdr[1] & 0x7F;
+        size_t hdr_len = 2;
+        if (payload == 126) {
+            if (len - pos < 4)
+                break;
+            payload = (hdr[2] << 8) | hdr[3];
+            hdr_len = 4;
+        } else if (payload == 127) {
+            if (len - pos < 10)
+                break;
+            payload = 0;
+            for (int i = 0; i < 8; i++)
+                payload = (payload << 8) | hdr[2 + i];
+            hdr_len = 10;
+        }
+        unsigned char *mask = hdr + hdr_len;
+        hdr_len += 4;
+        if (len - pos < hdr_len + payload)
+            break;
+        if ((hdr[0] & 0x0F) == 0x02) {
+            for (size_t i = 0; i < payload; i++)
+                mqtt[(*mqtt_len)++] = hdr[hdr_len + i] ^ mask[i % 4];
+        }
+        pos += hdr_len + payload;
+    }
+    return pos;
+}
+
+static size_t peer_vbi(const unsigned char *data, size_t len, size_t *value)
+{
+    size_t mul = 1, i = 0;
+    *value = 0;
+    do {
+        if (i >= len || i >= 4)
+            return 0;
+        *value += (data[i] & 0x7F) * mul;
+        mul <<= 7;
+    } while (data[i++] & 0x80);
+    return i;
+}
+
+static void peer_reply(unsigned char *out, size_t *out_len, const unsigned char *mqtt, size_t len)
+{
+    out[(*out_len)++] = 0x82;
+    out[(*out_len)++] = len;
+    memcpy(out + *out_len, mqtt, len);
+    *out_len += len;
+}
+
+// processes all complete MQTT packets, returns bytes consumed or -1 on DISCONNECT
+static ssize_t peer_mqtt_process(const unsigned char *data, size_t len, unsigned char *out, size_t *out_len)
+{
+    size_t pos = 0;
+    while (len - pos >= 2) {
+        size_t remaining;
+        size_t vbi_len = peer_vbi(data + pos + 1, len - pos - 1, &remaining);
+        if (!vbi_len || len - pos < 1 + vbi_len + remaining)
+            break;
+        const unsigned char *pkt = data + pos + 1 + vbi_len;
+        switch (data[pos] >> 4) {
+            case 1: { // CONNECT
+                static const unsigned char connack[] = { 0x20, 0x03, 0x00, 0x00, 0x00 };
+                peer_reply(out, out_len, connack, sizeof(connack));
+                break;
+            }
+            case 3: { // PUBLISH
+                int qos = (data[pos] >> 1) & 0x3;
+                size_t off = 2 + ((pkt[0] << 8) | pkt[1]);
+                uint16_t packet_id = 0;
+                if (qos) {
+                    packet_id = (pkt[off] << 8) | pkt[off + 1];
+                    off += 2;
+                }
+                size_t props_len;
+                off += peer_vbi(pkt + off, remaining - off, &props_len);
+                off += props_len;
+                if (!qos && remaining - off >= PAYLOAD_TS_SIZE) {
+                    uint64_t ts;
+                    memcpy(&ts, pkt + off, sizeof(ts));
+                    record_latency(now_ns() - ts);
+                }
+                if (qos) {
+                    unsigned char puback[] = { 0x40, 0x02, packet_id >> 8, packet_id & 0xFF };
+                    peer_reply(out, out_len, puback, sizeof(puback));
+                }
+                break;
+            }
+            case 12: { // PINGREQ
+                static const unsigned char pingresp[] = { 0xD0, 0x00 };
+                peer_reply(out, out_len, pingresp, sizeof(pingresp));
+                break;
+            }
+            case 14: // DISCONNECT
+                return -1;
+        }
+        pos += 1 + vbi_len + remaining;
+    }
+    return pos;
+}
+
+static void peer_serve(SSL *ssl)
+{
+    unsigned char *ws = malloc(PEER_BUF_SIZE);
+    // partial packet left over + whole ws buffer
+    unsigned char *mqtt = malloc(PEER_BUF_SIZE * 2);
+    // replies are at most 6 bytes per 4+ byte packet read
+    unsigned char *out = malloc(PEER_BUF_SIZE * 2);
+    size_t ws_len = 0, mqtt_len = 0;
+
+    if (!ws || !mqtt || !out || peer_ws_handshake(ssl))
+        goto done;
+
+    for (;;) {
+        int ret = SSL_read(ssl, ws + ws_len, PEER_BUF_SIZE - ws_len);
+        if (ret <= 0)
+            break;
+        ws_len += ret;
+
+        size_t consumed = peer_ws_unframe(ws, ws_len, mqtt, &mqtt_len);
+        memmove(ws, ws + consumed, ws_len - consumed);
+        ws_len -= consumed;
+
+        size_t out_len = 0;
+        ssize_t processed = peer_mqtt_process(mqtt, mqtt_len, out, &out_len);
+        if (out_len && SSL_write(ssl, out, out_len) <= 0)
+            break;
+        if (processed < 0)
+            break;
+        memmove(mqtt, mqtt + processed, mqtt_len - processed);
+        mqtt_len -= processed;
+    }
+done:
+    free(ws);
+    free(mqtt);
+    free(out);
+}
+
+struct peer {
+    int listen_fd;
+    int port;
+    SSL_CTX *ssl_ctx;
+};
+
+static void *peer_thread(void *arg)
+{
+    struct peer *peer = arg;
+    int fd;
+    while ((fd = accept(peer->listen_fd, NULL, NULL)) >= 0) {
+        SSL *ssl = SSL_new(peer->ssl_ctx);
+        SSL_set_fd(ssl, fd);
+        if (SSL_accept(ssl) == 1)
+            peer_serve(ssl);
+        SSL_shutdown(ssl);
+        SSL_free(ssl);
+        close(fd);
+    }
+    return NULL;
+}
+
+static int peer_start(struct peer *peer, pthread_t *thread)
+{
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = 0 };
+    socklen_t addr_len = sizeof(addr);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (!(peer->ssl_ctx = peer_ssl_ctx()))
+        return 1;
+    if ((peer->listen_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+        bind(peer->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+        listen(peer->listen_fd, 1) ||
+        getsockname(peer->listen_fd, (struct sockaddr *)&addr, &addr_len)) {
+        perror("Loopback peer socket");
+        return 1;
+    }
+    peer->port = ntohs(addr.sin_port);
+    return pthread_create(thread, NULL, peer_thread, peer);
+}
+
+// ---------- publisher ----------
+
+// peer closes TLS right after DISCONNECT which client reports as SSL_read error
+static void log_cb(mqtt_wss_log_type_t log_type, const char *str)
+{
+    if (log_type >= MQTT_WSS_LOG_ERROR && !strstr(str, "checking completely disabled") && !strstr(str, "SSL_ERROR_ZERO_RETURN"))
+        fprintf(stderr, "%s\n", str);
+}
+
+static void puback_cb(uint16_t packet_id)
+{
+    record_latency(now_ns() - run.publish_ts[packet_id]);
+    run.acked++;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static size_t count_for(size_t msg_len)
+{
+    size_t count = (256 * 1024 * 1024) / (msg_len + 64);
+    return count > 200000 ? 200000 : count;
+}
+
+static int bench_run(int port, int qos, size_t msg_len)
+{
+    size_t count = count_for(msg_len);
+    char *msg = calloc(1, msg_len);
+    memset(&run, 0, sizeof(run));
+    run.qos = qos;
+    run.latencies = calloc(count, sizeof(uint64_t));
+    if (!msg || !run.latencies)
+        return 1;
+
+    mqtt_wss_client client = mqtt_wss_new("bench", log_cb, NULL, puback_cb);
+    if (!client)
+        return 1;
+    mqtt_wss_set_max_buf_size(client, 64 * 1024 * 1024);
+
+    struct mqtt_connect_params params = {
+        .clientid = "bench",
+        .username = "bench",
+        .password = "bench",
+        .keep_alive = 60
+    };
+    if (mqtt_wss_connect(client, "127.0.0.1", port, &params, MQTT_WSS_SSL_DONT_CHECK_CERTS, NULL)) {
+        fprintf(stderr, "Couldn't connect to loopback peer\n");
+        mqtt_wss_destroy(client);
+        return 1;
+    }
+
+    uint64_t cpu_start = thread_cpu_ns();
+    uint64_t start = now_ns();
+    size_t sent = 0;
+    int rc = 0;
+    while (!rc) {
+        for (int burst = 0; burst < 64 && sent < count; burst++) {
+            if (qos && sent - run.acked >= MAX_INFLIGHT)
+                break;
+            uint64_t ts = now_ns();
+            uint16_t packet_id;
+            memcpy(msg, &ts, PAYLOAD_TS_SIZE);
+            if (mqtt_wss_publish5(client, BENCH_TOPIC, CALLER_RESPONSIBILITY, msg, NULL, msg_len, qos ? MQTT_WSS_PUB_QOS1 : MQTT_WSS_PUB_QOS0, &packet_id))
+                break; // buffer full, let it drain
+            if (qos)
+                run.publish_ts[packet_id] = ts;
+            sent++;
+        }
+        size_t done = qos ? run.acked : __atomic_load_n(&run.latencies_count, __ATOMIC_RELAXED);
+        if (done >= count)
+            break;
+        rc = mqtt_wss_service(client, sent < count ? 0 : 100) < 0;
+    }
+    uint64_t elapsed = now_ns() - start;
+    uint64_t cpu = thread_cpu_ns() - cpu_start;
+
+    mqtt_wss_disconnect(client, 1000);
+    mqtt_wss_destroy(client);
+
+    if (rc) {
+        fprintf(stderr, "Connection to loopback peer failed during benchmark\n");
+    } else {
+        size_t samples = run.latencies_count;
+        qsort(run.latencies, samples, sizeof(uint64_t), cmp_u64);
+        printf("QOS%d %8zu %9zu %12.0f %10.1f %10.1f %10.1f %10.2f\n", qos, msg_len, count,
+            count / (elapsed / 1e9),
+            (double)count * msg_len / (elapsed / 1e9) / (1024 * 1024),
+            run.latencies[samples / 2] / 1e3,
+            run.latencies[samples * 99 / 100] / 1e3,
+            (double)cpu / count / 1e3);
+    }
+    free(run.latencies);
+    free(msg);
+    return rc;
+}
+
+int main(void)
+{
+    struct peer peer;
+    pthread_t thread;
+
+    signal(SIGPIPE, SIG_IGN);
+    if (peer_start(&peer, &thread))
+        return 1;
+
+    printf("%-4s %8s %9s %12s %10s %10s %10s %10s\n", "qos", "size", "msgs", "msgs/s", "MiB/s", "p50 us", "p99 us", "cpu us/msg");
+    int rc = 0;
+    for (int qos = 0; qos <= 1; qos++)
+        for (size_t i = 0; i < sizeof(msg_sizes) / sizeof(msg_sizes[0]); i++)
+            rc |= bench_run(peer.port, qos, msg_sizes[i]);
+
+    shutdown(peer.listen_fd, SHUT_RDWR);
+    close(peer.listen_fd);
+    pthread_join(thread, NULL);
+    SSL_CTX_free(peer.ssl_ctx);
+    return rc;
+}
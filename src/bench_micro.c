@@ -0,0 +1,167 @@
+// SPDX-License-Identifier: GPL-3.0-only
+//
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free Software Foundation, version 3.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+// See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with this program.
+// If not, see <https://www.gnu.org/licenses/>.
+
+// Microbenchmarks of hot path building blocks (make bench)
+// mqtt_ng internals are measured by functions compiled in with MQTT_WSS_BENCH
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mqtt_wss_log.h"
+#include "mqtt_ng.h"
+#include "ws_client.h"
+#include "ws_mask.h"
+
+int mqtt_vbi_to_uint32(char *input, uint32_t *output);
+double bench_mqtt_ng_generate_publish(mqtt_wss_log_ctx_t log, size_t msg_len, size_t count);
+double bench_mqtt_ng_generate_prepared_publish(mqtt_wss_log_ctx_t log, size_t msg_len, size_t count);
+double bench_mqtt_ng_parse_publish(mqtt_wss_log_ctx_t log, size_t msg_len, size_t count);
+double bench_mqtt_ng_garbage_collect(mqtt_wss_log_ctx_t log, size_t packets, int rounds);
+double bench_mqtt_ng_send_behind_unacked(mqtt_wss_log_ctx_t log, size_t unacked, size_t count);
+
+// prevents compiler from optimizing benchmarked code away
+static volatile uint32_t sink;
+
+static const size_t msg_sizes[] = { 16, 256, 4096, 65536 };
+#define MSG_SIZES_COUNT (sizeof(msg_sizes) / sizeof(msg_sizes[0]))
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// keeps total amount of data processed per test roughly constant
+static size_t iterations_for(size_t msg_len)
+{
+    size_t count = (256 * 1024 * 1024) / (msg_len + 64);
+    return count > 1000000 ? 1000000 : count;
+}
+
+static void report(const char *name, size_t param, double ns_per_op, size_t bytes_per_op)
+{
+    if (ns_per_op < 0) {
+        printf("%-28s %8zu       FAILED\n", name, param);
+        return;
+    }
+    printf("%-28s %8zu %12.1f ns/op", name, param, ns_per_op);
+    if (bytes_per_op && ns_per_op > 0)
+        printf(" %10.1f MiB/s", bytes_per_op / ns_per_op * 1e9 / (1024 * 1024));
+    putchar('\n');
+}
+
+static void bench_vbi(void)
+{
+    // values spread over all four encoded lengths
+    static const uint32_t values[] = { 5, 127, 128, 16383, 16384, 2097151, 2097152, 268435455 };
+    const size_t count = 20000000;
+    char encoded[sizeof(values) / sizeof(values[0])][4];
+    uint32_t acc = 0;
+
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < count; i++) {
+        size_t idx = i % (sizeof(values) / sizeof(values[0]));
+        acc += uint32_to_mqtt_vbi(values[idx] - (i & 1), encoded[idx]);
+    }
+    report("uint32_to_mqtt_vbi", 0, (double)(now_ns() - start) / count, 0);
+
+    start = now_ns();
+    for (size_t i = 0; i < count; i++) {
+        uint32_t result;
+        acc += mqtt_vbi_to_uint32(encoded[i % (sizeof(values) / sizeof(values[0]))], &result);
+        acc += result;
+    }
+    report("mqtt_vbi_to_uint32", 0, (double)(now_ns() - start) / count, 0);
+    sink = acc;
+}
+
+// framing + masking of single binary frame into write buffer
+static void bench_ws_send(mqtt_wss_log_ctx_t log)
+{
+    char *host = "localhost";
+    char *data = calloc(1, msg_sizes[MSG_SIZES_COUNT - 1]);
+
+    for (size_t s = 0; s < MSG_SIZES_COUNT; s++) {
+        size_t len = msg_sizes[s];
+        size_t count = iterations_for(len);
+        ws_client *client = ws_client_new(0, &host, log);
+        if (!client || !data) {
+            report("ws_client_send", len, -1, len);
+            continue;
+        }
+        client->state = WS_ESTABLISHED;
+
+        uint64_t total = 0;
+        for (size_t i = 0; i < count; i++) {
+            if (rbuf_bytes_free(client->buf_write) < len + 14)
+                rbuf_flush(client->buf_write);
+            uint64_t start = now_ns();
+            int ret = ws_client_send(client, WS_OP_BINARY_FRAME, data, len);
+            total += now_ns() - start;
+            if (ret != (int)len) {
+                total = 0;
+                break;
+            }
+        }
+        report("ws_client_send", len, total ? (double)total / count : -1, len);
+        ws_client_destroy(client);
+    }
+    free(data);
+}
+
+static void bench_mqtt_ng(mqtt_wss_log_ctx_t log)
+{
+    // payload is neither copied on generation nor on parsing (borrowing callback)
+    // so throughput in bytes would be meaningless
+    for (size_t s = 0; s < MSG_SIZES_COUNT; s++)
+        report("mqtt_ng_generate_publish", msg_sizes[s], bench_mqtt_ng_generate_publish(log, msg_sizes[s], iterations_for(msg_sizes[s])), 0);
+
+    for (size_t s = 0; s < MSG_SIZES_COUNT; s++)
+        report("mqtt_ng_generate_publish (prepared)", msg_sizes[s], bench_mqtt_ng_generate_prepared_publish(log, msg_sizes[s], iterations_for(msg_sizes[s])), 0);
+
+    for (size_t s = 0; s < MSG_SIZES_COUNT; s++)
+        report("parse_data (PUBLISH)", msg_sizes[s], bench_mqtt_ng_parse_publish(log, msg_sizes[s], iterations_for(msg_sizes[s])), 0);
+
+    static const size_t packets[] = { 16, 256, 4096, 32768 };
+    for (size_t i = 0; i < sizeof(packets) / sizeof(packets[0]); i++)
+        report("buffer_garbage_collect", packets[i], bench_mqtt_ng_garbage_collect(log, packets[i], 20), 0);
+
+    static const size_t unacked[] = { 0, 1000, 40000 };
+    for (size_t i = 0; i < sizeof(unacked) / sizeof(unacked[0]); i++)
+        report("send behind unacked QOS1", unacked[i], bench_mqtt_ng_send_behind_unacked(log, unacked[i], 10000), 0);
+}
+
+// failures are reported as FAILED in results, library log would only add noise
+static void silent_log_cb(mqtt_wss_log_type_t log_type, const char *str)
+{
+    (void)log_type;
+    (void)str;
+}
+
+int main(void)
+{
+    mqtt_wss_log_ctx_t log = mqtt_wss_log_ctx_create("bench", &silent_log_cb);
+    if (!log)
+        return 1;
+
+    printf("ws_mask implementation: %s\n", ws_mask_impl_name());
+    printf("%-28s %8s %12s\n", "benchmark", "param", "result");
+    bench_vbi();
+    bench_ws_send(log);
+    bench_mqtt_ng(log);
+
+    mqtt_wss_log_ctx_destroy(log);
+    return 0;
+}
@@ -0,0 +1,283 @@
+// SPDX-License-Identifier: GPL-3.0-only
+//
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free Software Foundation, version 3.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+// See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with this program.
+// If not, see <https://www.gnu.org/licenses/>.
+
+// Offline replay of RX capture (see mqtt_wss_set_rx_capture) through
+// ws_client_process and mqtt_ng parser without TLS and sockets involved.
+// Capture is fed into buf_read in chunks of configurable size to exercise
+// parsers resuming from partial data.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mqtt_wss_log.h"
+#include "mqtt_ng.h"
+#include "ws_client.h"
+
+struct mqtt_ng_client *bench_mqtt_ng_replay_client_new(mqtt_wss_log_ctx_t log, rbuf_t data_in);
+
+#define DEFAULT_PASSES 10
+
+// chunk sizes used when none given on command line
+static const size_t default_chunks[] = { 1, 7, 64, 1460, 16384 };
+#define DEFAULT_CHUNKS_COUNT (sizeof(default_chunks) / sizeof(default_chunks[0]))
+
+struct replay_opts {
+    size_t buf_size;
+    int passes;
+    int copy;       // don't parse in place, go through buf_to_mqtt
+    int random;     // chunk sizes random in [1, chunk]
+    unsigned int seed;
+};
+
+struct replay_result {
+    uint64_t ns;
+    size_t bytes;
+    size_t rx_msgs;
+    size_t publish_msgs;
+    size_t publish_bytes;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void log_cb(mqtt_wss_log_type_t log_type, const char *str)
+{
+    if (log_type >= MQTT_WSS_LOG_ERROR)
+        fprintf(stderr, "%s\n", str);
+}
+
+static ssize_t rx_payload_cb(void *ctx, rbuf_t data, size_t max_bytes)
+{
+    return mqtt_ng_process_rx(ctx, data, max_bytes);
+}
+
+static void msg_borrowed_cb(void *ctx, const struct mqtt_rx_msg *msg)
+{
+    struct replay_result *res = ctx;
+    res->publish_msgs++;
+    res->publish_bytes += msg->data_len;
+}
+
+static char *load_file(const char *path, size_t *len)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        return NULL;
+    }
+    size_t size = 0, alloc = 1024 * 1024;
+    char *data = malloc(alloc);
+    size_t ret;
+    while (data && (ret = fread(data + size, 1, alloc - size, f)) > 0) {
+        size += ret;
+        if (size == alloc) {
+            char *tmp = realloc(data, alloc * 2);
+            if (!tmp) {
+                free(data);
+                data = NULL;
+                break;
+            }
+            data = tmp;
+            alloc *= 2;
+        }
+    }
+    if (!data)
+        fprintf(stderr, "OOM loading capture\n");
+    else if (ferror(f)) {
+        perror(path);
+        free(data);
+        data = NULL;
+    }
+    fclose(f);
+    *len = size;
+    return data;
+}
+
+// capture starts with HTTP upgrade reply which we can't validate
+// (it belongs to Sec-WebSocket-Key of the original session)
+static size_t skip_http_reply(const char *data, size_t len)
+{
+    if (len < 5 || memcmp(data, "HTTP/", 5))
+        return 0;
+    for (size_t i = 0; i + 4 <= len; i++) {
+        if (!memcmp(&data[i], "\r\n\r\n", 4))
+            return i + 4;
+    }
+    return len;
+}
+
+static int replay_pass(mqtt_wss_log_ctx_t log, const char *data, size_t len, size_t chunk, struct replay_opts *opts, struct replay_result *res)
+{
+    char *host = "replay";
+    int rc = 1;
+    ws_client *ws = ws_client_new(opts->buf_size, &host, log);
+    if (!ws)
+        return 1;
+    struct mqtt_ng_client *mqtt = bench_mqtt_ng_replay_client_new(log, ws->buf_to_mqtt);
+    if (!mqtt) {
+        ws_client_destroy(ws);
+        return 1;
+    }
+    ws->state = WS_ESTABLISHED;
+    if (!opts->copy)
+        ws_client_set_rx_payload_cb(ws, &rx_payload_cb, mqtt);
+    mqtt_ng_set_msg_borrowed_callback(mqtt, &msg_borrowed_cb, res);
+
+    size_t pos = 0;
+    while (pos < len) {
+        size_t want = opts->random ? (size_t)rand_r(&opts->seed) % chunk + 1 : chunk;
+        if (want > len - pos)
+            want = len - pos;
+        size_t pushed = rbuf_push(ws->buf_read, data + pos, want);
+        pos += pushed;
+
+        uint64_t start = now_ns();
+        int ret = ws_client_process(ws);
+        int mqtt_rc = mqtt_ng_sync(mqtt);
+        res->ns += now_ns() - start;
+
+        // replies (PONG, PUBACK) are generated as in live session and dropped here
+        rbuf_flush(ws->buf_write);
+
+        if (ret == WS_CLIENT_PROTOCOL_ERROR || ret == WS_CLIENT_CONSUMER_ERROR || mqtt_rc) {
+            fprintf(stderr, "Error replaying capture at offset %zu (ws %d, mqtt %d)\n", pos, ret, mqtt_rc);
+            goto exit;
+        }
+        if (ret == WS_CLIENT_CONNECTION_CLOSED)
+            break;
+        if (!pushed && !rbuf_bytes_free(ws->buf_read)) {
+            fprintf(stderr, "Read buffer full without progress at offset %zu (try bigger -B)\n", pos);
+            goto exit;
+        }
+    }
+    res->bytes += pos;
+
+    struct mqtt_ng_stats stats;
+    mqtt_ng_get_stats(mqtt, &stats);
+    res->rx_msgs += stats.rx_messages_rcvd;
+    rc = 0;
+exit:
+    mqtt_ng_destroy(mqtt);
+    ws_client_destroy(ws);
+    return rc;
+}
+
+static int replay(mqtt_wss_log_ctx_t log, const char *data, size_t len, size_t chunk, struct replay_opts *opts)
+{
+    struct replay_result res;
+    memset(&res, 0, sizeof(res));
+
+    for (int i = 0; i < opts->passes; i++) {
+        if (replay_pass(log, data, len, chunk, opts, &res))
+            return 1;
+    }
+
+    double sec = res.ns / 1e9;
+    printf("%s%-7zu %9.1f %9.2f %12.0f %10zu %10zu\n",
+        opts->random ? "1-" : "  ", chunk,
+        res.bytes / sec / (1024 * 1024),
+        (double)res.ns / res.bytes,
+        res.rx_msgs / sec,
+        res.rx_msgs / opts->passes,
+        res.publish_msgs / opts->passes);
+    return 0;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-c chunk] [-r] [-s seed] [-n passes] [-B bufsize] [-C] capture_file\n"
+        "  -c chunk   bytes pushed into read buffer at once (default: sweep over several sizes)\n"
+        "  -r         random chunk sizes between 1 and chunk\n"
+        "  -s seed    seed for -r\n"
+        "  -n passes  how many times to replay the capture (default %d)\n"
+        "  -B size    ws_client buffer size (default same as mqtt_wss_client)\n"
+        "  -C         copy payload into buf_to_mqtt instead of parsing in place\n",
+        name, DEFAULT_PASSES);
+}
+
+int main(int argc, char **argv)
+{
+    struct replay_opts opts = {
+        .passes = DEFAULT_PASSES,
+        .seed = 1
+    };
+    size_t chunk = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:rs:n:B:C")) != -1) {
+        switch (opt) {
+            case 'c':
+                chunk = strtoul(optarg, NULL, 0);
+                break;
+            case 'r':
+                opts.random = 1;
+                break;
+            case 's':
+                opts.seed = strtoul(optarg, NULL, 0);
+                break;
+            case 'n':
+                opts.passes = atoi(optarg);
+                break;
+            case 'B':
+                opts.buf_size = strtoul(optarg, NULL, 0);
+                break;
+            case 'C':
+                opts.copy = 1;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind != argc - 1 || opts.passes <= 0 || (opts.random && !chunk)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    size_t len;
+    char *data = load_file(argv[optind], &len);
+    if (!data)
+        return 1;
+    size_t offset = skip_http_reply(data, len);
+    if (offset == len) {
+        fprintf(stderr, "Capture contains no WebSocket data\n");
+        free(data);
+        return 1;
+    }
+
+    mqtt_wss_log_ctx_t log = mqtt_wss_log_ctx_create("replay", &log_cb);
+    if (!log) {
+        free(data);
+        return 1;
+    }
+
+    printf("capture %zu bytes, %d passes, %s\n", len - offset, opts.passes, opts.copy ? "buf_to_mqtt copy" : "in place parsing");
+    printf("%-9s %9s %9s %12s %10s %10s\n", "chunk", "MiB/s", "ns/byte", "mqtt msgs/s", "mqtt msgs", "publishes");
+    int rc = 0;
+    if (chunk)
+        rc = replay(log, data + offset, len - offset, chunk, &opts);
+    else {
+        for (size_t i = 0; i < DEFAULT_CHUNKS_COUNT && !rc; i++)
+            rc = replay(log, data + offset, len - offset, default_chunks[i], &opts);
+    }
+
+    mqtt_wss_log_ctx_destroy(log);
+    free(data);
+    return rc;
+}
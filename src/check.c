@@ -0,0 +1,70 @@
+// SPDX-License-Identifier: GPL-3.0-only
+//
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free Software Foundation, version 3.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+// See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with this program.
+// If not, see <https://www.gnu.org/licenses/>.
+
+// Runs unit tests compiled into the library with TESTS (make check)
+
+#include <stdio.h>
+
+int test_uint32_mqtt_vbi();
+int test_mqtt_vbi_to_uint32();
+int test_mqtt_properties_length();
+int test_mqtt_ng_window_bypass();
+int test_mqtt_ng_prepared_alias();
+int test_mqtt_ng_prepared_auto_alias();
+int test_mqtt_ng_stream_pull_error();
+int test_mqtt_ng_chunk_route();
+int test_mqtt_ng_subscribe_route_fail();
+int test_mqtt_ng_router();
+int test_mqtt_ng_alias_cache();
+int test_mqtt_ng_publish_queue();
+int test_mqtt_ng_inflight_index();
+int test_mqtt_ng_buffer_segments();
+int test_ws_mask();
+int test_ws_deflate();
+int test_mqtt_wss_instr();
+int test_mqtt_wss_spool();
+
+static const struct {
+    const char *name;
+    int (*fnc)();
+} tests[] = {
+    { "test_uint32_mqtt_vbi",              test_uint32_mqtt_vbi },
+    { "test_mqtt_vbi_to_uint32",           test_mqtt_vbi_to_uint32 },
+    { "test_mqtt_properties_length",       test_mqtt_properties_length },
+    { "test_mqtt_ng_window_bypass",        test_mqtt_ng_window_bypass },
+    { "test_mqtt_ng_prepared_alias",       test_mqtt_ng_prepared_alias },
+    { "test_mqtt_ng_prepared_auto_alias",  test_mqtt_ng_prepared_auto_alias },
+    { "test_mqtt_ng_stream_pull_error",    test_mqtt_ng_stream_pull_error },
+    { "test_mqtt_ng_chunk_route",          test_mqtt_ng_chunk_route },
+    { "test_mqtt_ng_subscribe_route_fail", test_mqtt_ng_subscribe_route_fail },
+    { "test_mqtt_ng_router",               test_mqtt_ng_router },
+    { "test_mqtt_ng_alias_cache",          test_mqtt_ng_alias_cache },
+    { "test_mqtt_ng_publish_queue",        test_mqtt_ng_publish_queue },
+    { "test_mqtt_ng_inflight_index",       test_mqtt_ng_inflight_index },
+    { "test_mqtt_ng_buffer_segments",      test_mqtt_ng_buffer_segments },
+    { "test_ws_mask",                      test_ws_mask },
+    { "test_ws_deflate",                   test_ws_deflate },
+    { "test_mqtt_wss_instr",               test_mqtt_wss_instr },
+    { "test_mqtt_wss_spool",               test_mqtt_wss_spool }
+};
+
+int main()
+{
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+        int rc = tests[i].fnc();
+        printf("%-34s %s\n", tests[i].name, rc ? "FAILED" : "OK");
+        if (rc)
+            failed++;
+    }
+    return failed ? 1 : 0;
+}
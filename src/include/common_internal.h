@@ -29,5 +29,6 @@
 #define OPENSSL_VERSION_097 0x00907000L
 #define OPENSSL_VERSION_110 0x10100000L
 #define OPENSSL_VERSION_111 0x10101000L
+#define OPENSSL_VERSION_300 0x30000000L
 
 #endif /* COMMON_INTERNAL_H */
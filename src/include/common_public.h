@@ -2,6 +2,8 @@
 #define MQTT_WEBSOCKETS_COMMON_PUBLIC_H
 
 #include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
 
 /* free_fnc_t in general (in whatever function or struct it is used)
  * decides how the related data will be handled.
@@ -18,6 +20,164 @@ typedef void (*free_fnc_t)(void *ptr);
 void _caller_responsibility(void *ptr);
 #define CALLER_RESPONSIBILITY ((free_fnc_t)&_caller_responsibility)
 
+#define MQTT_LATENCY_HISTOGRAM_BUCKETS 24
+/* Latency histogram with logarithmic buckets
+ * bucket 0 counts samples < 1 usec, bucket i counts samples
+ * in [2^(i-1), 2^i) usec, last bucket also counts everything above
+ */
+struct mqtt_latency_histogram {
+    uint64_t count;
+    uint64_t sum_usec;
+    uint64_t max_usec;
+    uint64_t buckets[MQTT_LATENCY_HISTOGRAM_BUCKETS];
+};
+
+/* Hot path stages timed by runtime instrumentation
+ * (see mqtt_wss_set_instrumentation)
+ */
+enum mqtt_wss_instr_stage {
+    MQTT_WSS_STAGE_POLL_WAIT = 0,   // time spent blocked in poll (mqtt_wss_service only)
+    MQTT_WSS_STAGE_SSL_READ,
+    MQTT_WSS_STAGE_WS_PARSE,        // WebSocket framing, excluding MQTT parsing done from within
+    MQTT_WSS_STAGE_MQTT_PARSE,
+    MQTT_WSS_STAGE_MSG_GENERATE,    // every attempt to generate outgoing message into buffer
+    MQTT_WSS_STAGE_GC,
+    MQTT_WSS_STAGE_BUFFER_GROW,
+    MQTT_WSS_STAGE_SSL_WRITE,       // single SSL_write call
+    MQTT_WSS_STAGE_COUNT
+};
+
+enum mqtt_wss_instr_event {
+    MQTT_WSS_EVENT_GC_RUN = 0,
+    MQTT_WSS_EVENT_BUFFER_GROW,     // transaction buffer obtained new segment
+    MQTT_WSS_EVENT_PARTIAL_WRITE,   // write pass ended with data left because TLS would block
+    MQTT_WSS_EVENT_RX_BUFFER_FULL,  // no space in read buffer to read from TLS into
+    MQTT_WSS_EVENT_TX_BUFFER_FULL,  // WebSocket write buffer couldn't take all MQTT wanted to send
+    MQTT_WSS_EVENT_COUNT
+};
+
+#define MQTT_WSS_TIMING_SUB_BUCKETS 4
+#define MQTT_WSS_TIMING_BUCKETS 160
+/* Timing histogram with nanosecond resolution
+ * buckets 0-3 count samples of 0-3 ns, after that each power of two
+ * is split into MQTT_WSS_TIMING_SUB_BUCKETS buckets (error < 25%),
+ * last bucket also counts everything above (~18 minutes)
+ */
+struct mqtt_wss_timing {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t min_ns; // 0 if count == 0
+    uint64_t max_ns;
+    uint64_t buckets[MQTT_WSS_TIMING_BUCKETS];
+};
+
+struct mqtt_wss_instr_snapshot {
+    int enabled;
+    struct mqtt_wss_timing stages[MQTT_WSS_STAGE_COUNT];
+    uint64_t events[MQTT_WSS_EVENT_COUNT];
+};
+
+/* Estimates percentile from timing histogram
+ * @param percentile requested percentile (0 - 100) e.g. 50 for median, 99 for p99
+ * @return upper bound of the bucket the percentile falls into (clamped to [min_ns, max_ns])
+ *         or 0 if there are no samples
+ */
+uint64_t mqtt_wss_timing_percentile(const struct mqtt_wss_timing *timing, double percentile);
+
+// names suitable for metric labels (e.g. "ssl_read", "gc_run")
+const char *mqtt_wss_instr_stage_name(enum mqtt_wss_instr_stage stage);
+const char *mqtt_wss_instr_event_name(enum mqtt_wss_instr_event event);
+
+/* WebSocket permessage-deflate [RFC7692] settings (see mqtt_wss_set_compression)
+ * "client" is our side (what we send), "server" is what the server sends.
+ * Smaller windows and no context takeover use less memory for worse ratio.
+ */
+struct mqtt_wss_deflate_params {
+    int enabled;
+    // reset compression context after every message instead of keeping history
+    int client_no_context_takeover;
+    // ask server to do the same (allows us to drop inflate history too)
+    int server_no_context_takeover;
+    // LZ77 window size as log2 (9 - 15, 0 for default of 15)
+    int client_max_window_bits;
+    // window size server is asked to use (8 - 15, 0 to not ask for limit)
+    int server_max_window_bits;
+    // zlib compression level (1 - 9, 0 for zlib default)
+    int level;
+    // zlib memLevel (1 - 9, 0 for zlib default of 8)
+    int mem_level;
+    // messages shorter than this are sent uncompressed
+    size_t threshold;
+};
+
+/* Allocator for library's small short lived objects (copies of published
+ * topics and payloads, incoming messages, topic aliases, HTTP headers)
+ * see mqtt_wss_set_allocator.
+ * Both functions have to be thread safe. free gets the same size that was
+ * requested from malloc (ptr is never NULL).
+ */
+struct mqtt_wss_allocator {
+    void *(*malloc)(void *ctx, size_t size);
+    void (*free)(void *ctx, void *ptr, size_t size);
+    void *ctx;
+};
+
+// plain malloc and free
+extern const struct mqtt_wss_allocator mqtt_wss_system_allocator;
+
+#define MQTT_WSS_POOL_CLASSES 8
+struct mqtt_wss_pool_class_stats {
+    size_t block_size;
+    size_t blocks_total;    // carved out of slabs so far
+    size_t blocks_used;
+    uint64_t allocs;
+};
+
+/* Statistics of built-in slab allocator
+ * counters are cumulative (not reset by mqtt_wss_get_stats)
+ */
+struct mqtt_wss_pool_stats {
+    struct mqtt_wss_pool_class_stats classes[MQTT_WSS_POOL_CLASSES];
+    // system allocations made to add slabs to the pool
+    uint64_t slab_allocs;
+    size_t slab_bytes;
+    // requests too large for any class passed directly to system allocator
+    uint64_t oversized_allocs;
+};
+
+/* Persistent outbound queue settings (see mqtt_wss_set_spool)
+ */
+struct mqtt_wss_spool_params {
+    // file is created if it doesn't exist, existing one is recovered
+    const char *path;
+    // size of the file (disk space is reserved upfront), 0 for default of 64 MiB
+    // existing file keeps the size it was created with
+    size_t max_file_size;
+    // QOS1 bytes sent from the spool and not acknowledged yet, 0 for default of 8 MiB
+    size_t max_inflight_bytes;
+    // msync every message appended (survives power loss, not only process crash)
+    int sync;
+};
+
+/* Statistics of the persistent outbound queue
+ * counters are cumulative (not reset by mqtt_wss_get_stats)
+ */
+struct mqtt_wss_spool_stats {
+    int enabled;
+    size_t file_size;
+    size_t bytes_used;
+    size_t records;             // in the file, not acknowledged yet
+    size_t records_pending;     // not handed to MQTT yet
+    size_t inflight_bytes;
+    uint64_t appended;
+    // resent with DUP flag after reconnect or restart
+    uint64_t replayed;
+    // not accepted because spool was full
+    uint64_t rejected;
+    // removed without being sent (e.g. too big for the server)
+    uint64_t dropped;
+};
+
 struct mqtt_ng_stats {
     size_t tx_bytes_queued;
     int tx_messages_queued;
@@ -28,6 +188,120 @@ struct mqtt_ng_stats {
     size_t tx_buffer_size;
     // part of transaction buffer that containes mesages we can free alredy during the garbage colleciton step
     size_t tx_buffer_reclaimable;
+    // time from queuing a PUBLISH until it is fully handed over to the transport
+    struct mqtt_latency_histogram tx_queue_residency;
+    // time from sending a QOS1 PUBLISH until PUBACK is received
+    struct mqtt_latency_histogram tx_puback_rtt;
+    // QOS1 PUBLISH sent and not acknowledged yet and server's limit of those (Receive Maximum)
+    int tx_inflight;
+    int tx_receive_max;
+    // times sending had to wait for PUBACK because of Receive Maximum (cumulative)
+    uint64_t tx_window_stalls;
+    // PUBLISH packets not sent (QOS0) or not acknowledged (QOS1) yet (see flow control)
+    size_t tx_publish_bytes;
+};
+
+/* Single message of publish batch (see mqtt_wss_publish_batch)
+ * topic, topic_free, msg, msg_free and msg_len have the same meaning
+ * as for publishing single message.
+ */
+struct mqtt_publish_batch_entry {
+    char *topic;
+    free_fnc_t topic_free;
+    void *msg;
+    free_fnc_t msg_free;
+    size_t msg_len;
+    uint8_t qos;
+    uint8_t retain;
+    // message is being redelivered (sets DUP flag of QOS > 0 PUBLISH)
+    uint8_t dup;
+
+    // filled in by the library
+    uint16_t packet_id;
+    int rc; // 0 if message was queued successfully
+};
+
+/* Pulls next part of streamed message payload (see mqtt_wss_publish_stream).
+ * Called by the service thread while sending, mqtt publishing functions
+ * must not be called from within. If no data are available right now
+ * return 0 and wake the service thread up (mqtt_wss_wakeup) once they are,
+ * packets queued after the streamed one wait meanwhile.
+ * If the payload can't be produced anymore return < 0, as the packet can't be
+ * completed connection is dropped then (mqtt_wss_service returns error) and
+ * the message is discarded with other unsent ones by the next connect.
+ * Pull is not called for the message anymore after that.
+ * @param offset offset of the part in the payload
+ * @param len maximum number of bytes to write (never more than left in the payload)
+ * @return number of bytes written into buf, 0 if none are available yet, < 0 on error
+ */
+typedef ssize_t (*mqtt_stream_pull_fnc_t)(void *ctx, size_t offset, char *buf, size_t len);
+
+struct mqtt_stream_source {
+    mqtt_stream_pull_fnc_t pull;
+    void *ctx;
+    // called with ctx once the message is done with (sent for QOS0, acknowledged
+    // for QOS1 or dropped), not called if publishing fails, can be NULL
+    free_fnc_t ctx_free;
+    // size of the buffer payload is pulled into (0 for default 16 KiB)
+    // only this much of the payload is held in memory at a time
+    size_t chunk_size;
+};
+
+/* Part of incoming application message delivered to chunk callback
+ * (see mqtt_wss_set_msg_chunk_callback). Chunks of the same message come
+ * in order, the last one has offset + data_len == total_len.
+ * topic and data are valid only until the callback returns.
+ */
+struct mqtt_rx_msg_chunk {
+    const char *topic;
+    size_t topic_len;
+    const void *data;
+    size_t data_len;
+    size_t offset;
+    size_t total_len;
+    int qos;
 };
 
+/* Handle for publishing to the same topic with the same flags repeatedly
+ * (see mqtt_wss_prepare_publish). Owned by the client it was prepared for.
+ */
+struct mqtt_prepared_publish;
+
+/* Incoming application message as passed to borrowing message callback.
+ * topic and data point into memory owned by the library and are valid only
+ * until the callback returns. Use mqtt_rx_msg_retain to keep them longer.
+ */
+struct mqtt_rx_msg {
+    const char *topic;
+    size_t topic_len;
+    const void *data;
+    size_t data_len;
+    int qos;
+};
+
+/* Reference counted copy of incoming message (see mqtt_rx_msg_retain).
+ * Owned by the library, use mqtt_rx_msg_retained_get to access the message.
+ */
+struct mqtt_rx_msg_retained;
+
+/* Makes message usable after the borrowing callback returns.
+ * Message is copied into reference counted allocation (refcount 1).
+ * Thread safe.
+ * @return handle to be passed to mqtt_rx_msg_release or NULL on OOM
+ */
+struct mqtt_rx_msg_retained *mqtt_rx_msg_retain(const struct mqtt_rx_msg *msg);
+
+/* Adds reference to already retained message. Thread safe.
+ * @return the same handle (to be released separately)
+ */
+struct mqtt_rx_msg_retained *mqtt_rx_msg_retained_ref(struct mqtt_rx_msg_retained *retained);
+
+/* @return message held by the handle, valid until the last reference is released
+ */
+const struct mqtt_rx_msg *mqtt_rx_msg_retained_get(const struct mqtt_rx_msg_retained *retained);
+
+/* Drops reference to retained message. Memory is freed when last reference is dropped.
+ */
+void mqtt_rx_msg_release(struct mqtt_rx_msg_retained *retained);
+
 #endif /* MQTT_WEBSOCKETS_COMMON_PUBLIC_H */
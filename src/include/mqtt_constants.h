@@ -40,6 +40,12 @@
 #define MQTT_CONNECT_FLAG_QOS_MASK    0x18
 #define MQTT_CONNECT_FLAG_QOS_BITSHIFT 3
 
+// MQTT PUBLISH FLAGS (spec:3.3.1)
+#define MQTT_PUBLISH_FLAG_RETAIN      0x01
+#define MQTT_PUBLISH_FLAG_DUP         0x08
+#define MQTT_PUBLISH_FLAG_QOS_MASK    0x06
+#define MQTT_PUBLISH_FLAG_QOS_BITSHIFT 1
+
 #define MQTT_MAX_CLIENT_ID 23 /* [MQTT-3.1.3-5] */
 
 // MQTT Property identifiers [MQTT-2.2.2.2]
@@ -98,4 +104,6 @@
 #define MQTT_PROP_SHARED_SUB_AVAIL             0x2A
 #define MQTT_PROP_SHARED_SUB_AVAIL_NAME        "Shared Subscription Available"
 
+#define MQTT_PROP_ID_MAX                       MQTT_PROP_SHARED_SUB_AVAIL
+
 #endif /* MQTT_CONSTANTS_H */
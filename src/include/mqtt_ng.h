@@ -1,5 +1,6 @@
 #include <stdint.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <time.h>
 
 #include "ringbuffer.h"
@@ -13,6 +14,7 @@
 #define MQTT_NG_MSGGEN_MSG_TOO_BIG 3
 
 struct mqtt_ng_client;
+struct mqtt_wss_instr;
 
 /* Converts integer to MQTT Variable Byte Integer as per 1.5.5 of MQTT 5 specs
  * @param input value to be converted
@@ -57,6 +59,84 @@ int mqtt_ng_publish(struct mqtt_ng_client *client,
                     uint8_t publish_flags,
                     uint16_t *packet_id);
 
+/* Publishes multiple messages taking every lock only once
+ * @return number of messages which couldn't be queued (see entries[i].rc for reason)
+ */
+size_t mqtt_ng_publish_batch(struct mqtt_ng_client *client, struct mqtt_publish_batch_entry *entries, size_t count);
+
+/* Pre-encodes fixed part of PUBLISH header (flags, Topic Name) so that
+ * mqtt_ng_publish_prepared only fills in lengths, packet id and payload.
+ * Handle stays valid until mqtt_ng_prepared_publish_free or mqtt_ng_destroy
+ * (which frees handles not freed yet), can be used from any thread.
+ * Topic is copied. Alias (set by mqtt_ng_set_topic_alias or automatic one)
+ * is resolved by the first publish and kept in the handle along with encoded
+ * header until aliases change.
+ * @param publish_flags same as for mqtt_ng_publish (QOS and RETAIN are used)
+ * @return handle or NULL on error
+ */
+struct mqtt_prepared_publish *mqtt_ng_prepare_publish(struct mqtt_ng_client *client, const char *topic, uint8_t publish_flags);
+
+/* Frees handle returned by mqtt_ng_prepare_publish. Messages already published
+ * with it are not affected. Handle must not be used by any other thread anymore.
+ */
+void mqtt_ng_prepared_publish_free(struct mqtt_ng_client *client, struct mqtt_prepared_publish *pp);
+
+/* Same as mqtt_ng_publish with topic and flags taken from the handle */
+int mqtt_ng_publish_prepared(struct mqtt_ng_client *client,
+                             struct mqtt_prepared_publish *pp,
+                             void *msg,
+                             free_fnc_t msg_free,
+                             size_t msg_len,
+                             uint16_t *packet_id);
+
+// topic and publish flags (as given to mqtt_ng_publish) of the handle
+const char *mqtt_ng_prepared_topic(const struct mqtt_prepared_publish *pp);
+uint8_t mqtt_ng_prepared_flags(const struct mqtt_prepared_publish *pp);
+
+/* Publishes message of known length with payload pulled from src in chunks
+ * while it is being sent (see struct mqtt_stream_source), so memory used
+ * doesn't depend on message size. Packets queued after it are sent only
+ * once the whole payload is. Topic aliases are not used for streamed messages.
+ * @param msg_len total length of the payload
+ * @return same as mqtt_ng_publish
+ */
+int mqtt_ng_publish_stream(struct mqtt_ng_client *client,
+                           char *topic,
+                           free_fnc_t topic_free,
+                           size_t msg_len,
+                           uint8_t publish_flags,
+                           const struct mqtt_stream_source *src,
+                           uint16_t *packet_id);
+
+/* Called by the service thread (from mqtt_ng_sync) for every message
+ * given to mqtt_ng_publish_enqueue once it is put into transmit buffer.
+ * @param msg_ctx as given to mqtt_ng_publish_enqueue
+ * @param packet_id packet id assigned to the message (if rc == MQTT_NG_MSGGEN_OK)
+ * @param rc same as mqtt_ng_publish would return
+ */
+typedef void (*mqtt_ng_publish_queued_callback_t)(void *ctx, void *msg_ctx, uint16_t packet_id, int rc);
+void mqtt_ng_set_publish_queued_callback(struct mqtt_ng_client *client, mqtt_ng_publish_queued_callback_t callback, void *ctx);
+// calls publish queued callback (if set) for message queued elsewhere (e.g. spooled)
+void mqtt_ng_publish_queued_notify(struct mqtt_ng_client *client, void *msg_ctx, uint16_t packet_id, int rc);
+
+/* Same as mqtt_ng_publish but doesn't take any lock. Message is put into lock-free queue
+ * and added to transmit buffer by the next mqtt_ng_sync call (in batches).
+ * Caller has to make sure service thread calls mqtt_ng_sync after this returns
+ * (mqtt_wss_client signals it unless it was signalled since its last wakeup).
+ * Data are copied if topic_free/msg_free is NULL. If publishing fails data are freed
+ * by the library (e.g. msg_free is called).
+ * @param msg_ctx passed to publish queued callback as is
+ * @return MQTT_NG_MSGGEN_OK if message was added to the queue
+ */
+int mqtt_ng_publish_enqueue(struct mqtt_ng_client *client,
+                            char *topic,
+                            free_fnc_t topic_free,
+                            void *msg,
+                            free_fnc_t msg_free,
+                            size_t msg_len,
+                            uint8_t publish_flags,
+                            void *msg_ctx);
+
 struct mqtt_sub {
     char *topic;
     free_fnc_t topic_free;
@@ -68,16 +148,45 @@ int mqtt_ng_subscribe(struct mqtt_ng_client *client, struct mqtt_sub *subscripti
 int mqtt_ng_ping(struct mqtt_ng_client *client);
 
 typedef ssize_t (*mqtt_ng_send_fnc_t)(void *user_ctx, const void* buf, size_t len);
+// optional scatter/gather version of mqtt_ng_send_fnc_t
+// allows sending multiple buffer fragments (and MQTT packets) in one call
+// (e.g. as one WebSocket frame)
+typedef ssize_t (*mqtt_ng_sendv_fnc_t)(void *user_ctx, const struct iovec *iov, int iovcnt);
+
+// alternative to msg_callback avoiding malloc and copy per message
+// see struct mqtt_rx_msg for data validity
+typedef void (*mqtt_ng_msg_borrowed_callback_t)(void *ctx, const struct mqtt_rx_msg *msg);
+
+/* Subscribes to single topic filter and routes messages matching it to callback
+ * instead of msg_callback/msg_borrowed_callback (in the callback message can be
+ * retained same as in msg_borrowed_callback). Subscription Identifier is sent
+ * if server supports it, so that route can be found without topic matching.
+ * Subscribing the same filter again replaces the callback.
+ * Must not be called from within route callback.
+ * @return 0 on success
+ */
+int mqtt_ng_subscribe_route(struct mqtt_ng_client *client, struct mqtt_sub *sub, mqtt_ng_msg_borrowed_callback_t callback, void *ctx);
 
 struct mqtt_ng_init {
     mqtt_wss_log_ctx_t log;
     rbuf_t data_in;
     mqtt_ng_send_fnc_t data_out_fnc;
+    // if set it is used instead of data_out_fnc
+    // see mqtt_ng_set_send_coalesce_limit
+    mqtt_ng_sendv_fnc_t data_outv_fnc;
     void *user_ctx;
 
     void (*puback_callback)(uint16_t packet_id);
+    // same as puback_callback but gets user_ctx (both are called if set)
+    void (*puback_ctx_callback)(void *user_ctx, uint16_t packet_id);
     void (*connack_callback)(void* user_ctx, int connack_reply);
     void (*msg_callback)(const char *topic, const void *msg, size_t msglen, int qos);
+
+    // optional, generation, GC and buffer growth are timed into it
+    struct mqtt_wss_instr *instr;
+
+    // optional, for copies of published data and incoming messages (system allocator if NULL)
+    const struct mqtt_wss_allocator *allocator;
 };
 
 struct mqtt_ng_client *mqtt_ng_init(struct mqtt_ng_init *settings);
@@ -88,10 +197,75 @@ int mqtt_ng_disconnect(struct mqtt_ng_client *client, uint8_t reason_code);
 
 int mqtt_ng_sync(struct mqtt_ng_client *client);
 
+/* Parses incoming MQTT data directly from buffer given instead of settings->data_in.
+ * Allows parsing the data in place (e.g. WebSocket payload still in the socket read buffer)
+ * without copying it into data_in first.
+ * Parser state is kept between calls (packets can be split across multiple calls)
+ * but caller has to ensure data_in is empty when calling this to keep the stream in order.
+ * @param max_bytes maximum number of bytes to consume from data
+ * @return number of bytes consumed (0 if client is not connected), negative on error
+ */
+ssize_t mqtt_ng_process_rx(struct mqtt_ng_client *client, rbuf_t data, size_t max_bytes);
+
+/* Sets callback receiving incoming messages as borrowed pointers.
+ * If set it is called instead of settings->msg_callback.
+ * Not thread safe, to be set before connecting.
+ */
+void mqtt_ng_set_msg_borrowed_callback(struct mqtt_ng_client *client, mqtt_ng_msg_borrowed_callback_t callback, void *ctx);
+
+typedef void (*mqtt_ng_msg_chunk_callback_t)(void *ctx, const struct mqtt_rx_msg_chunk *chunk);
+
+/* Incoming messages with payload longer than min_len are delivered in chunks
+ * as they are parsed off the receive buffer instead of being passed to message
+ * callbacks, so they don't have to fit into memory (or receive buffer)
+ * whole. QOS1 messages are acknowledged after the last chunk. Messages matching
+ * some route (see mqtt_ng_subscribe_route) are never chunked, route callback
+ * gets them whole.
+ * Not thread safe, to be set before connecting. NULL callback disables.
+ */
+void mqtt_ng_set_msg_chunk_callback(struct mqtt_ng_client *client, size_t min_len, mqtt_ng_msg_chunk_callback_t callback, void *ctx);
+
 time_t mqtt_ng_last_send_time(struct mqtt_ng_client *client);
 
 void mqtt_ng_set_max_mem(struct mqtt_ng_client *client, size_t bytes);
 
+/* Called when bytes of PUBLISH packets held by the client (not sent for QOS0,
+ * not acknowledged for QOS1) reach high watermark (above == 1) and once they
+ * drop to low watermark again (above == 0). Called from publishing threads
+ * as well as from mqtt_ng_sync, without any lock held.
+ */
+typedef void (*mqtt_ng_flow_callback_t)(void *ctx, int above);
+
+/* Sets flow control watermarks (in bytes)
+ * @param callback NULL disables flow control
+ * @return 0 on success, 1 if watermarks don't make sense (low has to be < high)
+ */
+int mqtt_ng_set_flow_control(struct mqtt_ng_client *client, size_t high, size_t low, mqtt_ng_flow_callback_t callback, void *ctx);
+
+/* Returns how many bytes of PUBLISH packets can be queued before reaching
+ * high watermark (or max mem if flow control is not set). Lock free.
+ */
+size_t mqtt_ng_publish_credit(struct mqtt_ng_client *client);
+
+/* Replaces allocator given in settings, can be called any time (also while connected)
+ * Objects allocated already are freed to the allocator they came from
+ * so it has to be kept valid until the client is destroyed.
+ * @param allocator NULL for system allocator
+ */
+void mqtt_ng_set_allocator(struct mqtt_ng_client *client, const struct mqtt_wss_allocator *allocator);
+
+// Sets maximum number of bytes gathered into single data_outv_fnc call
+// 0 disables coalescing (every buffer fragment is sent by separate call)
+void mqtt_ng_set_send_coalesce_limit(struct mqtt_ng_client *client, size_t bytes);
+
 void mqtt_ng_get_stats(struct mqtt_ng_client *client, struct mqtt_ng_stats *stats);
 
 int mqtt_ng_set_topic_alias(struct mqtt_ng_client *client, const char *topic);
+
+/* Enables automatic assignment of topic aliases to the most frequently published topics
+ * (in addition to the ones set by mqtt_ng_set_topic_alias). Number of aliases used
+ * is limited also by Topic Alias Maximum the server sent in CONNACK.
+ * @param max_aliases maximum number of topics aliased automatically, 0 disables
+ * @return 0 on success
+ */
+int mqtt_ng_set_auto_topic_alias(struct mqtt_ng_client *client, uint16_t max_aliases);
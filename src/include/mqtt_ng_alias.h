@@ -0,0 +1,58 @@
+// SPDX-License-Identifier: GPL-3.0-only
+//
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free Software Foundation, version 3.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+// See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with this program.
+// If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef MQTT_NG_ALIAS_H
+#define MQTT_NG_ALIAS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Automatic assignment of TX topic aliases [MQTT-3.3.2.3.4]
+// Frequency of topics published is estimated by count-min sketch (aged periodically)
+// and slots are given to the most frequent ones. When all slots are taken
+// a few slots are sampled and the coldest one is reassigned if the new topic
+// is more frequent than it (sampled LFU eviction with frequency based admission).
+// Lookups of topics (mqtt_ng_alias_cache_find, mqtt_ng_alias_cache_established)
+// can run concurrently under shared lock, everything else needs the lock exclusively.
+
+// topics shorter than this are not worth the alias
+#define MQTT_NG_ALIAS_MIN_TOPIC_LEN 8
+
+struct mqtt_ng_alias_cache;
+
+struct mqtt_ng_alias_cache *mqtt_ng_alias_cache_new(uint16_t slot_count);
+void mqtt_ng_alias_cache_destroy(struct mqtt_ng_alias_cache *cache);
+
+// forgets all assignments (e.g. aliases don't survive reconnect)
+void mqtt_ng_alias_cache_reset(struct mqtt_ng_alias_cache *cache);
+
+#define MQTT_NG_ALIAS_ASSIGN (-2)
+
+/* Accounts publish of topic and finds its slot, doesn't change slot assignments
+ * @param capacity number of slots (from 0) that can be used currently
+ * @param established set to 1 if message with topic and this slot's alias was already sent
+ *        (topic can be omitted), to 0 if topic has to be sent along the alias
+ * @return slot index, -1 if topic doesn't have an alias or MQTT_NG_ALIAS_ASSIGN
+ *         if slot has to be (re)assigned by mqtt_ng_alias_cache_assign
+ */
+int mqtt_ng_alias_cache_find(struct mqtt_ng_alias_cache *cache, const char *topic, uint16_t capacity, int *established);
+
+/* Assigns slot to topic already accounted by mqtt_ng_alias_cache_find,
+ * slots above capacity are released when hit. Parameters and return value
+ * same as for mqtt_ng_alias_cache_find (never returns MQTT_NG_ALIAS_ASSIGN).
+ */
+int mqtt_ng_alias_cache_assign(struct mqtt_ng_alias_cache *cache, const char *topic, uint16_t capacity, int *established);
+
+// to be called once message with topic and slot's alias was queued successfully
+void mqtt_ng_alias_cache_established(struct mqtt_ng_alias_cache *cache, int slot);
+
+#endif /* MQTT_NG_ALIAS_H */
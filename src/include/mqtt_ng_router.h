@@ -0,0 +1,68 @@
+// SPDX-License-Identifier: GPL-3.0-only
+//
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free Software Foundation, version 3.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+// See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with this program.
+// If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef MQTT_NG_ROUTER_H
+#define MQTT_NG_ROUTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common_public.h"
+
+// Routes incoming PUBLISH messages to callbacks registered per topic filter.
+// Filters are kept in a trie with one node per topic level [MQTT-4.7] so
+// matching cost depends on topic depth rather than number of filters.
+// Every route gets a Subscription Identifier [MQTT-3.8.2.1.2], if server
+// sends it back with the message the route is found directly without matching.
+// Identifiers of removed routes are not reused.
+// Thread safe, callbacks are called without any lock held.
+
+typedef void (*mqtt_ng_route_callback_t)(void *ctx, const struct mqtt_rx_msg *msg);
+
+struct mqtt_ng_router;
+
+struct mqtt_ng_router *mqtt_ng_router_new(void);
+void mqtt_ng_router_destroy(struct mqtt_ng_router *router);
+
+/* Adds route or replaces callback of route with the same filter
+ * @return Subscription Identifier to be sent with the SUBSCRIBE (> 0),
+ *         0 if filter is invalid or on OOM
+ */
+uint32_t mqtt_ng_router_add(struct mqtt_ng_router *router, const char *filter, mqtt_ng_route_callback_t callback, void *ctx);
+
+/* Finds route of filter (exact filter, not matching topic)
+ * @param callback, ctx set to those of the route if it is found
+ * @return Subscription Identifier of the route, 0 if there is none
+ */
+uint32_t mqtt_ng_router_lookup(struct mqtt_ng_router *router, const char *filter, mqtt_ng_route_callback_t *callback, void **ctx);
+
+/* Removes route with Subscription Identifier sub_id
+ * @return 0 on success, 1 if there is no such route
+ */
+int mqtt_ng_router_remove(struct mqtt_ng_router *router, uint32_t sub_id);
+
+// returns 1 if there is any route (cheap, can be checked before collecting Subscription Identifiers)
+int mqtt_ng_router_active(struct mqtt_ng_router *router);
+
+/* Finds out how many routes message would be dispatched to without calling them
+ * (e.g. before its payload is received), parameters are the same as for dispatch
+ */
+int mqtt_ng_router_match(struct mqtt_ng_router *router, const char *topic, const uint32_t *sub_ids, size_t sub_id_count);
+
+/* Calls callbacks of all routes message belongs to
+ * @param sub_ids Subscription Identifiers sent by server with the message,
+ *        topic is matched against the filters only if none of them is known
+ * @return number of callbacks called (0 means message was not routed)
+ */
+int mqtt_ng_router_dispatch(struct mqtt_ng_router *router, const struct mqtt_rx_msg *msg, const uint32_t *sub_ids, size_t sub_id_count);
+
+#endif /* MQTT_NG_ROUTER_H */
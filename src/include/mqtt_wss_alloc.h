@@ -0,0 +1,46 @@
+// SPDX-License-Identifier: GPL-3.0-only
+//
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free Software Foundation, version 3.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+// See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with this program.
+// If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef MQTT_WSS_ALLOC_H
+#define MQTT_WSS_ALLOC_H
+
+#include <stddef.h>
+
+#include "common_public.h"
+
+// Objects allocated by mw_obj_* remember the allocator (and size) they came from
+// so they can be freed from places that have no access to the client
+// (e.g. by free_fnc_t callbacks) and allocator can be replaced at any time.
+// Allocator has to outlive all objects allocated from it.
+
+// mqtt_wss_system_allocator (see common_public.h) is used when allocator is NULL
+
+void *mw_obj_malloc(const struct mqtt_wss_allocator *alloc, size_t size);
+char *mw_obj_strdup(const struct mqtt_wss_allocator *alloc, const char *str);
+void mw_obj_free(void *ptr);
+
+// Size class slab allocator
+// Blocks are taken from per class free lists, slabs are allocated from system
+// when free list is empty and are kept until the pool is destroyed
+// so steady state doesn't call system allocator at all.
+struct mqtt_wss_pool;
+
+struct mqtt_wss_pool *mqtt_wss_pool_new(void);
+// all blocks have to be freed already
+void mqtt_wss_pool_destroy(struct mqtt_wss_pool *pool);
+
+// returns allocator backed by the pool (valid until pool is destroyed)
+const struct mqtt_wss_allocator *mqtt_wss_pool_allocator(struct mqtt_wss_pool *pool);
+
+void mqtt_wss_pool_get_stats(struct mqtt_wss_pool *pool, struct mqtt_wss_pool_stats *stats);
+
+#endif /* MQTT_WSS_ALLOC_H */
@@ -40,6 +40,9 @@
 // if client was initialized with MQTT 3 but MQTT 5 feature
 // was requested by user of library
 #define MQTT_WSS_ERR_CANT_DO       -8
+// connection attempt started by mqtt_wss_connect_async failed
+// (see mqtt_wss_get_connect_error)
+#define MQTT_WSS_ERR_CONNECT_FAILED -9
 
 typedef struct mqtt_wss_client_struct *mqtt_wss_client;
 
@@ -61,8 +64,108 @@ mqtt_wss_client mqtt_wss_new(const char *log_prefix,
                              msg_callback_fnc_t msg_callback,
                              void (*puback_callback)(uint16_t packet_id));
 
+/* Sets minimum severity of messages to be logged, see mqtt_wss_log_ctx_set_level */
+void mqtt_wss_set_log_level(mqtt_wss_client client, mqtt_wss_log_type_t min_severity);
+
+/* Moves log output to background thread so that logging from the service thread
+ * never waits for log callback I/O, see mqtt_wss_log_ctx_set_async.
+ * Has to be called before mqtt_wss_connect.
+ * @param records capacity of the log ring in messages
+ * @return 0 on success
+ */
+int mqtt_wss_set_log_async(mqtt_wss_client client, size_t records);
+
 void mqtt_wss_set_max_buf_size(mqtt_wss_client client, size_t size);
 
+typedef void (*flow_control_callback_fnc_t)(void *ctx, int above);
+/* Sets backpressure watermarks on bytes of PUBLISH packets held by the client
+ * (QOS0 not sent yet, QOS1 not acknowledged yet). Callback is called with above == 1
+ * once high watermark is reached and with above == 0 once it drops to low watermark.
+ * It can be called from publishing thread as well as from service thread.
+ * Sending of QOS1 messages is limited by Receive Maximum server sent in CONNACK,
+ * messages over the limit are kept in the buffer until PUBACK arrives
+ * (packets other than PUBLISH queued behind them, e.g. our PUBACKs, are sent meanwhile).
+ * @param callback function to be called or NULL to disable
+ * @param ctx passed to callback as is
+ * @return 0 on success, 1 if low is not lower than high
+ */
+int mqtt_wss_set_flow_control(mqtt_wss_client client, size_t high, size_t low, flow_control_callback_fnc_t callback, void *ctx);
+
+/* Returns how many bytes of messages can be published before high watermark
+ * (or max buffer size when flow control is disabled) is reached.
+ * Can be called from any thread.
+ */
+size_t mqtt_wss_publish_credit(mqtt_wss_client client);
+
+typedef void (*msg_borrowed_callback_fnc_t)(void *ctx, const struct mqtt_rx_msg *msg);
+/* Sets callback to be used instead of msg_callback given to mqtt_wss_new.
+ * Topic and payload are passed as pointers into internal buffers (no malloc and copy
+ * per message) valid only until callback returns. Use mqtt_rx_msg_retain to keep them.
+ * Has to be set before mqtt_wss_connect.
+ * @param callback function to be called or NULL to use msg_callback again
+ * @param ctx passed to callback as is
+ */
+void mqtt_wss_set_msg_borrowed_callback(mqtt_wss_client client, msg_borrowed_callback_fnc_t callback, void *ctx);
+
+typedef void (*msg_chunk_callback_fnc_t)(void *ctx, const struct mqtt_rx_msg_chunk *chunk);
+/* Messages with payload longer than min_len are passed to callback in chunks
+ * (see struct mqtt_rx_msg_chunk) as they are read from the socket instead of
+ * to message callbacks, so they are not held in memory whole no matter
+ * how big. QOS1 messages are acknowledged after the last chunk. Messages
+ * routed by mqtt_wss_subscribe_route are not chunked (route callback gets
+ * them whole).
+ * Has to be set before mqtt_wss_connect.
+ * @param callback function to be called or NULL to disable
+ */
+void mqtt_wss_set_msg_chunk_callback(mqtt_wss_client client, size_t min_len, msg_chunk_callback_fnc_t callback, void *ctx);
+
+/* Sets maximum number of bytes of MQTT data (possibly multiple MQTT packets)
+ * that will be coalesced into single WebSocket frame
+ * @param bytes limit in bytes, 0 will disable coalescing (one frame per internal buffer fragment)
+ */
+void mqtt_wss_set_send_coalesce_limit(mqtt_wss_client client, size_t bytes);
+
+/* Sets how many random bytes are read from entropy source at once
+ * to be used as WebSocket frame masks (4 bytes per frame)
+ * @param bytes pool size in bytes (rounded down to multiple of 4)
+ * @return 0 on success
+ */
+int mqtt_wss_set_mask_pool_size(mqtt_wss_client client, size_t bytes);
+
+/* Configures WebSocket permessage-deflate compression [RFC7692]
+ * Offered to the server in the handshake of the next mqtt_wss_connect,
+ * used only if server accepts it. Disabled by default.
+ * @param params compression settings, see struct mqtt_wss_deflate_params
+ * @return 0 on success, non 0 if params are invalid
+ */
+int mqtt_wss_set_compression(mqtt_wss_client client, const struct mqtt_wss_deflate_params *params);
+
+#define MQTT_WSS_DEFAULT_TX_RECORD_SIZE (16 * 1024)
+#define MQTT_WSS_MAX_TX_RECORD_SIZE (16 * 1024 * 1024)
+/* Sets target size of single SSL_write. Outgoing data are written until
+ * TLS would block, joining data at the wrap around of internal ring buffer
+ * so that fewer and larger TLS records (and syscalls) are produced.
+ * Has to be called before mqtt_wss_connect.
+ * @param bytes target size in bytes (default MQTT_WSS_DEFAULT_TX_RECORD_SIZE),
+ *        0 to write only what is linearly available in the ring buffer
+ * @return 0 on success
+ */
+int mqtt_wss_set_tx_record_size(mqtt_wss_client client, size_t bytes);
+
+/* Enables Linux kernel TLS offload for following connections.
+ * Once TLS handshake is done records are encrypted by kernel (or NIC)
+ * and outgoing data are sent by plain send. Incoming data are read by
+ * recvmsg for TLS 1.2 (TLS 1.3 post handshake messages need OpenSSL).
+ * Falls back to OpenSSL for whatever kernel or cipher can't offload.
+ * @return 0 on success, 1 if this build doesn't support kTLS (needs Linux and OpenSSL 3)
+ */
+int mqtt_wss_set_ktls(mqtt_wss_client client, int enable);
+
+#define MQTT_WSS_KTLS_TX 0x01
+#define MQTT_WSS_KTLS_RX 0x02
+// @return offload active on current connection (MQTT_WSS_KTLS_TX | MQTT_WSS_KTLS_RX)
+int mqtt_wss_get_ktls(mqtt_wss_client client);
+
 void mqtt_wss_destroy(mqtt_wss_client client);
 
 struct mqtt_connect_params;
@@ -73,6 +176,10 @@ struct mqtt_wss_proxy;
 #define MQTT_WSS_SSL_DONT_CHECK_CERTS  0x08
 
 /* Will block until the MQTT over WSS connection is established or return error
+ * (or MQTT_WSS_DEFAULT_CONNECT_TIMEOUT_MS passes, see mqtt_wss_set_connect_timeout)
+ * TLS context (trust store) is kept between connects of the same client and
+ * the last TLS session is offered when reconnecting to the same host and port
+ * (see tls_resumed in mqtt_wss_stats).
  * @param client mqtt_wss_client which should connect
  * @param host to connect to (where MQTT over WSS server is listening)
  * @param port to connect to (where MQTT over WSS server is listening)
@@ -80,9 +187,47 @@ struct mqtt_wss_proxy;
  * @param ssl_flags parameters for OpenSSL, 0=MQTT_WSS_SSL_CERT_CHECK_FULL
  */
 int mqtt_wss_connect(mqtt_wss_client client, char *host, int port, struct mqtt_connect_params *mqtt_params, int ssl_flags, struct mqtt_wss_proxy *proxy);
+
+enum mqtt_wss_connect_state {
+    MQTT_WSS_CONN_IDLE = 0,
+    MQTT_WSS_CONN_RESOLVING,
+    MQTT_WSS_CONN_TCP,
+    MQTT_WSS_CONN_PROXY,
+    MQTT_WSS_CONN_TLS,
+    MQTT_WSS_CONN_HANDSHAKE, // WebSocket upgrade and MQTT CONNECT
+    MQTT_WSS_CONN_CONNECTED,
+    MQTT_WSS_CONN_FAILED
+};
+
+/* Starts connecting and returns without waiting for the network.
+ * Connection is then driven by mqtt_wss_service (or mqtt_wss_reactor)
+ * which returns MQTT_WSS_ERR_CONNECT_FAILED if the attempt fails.
+ * Names are resolved in background (results are cached for MWS_DNS_CACHE_TTL_SEC),
+ * all resolved IPv4 and IPv6 addresses are raced "Happy Eyeballs" style.
+ * Parameters are the same as for mqtt_wss_connect (which is this plus waiting).
+ * @return 0 if connection attempt is in progress, otherwise
+ *         the error code mqtt_wss_connect would return
+ */
+int mqtt_wss_connect_async(mqtt_wss_client client, char *host, int port, struct mqtt_connect_params *mqtt_params, int ssl_flags, struct mqtt_wss_proxy *proxy);
+enum mqtt_wss_connect_state mqtt_wss_get_connect_state(mqtt_wss_client client);
+// @return error code mqtt_wss_connect would return if the state is MQTT_WSS_CONN_FAILED, 0 otherwise
+int mqtt_wss_get_connect_error(mqtt_wss_client client);
+
+#define MQTT_WSS_DEFAULT_CONNECT_TIMEOUT_MS 60000
+/* Limits how long the whole connection attempt (from resolving till CONNACK) can take
+ * @param timeout_ms 0 to wait forever, applies to following connects
+ */
+void mqtt_wss_set_connect_timeout(mqtt_wss_client client, int timeout_ms);
 int mqtt_wss_service(mqtt_wss_client client, int timeout_ms);
 void mqtt_wss_disconnect(mqtt_wss_client client, int timeout_ms);
 
+/* Makes the thread servicing the client (mqtt_wss_service or mqtt_wss_reactor)
+ * look for work again, e.g. once data of streamed payload are available
+ * (see mqtt_stream_pull_fnc_t). Publishing functions do this themselves.
+ * Can be called from any thread.
+ */
+void mqtt_wss_wakeup(mqtt_wss_client client);
+
 // we redefine this instead of using MQTT-C flags as in future
 // we want to support different MQTT implementations if needed
 enum mqtt_wss_publish_flags {
@@ -127,6 +272,7 @@ struct mqtt_wss_proxy {
  * @param publish_flags see enum mqtt_wss_publish_flags e.g. (MQTT_WSS_PUB_QOS1 | MQTT_WSS_PUB_RETAIN)
  * @param packet_id is 16 bit unsigned int representing ID that can be used to pair with PUBACK callback
  *        for usages where application layer wants to know which messages are delivered when
+ *        (0 if message was put into the spool, see mqtt_wss_set_spool)
  * @return Returns 0 on success
  */
 int mqtt_wss_publish5(mqtt_wss_client client,
@@ -138,8 +284,104 @@ int mqtt_wss_publish5(mqtt_wss_client client,
                       uint8_t publish_flags,
                       uint16_t *packet_id);
 
+/* Prepares handle for publishing to the same topic with the same flags repeatedly
+ * Fixed part of PUBLISH header is encoded once, mqtt_wss_publish_prepared then
+ * only fills in lengths, packet id and payload. Topic is copied. Handle is freed
+ * by mqtt_wss_prepared_publish_free or by mqtt_wss_destroy if it wasn't freed
+ * before and can be used from any thread. Topic alias set by
+ * mqtt_wss_set_topic_alias is applied if it is set at the time of publishing,
+ * automatic aliases are still applied (slower path).
+ * @param publish_flags see enum mqtt_wss_publish_flags
+ * @return handle or NULL on error
+ */
+struct mqtt_prepared_publish *mqtt_wss_prepare_publish(mqtt_wss_client client, const char *topic, uint8_t publish_flags);
+
+/* Frees handle returned by mqtt_wss_prepare_publish, messages already
+ * published with it are not affected */
+void mqtt_wss_prepared_publish_free(mqtt_wss_client client, struct mqtt_prepared_publish *pp);
+
+/* Same as mqtt_wss_publish5 with topic and flags given by mqtt_wss_prepare_publish */
+int mqtt_wss_publish_prepared(mqtt_wss_client client,
+                              struct mqtt_prepared_publish *pp,
+                              void *msg,
+                              free_fnc_t msg_free,
+                              size_t msg_len,
+                              uint16_t *packet_id);
+
+/* Publishes message of known length with payload pulled in chunks
+ * from src while it is being sent (see struct mqtt_stream_source).
+ * Memory used is bounded by chunk size no matter how big the message is.
+ * Messages published after it are sent once the whole payload is.
+ * Streamed messages are not spooled and don't use topic aliases.
+ * @param msg_len total length of the payload
+ * @param publish_flags see enum mqtt_wss_publish_flags
+ * @return Returns 0 on success (src->ctx_free is then called once done with ctx)
+ */
+int mqtt_wss_publish_stream(mqtt_wss_client client,
+                            char *topic,
+                            free_fnc_t topic_free,
+                            size_t msg_len,
+                            uint8_t publish_flags,
+                            const struct mqtt_stream_source *src,
+                            uint16_t *packet_id);
+
+/* Publishes MQTT message without blocking on any lock shared with the service thread
+ * Message is put into lock-free queue which is moved into transmit buffer
+ * by the service thread (mqtt_wss_service) in batches. Useful when many
+ * threads publish at once. As the packet id is assigned later application
+ * gets it using publish queued callback (see mqtt_wss_set_publish_queued_callback).
+ * Data are copied if topic_free/msg_free is NULL. If message can't be queued by
+ * the service thread later data are freed by the library.
+ * With spool enabled messages are spooled by the same rules as for mqtt_wss_publish5,
+ * publish queued callback is then called right away from the calling thread
+ * with packet id 0.
+ * @param msg_ctx opaque pointer given to publish queued callback
+ * @return Returns 0 on success
+ */
+int mqtt_wss_publish5_enqueue(mqtt_wss_client client,
+                              char *topic,
+                              free_fnc_t topic_free,
+                              void *msg,
+                              free_fnc_t msg_free,
+                              size_t msg_len,
+                              uint8_t publish_flags,
+                              void *msg_ctx);
+
+/* Called from service thread for every message published by mqtt_wss_publish5_enqueue
+ * (from publishing thread for spooled messages)
+ * @param msg_ctx as given to mqtt_wss_publish5_enqueue
+ * @param packet_id packet id of the message (can be paired with PUBACK callback)
+ * @param rc 0 on success, error otherwise (message was not sent)
+ */
+typedef void (*publish_queued_callback_fnc_t)(void *ctx, void *msg_ctx, uint16_t packet_id, int rc);
+void mqtt_wss_set_publish_queued_callback(mqtt_wss_client client, publish_queued_callback_fnc_t callback, void *ctx);
+
+/* Publishes multiple MQTT messages at once
+ * All messages are queued under a single lock of the transmit buffer and the
+ * service loop is woken up only once which is much cheaper than calling
+ * mqtt_wss_publish5 repeatedly.
+ * @param client mqtt_wss_client which should transfer the messages
+ * @param entries array of messages to be published, packet_id and rc of every
+ *        entry are filled in (rc == 0 on success, error code same as mqtt_wss_publish5 otherwise)
+ * @param count number of entries
+ * @return number of messages which were not queued (0 if all succeeded)
+ * With spool enabled the whole batch is spooled if any message is QOS1
+ * (same rules as for mqtt_wss_publish5 otherwise).
+ */
+size_t mqtt_wss_publish_batch(mqtt_wss_client client, struct mqtt_publish_batch_entry *entries, size_t count);
+
 int mqtt_wss_set_topic_alias(mqtt_wss_client client, const char *topic);
 
+/* Lets the library assign topic aliases automatically so that the most frequently
+ * published topics are not sent over and over (no need to call mqtt_wss_set_topic_alias).
+ * Aliases are (re)assigned on the fly by publish frequency, never more than
+ * Topic Alias Maximum the broker sent in CONNACK.
+ * @param client mqtt_wss_client
+ * @param max_aliases maximum number of topics aliased automatically, 0 disables (default)
+ * @return 0 on success
+ */
+int mqtt_wss_set_auto_topic_alias(mqtt_wss_client client, uint16_t max_aliases);
+
 /* Subscribes to MQTT topic
  * @param client mqtt_wss_client which should do the subscription
  * @param topic MQTT topic to subscribe to
@@ -148,25 +390,94 @@ int mqtt_wss_set_topic_alias(mqtt_wss_client client, const char *topic);
  */
 int mqtt_wss_subscribe(mqtt_wss_client client, char *topic, int max_qos_level);
 
+/* Subscribes to MQTT topic filter and routes messages matching it to callback
+ * (instead of msg_callback or msg_borrowed_callback). Filters are kept in a trie
+ * built at subscribe time so dispatch cost doesn't grow with number of subscriptions.
+ * If broker supports MQTT 5 Subscription Identifiers messages are routed by them
+ * without matching the topic at all. Message matching multiple filters is given
+ * to all their callbacks. Messages not matching any filter go to msg_callback.
+ * Subscribing the same filter again replaces its callback.
+ * Must not be called from within the route callback.
+ * @param client mqtt_wss_client which should do the subscription
+ * @param topic MQTT topic filter ('+' and '#' wildcards allowed)
+ * @param max_qos_level maximum QOS level that broker can send to us on this subscription
+ * @param callback called with message borrowed same as msg_borrowed_callback (see mqtt_rx_msg_retain)
+ * @param ctx passed to callback as is
+ * @return Returns 0 on success
+ */
+int mqtt_wss_subscribe_route(mqtt_wss_client client, char *topic, int max_qos_level, msg_borrowed_callback_fnc_t callback, void *ctx);
+
 
 struct mqtt_wss_stats {
     uint64_t bytes_tx;
     uint64_t bytes_rx;
-#ifdef MQTT_WSS_CPUSTATS
-    uint64_t time_keepalive;
-    uint64_t time_read_socket;
-    uint64_t time_write_socket;
-    uint64_t time_process_websocket;
-    uint64_t time_process_mqtt;
-#endif
+    // TLS records sent and write syscalls made (require OpenSSL >= 1.1.0 and >= 1.1.1 respectively)
+    uint64_t tx_tls_records;
+    uint64_t tx_syscalls;
+    // connections established and how many of them resumed previous TLS session
+    uint64_t tls_handshakes;
+    uint64_t tls_resumed;
     struct mqtt_ng_stats mqtt;
+    // built-in allocator (kept counting even when other allocator is set)
+    struct mqtt_wss_pool_stats pool;
+    struct mqtt_wss_spool_stats spool;
 };
 
 struct mqtt_wss_stats mqtt_wss_get_stats(mqtt_wss_client client);
 
+/* Sets allocator for library's small short lived objects (see struct mqtt_wss_allocator)
+ * By default they come from built-in size class slab pool so that steady
+ * state publishing and receiving doesn't call system allocator.
+ * Can be called at any time (objects allocated already are freed back
+ * to the allocator they came from) so allocator has to stay valid
+ * until mqtt_wss_destroy.
+ * @param allocator NULL to return to the built-in pool,
+ *        &mqtt_wss_system_allocator to use system allocator
+ * @return 0 on success, 1 if allocator is missing malloc or free (allocator is not changed)
+ */
+int mqtt_wss_set_allocator(mqtt_wss_client client, const struct mqtt_wss_allocator *allocator);
+
+/* Enables persistent outbound queue (spool) backed by memory mapped file
+ * While enabled mqtt_wss_publish5 and mqtt_wss_publish_batch put QOS1 messages,
+ * messages published while offline and messages published while spool
+ * has backlog into the spool instead of failing/bypassing it. Spool is
+ * drained by the service thread once connected (CONNACK received).
+ * Messages survive reconnect and process restart (file is recovered on next
+ * mqtt_wss_set_spool). QOS1 messages sent but not acknowledged are sent again
+ * with DUP flag. Publishing returns packet id 0 for spooled messages and PUBACK
+ * callback is not called for them.
+ * Can be called only while disconnected, not concurrently with publishing.
+ * @param params NULL to disable (file is kept), see struct mqtt_wss_spool_params
+ * @return 0 on success
+ */
+int mqtt_wss_set_spool(mqtt_wss_client client, const struct mqtt_wss_spool_params *params);
+
+/* Switches hot path instrumentation on/off at runtime (off by default)
+ * When on, stages listed in enum mqtt_wss_instr_stage are timed into
+ * histograms and events in enum mqtt_wss_instr_event are counted.
+ * Data collected are kept when switched off.
+ */
+void mqtt_wss_set_instrumentation(mqtt_wss_client client, int enabled);
+
+/* Copies current instrumentation data into snapshot
+ * Unlike mqtt_wss_get_stats nothing is reset, values are cumulative.
+ * Lock free, can be called from any thread. Use mqtt_wss_timing_percentile
+ * to get p50/p99 etc. from the histograms.
+ */
+void mqtt_wss_get_instrumentation(mqtt_wss_client client, struct mqtt_wss_instr_snapshot *snapshot);
+
 #ifdef MQTT_WSS_DEBUG
 #include <openssl/ssl.h>
 void mqtt_wss_set_SSL_CTX_keylog_cb(mqtt_wss_client client, void (*ssl_ctx_keylog_cb)(const SSL *ssl, const char *line));
+
+/* Records decrypted incoming byte stream (everything read from TLS) into file
+ * to be replayed offline by bench_replay. Takes effect with next mqtt_wss_connect,
+ * file is truncated on every connect so it always holds single session.
+ * The file contains all data sent by server in plain text!
+ * @param path file to write or NULL to stop capturing
+ * @return 0 on success
+ */
+int mqtt_wss_set_rx_capture(mqtt_wss_client client, const char *path);
 #endif
 
 #endif /* MQTT_WSS_CLIENT_H */
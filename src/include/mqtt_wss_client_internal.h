@@ -0,0 +1,54 @@
+// SPDX-License-Identifier: GPL-3.0-only
+//
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free Software Foundation, version 3.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+// See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with this program.
+// If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef MQTT_WSS_CLIENT_INTERNAL_H
+#define MQTT_WSS_CLIENT_INTERNAL_H
+
+#include "mqtt_wss_client.h"
+#include "mqtt_wss_tcp.h"
+
+// Used by event loops other than mqtt_wss_service's own poll (mqtt_wss_reactor)
+
+#define MQTT_WSS_MAX_SOCKETS MWS_TCP_MAX_ATTEMPTS
+
+int mqtt_wss_get_socket_fd(mqtt_wss_client client);
+// all sockets to be watched (several while TCP connect attempts race)
+// returns their count
+int mqtt_wss_get_socket_fds(mqtt_wss_client client, int *fds, int max);
+// changes whenever the sockets returned by mqtt_wss_get_socket_fds might have changed
+unsigned int mqtt_wss_socket_generation(mqtt_wss_client client);
+// becomes readable when mqtt_wss_client has new data to send
+// (or background name resolution finished), eventfd on Linux
+int mqtt_wss_get_wakeup_fd(mqtt_wss_client client);
+
+// wakeups (new data to send) are signalled to fd (eventfd shared by many clients)
+// instead of the client's own wakeup fd, -1 goes back to the own one
+// once this returns previous target is not signalled anymore (it can be closed)
+// resolver still uses the own one
+void mqtt_wss_set_wakeup_target(mqtt_wss_client client, int fd);
+// client was woken up since last mqtt_wss_service_events
+int mqtt_wss_wakeup_pending(mqtt_wss_client client);
+
+// milliseconds till mqtt_wss_service_events has to be called even without any events
+// (MQTT keep-alive or connection timers), -1 if not needed
+long long int mqtt_wss_timer_in_ms(mqtt_wss_client client);
+
+// does everything mqtt_wss_service does after poll returns
+// wakeup_pending - wakeup fd was signalled
+// send_keepalive - MQTT PING should be sent
+int mqtt_wss_service_events(mqtt_wss_client client, int wakeup_pending, int send_keepalive);
+
+// returns 1 if client should be serviced again without waiting
+// for new socket readiness (last read or write didn't block)
+int mqtt_wss_has_pending_work(mqtt_wss_client client);
+
+#endif /* MQTT_WSS_CLIENT_INTERNAL_H */
@@ -0,0 +1,59 @@
+// SPDX-License-Identifier: GPL-3.0-only
+//
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free Software Foundation, version 3.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+// See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with this program.
+// If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef MQTT_WSS_DNS_H
+#define MQTT_WSS_DNS_H
+
+#include <sys/socket.h>
+
+#include "mqtt_wss_log.h"
+
+// Asynchronous name resolution for non blocking connect
+// getaddrinfo is run in a short lived thread, results are cached process wide
+
+#define MWS_DNS_CACHE_TTL_SEC 60
+
+struct mws_addr {
+    struct sockaddr_storage addr;
+    socklen_t len;
+};
+
+// addresses in the order they should be tried (families interleaved [RFC8305 4])
+struct mws_addr_list {
+    size_t count;
+    struct mws_addr addrs[];
+};
+
+struct mws_dns_query;
+
+/* Starts resolution of host
+ * @param notify_fd pipe or eventfd, 8 byte value 1 is written into it once query is done
+ *        (not written if the result was cached and query is done right away)
+ * @return query (check mws_dns_query_done) or NULL on error
+ */
+struct mws_dns_query *mws_dns_resolve(const char *host, int port, int notify_fd, mqtt_wss_log_ctx_t log);
+
+// thread safe, can be polled anytime
+int mws_dns_query_done(struct mws_dns_query *query);
+
+/* Takes result of finished query
+ * @return list of addresses (to be freed by mw_free) or NULL if resolution failed
+ */
+struct mws_addr_list *mws_dns_query_result(struct mws_dns_query *query, mqtt_wss_log_ctx_t log);
+
+// drops query (running resolution finishes and is cached but nobody is notified)
+void mws_dns_query_release(struct mws_dns_query *query);
+
+// forgets cached result e.g. after none of the addresses could be connected to
+void mws_dns_cache_invalidate(const char *host);
+
+#endif /* MQTT_WSS_DNS_H */
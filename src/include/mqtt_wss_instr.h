@@ -0,0 +1,72 @@
+// SPDX-License-Identifier: GPL-3.0-only
+//
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free Software Foundation, version 3.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+// See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with this program.
+// If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef MQTT_WSS_INSTR_H
+#define MQTT_WSS_INSTR_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "common_public.h"
+
+// Runtime switchable hot path instrumentation shared by mqtt_wss_client and mqtt_ng
+// When disabled every probe costs one relaxed load and a branch.
+// Histograms can be written from multiple threads at once (message generation
+// is timed by every publishing thread), all updates are atomic, readers are lock free.
+
+struct mqtt_wss_instr {
+    int enabled;
+    struct mqtt_wss_timing stages[MQTT_WSS_STAGE_COUNT];
+    uint64_t events[MQTT_WSS_EVENT_COUNT];
+};
+
+void mqtt_wss_instr_init(struct mqtt_wss_instr *instr);
+void mqtt_wss_instr_set_enabled(struct mqtt_wss_instr *instr, int enabled);
+void mqtt_wss_instr_record(struct mqtt_wss_instr *instr, enum mqtt_wss_instr_stage stage, uint64_t ns);
+// doesn't reset anything
+void mqtt_wss_instr_snapshot(struct mqtt_wss_instr *instr, struct mqtt_wss_instr_snapshot *snapshot);
+
+static inline uint64_t mqtt_wss_instr_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline int mqtt_wss_instr_enabled(struct mqtt_wss_instr *instr)
+{
+    return instr && __atomic_load_n(&instr->enabled, __ATOMIC_RELAXED);
+}
+
+// returns 0 if instrumentation is disabled (stop will then do nothing)
+static inline uint64_t mqtt_wss_instr_start(struct mqtt_wss_instr *instr)
+{
+    return mqtt_wss_instr_enabled(instr) ? mqtt_wss_instr_now_ns() : 0;
+}
+
+// records time since start, returns it (0 if not measured)
+static inline uint64_t mqtt_wss_instr_stop(struct mqtt_wss_instr *instr, enum mqtt_wss_instr_stage stage, uint64_t start)
+{
+    if (!start)
+        return 0;
+    uint64_t ns = mqtt_wss_instr_now_ns() - start;
+    mqtt_wss_instr_record(instr, stage, ns);
+    return ns;
+}
+
+static inline void mqtt_wss_instr_event(struct mqtt_wss_instr *instr, enum mqtt_wss_instr_event event)
+{
+    if (mqtt_wss_instr_enabled(instr))
+        __atomic_fetch_add(&instr->events[event], 1, __ATOMIC_RELAXED);
+}
+
+#endif /* MQTT_WSS_INSTR_H */
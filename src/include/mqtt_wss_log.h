@@ -1,6 +1,9 @@
 #ifndef MQTT_WSS_LOG_H
 #define MQTT_WSS_LOG_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 typedef enum mqtt_wss_log_type {
     MQTT_WSS_LOG_DEBUG = 0x01,
     MQTT_WSS_LOG_INFO  = 0x02,
@@ -28,10 +31,48 @@ mqtt_wss_log_ctx_t mqtt_wss_log_ctx_create(const char *ctx_prefix, mqtt_wss_log_
  *  @param ctx Context to destroy */
 void mqtt_wss_log_ctx_destroy(mqtt_wss_log_ctx_t ctx);
 
+/** Sets minimum severity of messages to be logged (default MQTT_WSS_LOG_DEBUG - everything)
+ *  Messages below are dropped before their arguments are evaluated or formatted.
+ *  Can be changed at any time from any thread.
+ *  @param ctx Context to change
+ *  @param min_severity e.g. MQTT_WSS_LOG_WARN to log warnings, errors and fatal errors only */
+void mqtt_wss_log_ctx_set_level(mqtt_wss_log_ctx_t ctx, mqtt_wss_log_type_t min_severity);
+
+/** Moves log output (callback or STDOUT) to background thread
+ *  Messages are formatted by the calling thread into lock-free ring buffer
+ *  which the background thread drains, so logging never blocks on I/O.
+ *  Messages are dropped (and counted) when the ring is full.
+ *  Has to be called before the context is used by other threads.
+ *  Background thread is stopped (and remaining messages logged) by mqtt_wss_log_ctx_destroy.
+ *  @param ctx Context to change
+ *  @param records ring capacity in messages (rounded up to power of 2)
+ *  @return 0 on success */
+int mqtt_wss_log_ctx_set_async(mqtt_wss_log_ctx_t ctx, size_t records);
+
+/** @return number of messages dropped because asynchronous log ring was full */
+uint64_t mqtt_wss_log_ctx_dropped(mqtt_wss_log_ctx_t ctx);
+
+// first member of struct mqtt_wss_log_ctx, allows the level check to be inlined
+struct mqtt_wss_log_gate {
+    int min_severity;
+};
+
+static inline int mws_log_enabled(mqtt_wss_log_ctx_t ctx, int severity)
+{
+    return severity >= __atomic_load_n(&((struct mqtt_wss_log_gate *)ctx)->min_severity, __ATOMIC_RELAXED);
+}
+
 void mws_fatal(mqtt_wss_log_ctx_t ctx, const char *fmt, ...);
 void mws_error(mqtt_wss_log_ctx_t ctx, const char *fmt, ...);
 void mws_warn (mqtt_wss_log_ctx_t ctx, const char *fmt, ...);
 void mws_info (mqtt_wss_log_ctx_t ctx, const char *fmt, ...);
 void mws_debug(mqtt_wss_log_ctx_t ctx, const char *fmt, ...);
 
+// level is checked before arguments are evaluated
+#define mws_fatal(ctx, ...) (mws_log_enabled((ctx), MQTT_WSS_LOG_FATAL) ? mws_fatal((ctx), __VA_ARGS__) : (void)0)
+#define mws_error(ctx, ...) (mws_log_enabled((ctx), MQTT_WSS_LOG_ERROR) ? mws_error((ctx), __VA_ARGS__) : (void)0)
+#define mws_warn(ctx, ...)  (mws_log_enabled((ctx), MQTT_WSS_LOG_WARN)  ? mws_warn((ctx), __VA_ARGS__)  : (void)0)
+#define mws_info(ctx, ...)  (mws_log_enabled((ctx), MQTT_WSS_LOG_INFO)  ? mws_info((ctx), __VA_ARGS__)  : (void)0)
+#define mws_debug(ctx, ...) (mws_log_enabled((ctx), MQTT_WSS_LOG_DEBUG) ? mws_debug((ctx), __VA_ARGS__) : (void)0)
+
 #endif /* MQTT_WSS_LOG_H */
@@ -0,0 +1,56 @@
+// SPDX-License-Identifier: GPL-3.0-only
+//
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free Software Foundation, version 3.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+// See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with this program.
+// If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef MQTT_WSS_REACTOR_H
+#define MQTT_WSS_REACTOR_H
+
+#include "mqtt_wss_client.h"
+
+/* Reactor allows servicing many mqtt_wss_client connections from a single thread.
+ * It waits for socket readiness of all registered clients at once (edge triggered epoll)
+ * and takes care of MQTT keep-alives of all of them.
+ * Registered clients must not be serviced by mqtt_wss_service at the same time.
+ * Currently implemented on Linux only.
+ */
+typedef struct mqtt_wss_reactor *mqtt_wss_reactor;
+
+/* Called when servicing of the client fails. The client is already removed
+ * from the reactor when this is called (it can be reconnected and added again).
+ * @param rc error code as returned by mqtt_wss_service
+ */
+typedef void (*mqtt_wss_reactor_error_cb_t)(void *ctx, mqtt_wss_client client, int rc);
+
+mqtt_wss_reactor mqtt_wss_reactor_new(const char *log_prefix, mqtt_wss_log_callback_t log_callback);
+void mqtt_wss_reactor_destroy(mqtt_wss_reactor reactor);
+
+/* Registers connected client (or one with mqtt_wss_connect_async in progress) with reactor
+ * error_cb is called with MQTT_WSS_ERR_CONNECT_FAILED if connecting fails.
+ * Client has to be removed and added again after reconnect.
+ * @param error_cb called if servicing the client fails (can be NULL)
+ * @param ctx passed to error_cb as is
+ * @return 0 on success
+ */
+int mqtt_wss_reactor_add(mqtt_wss_reactor reactor, mqtt_wss_client client, mqtt_wss_reactor_error_cb_t error_cb, void *ctx);
+
+/* Unregisters client from reactor (e.g. to disconnect it).
+ * Can be called from within error_cb for other clients.
+ * @return 0 on success, 1 if client was not registered
+ */
+int mqtt_wss_reactor_remove(mqtt_wss_reactor reactor, mqtt_wss_client client);
+
+/* Waits for events and services all clients that are ready (or need to send keep-alive)
+ * @param timeout_ms maximum time to wait for events, -1 to wait until something happens
+ * @return number of clients serviced, < 0 on error
+ */
+int mqtt_wss_reactor_run(mqtt_wss_reactor reactor, int timeout_ms);
+
+#endif /* MQTT_WSS_REACTOR_H */
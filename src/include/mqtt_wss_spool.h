@@ -0,0 +1,62 @@
+// SPDX-License-Identifier: GPL-3.0-only
+//
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free Software Foundation, version 3.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+// See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with this program.
+// If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef MQTT_WSS_SPOOL_H
+#define MQTT_WSS_SPOOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common_public.h"
+#include "mqtt_wss_log.h"
+
+struct mqtt_ng_client;
+
+// Persistent outbound queue
+// Messages are appended to memory mapped ring log file and stay there
+// until sent (QOS0) or acknowledged (QOS1). Payloads of QOS1 messages are
+// given to mqtt_ng straight from the mapping (no copy). After reconnect
+// or restart messages already sent but not acknowledged are sent again
+// with DUP flag. Single process only (file is locked).
+// All functions are thread safe.
+struct mqtt_wss_spool;
+
+struct mqtt_wss_spool *mqtt_wss_spool_open(const struct mqtt_wss_spool_params *params, mqtt_wss_log_ctx_t log);
+// mqtt_ng must not be sending from the spool anymore
+void mqtt_wss_spool_close(struct mqtt_wss_spool *spool);
+
+/* Appends message to the spool
+ * @return 0 on success, 1 if spool is full or message can never fit
+ */
+int mqtt_wss_spool_append(struct mqtt_wss_spool *spool, const char *topic, const void *msg, size_t msg_len, uint8_t qos, uint8_t retain);
+
+// to be called when new MQTT connection is established (before draining)
+// so that messages sent over previous one are sent again
+void mqtt_wss_spool_rewind(struct mqtt_wss_spool *spool);
+
+// returns nonzero if there are messages not handed to mqtt_ng yet (lock free)
+int mqtt_wss_spool_has_pending(struct mqtt_wss_spool *spool);
+
+/* Moves pending messages into mqtt_ng transaction buffer in batches
+ * until it is full, inflight limit is reached or there are no more.
+ * @return number of messages handed to mqtt_ng
+ */
+size_t mqtt_wss_spool_drain(struct mqtt_wss_spool *spool, struct mqtt_ng_client *mqtt);
+
+/* Acknowledges message sent from the spool
+ * @return 1 if packet_id belongs to message sent from the spool, 0 otherwise
+ */
+int mqtt_wss_spool_ack(struct mqtt_wss_spool *spool, uint16_t packet_id);
+
+void mqtt_wss_spool_get_stats(struct mqtt_wss_spool *spool, struct mqtt_wss_spool_stats *stats);
+
+#endif /* MQTT_WSS_SPOOL_H */
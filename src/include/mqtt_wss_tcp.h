@@ -0,0 +1,63 @@
+// SPDX-License-Identifier: GPL-3.0-only
+//
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free Software Foundation, version 3.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+// See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with this program.
+// If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef MQTT_WSS_TCP_H
+#define MQTT_WSS_TCP_H
+
+#include <poll.h>
+
+#include "mqtt_wss_dns.h"
+#include "mqtt_wss_log.h"
+
+// Non blocking TCP connect racing resolved addresses "Happy Eyeballs" style [RFC8305]
+// next address is tried if previous attempt didn't succeed in MWS_TCP_ATTEMPT_DELAY_MS
+// (or failed), first attempt that connects wins
+
+#define MWS_TCP_MAX_ATTEMPTS 4
+#define MWS_TCP_ATTEMPT_DELAY_MS 250
+
+#define MWS_TCP_RACE_PENDING -1
+#define MWS_TCP_RACE_FAILED  -2
+
+struct mws_tcp_race {
+    struct mws_addr_list *addrs;
+    size_t next_addr;
+
+    int fds[MWS_TCP_MAX_ATTEMPTS];
+    size_t fd_addr[MWS_TCP_MAX_ATTEMPTS];
+    int attempts;
+
+    long long int next_attempt_ms;
+    int last_errno;
+};
+
+/* Starts racing, takes ownership of addrs
+ * @return 0 on success (race is running), 1 if no attempt could be started
+ */
+int mws_tcp_race_start(struct mws_tcp_race *race, struct mws_addr_list *addrs, long long int now_ms, mqtt_wss_log_ctx_t log);
+
+/* Checks attempts in progress (non blocking) and starts new ones when due
+ * @return connected socket (race is finished, other attempts closed),
+ *         MWS_TCP_RACE_PENDING or MWS_TCP_RACE_FAILED (all addresses failed)
+ */
+int mws_tcp_race_process(struct mws_tcp_race *race, long long int now_ms, mqtt_wss_log_ctx_t log);
+
+// ms till next attempt should be started, -1 if none
+long long int mws_tcp_race_timeout_ms(struct mws_tcp_race *race, long long int now_ms);
+
+// fills sockets of attempts in progress (to wait for them to become writable)
+int mws_tcp_race_get_fds(struct mws_tcp_race *race, int *fds, int max);
+
+// closes all attempts in progress and frees the addresses (safe to call on zeroed race)
+void mws_tcp_race_cancel(struct mws_tcp_race *race);
+
+#endif /* MQTT_WSS_TCP_H */
@@ -16,8 +16,10 @@
 
 #include "ringbuffer.h"
 #include "mqtt_wss_log.h"
+#include "ws_deflate.h"
 
 #include <stdint.h>
+#include <sys/uio.h>
 
 #define WS_CLIENT_NEED_MORE_BYTES     0x10
 #define WS_CLIENT_PARSING_DONE        0x11
@@ -25,6 +27,7 @@
 #define WS_CLIENT_PROTOCOL_ERROR     -0x10
 #define WS_CLIENT_BUFFER_FULL        -0x11
 #define WS_CLIENT_INTERNAL_ERROR     -0x12
+#define WS_CLIENT_CONSUMER_ERROR     -0x13
 
 enum websocket_client_conn_state {
     WS_RAW = 0,
@@ -48,6 +51,7 @@ enum websocket_client_rx_ws_parse_state {
     WS_PAYLOAD_EXTENDED_16,
     WS_PAYLOAD_EXTENDED_64,
     WS_PAYLOAD_DATA, // BINARY payload to be passed to MQTT
+    WS_PAYLOAD_DEFLATED_DATA, // compressed BINARY payload to be inflated for MQTT
     WS_PAYLOAD_CONNECTION_CLOSE,
     WS_PAYLOAD_CONNECTION_CLOSE_EC,
     WS_PAYLOAD_CONNECTION_CLOSE_MSG,
@@ -76,6 +80,12 @@ struct http_header {
     struct http_header *next;
 };
 
+/* Called with WebSocket BINARY payload still in the read buffer.
+ * @param max_bytes how many bytes of the payload are available in data
+ * @return number of bytes consumed (0 if consumer needs more data), negative on error
+ */
+typedef ssize_t (*ws_client_rx_payload_cb_t)(void *ctx, rbuf_t data, size_t max_bytes);
+
 typedef struct websocket_client {
     enum websocket_client_conn_state state;
 
@@ -95,6 +105,7 @@ typedef struct websocket_client {
         enum websocket_opcode opcode;
         uint64_t payload_length;
         uint64_t payload_processed;
+        int compressed; // RSV1 set [RFC7692 6]
         union {
             struct ws_op_close_payload op_close;
             char *ping_msg;
@@ -103,12 +114,26 @@ typedef struct websocket_client {
 
     rbuf_t buf_read;    // from SSL
     rbuf_t buf_write;   // to SSL and then to socket
-    // TODO if ringbuffer gets multiple tail support
-    // we can work without buf_to_mqtt and thus reduce
-    // memory usage and remove one more memcpy buf_read->buf_to_mqtt
     rbuf_t buf_to_mqtt; // RAW data for MQTT lib
+                        // if rx_payload_cb is set this is used only to stage
+                        // data consumer couldn't process in place
+                        // (e.g. MQTT field split over multiple WebSocket frames)
+
+    ws_client_rx_payload_cb_t rx_payload_cb;
+    void *rx_payload_ctx;
+
+    struct ws_deflate deflate;
 
     int entropy_fd;
+    // random bytes for WebSocket frame masks
+    // refilled from entropy_fd in batches
+    // to avoid syscall per frame sent
+    char *mask_pool;
+    size_t mask_pool_size;
+    size_t mask_pool_used;
+
+    // for HTTP headers and control frame payloads (NULL for system allocator)
+    const struct mqtt_wss_allocator *alloc;
 
     // careful host is borrowed, don't free
     char **host;
@@ -121,10 +146,36 @@ void ws_client_reset(ws_client *client);
 
 int ws_client_start_handshake(ws_client *client);
 
+/* Sets how many bytes of entropy are read at once to generate WebSocket frame masks
+ * (every frame consumes 4 bytes). Size is rounded down to multiple of 4.
+ * @return 0 on success
+ */
+int ws_client_set_mask_pool_size(ws_client *client, size_t size);
+
+/* Sets consumer for incoming BINARY payload which is then
+ * processed directly from buf_read avoiding the copy into buf_to_mqtt.
+ * @param cb callback or NULL to always copy into buf_to_mqtt
+ */
+void ws_client_set_rx_payload_cb(ws_client *client, ws_client_rx_payload_cb_t cb, void *ctx);
+
+/* Sets permessage-deflate parameters to be offered in next handshake
+ * @return 0 on success
+ */
+int ws_client_set_deflate(ws_client *client, const struct mqtt_wss_deflate_params *params);
+
+// allocator has to stay valid until client is destroyed, NULL for system allocator
+void ws_client_set_allocator(ws_client *client, const struct mqtt_wss_allocator *allocator);
+
 int ws_client_want_write(ws_client *client);
 
 int ws_client_process(ws_client *client);
 
 int ws_client_send(ws_client *client, enum websocket_opcode frame_type, const char *data, size_t size);
 
+/* Sends all buffers given as single WebSocket frame (scatter/gather)
+ * @return number of payload bytes written (can be less than sum of all iov_len
+ *         if there is not enough space in buf_write) or < 0 on error
+ */
+int ws_client_sendv(ws_client *client, enum websocket_opcode frame_type, const struct iovec *iov, int iovcnt);
+
 #endif /* WS_CLIENT_H */
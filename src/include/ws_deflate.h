@@ -0,0 +1,105 @@
+// SPDX-License-Identifier: GPL-3.0-only
+//
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free Software Foundation, version 3.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+// See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with this program.
+// If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef WS_DEFLATE_H
+#define WS_DEFLATE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <zlib.h>
+
+#include "common_public.h"
+#include "mqtt_wss_log.h"
+
+// WebSocket permessage-deflate extension [RFC7692]
+// every WebSocket message we send is single frame so message == frame here
+
+#define WS_DEFLATE_EXT_NAME "permessage-deflate"
+
+// bytes every compressed message ends with (removed before sending) [RFC7692 7.2.1]
+#define WS_DEFLATE_TRAILER_SIZE 4
+
+struct ws_deflate {
+    // requested by user, offered in the handshake
+    struct mqtt_wss_deflate_params params;
+
+    // negotiated for current connection
+    int active;
+    int tx_no_context_takeover;
+    int rx_no_context_takeover;
+    int tx_window_bits;
+    int rx_window_bits;
+
+    z_stream tx;
+    z_stream rx;
+    unsigned int tx_init:1;
+    unsigned int rx_init:1;
+
+    // compressed message is staged here as frame header needs its length
+    char *tx_buf;
+    size_t tx_buf_size;
+
+    // state of currently received message
+    int rx_trailer_fed;
+    int rx_output_pending;
+};
+
+/* Validates params and stores them to be offered in the next handshake
+ * @return 0 on success
+ */
+int ws_deflate_set_params(struct ws_deflate *d, const struct mqtt_wss_deflate_params *params, mqtt_wss_log_ctx_t log);
+
+/* Generates Sec-WebSocket-Extensions header line (including CRLF)
+ * or empty string if compression is disabled
+ * @return 0 on success, 1 if buf is too small
+ */
+int ws_deflate_offer(struct ws_deflate *d, char *buf, size_t size);
+
+/* Processes server reply to our offer and prepares compression contexts
+ * @param ext_hdr value of Sec-WebSocket-Extensions header, NULL if server didn't send any
+ * @return 0 on success (d->active tells if compression is in use), 1 on protocol error
+ */
+int ws_deflate_accept(struct ws_deflate *d, const char *ext_hdr, mqtt_wss_log_ctx_t log);
+
+// drops negotiated state (connection ended)
+void ws_deflate_reset(struct ws_deflate *d);
+void ws_deflate_destroy(struct ws_deflate *d);
+
+/* @return maximum number of input bytes which are guaranteed to compress
+ *         into at most out_space bytes
+ */
+size_t ws_deflate_max_input(struct ws_deflate *d, size_t out_space);
+
+/* Compresses first size bytes of iov as one message into d->tx_buf
+ * @return length of compressed message (trailer already removed), < 0 on error
+ */
+ssize_t ws_deflate_compress(struct ws_deflate *d, const struct iovec *iov, int iovcnt, size_t size, mqtt_wss_log_ctx_t log);
+
+/* Feeds compressed data of received message into inflate
+ * Once all payload of the message was consumed keep calling it with empty input
+ * (feeds the trailer and flushes pending output) until ws_deflate_rx_msg_complete.
+ * @param in_len in: bytes available, out: bytes consumed
+ * @param out_len in: space available, out: bytes produced
+ * @return 0 on success, 1 on corrupted data
+ */
+int ws_deflate_inflate(struct ws_deflate *d, const char *in, size_t *in_len, char *out, size_t *out_len);
+
+static inline int ws_deflate_rx_msg_complete(struct ws_deflate *d)
+{
+    return d->rx_trailer_fed == WS_DEFLATE_TRAILER_SIZE && !d->rx_output_pending;
+}
+
+// to be called after whole received message was inflated
+void ws_deflate_rx_msg_done(struct ws_deflate *d);
+
+#endif /* WS_DEFLATE_H */
@@ -0,0 +1,36 @@
+// SPDX-License-Identifier: GPL-3.0-only
+//
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free Software Foundation, version 3.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+// See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with this program.
+// If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef WS_MASK_H
+#define WS_MASK_H
+
+#include <stddef.h>
+
+#define WS_MASK_KEY_SIZE 4
+
+/* Copies len bytes from src to dst XORing them with WebSocket masking key [RFC6455 5.3]
+ * As XOR is its own inverse the same function is used for unmasking.
+ * src and dst can point to the same memory (in place (un)masking) but must not otherwise overlap.
+ * Fastest implementation available on the running CPU is selected at first use
+ * (can be forced to portable one by compiling with MQTT_WSS_NO_SIMD).
+ * @param mask WS_MASK_KEY_SIZE bytes long masking key
+ * @param offset offset of src[0] from the start of the frame payload. This allows
+ *        payload to be processed in chunks (e.g. ring buffer wrap around)
+ *        without losing mask phase.
+ * @return offset to be used for the data following (offset + len)
+ */
+size_t ws_mask_copy(char *dst, const char *src, size_t len, const char *mask, size_t offset);
+
+// name of implementation selected (for debugging and benchmarks)
+const char *ws_mask_impl_name(void);
+
+#endif /* WS_MASK_H */
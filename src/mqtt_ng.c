@@ -5,6 +5,7 @@
 #include <string.h>
 #include <pthread.h>
 #include <inttypes.h>
+#include <time.h>
 
 #include "c_rhash.h"
 
@@ -12,6 +13,10 @@
 #include "mqtt_constants.h"
 #include "mqtt_wss_log.h"
 #include "mqtt_ng.h"
+#include "mqtt_ng_alias.h"
+#include "mqtt_ng_router.h"
+#include "mqtt_wss_instr.h"
+#include "mqtt_wss_alloc.h"
 
 #define UNIT_LOG_PREFIX "mqtt_client: "
 #define FATAL(fmt, ...) mws_fatal(client->log, UNIT_LOG_PREFIX fmt, ##__VA_ARGS__)
@@ -40,6 +45,15 @@
 // this marks this fragment to be the first/last
 #define BUFFER_FRAG_MQTT_PACKET_HEAD        0x10
 #define BUFFER_FRAG_MQTT_PACKET_TAIL        0x20
+// head of QOS1 PUBLISH which took place in the Receive Maximum window
+#define BUFFER_FRAG_WINDOW                  0x40
+// payload pulled from producer while sending (see mqtt_ng_publish_stream)
+// data points to struct publish_stream, len is length of the whole payload
+#define BUFFER_FRAG_DATA_STREAM             0x80
+// packet being sent ahead of QOS1 PUBLISH waiting for Receive Maximum window
+// (send cursor stays on the waiting PUBLISH, see next_bypassing_window)
+// cleared once the fragment is sent
+#define BUFFER_FRAG_WINDOW_BYPASS           0x100
 
 typedef uint16_t buffer_frag_flag_t;
 struct buffer_fragment {
@@ -50,6 +64,12 @@ struct buffer_fragment {
     char *data;
 
     uint16_t packet_id;
+    // on PUBLISH packet tail: packet size counted into publish_bytes
+    uint32_t packet_len;
+
+    // on MQTT packet tail (usec, monotonic): time it was queued
+    // and after it is sent the time of sending (to measure latencies)
+    uint64_t timestamp;
 
     struct buffer_fragment *next;
 };
@@ -58,13 +78,33 @@ typedef struct buffer_fragment *mqtt_msg_data;
 
 // buffer used for MQTT headers only
 // not for actual data sent
+// consists of fixed size segments so fragments never move
+// data, size and tail describe the segment currently being written to
 struct header_buffer {
     size_t size;
     char *data;
     char *tail;
+    struct buffer_fragment *head_frag;
     struct buffer_fragment *tail_frag;
 };
 
+struct buffer_segment {
+    struct buffer_segment *next;
+    size_t live_frags; // updated by garbage collection only
+    char data[];
+};
+
+#define MQTT_PACKET_ID_COUNT (UINT16_MAX + 1)
+#define INFLIGHT_BITMAP_WORD_BITS 64
+
+// index of packets waiting for acknowledgement (PUBACK, SUBACK) by packet id
+struct inflight_index {
+    struct buffer_fragment **frags;
+    uint64_t in_use[MQTT_PACKET_ID_COUNT / INFLIGHT_BITMAP_WORD_BITS];
+    uint16_t last_id;
+    size_t count;
+};
+
 struct transaction_buffer {
     struct header_buffer hdr_buffer;
     // used while building new message
@@ -73,6 +113,29 @@ struct transaction_buffer {
     struct header_buffer state_backup;
     pthread_mutex_t mutex;
     struct buffer_fragment *sending_frag;
+    // all fragments before this one are fully sent
+    // so we don't have to skip over sent messages waiting for PUBACK
+    // every time (NULL to start from the first fragment)
+    struct buffer_fragment *send_cursor;
+    // last fragment checked by next_bypassing_window
+    // (NULL to start right after the PUBLISH waiting for window)
+    struct buffer_fragment *bypass_cursor;
+    struct inflight_index inflight;
+
+    // segments in use, oldest first, last one is being written to
+    struct buffer_segment *seg_head;
+    struct buffer_segment *seg_tail;
+    // released segments kept for reuse
+    struct buffer_segment *seg_free;
+    size_t seg_count;
+
+    // for copies of user data and incoming messages (NULL for system allocator)
+    // changed under the mutex but read without it too
+    const struct mqtt_wss_allocator *alloc;
+
+    // PUBLISH packets not sent (QOS0) or not acknowledged (QOS1) yet
+    // changed under the mutex, read without it by flow control
+    size_t publish_bytes;
 };
 
 enum mqtt_client_state {
@@ -99,7 +162,8 @@ enum varhdr_parser_state {
     MQTT_PARSE_VARHDR_POST_TOPICNAME,
     MQTT_PARSE_VARHDR_PACKET_ID,
     MQTT_PARSE_REASONCODES,
-    MQTT_PARSE_PAYLOAD
+    MQTT_PARSE_PAYLOAD,
+    MQTT_PARSE_PAYLOAD_CHUNKS
 };
 
 struct mqtt_vbi_parser_ctx {
@@ -130,7 +194,6 @@ struct mqtt_property {
         uint32_t uint32;
     } data;
     size_t bindata_len;
-    struct mqtt_property *next;
 };
 
 enum mqtt_properties_parser_state {
@@ -147,10 +210,26 @@ enum mqtt_properties_parser_state {
     PROPERTY_NEXT
 };
 
+// most packets have just a few properties (CONNACK about a dozen)
+#define MQTT_PROPS_INLINE 16
+
+// memory is kept between packets so that parsing properties
+// doesn't allocate at all in steady state and reset is O(1)
 struct mqtt_properties_parser_ctx {
     enum mqtt_properties_parser_state state;
-    struct mqtt_property *head;
-    struct mqtt_property *tail;
+    // props_inline unless there were more properties than that
+    struct mqtt_property *props;
+    size_t count;
+    size_t alloc;
+    struct mqtt_property props_inline[MQTT_PROPS_INLINE];
+    // index + 1 of first property with the id, 0 if not present
+    uint32_t by_id[MQTT_PROP_ID_MAX + 1];
+    // bump allocator for strings and binary data of properties
+    // reserved for whole property array once its length is known
+    // so pointers stay valid until the next packet
+    char *arena;
+    size_t arena_size;
+    size_t arena_used;
     uint32_t properties_length;
     uint32_t vbi_length;
     struct mqtt_vbi_parser_ctx vbi_parser_ctx;
@@ -181,14 +260,41 @@ struct mqtt_publish {
     size_t data_len;
     char *data;
     uint8_t qos;
+    // topic and data are in parser scratch memory
+    // (or data directly in the receive buffer) instead of malloced
+    uint8_t borrowed:1;
+    // data points into the receive buffer which is consumed
+    // only after the message callback returns
+    uint8_t data_in_place:1;
+    // payload is delivered to chunk callback while parsing (data is NULL)
+    uint8_t chunked:1;
+    // Topic Alias property was resolved already (topic is owned by rx_aliases)
+    uint8_t topic_aliased:1;
+    // chunked payload bytes delivered so far
+    size_t data_offset;
 };
 
 struct mqtt_disconnect {
     uint8_t reason_code;
 };
 
+// received data as seen by the parser
+// limit allows parsing only part of the buffer
+// (e.g. WebSocket frame payload directly in the socket read buffer)
+struct mqtt_ng_rx_data {
+    rbuf_t buf;
+    size_t limit;
+};
+
+#define RX_DATA_UNLIMITED SIZE_MAX
+
 struct mqtt_ng_parser {
-    rbuf_t received_data;
+    struct mqtt_ng_rx_data received_data;
+
+    // reusable memory for incoming PUBLISH topic and payload
+    // used when borrowing message callback is set (grows as needed)
+    char *rx_scratch;
+    size_t rx_scratch_size;
 
     uint8_t mqtt_control_packet_type;
     uint32_t mqtt_fixed_hdr_remaining_length;
@@ -220,12 +326,83 @@ struct topic_aliases_data {
     c_rhash stoi_dict;
     uint32_t idx_max;
     uint32_t idx_assigned;
+    // Topic Alias Maximum from CONNACK [MQTT-3.2.2.3.8], 0 until received
+    uint16_t server_max;
+    // aliases assigned automatically, numbered from server_max down
+    // so they don't collide with the ones assigned by mqtt_ng_set_topic_alias
+    struct mqtt_ng_alias_cache *auto_cache;
+    // incremented whenever alias of any topic changes (with rwlock held exclusively,
+    // before any message with the new alias can be generated) or topic starts
+    // to be omitted, prepared publishes keep their resolved header until it does
+    uint32_t generation;
     pthread_rwlock_t rwlock;
 };
 
+static inline void tx_topic_aliases_changed(struct topic_aliases_data *aliases)
+{
+    __atomic_add_fetch(&aliases->generation, 1, __ATOMIC_RELEASE);
+}
+
+// lock-free multi producer single consumer queue of messages
+// waiting to be put into transaction buffer by the service thread
+// intrusive list as described by D. Vyukov
+struct publish_queue_node {
+    struct publish_queue_node *next;
+    struct mqtt_publish_batch_entry entry;
+    // topic is always copied into transaction buffer
+    // users topic is freed by us right after
+    char *user_topic;
+    free_fnc_t user_topic_free;
+    void *msg_ctx;
+};
+
+#define PUBLISH_QUEUE_CACHELINE 64
+struct publish_queue {
+    // producers append here
+    struct publish_queue_node *head;
+    char pad[PUBLISH_QUEUE_CACHELINE - sizeof(struct publish_queue_node *)];
+    // only touched by the consumer
+    struct publish_queue_node *tail;
+    struct publish_queue_node stub;
+};
+
+// header of prepared PUBLISH as resolved by the last publish
+// valid while tx_topic_aliases.generation stays the same, only accessed with buffer locked
+struct prepared_publish_hdr {
+    int cached;
+    uint32_t generation;
+    int send_topic;
+    // [MQTT-3.3.2.3] Property Length followed by Topic Alias property if any
+    uint8_t props_len;
+    char props[4];
+    // [MQTT-3.3.1] fixed header for payload of msg_len
+    size_t msg_len;
+    uint8_t fixed_len;
+    char fixed[1 + 4];
+};
+
+// PUBLISH to the same topic with the same flags every time
+// Topic Name is kept encoded the way it goes right after the Remaining Length
+struct mqtt_prepared_publish {
+    struct mqtt_prepared_publish *next;
+    struct mqtt_prepared_publish *prev;
+    // [MQTT-3.3.1] packet type and flags
+    uint8_t first_byte;
+    uint8_t qos;
+    struct prepared_publish_hdr hdr;
+    size_t topic_len;
+    // [MQTT-3.3.2.1] Topic Name (2 byte length + topic) followed by 0
+    // so that topic can be used as C string too
+    char encoded_topic[];
+};
+
 struct mqtt_ng_client {
     struct transaction_buffer main_buffer;
 
+    struct publish_queue publish_queue;
+    mqtt_ng_publish_queued_callback_t publish_queued_callback;
+    void *publish_queued_ctx;
+
     enum mqtt_client_state client_state;
 
     mqtt_msg_data connect_msg;
@@ -233,8 +410,12 @@ struct mqtt_ng_client {
     mqtt_wss_log_ctx_t log;
 
     mqtt_ng_send_fnc_t send_fnc_ptr;
+    mqtt_ng_sendv_fnc_t sendv_fnc_ptr;
     void *user_ctx;
 
+    // max bytes to be coalesced into single sendv_fnc_ptr call
+    size_t send_coalesce_limit;
+
     // time when last fragment of MQTT message was sent
     time_t time_of_last_send;
 
@@ -243,32 +424,68 @@ struct mqtt_ng_client {
     size_t max_mem_bytes;
 
     void (*puback_callback)(uint16_t packet_id);
+    void (*puback_ctx_callback)(void *user_ctx, uint16_t packet_id);
     void (*connack_callback)(void* user_ctx, int connack_reply);
     void (*msg_callback)(const char *topic, const void *msg, size_t msglen, int qos);
+    mqtt_ng_msg_borrowed_callback_t msg_borrowed_callback;
+    void *msg_borrowed_ctx;
+    mqtt_ng_msg_chunk_callback_t msg_chunk_callback;
+    void *msg_chunk_ctx;
+    size_t msg_chunk_min;
 
-    unsigned int ping_pending:1;
+    // per topic filter callbacks (see mqtt_ng_subscribe_route)
+    struct mqtt_ng_router *router;
+    // [MQTT-3.2.2.3.12] Subscription Identifier Available
+    int sub_ids_available;
 
+    unsigned int ping_pending:1;
+    // PINGREQ is sent from here rather than from the buffer
+    // (per client as sent keeps progress of this client's sending)
+    struct buffer_fragment ping_frag;
+
+    // [MQTT-3.2.2.3.3] Receive Maximum of the server and number of QOS1
+    // PUBLISH packets counted against it (sent and not acknowledged yet)
+    // sending stops at the first QOS1 PUBLISH which doesn't fit
+    uint16_t receive_max;
+    uint32_t window_inflight;
+    int window_blocked;
+
+    // see mqtt_ng_set_flow_control
+    size_t flow_high;
+    size_t flow_low;
+    mqtt_ng_flow_callback_t flow_callback;
+    void *flow_ctx;
+    int flow_above;
+
+    // updated by relaxed atomics (see STATS_ADD)
     struct mqtt_ng_stats stats;
-    pthread_mutex_t stats_mutex;
 
     struct topic_aliases_data tx_topic_aliases;
     c_rhash rx_aliases;
 
     size_t max_msg_size;
-};
 
-char pingreq[] = { MQTT_CPT_PINGREQ << 4, 0x00 };
+    struct mqtt_wss_instr *instr;
 
-struct buffer_fragment ping_frag = {
-    .data = pingreq,
-    .flags =  BUFFER_FRAG_MQTT_PACKET_HEAD | BUFFER_FRAG_MQTT_PACKET_TAIL,
-    .free_fnc = NULL,
-    .len = sizeof(pingreq),
-    .next = NULL,
-    .sent = 0,
-    .packet_id = 0
+    // see mqtt_ng_prepare_publish, ones not freed by mqtt_ng_prepared_publish_free
+    // are freed with the client
+    struct mqtt_prepared_publish *prepared;
+    pthread_mutex_t prepared_mutex;
+
+#ifdef MQTT_WSS_BENCH
+    // parsing traffic captured from other session, acks don't match anything we sent
+    int rx_replay;
+#endif
 };
 
+#ifdef MQTT_WSS_BENCH
+#define RX_REPLAY(client) ((client)->rx_replay)
+#else
+#define RX_REPLAY(client) 0
+#endif
+
+static char pingreq[] = { MQTT_CPT_PINGREQ << 4, 0x00 };
+
 int uint32_to_mqtt_vbi(uint32_t input, char *output) {
     int i = 1;
     *output = 0;
@@ -366,7 +583,7 @@ int test_uint32_mqtt_vbi() {
 #define MQTT_VBI2UINT_TESTCASE(case, expected_error) \
     { \
     uint32_t result; \
-    int ret = mqtt_vbi_to_uint32(_mqtt_vbi_ ## case, &result); \
+    int ret = mqtt_vbi_to_uint32((char *)_mqtt_vbi_ ## case, &result); \
     if (ret && !(expected_error)) { \
         fprintf(stderr, "mqtt_vbi_to_uint(case:%d, line:%d): Unexpectedly Errored\n", (case), __LINE__); \
         return 1; \
@@ -419,7 +636,7 @@ static void buffer_frag_free_data(struct buffer_fragment *frag)
     if ( frag->flags & BUFFER_FRAG_DATA_EXTERNAL && frag->data != NULL) {
         switch (ptr2memory_mode(frag->free_fnc)) {
             case MEMCPY:
-                mw_free(frag->data);
+                mw_obj_free(frag->data);
                 break;
             case EXTERNAL_FREE_AFTER_USE:
                 frag->free_fnc(frag->data);
@@ -431,21 +648,62 @@ static void buffer_frag_free_data(struct buffer_fragment *frag)
     }
 }
 
+#define PUBLISH_STREAM_DEFAULT_CHUNK (16 * 1024)
+
+struct publish_stream {
+    struct mqtt_stream_source src;
+    // offset of chunk in the payload and number of bytes pulled into it
+    size_t chunk_offset;
+    size_t chunk_len;
+    // pull returned error, packet can't be completed
+    int failed;
+    char chunk[];
+};
+
+// free_fnc of BUFFER_FRAG_DATA_STREAM fragment
+static void publish_stream_free(void *ptr)
+{
+    struct publish_stream *stream = ptr;
+    if (stream->src.ctx_free && stream->src.ctx_free != CALLER_RESPONSIBILITY)
+        stream->src.ctx_free(stream->src.ctx);
+    mw_obj_free(stream);
+}
+
+// sets ptr to data of fragment not sent yet
+// returns number of bytes available there (0 only if producer of streamed payload
+// has no data yet or failed, client is put into ERROR state then)
+static inline size_t frag_send_ptr(struct mqtt_ng_client *client, struct buffer_fragment *frag, char **ptr)
+{
+    if (!(frag->flags & BUFFER_FRAG_DATA_STREAM)) {
+        *ptr = frag->data + frag->sent;
+        return frag->len - frag->sent;
+    }
+
+    struct publish_stream *stream = (struct publish_stream *)frag->data;
+    if (frag->sent == stream->chunk_offset + stream->chunk_len && frag->sent != frag->len && !stream->failed) {
+        size_t want = MIN(stream->src.chunk_size, frag->len - frag->sent);
+        ssize_t pulled = stream->src.pull(stream->src.ctx, frag->sent, stream->chunk, want);
+        stream->chunk_offset = frag->sent;
+        if (pulled < 0) {
+            // rest of the packet (and everything behind it) can't be sent
+            mws_error(client->log, "Streamed payload pull failed at offset %zu of %zu, dropping connection", frag->sent, frag->len);
+            stream->failed = 1;
+        }
+        stream->chunk_len = pulled < 0 ? 0 : MIN(want, (size_t)pulled);
+    }
+    if (stream->failed)
+        client->client_state = ERROR;
+    *ptr = stream->chunk + (frag->sent - stream->chunk_offset);
+    return stream->chunk_offset + stream->chunk_len - frag->sent;
+}
+
 #define HEADER_BUFFER_SIZE 1024*1024
-#define GROWTH_FACTOR 1.25
+#define BUFFER_SEGMENT_SIZE (256 * 1024)
 
 #define BUFFER_BYTES_USED(buf) ((size_t)((buf)->tail - (buf)->data))
 #define BUFFER_BYTES_AVAILABLE(buf) ((buf)->size - BUFFER_BYTES_USED(buf))
-#define BUFFER_FIRST_FRAG(buf) ((struct buffer_fragment *)((buf)->tail_frag ? (buf)->data : NULL))
-static void buffer_purge(struct header_buffer *buf) {
-    struct buffer_fragment *frag = BUFFER_FIRST_FRAG(buf);
-    while (frag) {
-        buffer_frag_free_data(frag);
-        frag = frag->next;
-    }
-    buf->tail = buf->data;
-    buf->tail_frag = NULL;
-}
+#define BUFFER_FIRST_FRAG(buf) ((buf)->head_frag)
+#define SEGMENT_CONTAINS(seg, ptr) ((char*)(ptr) >= (seg)->data && (char*)(ptr) < (seg)->data + BUFFER_SEGMENT_SIZE)
 
 static struct buffer_fragment *buffer_new_frag(struct header_buffer *buf, buffer_frag_flag_t flags)
 {
@@ -456,8 +714,10 @@ static struct buffer_fragment *buffer_new_frag(struct header_buffer *buf, buffer
     memset(frag, 0, sizeof(*frag));
     buf->tail += sizeof(*frag);
 
-    if (/*!((frag)->flags & BUFFER_FRAG_MQTT_PACKET_HEAD) &&*/ buf->tail_frag)
+    if (buf->tail_frag)
         buf->tail_frag->next = frag;
+    else
+        buf->head_frag = frag;
 
     buf->tail_frag = frag;
 
@@ -468,125 +728,260 @@ static struct buffer_fragment *buffer_new_frag(struct header_buffer *buf, buffer
     return frag;
 }
 
-static void buffer_rebuild(struct header_buffer *buf)
+static inline void transaction_buffer_write_to(struct transaction_buffer *buf, struct buffer_segment *seg)
 {
-    struct buffer_fragment *frag = (struct buffer_fragment*)buf->data;
-    do {
-        buf->tail = (char*)frag + sizeof(struct buffer_fragment);
-        buf->tail_frag = frag;
-        if (!(frag->flags & BUFFER_FRAG_DATA_EXTERNAL)) {
-            buf->tail_frag->data = buf->tail;
-            buf->tail += frag->len;
-        }
-        if (frag->next != NULL)
-            frag->next = (struct buffer_fragment*)buf->tail;
-        frag = frag->next;
-    } while(frag);
+    buf->hdr_buffer.data = seg->data;
+    buf->hdr_buffer.tail = seg->data;
+    buf->hdr_buffer.size = BUFFER_SEGMENT_SIZE;
 }
 
-static void buffer_garbage_collect(struct header_buffer *buf, mqtt_wss_log_ctx_t log_ctx)
+static void transaction_buffer_release_segment(struct transaction_buffer *buf, struct buffer_segment *seg)
 {
-#if !defined(MQTT_DEBUG_VERBOSE) && !defined(ADDITIONAL_CHECKS)
-    (void) log_ctx;
-#endif
-#ifdef MQTT_DEBUG_VERBOSE
-        mws_debug(log_ctx, "Buffer Garbage Collection!");
-#endif
-
-    struct buffer_fragment *frag = BUFFER_FIRST_FRAG(buf);
-    while (frag) {
-        if (!frag_is_marked_for_gc(frag))
-            break;
+    seg->next = buf->seg_free;
+    buf->seg_free = seg;
+}
 
+// frees all the fragments of one MQTT packet
+// returns last fragment of the packet
+static struct buffer_fragment *buffer_free_packet(struct transaction_buffer *buf, struct buffer_fragment *frag, struct buffer_fragment *prev_live)
+{
+    while (1) {
         buffer_frag_free_data(frag);
+        if (frag == buf->send_cursor)
+            buf->send_cursor = prev_live;
+        if (frag == buf->bypass_cursor)
+            buf->bypass_cursor = prev_live;
+        if (frag->flags & BUFFER_FRAG_MQTT_PACKET_TAIL || frag->next == NULL)
+            return frag;
+        frag = frag->next;
+    }
+}
 
+static int packet_is_marked_for_gc(struct buffer_fragment *frag)
+{
+    while (1) {
+        if (!frag_is_marked_for_gc(frag))
+            return 0;
+        if (frag->flags & BUFFER_FRAG_MQTT_PACKET_TAIL || frag->next == NULL)
+            return 1;
         frag = frag->next;
     }
+}
 
-    if (frag == BUFFER_FIRST_FRAG(buf)) {
+// unlinks every packet marked for gc (not just from the start of the buffer)
+// and releases segments which don't have any live fragment anymore
+static void transaction_buffer_garbage_collect(struct transaction_buffer *buf, mqtt_wss_log_ctx_t log_ctx)
+{
 #ifdef MQTT_DEBUG_VERBOSE
-        mws_debug(log_ctx, "Buffer Garbage Collection! No Space Reclaimed!");
+    mws_debug(log_ctx, "Transaction Buffer Garbage Collection! %s", buf->sending_frag == NULL ? "NULL" : "in flight message");
+#else
+    (void) log_ctx;
 #endif
-        return;
-    }
+    struct header_buffer *hdr = &buf->hdr_buffer;
 
-    if (!frag) {
-        buf->tail_frag = NULL;
-        buf->tail = buf->data;
-        return;
+    for (struct buffer_segment *seg = buf->seg_head; seg; seg = seg->next)
+        seg->live_frags = 0;
+
+    // fragments are in the same order as segments
+    struct buffer_segment *seg = buf->seg_head;
+    struct buffer_fragment *prev = NULL;
+    struct buffer_fragment *frag = hdr->head_frag;
+    while (frag) {
+        if (packet_is_marked_for_gc(frag)) {
+            struct buffer_fragment *last = buffer_free_packet(buf, frag, prev);
+            if (prev)
+                prev->next = last->next;
+            else
+                hdr->head_frag = last->next;
+            if (last == hdr->tail_frag)
+                hdr->tail_frag = prev;
+            frag = last->next;
+            continue;
+        }
+        while (1) {
+            while (!SEGMENT_CONTAINS(seg, frag))
+                seg = seg->next;
+            seg->live_frags++;
+            prev = frag;
+            if (frag->flags & BUFFER_FRAG_MQTT_PACKET_TAIL)
+                break;
+            frag = frag->next;
+            if (!frag)
+                break;
+        }
+        frag = frag ? frag->next : NULL;
     }
 
-#ifdef ADDITIONAL_CHECKS
-    if (!(frag->flags & BUFFER_FRAG_MQTT_PACKET_HEAD)) {
-        mws_error(log_ctx, "Expected to find end of buffer (NULL) or next packet head!");
-        return;
+    struct buffer_segment **link = &buf->seg_head;
+    buf->seg_tail = NULL;
+    while ((seg = *link)) {
+        // segment being written to is kept
+        if (seg->live_frags || seg->next == NULL) {
+            buf->seg_tail = seg;
+            link = &seg->next;
+            continue;
+        }
+        *link = seg->next;
+        transaction_buffer_release_segment(buf, seg);
     }
-#endif
 
-    memmove(buf->data, frag, buf->tail - (char*)frag);
-    buffer_rebuild(buf);
+    if (!buf->seg_tail->live_frags)
+        transaction_buffer_write_to(buf, buf->seg_tail);
 }
 
-static void transaction_buffer_garbage_collect(struct transaction_buffer *buf, mqtt_wss_log_ctx_t log_ctx)
+// starts writing new messages into fresh segment (reused or newly allocated)
+// returns 0 on success
+static int transaction_buffer_grow(struct transaction_buffer *buf, mqtt_wss_log_ctx_t log_ctx, size_t max)
 {
-#ifdef MQTT_DEBUG_VERBOSE
-    mws_debug(log_ctx, "Transaction Buffer Garbage Collection! %s", buf->sending_frag == NULL ? "NULL" : "in flight message");
-#endif
+    struct buffer_segment *seg = buf->seg_free;
+    if (seg != NULL) {
+        buf->seg_free = seg->next;
+    } else {
+        if ((buf->seg_count + 1) * BUFFER_SEGMENT_SIZE > max)
+            return 1;
+        seg = mw_malloc(sizeof(struct buffer_segment) + BUFFER_SEGMENT_SIZE);
+        if (seg == NULL) {
+            mws_warn(log_ctx, "Buffer growth failed (malloc)");
+            return 1;
+        }
+        buf->seg_count++;
+        mws_debug(log_ctx, "Message metadata buffer was grown");
+    }
+
+    seg->next = NULL;
+    seg->live_frags = 0;
+    buf->seg_tail->next = seg;
+    buf->seg_tail = seg;
+    transaction_buffer_write_to(buf, seg);
+    return 0;
+}
 
-    // Invalidate the cached sending fragment
-    // as we will move data around
-    if (buf->sending_frag != &ping_frag)
-        buf->sending_frag = NULL;
+static inline int inflight_is_set(struct inflight_index *idx, uint16_t packet_id)
+{
+    return (idx->in_use[packet_id / INFLIGHT_BITMAP_WORD_BITS] >> (packet_id % INFLIGHT_BITMAP_WORD_BITS)) & 1;
+}
 
-    buffer_garbage_collect(&buf->hdr_buffer, log_ctx);
+static void inflight_reset(struct inflight_index *idx)
+{
+    memset(idx->in_use, 0, sizeof(idx->in_use));
+    idx->count = 0;
 }
 
-static int transaction_buffer_grow(struct transaction_buffer *buf, mqtt_wss_log_ctx_t log_ctx, float rate, size_t max)
+// returns next packet id not currently waiting for acknowledgement
+// or 0 if all of them are
+static uint16_t inflight_get_unused_id(struct inflight_index *idx)
 {
-    if (buf->hdr_buffer.size >= max)
+    if (idx->count >= UINT16_MAX)
         return 0;
 
-    // Invalidate the cached sending fragment
-    // as we will move data around
-    if (buf->sending_frag != &ping_frag)
-        buf->sending_frag = NULL;
+    uint16_t id = idx->last_id;
+    do {
+        id++;
+    } while (!id || inflight_is_set(idx, id));
 
-    buf->hdr_buffer.size *= rate;
-    if (buf->hdr_buffer.size > max)
-        buf->hdr_buffer.size = max;
+    idx->last_id = id;
+    return id;
+}
 
-    void *ret = mw_realloc(buf->hdr_buffer.data, buf->hdr_buffer.size);
-    if (ret == NULL) {
-        mws_warn(log_ctx, "Buffer growth failed (realloc)");
-        return 1;
+static void inflight_add(struct transaction_buffer *buf, struct buffer_fragment *frag)
+{
+    struct inflight_index *idx = &buf->inflight;
+    idx->frags[frag->packet_id] = frag;
+    idx->in_use[frag->packet_id / INFLIGHT_BITMAP_WORD_BITS] |= (uint64_t)1 << (frag->packet_id % INFLIGHT_BITMAP_WORD_BITS);
+    idx->count++;
+}
+
+static void inflight_remove(struct inflight_index *idx, uint16_t packet_id)
+{
+    idx->in_use[packet_id / INFLIGHT_BITMAP_WORD_BITS] &= ~((uint64_t)1 << (packet_id % INFLIGHT_BITMAP_WORD_BITS));
+    idx->count--;
+}
+
+static struct buffer_fragment *inflight_get(struct transaction_buffer *buf, uint16_t packet_id)
+{
+    struct inflight_index *idx = &buf->inflight;
+    if (!inflight_is_set(idx, packet_id))
+        return NULL;
+    return idx->frags[packet_id];
+}
+
+static struct buffer_fragment *send_cursor_frag(struct transaction_buffer *buf)
+{
+    return buf->send_cursor ? buf->send_cursor : BUFFER_FIRST_FRAG(&buf->hdr_buffer);
+}
+
+// to be called with first fragment (in buffer order) which is not fully sent anymore
+// returns 1 if cursor was moved
+static inline int send_cursor_rewind(struct mqtt_ng_client *client, struct buffer_fragment *frag)
+{
+    // cursor is already before these
+    if (frag == &client->ping_frag || (frag->flags & BUFFER_FRAG_WINDOW_BYPASS))
+        return 0;
+    client->main_buffer.send_cursor = frag;
+    return 1;
+}
+
+// frees all messages, keeps one segment to write to
+static void transaction_buffer_purge(struct transaction_buffer *buf)
+{
+    struct buffer_fragment *frag = BUFFER_FIRST_FRAG(&buf->hdr_buffer);
+    while (frag) {
+        buffer_frag_free_data(frag);
+        frag = frag->next;
     }
+    buf->hdr_buffer.head_frag = NULL;
+    buf->hdr_buffer.tail_frag = NULL;
 
-    mws_debug(log_ctx, "Message metadata buffer was grown");
+    while (buf->seg_head != buf->seg_tail) {
+        struct buffer_segment *seg = buf->seg_head;
+        buf->seg_head = seg->next;
+        transaction_buffer_release_segment(buf, seg);
+    }
+    transaction_buffer_write_to(buf, buf->seg_tail);
 
-    buf->hdr_buffer.data = ret;
-    buffer_rebuild(&buf->hdr_buffer);
-    return 0;
+    buf->sending_frag = NULL;
+    buf->send_cursor = NULL;
+    buf->bypass_cursor = NULL;
+    inflight_reset(&buf->inflight);
+    __atomic_store_n(&buf->publish_bytes, 0, __ATOMIC_RELAXED);
 }
 
-inline static int transaction_buffer_init(struct transaction_buffer *to_init, size_t size)
+inline static int transaction_buffer_init(struct transaction_buffer *to_init)
 {
     pthread_mutex_init(&to_init->mutex, NULL);
 
-    to_init->hdr_buffer.size = size;
-    to_init->hdr_buffer.data = mw_malloc(size);
-    if (to_init->hdr_buffer.data == NULL)
+    to_init->seg_head = mw_malloc(sizeof(struct buffer_segment) + BUFFER_SEGMENT_SIZE);
+    if (to_init->seg_head == NULL)
         return 1;
+    to_init->seg_head->next = NULL;
+    to_init->seg_tail = to_init->seg_head;
+    to_init->seg_free = NULL;
+    to_init->seg_count = 1;
+
+    to_init->inflight.frags = mw_malloc(MQTT_PACKET_ID_COUNT * sizeof(*to_init->inflight.frags));
+    if (to_init->inflight.frags == NULL) {
+        mw_free(to_init->seg_head);
+        return 1;
+    }
+    inflight_reset(&to_init->inflight);
 
-    to_init->hdr_buffer.tail = to_init->hdr_buffer.data;
+    transaction_buffer_write_to(to_init, to_init->seg_head);
+    to_init->hdr_buffer.head_frag = NULL;
     to_init->hdr_buffer.tail_frag = NULL;
     return 0;
 }
 
 static void transaction_buffer_destroy(struct transaction_buffer *to_init)
 {
-    buffer_purge(&to_init->hdr_buffer);
+    transaction_buffer_purge(to_init);
     pthread_mutex_destroy(&to_init->mutex);
-    mw_free(to_init->hdr_buffer.data);
+    mw_free(to_init->seg_head);
+    while (to_init->seg_free) {
+        struct buffer_segment *seg = to_init->seg_free;
+        to_init->seg_free = seg->next;
+        mw_free(seg);
+    }
+    mw_free(to_init->inflight.frags);
 }
 
 // Creates transaction
@@ -598,7 +993,12 @@ static void transaction_buffer_destroy(struct transaction_buffer *to_init)
 
 #define transaction_buffer_transaction_commit(buf) UNLOCK_HDR_BUFFER(buf);
 
-void transaction_buffer_transaction_rollback(struct transaction_buffer *buf, struct buffer_fragment *frag)
+// same as above for callers already holding the lock
+// (to generate multiple messages under one lock)
+#define transaction_buffer_transaction_start_locked(buf) \
+    memcpy(&(buf)->state_backup, &(buf)->hdr_buffer, sizeof((buf)->hdr_buffer));
+
+void transaction_buffer_transaction_revert(struct transaction_buffer *buf, struct buffer_fragment *frag)
 {
     memcpy(&buf->hdr_buffer, &buf->state_backup, sizeof(buf->hdr_buffer));
     if (buf->hdr_buffer.tail_frag != NULL)
@@ -612,10 +1012,16 @@ void transaction_buffer_transaction_rollback(struct transaction_buffer *buf, str
         // which is locked by HDR_BUFFER lock
         frag = frag->next;
     }
+}
 
+void transaction_buffer_transaction_rollback(struct transaction_buffer *buf, struct buffer_fragment *frag)
+{
+    transaction_buffer_transaction_revert(buf, frag);
     UNLOCK_HDR_BUFFER(buf);
 }
 
+#define MQTT_NG_DEFAULT_SEND_COALESCE_LIMIT (16 * 1024)
+
 #define TX_ALIASES_INITIALIZE() c_rhash_new(0)
 #define RX_ALIASES_INITIALIZE() c_rhash_new(UINT16_MAX >> 8)
 struct mqtt_ng_client *mqtt_ng_init(struct mqtt_ng_init *settings)
@@ -624,41 +1030,59 @@ struct mqtt_ng_client *mqtt_ng_init(struct mqtt_ng_init *settings)
     if (client == NULL)
         return NULL;
 
-    if (transaction_buffer_init(&client->main_buffer, HEADER_BUFFER_SIZE))
+    if (transaction_buffer_init(&client->main_buffer))
         goto err_free_client;
 
     client->rx_aliases = RX_ALIASES_INITIALIZE();
     if (client->rx_aliases == NULL)
         goto err_free_trx_buf;
 
-    if (pthread_mutex_init(&client->stats_mutex, NULL))
-        goto err_free_rx_alias;
-
     client->tx_topic_aliases.stoi_dict = TX_ALIASES_INITIALIZE();
     if (client->tx_topic_aliases.stoi_dict == NULL)
-        goto err_free_stats_mutex;
+        goto err_free_rx_alias;
     client->tx_topic_aliases.idx_max = UINT16_MAX;
+    client->tx_topic_aliases.generation = 1;
 
     if (pthread_rwlock_init(&client->tx_topic_aliases.rwlock, NULL))
         goto err_free_tx_alias;
 
+    if ((client->router = mqtt_ng_router_new()) == NULL)
+        goto err_destroy_rwlock;
+
+    pthread_mutex_init(&client->prepared_mutex, NULL);
+
+    client->publish_queue.head = &client->publish_queue.stub;
+    client->publish_queue.tail = &client->publish_queue.stub;
+
+    client->ping_frag.data = pingreq;
+    client->ping_frag.flags = BUFFER_FRAG_MQTT_PACKET_HEAD | BUFFER_FRAG_MQTT_PACKET_TAIL;
+    client->ping_frag.len = sizeof(pingreq);
+
     // TODO just embed the struct into mqtt_ng_client
-    client->parser.received_data = settings->data_in;
+    client->parser.received_data.buf = settings->data_in;
+    client->parser.received_data.limit = RX_DATA_UNLIMITED;
     client->send_fnc_ptr = settings->data_out_fnc;
+    client->sendv_fnc_ptr = settings->data_outv_fnc;
+    client->send_coalesce_limit = MQTT_NG_DEFAULT_SEND_COALESCE_LIMIT;
     client->user_ctx = settings->user_ctx;
 
     client->log = settings->log;
 
     client->puback_callback = settings->puback_callback;
+    client->puback_ctx_callback = settings->puback_ctx_callback;
+    client->receive_max = UINT16_MAX;
     client->connack_callback = settings->connack_callback;
     client->msg_callback = settings->msg_callback;
 
+    client->instr = settings->instr;
+    client->main_buffer.alloc = settings->allocator;
+
     return client;
 
+err_destroy_rwlock:
+    pthread_rwlock_destroy(&client->tx_topic_aliases.rwlock);
 err_free_tx_alias:
     c_rhash_destroy(client->tx_topic_aliases.stoi_dict);
-err_free_stats_mutex:
-    pthread_mutex_destroy(&client->stats_mutex);
 err_free_rx_alias:
     c_rhash_destroy(client->rx_aliases);
 err_free_trx_buf:
@@ -680,7 +1104,7 @@ static void mqtt_ng_destroy_rx_alias_hash(c_rhash hash)
     void *to_free;
     while(!c_rhash_iter_uint64_keys(hash, &i, &stored_key)) {
         c_rhash_get_ptr_by_uint64(hash, stored_key, &to_free);
-        mw_free(to_free);
+        mw_obj_free(to_free);
     }
     c_rhash_destroy(hash);
 }
@@ -697,19 +1121,32 @@ static void mqtt_ng_destroy_tx_alias_hash(c_rhash hash)
     c_rhash_destroy(hash);
 }
 
+static void publish_queue_destroy(struct mqtt_ng_client *client);
+static void mqtt_properties_parser_ctx_destroy(struct mqtt_properties_parser_ctx *ctx);
 void mqtt_ng_destroy(struct mqtt_ng_client *client)
 {
+    publish_queue_destroy(client);
     transaction_buffer_destroy(&client->main_buffer);
-    pthread_mutex_destroy(&client->stats_mutex);
+
+    while (client->prepared) {
+        struct mqtt_prepared_publish *pp = client->prepared;
+        client->prepared = pp->next;
+        mw_free(pp);
+    }
+    pthread_mutex_destroy(&client->prepared_mutex);
 
     mqtt_ng_destroy_tx_alias_hash(client->tx_topic_aliases.stoi_dict);
+    mqtt_ng_alias_cache_destroy(client->tx_topic_aliases.auto_cache);
     pthread_rwlock_destroy(&client->tx_topic_aliases.rwlock);
     mqtt_ng_destroy_rx_alias_hash(client->rx_aliases);
+    mqtt_ng_router_destroy(client->router);
 
+    mw_free(client->parser.rx_scratch);
+    mqtt_properties_parser_ctx_destroy(&client->parser.properties_parser);
     mw_free(client);
 }
 
-int frag_set_external_data(mqtt_wss_log_ctx_t log, struct buffer_fragment *frag, void *data, size_t data_len, free_fnc_t data_free_fnc)
+int frag_set_external_data(mqtt_wss_log_ctx_t log, const struct mqtt_wss_allocator *alloc, struct buffer_fragment *frag, void *data, size_t data_len, free_fnc_t data_free_fnc)
 {
     if (frag->len) {
         // TODO?: This could potentially be done in future if we set rule
@@ -722,7 +1159,7 @@ int frag_set_external_data(mqtt_wss_log_ctx_t log, struct buffer_fragment *frag,
 
     switch (ptr2memory_mode(data_free_fnc)) {
         case MEMCPY:
-            frag->data = mw_malloc(data_len);
+            frag->data = mw_obj_malloc(alloc, data_len);
             if (frag->data == NULL) {
                 mws_error(log, UNIT_LOG_PREFIX "OOM while malloc @_optimized_add");
                 return 1;
@@ -808,7 +1245,7 @@ static size_t mqtt_ng_connect_size(struct mqtt_auth_properties *auth,
 #define PACK_2B_INT(buffer, integer, frag) { *(uint16_t *)WRITE_POS(frag) = htobe16((integer)); \
             DATA_ADVANCE(buffer, sizeof(uint16_t), frag); }
 
-static int _optimized_add(struct header_buffer *buf, mqtt_wss_log_ctx_t log_ctx, void *data, size_t data_len, free_fnc_t data_free_fnc, struct buffer_fragment **frag)
+static int _optimized_add(struct header_buffer *buf, const struct mqtt_wss_allocator *alloc, mqtt_wss_log_ctx_t log_ctx, void *data, size_t data_len, free_fnc_t data_free_fnc, struct buffer_fragment **frag)
 {
     if (data_len > SMALL_STRING_DONT_FRAGMENT_LIMIT) {
         buffer_frag_flag_t flags = BUFFER_FRAG_DATA_EXTERNAL;
@@ -818,7 +1255,7 @@ static int _optimized_add(struct header_buffer *buf, mqtt_wss_log_ctx_t log_ctx,
             mws_error(log_ctx, "Out of buffer space while generating the message");
             return 1;
         }
-        if (frag_set_external_data(log_ctx, *frag, data, data_len, data_free_fnc)) {
+        if (frag_set_external_data(log_ctx, alloc, *frag, data, data_len, data_free_fnc)) {
             mws_error(log_ctx, "Error adding external data to newly created fragment");
             return 1;
         }
@@ -834,27 +1271,113 @@ static int _optimized_add(struct header_buffer *buf, mqtt_wss_log_ctx_t log_ctx,
     return 0;
 }
 
+// HEADER_BUFFER_SIZE is allowed always as it was the fixed buffer size
+// before max_mem_bytes was introduced
+#define MQTT_NG_MAX_MEM(client) ((client)->max_mem_bytes > HEADER_BUFFER_SIZE ? (client)->max_mem_bytes : HEADER_BUFFER_SIZE)
+
+// stats are read by other threads without any lock
+#define STATS_ADD(client, field, n) __atomic_fetch_add(&(client)->stats.field, (n), __ATOMIC_RELAXED)
+#define STATS_SET(client, field, n) __atomic_store_n(&(client)->stats.field, (n), __ATOMIC_RELAXED)
+#define STATS_GET(client, field) __atomic_load_n(&(client)->stats.field, __ATOMIC_RELAXED)
+
+static inline uint64_t mqtt_ng_now_usec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void latency_histogram_add(struct mqtt_latency_histogram *hist, uint64_t usec)
+{
+    // bucket i holds [2^(i-1), 2^i) usec
+    int bucket = usec ? 64 - __builtin_clzll(usec) : 0;
+    if (bucket >= MQTT_LATENCY_HISTOGRAM_BUCKETS)
+        bucket = MQTT_LATENCY_HISTOGRAM_BUCKETS - 1;
+
+    __atomic_fetch_add(&hist->buckets[bucket], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->sum_usec, usec, __ATOMIC_RELAXED);
+    // only service thread writes histograms
+    if (usec > __atomic_load_n(&hist->max_usec, __ATOMIC_RELAXED))
+        __atomic_store_n(&hist->max_usec, usec, __ATOMIC_RELAXED);
+}
+
+static void latency_histogram_get(struct mqtt_latency_histogram *hist, struct mqtt_latency_histogram *out)
+{
+    out->count = __atomic_load_n(&hist->count, __ATOMIC_RELAXED);
+    out->sum_usec = __atomic_load_n(&hist->sum_usec, __ATOMIC_RELAXED);
+    out->max_usec = __atomic_load_n(&hist->max_usec, __ATOMIC_RELAXED);
+    for (int i = 0; i < MQTT_LATENCY_HISTOGRAM_BUCKETS; i++)
+        out->buckets[i] = __atomic_load_n(&hist->buckets[i], __ATOMIC_RELAXED);
+}
+
+// buffer GC and growth as done when message doesn't fit, also feeds instrumentation
+// caller must hold the buffer lock
+static void client_garbage_collect(struct mqtt_ng_client *client)
+{
+    uint64_t start = mqtt_wss_instr_start(client->instr);
+    transaction_buffer_garbage_collect(&client->main_buffer, client->log);
+    mqtt_wss_instr_stop(client->instr, MQTT_WSS_STAGE_GC, start);
+    mqtt_wss_instr_event(client->instr, MQTT_WSS_EVENT_GC_RUN);
+}
+
+static int client_buffer_grow(struct mqtt_ng_client *client)
+{
+    uint64_t start = mqtt_wss_instr_start(client->instr);
+    int rc = transaction_buffer_grow(&client->main_buffer, client->log, MQTT_NG_MAX_MEM(client));
+    mqtt_wss_instr_stop(client->instr, MQTT_WSS_STAGE_BUFFER_GROW, start);
+    if (!rc)
+        mqtt_wss_instr_event(client->instr, MQTT_WSS_EVENT_BUFFER_GROW);
+    return rc;
+}
+
+// calls flow control callback if publish_bytes crossed the watermark
+// (lock free, every transition is reported once no matter which thread sees it)
+static void flow_control_update(struct mqtt_ng_client *client)
+{
+    mqtt_ng_flow_callback_t callback = __atomic_load_n(&client->flow_callback, __ATOMIC_ACQUIRE);
+    if (!callback)
+        return;
+
+    size_t bytes = __atomic_load_n(&client->main_buffer.publish_bytes, __ATOMIC_RELAXED);
+    int above = __atomic_load_n(&client->flow_above, __ATOMIC_RELAXED);
+    int expected = above;
+    if (!above && bytes >= client->flow_high) {
+        if (__atomic_compare_exchange_n(&client->flow_above, &expected, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            callback(client->flow_ctx, 1);
+    } else if (above && bytes <= client->flow_low) {
+        if (__atomic_compare_exchange_n(&client->flow_above, &expected, 0, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            callback(client->flow_ctx, 0);
+    }
+}
+
+#define GENERATE_TIMED(rc, generator_function, client, ...) \
+    do { \
+        uint64_t gen_start = mqtt_wss_instr_start(client->instr); \
+        rc = generator_function(&client->main_buffer, client->log, ##__VA_ARGS__); \
+        mqtt_wss_instr_stop(client->instr, MQTT_WSS_STAGE_MSG_GENERATE, gen_start); \
+    } while (0)
+
 #define TRY_GENERATE_MESSAGE(generator_function, client, ...) \
-    int rc = generator_function(&client->main_buffer, client->log, ##__VA_ARGS__); \
+    int rc; \
+    GENERATE_TIMED(rc, generator_function, client, ##__VA_ARGS__); \
     if (rc == MQTT_NG_MSGGEN_BUFFER_OOM) { \
         LOCK_HDR_BUFFER(&client->main_buffer); \
-        transaction_buffer_garbage_collect((&client->main_buffer), client->log); \
+        client_garbage_collect(client); \
         UNLOCK_HDR_BUFFER(&client->main_buffer); \
-        rc = generator_function(&client->main_buffer, client->log, ##__VA_ARGS__); \
-        if (rc == MQTT_NG_MSGGEN_BUFFER_OOM && client->max_mem_bytes) { \
+        GENERATE_TIMED(rc, generator_function, client, ##__VA_ARGS__); \
+        if (rc == MQTT_NG_MSGGEN_BUFFER_OOM) { \
             LOCK_HDR_BUFFER(&client->main_buffer); \
-            transaction_buffer_grow((&client->main_buffer), client->log, GROWTH_FACTOR, client->max_mem_bytes); \
+            client_buffer_grow(client); \
             UNLOCK_HDR_BUFFER(&client->main_buffer); \
-            rc = generator_function(&client->main_buffer, client->log, ##__VA_ARGS__); \
+            GENERATE_TIMED(rc, generator_function, client, ##__VA_ARGS__); \
         } \
         if (rc == MQTT_NG_MSGGEN_BUFFER_OOM) \
             mws_error(client->log, "%s failed to generate message due to insufficient buffer space (line %d)", __FUNCTION__, __LINE__); \
     } \
-    if (rc == MQTT_NG_MSGGEN_OK) { \
-        pthread_mutex_lock(&client->stats_mutex); \
-        client->stats.tx_messages_queued++; \
-        pthread_mutex_unlock(&client->stats_mutex); \
-    } \
+    if (rc == MQTT_NG_MSGGEN_OK) \
+        STATS_ADD(client, tx_messages_queued, 1); \
+    flow_control_update(client); \
     return rc;
 
 mqtt_msg_data mqtt_ng_generate_connect(struct transaction_buffer *trx_buf,
@@ -958,7 +1481,7 @@ mqtt_msg_data mqtt_ng_generate_connect(struct transaction_buffer *trx_buf,
     // [MQTT-3.1.3.1] Client identifier
     CHECK_BYTES_AVAILABLE(&trx_buf->hdr_buffer, 2, goto fail_rollback);
     PACK_2B_INT(&trx_buf->hdr_buffer, strlen(auth->client_id), frag);
-    if (_optimized_add(&trx_buf->hdr_buffer, log_ctx, auth->client_id, strlen(auth->client_id), auth->client_id_free, &frag))
+    if (_optimized_add(&trx_buf->hdr_buffer, trx_buf->alloc, log_ctx, auth->client_id, strlen(auth->client_id), auth->client_id_free, &frag))
         goto fail_rollback;
 
     if (lwt != NULL) {
@@ -972,7 +1495,7 @@ mqtt_msg_data mqtt_ng_generate_connect(struct transaction_buffer *trx_buf,
         // Will Topic [MQTT-3.1.3.3]
         CHECK_BYTES_AVAILABLE(&trx_buf->hdr_buffer, 2, goto fail_rollback);
         PACK_2B_INT(&trx_buf->hdr_buffer, strlen(lwt->will_topic), frag);
-        if (_optimized_add(&trx_buf->hdr_buffer, log_ctx, lwt->will_topic, strlen(lwt->will_topic), lwt->will_topic_free, &frag))
+        if (_optimized_add(&trx_buf->hdr_buffer, trx_buf->alloc, log_ctx, lwt->will_topic, strlen(lwt->will_topic), lwt->will_topic_free, &frag))
             goto fail_rollback;
 
         // Will Payload [MQTT-3.1.3.4]
@@ -980,7 +1503,7 @@ mqtt_msg_data mqtt_ng_generate_connect(struct transaction_buffer *trx_buf,
             BUFFER_TRANSACTION_NEW_FRAG(&trx_buf->hdr_buffer, 0, frag, goto fail_rollback);
             CHECK_BYTES_AVAILABLE(&trx_buf->hdr_buffer, 2, goto fail_rollback);
             PACK_2B_INT(&trx_buf->hdr_buffer, lwt->will_message_size, frag);
-            if (_optimized_add(&trx_buf->hdr_buffer, log_ctx, lwt->will_message, lwt->will_message_size, lwt->will_topic_free, &frag))
+            if (_optimized_add(&trx_buf->hdr_buffer, trx_buf->alloc, log_ctx, lwt->will_message, lwt->will_message_size, lwt->will_topic_free, &frag))
                 goto fail_rollback;
         }
     }
@@ -990,7 +1513,7 @@ mqtt_msg_data mqtt_ng_generate_connect(struct transaction_buffer *trx_buf,
         BUFFER_TRANSACTION_NEW_FRAG(&trx_buf->hdr_buffer, 0, frag, goto fail_rollback);
         CHECK_BYTES_AVAILABLE(&trx_buf->hdr_buffer, 2, goto fail_rollback);
         PACK_2B_INT(&trx_buf->hdr_buffer, strlen(auth->username), frag);
-        if (_optimized_add(&trx_buf->hdr_buffer, log_ctx, auth->username, strlen(auth->username), auth->username_free, &frag))
+        if (_optimized_add(&trx_buf->hdr_buffer, trx_buf->alloc, log_ctx, auth->username, strlen(auth->username), auth->username_free, &frag))
             goto fail_rollback;
     }
 
@@ -999,7 +1522,7 @@ mqtt_msg_data mqtt_ng_generate_connect(struct transaction_buffer *trx_buf,
         BUFFER_TRANSACTION_NEW_FRAG(&trx_buf->hdr_buffer, 0, frag, goto fail_rollback);
         CHECK_BYTES_AVAILABLE(&trx_buf->hdr_buffer, 2, goto fail_rollback);
         PACK_2B_INT(&trx_buf->hdr_buffer, strlen(auth->password), frag);
-        if (_optimized_add(&trx_buf->hdr_buffer, log_ctx, auth->password, strlen(auth->password), auth->password_free, &frag))
+        if (_optimized_add(&trx_buf->hdr_buffer, trx_buf->alloc, log_ctx, auth->password, strlen(auth->password), auth->password_free, &frag))
             goto fail_rollback;
     }
     trx_buf->hdr_buffer.tail_frag->flags |= BUFFER_FRAG_MQTT_PACKET_TAIL;
@@ -1021,8 +1544,12 @@ int mqtt_ng_connect(struct mqtt_ng_client *client,
 
     LOCK_HDR_BUFFER(&client->main_buffer);
     client->main_buffer.sending_frag = NULL;
-    if (clean_start)
-        buffer_purge(&client->main_buffer.hdr_buffer);
+    if (clean_start) {
+        transaction_buffer_purge(&client->main_buffer);
+        client->window_inflight = 0;
+    }
+    client->window_blocked = 0;
+    client->main_buffer.bypass_cursor = NULL;
     UNLOCK_HDR_BUFFER(&client->main_buffer);
 
     pthread_rwlock_wrlock(&client->tx_topic_aliases.rwlock);
@@ -1035,6 +1562,10 @@ int mqtt_ng_connect(struct mqtt_ng_client *client,
         return 1;
     }
     client->tx_topic_aliases.idx_assigned = 0;
+    client->tx_topic_aliases.server_max = 0;
+    if (client->tx_topic_aliases.auto_cache)
+        mqtt_ng_alias_cache_reset(client->tx_topic_aliases.auto_cache);
+    tx_topic_aliases_changed(&client->tx_topic_aliases);
     pthread_rwlock_unlock(&client->tx_topic_aliases.rwlock);
 
     mqtt_ng_destroy_rx_alias_hash(client->rx_aliases);
@@ -1046,33 +1577,34 @@ int mqtt_ng_connect(struct mqtt_ng_client *client,
     if (client->connect_msg == NULL)
         return 1;
 
-    pthread_mutex_lock(&client->stats_mutex);
     if (clean_start)
-        client->stats.tx_messages_queued = 1;
+        STATS_SET(client, tx_messages_queued, 1);
     else
-        client->stats.tx_messages_queued++;
+        STATS_ADD(client, tx_messages_queued, 1);
 
-    client->stats.tx_messages_sent = 0;
-    client->stats.rx_messages_rcvd = 0;
-    pthread_mutex_unlock(&client->stats_mutex);
+    STATS_SET(client, tx_messages_sent, 0);
+    STATS_SET(client, rx_messages_rcvd, 0);
 
     client->client_state = CONNECT_PENDING;
     return 0;
 }
 
-uint16_t get_unused_packet_id() {
-    static uint16_t packet_id = 0;
-    packet_id++;
-    return packet_id ? packet_id : ++packet_id;
+// has to be called with transaction buffer locked
+static uint16_t get_unused_packet_id(struct transaction_buffer *trx_buf, mqtt_wss_log_ctx_t log_ctx) {
+    uint16_t packet_id = inflight_get_unused_id(&trx_buf->inflight);
+    if (!packet_id)
+        mws_error(log_ctx, "All packet ids are in use by messages waiting for acknowledgement");
+    return packet_id;
 }
 
 static inline size_t mqtt_ng_publish_size(const char *topic,
                             size_t msg_len,
-                            uint16_t topic_id)
+                            uint16_t topic_id,
+                            uint8_t qos)
 {
     size_t retval = 2 /* Topic Name Length */
         + (topic == NULL ? 0 : strlen(topic))
-        + 2 /* Packet identifier */
+        + (qos ? 2 : 0) /* Packet identifier */
         + 1 /* Properties Length TODO for now fixed to 1 property */
         + msg_len;
 
@@ -1082,22 +1614,38 @@ static inline size_t mqtt_ng_publish_size(const char *topic,
     return retval;
 }
 
-int mqtt_ng_generate_publish(struct transaction_buffer *trx_buf,
-                             mqtt_wss_log_ctx_t log_ctx,
-                             char *topic,
-                             free_fnc_t topic_free,
-                             void *msg,
-                             free_fnc_t msg_free,
-                             size_t msg_len,
-                             uint8_t publish_flags,
-                             uint16_t *packet_id,
-                             uint16_t topic_alias)
+// finishes PUBLISH packet once payload fragment is added (last one in buffer)
+static inline void publish_generated(struct transaction_buffer *trx_buf, mqtt_msg_data mqtt_msg, uint8_t qos, size_t packet_len)
+{
+    trx_buf->hdr_buffer.tail_frag->flags |= BUFFER_FRAG_MQTT_PACKET_TAIL;
+    trx_buf->hdr_buffer.tail_frag->timestamp = mqtt_ng_now_usec();
+    if (!qos)
+        trx_buf->hdr_buffer.tail_frag->flags |= BUFFER_FRAG_GARBAGE_COLLECT_ON_SEND;
+    else
+        inflight_add(trx_buf, mqtt_msg);
+    trx_buf->hdr_buffer.tail_frag->packet_len = packet_len;
+    __atomic_store_n(&trx_buf->publish_bytes, trx_buf->publish_bytes + packet_len, __ATOMIC_RELAXED);
+}
+
+// expects trx_buf to be locked
+static int mqtt_ng_generate_publish_locked(struct transaction_buffer *trx_buf,
+                                           mqtt_wss_log_ctx_t log_ctx,
+                                           char *topic,
+                                           free_fnc_t topic_free,
+                                           void *msg,
+                                           free_fnc_t msg_free,
+                                           size_t msg_len,
+                                           uint8_t publish_flags,
+                                           uint16_t *packet_id,
+                                           uint16_t topic_alias)
 {
     // >> START THE RODEO <<
-    transaction_buffer_transaction_start(trx_buf);
+    transaction_buffer_transaction_start_locked(trx_buf);
+
+    uint8_t qos = (publish_flags >> 1) & 0x03;
 
     // Calculate the resulting message size sans fixed MQTT header
-    size_t size = mqtt_ng_publish_size(topic, msg_len, topic_alias);
+    size_t size = mqtt_ng_publish_size(topic, msg_len, topic_alias, qos);
 
     // Start generating the message
     struct buffer_fragment *frag = NULL;
@@ -1105,7 +1653,6 @@ int mqtt_ng_generate_publish(struct transaction_buffer *trx_buf,
 
     BUFFER_TRANSACTION_NEW_FRAG(&trx_buf->hdr_buffer, BUFFER_FRAG_MQTT_PACKET_HEAD, frag, goto fail_rollback );
     // in case of QOS 0 we can garbage collect immediatelly after sending
-    uint8_t qos = (publish_flags >> 1) & 0x03;
     if (!qos)
         frag->flags |= BUFFER_FRAG_GARBAGE_COLLECT_ON_SEND;
     mqtt_msg = frag;
@@ -1122,15 +1669,19 @@ int mqtt_ng_generate_publish(struct transaction_buffer *trx_buf,
     // [MQTT-3.3.2.1]
     PACK_2B_INT(&trx_buf->hdr_buffer, topic == NULL ? 0 : strlen(topic), frag);
     if (topic != NULL) {
-        if (_optimized_add(&trx_buf->hdr_buffer, log_ctx, topic, strlen(topic), topic_free, &frag))
+        if (_optimized_add(&trx_buf->hdr_buffer, trx_buf->alloc, log_ctx, topic, strlen(topic), topic_free, &frag))
             goto fail_rollback;
         BUFFER_TRANSACTION_NEW_FRAG(&trx_buf->hdr_buffer, 0, frag, goto fail_rollback);
     }
 
-    // [MQTT-3.3.2.2]
-    mqtt_msg->packet_id = get_unused_packet_id();
+    // [MQTT-3.3.2.2] Packet Identifier is present only in QOS > 0 PUBLISH
+    if (qos) {
+        mqtt_msg->packet_id = get_unused_packet_id(trx_buf, log_ctx);
+        if (!mqtt_msg->packet_id)
+            goto fail_rollback;
+        PACK_2B_INT(&trx_buf->hdr_buffer, mqtt_msg->packet_id, frag);
+    }
     *packet_id = mqtt_msg->packet_id;
-    PACK_2B_INT(&trx_buf->hdr_buffer, mqtt_msg->packet_id, frag);
 
     // [MQTT-3.3.2.3.1] TODO Property Length for now fixed 0
     *WRITE_POS(frag) = topic_alias ? 3 : 0;
@@ -1146,71 +1697,756 @@ int mqtt_ng_generate_publish(struct transaction_buffer *trx_buf,
     if( (frag = buffer_new_frag(&trx_buf->hdr_buffer, BUFFER_FRAG_DATA_EXTERNAL)) == NULL )
         goto fail_rollback;
 
-    if (frag_set_external_data(log_ctx, frag, msg, msg_len, msg_free))
+    if (frag_set_external_data(log_ctx, trx_buf->alloc, frag, msg, msg_len, msg_free))
         goto fail_rollback;
 
-    trx_buf->hdr_buffer.tail_frag->flags |= BUFFER_FRAG_MQTT_PACKET_TAIL;
-    if (!qos)
-        trx_buf->hdr_buffer.tail_frag->flags |= BUFFER_FRAG_GARBAGE_COLLECT_ON_SEND;
-    transaction_buffer_transaction_commit(trx_buf);
+    publish_generated(trx_buf, mqtt_msg, qos, needed_bytes + msg_len);
     return MQTT_NG_MSGGEN_OK;
 fail_rollback:
-    transaction_buffer_transaction_rollback(trx_buf, mqtt_msg);
+    transaction_buffer_transaction_revert(trx_buf, mqtt_msg);
     return MQTT_NG_MSGGEN_BUFFER_OOM;
 }
 
-#define PUBLISH_SP_SIZE 64
-int mqtt_ng_publish(struct mqtt_ng_client *client,
-                    char *topic,
-                    free_fnc_t topic_free,
-                    void *msg,
-                    free_fnc_t msg_free,
-                    size_t msg_len,
-                    uint8_t publish_flags,
-                    uint16_t *packet_id)
+int mqtt_ng_generate_publish(struct transaction_buffer *trx_buf,
+                             mqtt_wss_log_ctx_t log_ctx,
+                             char *topic,
+                             free_fnc_t topic_free,
+                             void *msg,
+                             free_fnc_t msg_free,
+                             size_t msg_len,
+                             uint8_t publish_flags,
+                             uint16_t *packet_id,
+                             uint16_t topic_alias)
 {
-    struct topic_alias_data *alias = NULL;
-    pthread_rwlock_rdlock(&client->tx_topic_aliases.rwlock);
-    c_rhash_get_ptr_by_str(client->tx_topic_aliases.stoi_dict, topic, (void**)&alias);
-    pthread_rwlock_unlock(&client->tx_topic_aliases.rwlock);
-
-    uint16_t topic_id = 0;
+    LOCK_HDR_BUFFER(trx_buf);
+    int rc = mqtt_ng_generate_publish_locked(trx_buf, log_ctx, topic, topic_free, msg, msg_free, msg_len, publish_flags, packet_id, topic_alias);
+    UNLOCK_HDR_BUFFER(trx_buf);
+    return rc;
+}
 
-    if (alias != NULL) {
-        topic_id = alias->idx;
-        uint32_t cnt = __atomic_fetch_add(&alias->usage_count, 1, __ATOMIC_SEQ_CST);
-        if (cnt) {
-            topic = NULL;
-            topic_free = NULL;
+// expects tx_topic_aliases.rwlock to be held (exclusively if exclusive is set)
+// if alias was already used topic is not sent anymore
+// auto_slot is set to slot of automatic alias which has to be confirmed
+// by mqtt_ng_alias_cache_established once the message is queued (-1 otherwise)
+// or to MQTT_NG_ALIAS_ASSIGN if automatic alias has to be assigned, then lookup
+// has to be repeated with the lock held exclusively and accounted set
+// (publish of topic was counted already)
+// manual is set to alias which has to be marked used by tx_topic_alias_used
+// once the message is queued (NULL otherwise), until then topic keeps being sent
+static uint16_t tx_topic_alias_lookup(struct mqtt_ng_client *client, char **topic, free_fnc_t *topic_free, int exclusive, int accounted, int *auto_slot, struct topic_alias_data **manual)
+{
+    struct topic_aliases_data *aliases = &client->tx_topic_aliases;
+    struct topic_alias_data *alias = NULL;
+    *auto_slot = -1;
+    *manual = NULL;
+
+    c_rhash_get_ptr_by_str(aliases->stoi_dict, *topic, (void**)&alias);
+    if (alias != NULL && alias->idx <= aliases->server_max) {
+        if (__atomic_load_n(&alias->usage_count, __ATOMIC_SEQ_CST)) {
+            *topic = NULL;
+            *topic_free = NULL;
         }
+        *manual = alias;
+        return alias->idx;
     }
 
-    if (client->max_msg_size && PUBLISH_SP_SIZE + mqtt_ng_publish_size(topic, msg_len, topic_id) > client->max_msg_size) {
-        mws_error(client->log, "Message too big for server: %zu", msg_len);
-        return MQTT_NG_MSGGEN_MSG_TOO_BIG;
+    if (!aliases->auto_cache || alias != NULL)
+        return 0;
+
+    uint16_t capacity = aliases->server_max > aliases->idx_assigned ? aliases->server_max - aliases->idx_assigned : 0;
+    int established;
+    int slot = accounted ? MQTT_NG_ALIAS_ASSIGN : mqtt_ng_alias_cache_find(aliases->auto_cache, *topic, capacity, &established);
+    if (slot == MQTT_NG_ALIAS_ASSIGN) {
+        if (!exclusive) {
+            *auto_slot = MQTT_NG_ALIAS_ASSIGN;
+            return 0;
+        }
+        // slot can be taken from another topic
+        slot = mqtt_ng_alias_cache_assign(aliases->auto_cache, *topic, capacity, &established);
+        tx_topic_aliases_changed(aliases);
     }
+    if (slot < 0)
+        return 0;
 
-    TRY_GENERATE_MESSAGE(mqtt_ng_generate_publish, client, topic, topic_free, msg, msg_free, msg_len, publish_flags, packet_id, topic_id);
+    if (established) {
+        *topic = NULL;
+        *topic_free = NULL;
+    } else
+        *auto_slot = slot;
+    return aliases->server_max - slot;
 }
 
-static inline size_t mqtt_ng_subscribe_size(struct mqtt_sub *subs, size_t sub_count)
+// aliases are never removed while client exists so no lock is needed
+static inline void tx_topic_alias_used(struct topic_aliases_data *aliases, struct topic_alias_data *alias)
 {
-    size_t len = 2 /* Packet Identifier */ + 1 /* Properties Length TODO for now fixed 0 */;
-    len += sub_count * (2 /* topic filter string length */ + 1 /* [MQTT-3.8.3.1] Subscription Options Byte */);
-
-    for (size_t i = 0; i < sub_count; i++) {
-        len += strlen(subs[i].topic);
-    }
-    return len;
+    // topic is omitted from now on
+    if (alias && !__atomic_fetch_add(&alias->usage_count, 1, __ATOMIC_SEQ_CST))
+        tx_topic_aliases_changed(aliases);
 }
 
-int mqtt_ng_generate_subscribe(struct transaction_buffer *trx_buf, mqtt_wss_log_ctx_t log_ctx, struct mqtt_sub *subs, size_t sub_count)
+// expects tx_topic_aliases.rwlock to be held
+static inline void tx_topic_alias_established(struct topic_aliases_data *aliases, int auto_slot)
 {
-    // >> START THE RODEO <<
-    transaction_buffer_transaction_start(trx_buf);
+    if (auto_slot < 0)
+        return;
+    mqtt_ng_alias_cache_established(aliases->auto_cache, auto_slot);
+    tx_topic_aliases_changed(aliases);
+}
 
-    // Calculate the resulting message size sans fixed MQTT header
-    size_t size = mqtt_ng_subscribe_size(subs, sub_count);
+static int mqtt_ng_publish_generate(struct mqtt_ng_client *client,
+                                    char *topic,
+                                    free_fnc_t topic_free,
+                                    void *msg,
+                                    free_fnc_t msg_free,
+                                    size_t msg_len,
+                                    uint8_t publish_flags,
+                                    uint16_t *packet_id,
+                                    uint16_t topic_id)
+{
+    TRY_GENERATE_MESSAGE(mqtt_ng_generate_publish, client, topic, topic_free, msg, msg_free, msg_len, publish_flags, packet_id, topic_id);
+}
+
+#define PUBLISH_SP_SIZE 64
+int mqtt_ng_publish(struct mqtt_ng_client *client,
+                    char *topic,
+                    free_fnc_t topic_free,
+                    void *msg,
+                    free_fnc_t msg_free,
+                    size_t msg_len,
+                    uint8_t publish_flags,
+                    uint16_t *packet_id)
+{
+    // automatically aliased messages have to be generated while holding the alias lock
+    // (shared unless new alias is assigned) so that they enter the transaction buffer
+    // in the order aliases were (re)assigned
+    if (__atomic_load_n(&client->tx_topic_aliases.auto_cache, __ATOMIC_ACQUIRE)) {
+        struct mqtt_publish_batch_entry entry = {
+            .topic = topic,
+            .topic_free = topic_free,
+            .msg = msg,
+            .msg_free = msg_free,
+            .msg_len = msg_len,
+            .qos = (publish_flags >> MQTT_PUBLISH_FLAG_QOS_BITSHIFT) & 0x3,
+            .retain = publish_flags & MQTT_PUBLISH_FLAG_RETAIN,
+            .dup = !!(publish_flags & MQTT_PUBLISH_FLAG_DUP)
+        };
+        mqtt_ng_publish_batch(client, &entry, 1);
+        if (packet_id)
+            *packet_id = entry.packet_id;
+        return entry.rc;
+    }
+
+    int auto_slot;
+    struct topic_alias_data *alias;
+    pthread_rwlock_rdlock(&client->tx_topic_aliases.rwlock);
+    uint16_t topic_id = tx_topic_alias_lookup(client, &topic, &topic_free, 0, 0, &auto_slot, &alias);
+    pthread_rwlock_unlock(&client->tx_topic_aliases.rwlock);
+
+    if (client->max_msg_size && PUBLISH_SP_SIZE + mqtt_ng_publish_size(topic, msg_len, topic_id, (publish_flags >> 1) & 0x03) > client->max_msg_size) {
+        mws_error(client->log, "Message too big for server: %zu", msg_len);
+        return MQTT_NG_MSGGEN_MSG_TOO_BIG;
+    }
+
+    int rc = mqtt_ng_publish_generate(client, topic, topic_free, msg, msg_free, msg_len, publish_flags, packet_id, topic_id);
+    if (rc == MQTT_NG_MSGGEN_OK)
+        tx_topic_alias_used(&client->tx_topic_aliases, alias);
+    return rc;
+}
+
+size_t mqtt_ng_publish_batch(struct mqtt_ng_client *client, struct mqtt_publish_batch_entry *entries, size_t count)
+{
+    size_t failed = 0;
+    int queued = 0;
+
+    // alias lock is taken exclusively only once some topic needs automatic alias assigned
+    int aliases_exclusive = 0;
+    pthread_rwlock_rdlock(&client->tx_topic_aliases.rwlock);
+    LOCK_HDR_BUFFER(&client->main_buffer);
+    for (size_t i = 0; i < count; i++) {
+        struct mqtt_publish_batch_entry *entry = &entries[i];
+        char *topic = entry->topic;
+        free_fnc_t topic_free = entry->topic_free;
+        int auto_slot;
+        struct topic_alias_data *alias;
+        uint16_t topic_id = tx_topic_alias_lookup(client, &topic, &topic_free, aliases_exclusive, 0, &auto_slot, &alias);
+        if (auto_slot == MQTT_NG_ALIAS_ASSIGN) {
+            // alias lock is always taken before buffer lock
+            UNLOCK_HDR_BUFFER(&client->main_buffer);
+            pthread_rwlock_unlock(&client->tx_topic_aliases.rwlock);
+            pthread_rwlock_wrlock(&client->tx_topic_aliases.rwlock);
+            LOCK_HDR_BUFFER(&client->main_buffer);
+            aliases_exclusive = 1;
+            topic_id = tx_topic_alias_lookup(client, &topic, &topic_free, aliases_exclusive, 1, &auto_slot, &alias);
+        }
+        uint8_t publish_flags = (entry->qos & 0x3) << MQTT_PUBLISH_FLAG_QOS_BITSHIFT;
+        if (entry->retain)
+            publish_flags |= MQTT_PUBLISH_FLAG_RETAIN;
+        // DUP has to be 0 for QOS0 [MQTT-3.3.1-2]
+        if (entry->dup && entry->qos)
+            publish_flags |= MQTT_PUBLISH_FLAG_DUP;
+
+        entry->packet_id = 0;
+        if (entry->qos > MQTT_MAX_QOS) {
+            mws_error(client->log, "Invalid QOS %d for publish", (int)entry->qos);
+            entry->rc = MQTT_NG_MSGGEN_USER_ERROR;
+            failed++;
+            continue;
+        }
+
+        if (client->max_msg_size && PUBLISH_SP_SIZE + mqtt_ng_publish_size(topic, entry->msg_len, topic_id, entry->qos) > client->max_msg_size) {
+            mws_error(client->log, "Message too big for server: %zu", entry->msg_len);
+            entry->rc = MQTT_NG_MSGGEN_MSG_TOO_BIG;
+            failed++;
+            continue;
+        }
+
+#define GENERATE_BATCH_ENTRY() GENERATE_TIMED(entry->rc, mqtt_ng_generate_publish_locked, client, topic, topic_free, entry->msg, entry->msg_free, entry->msg_len, publish_flags, &entry->packet_id, topic_id)
+        GENERATE_BATCH_ENTRY();
+        if (entry->rc == MQTT_NG_MSGGEN_BUFFER_OOM) {
+            client_garbage_collect(client);
+            GENERATE_BATCH_ENTRY();
+            if (entry->rc == MQTT_NG_MSGGEN_BUFFER_OOM) {
+                client_buffer_grow(client);
+                GENERATE_BATCH_ENTRY();
+            }
+            if (entry->rc == MQTT_NG_MSGGEN_BUFFER_OOM)
+                mws_error(client->log, "%s failed to generate message due to insufficient buffer space", __FUNCTION__);
+        }
+#undef GENERATE_BATCH_ENTRY
+
+        if (entry->rc)
+            failed++;
+        else {
+            queued++;
+            tx_topic_alias_used(&client->tx_topic_aliases, alias);
+            tx_topic_alias_established(&client->tx_topic_aliases, auto_slot);
+        }
+    }
+    UNLOCK_HDR_BUFFER(&client->main_buffer);
+    pthread_rwlock_unlock(&client->tx_topic_aliases.rwlock);
+
+    if (queued)
+        STATS_ADD(client, tx_messages_queued, queued);
+
+    flow_control_update(client);
+    return failed;
+}
+
+struct mqtt_prepared_publish *mqtt_ng_prepare_publish(struct mqtt_ng_client *client, const char *topic, uint8_t publish_flags)
+{
+    size_t topic_len = strlen(topic);
+    if (!topic_len || topic_len > UINT16_MAX) {
+        mws_error(client->log, "Topic length %zu can't be used for PUBLISH", topic_len);
+        return NULL;
+    }
+    if (((publish_flags >> MQTT_PUBLISH_FLAG_QOS_BITSHIFT) & 0x3) > MQTT_MAX_QOS) {
+        mws_error(client->log, "Invalid QOS %d for publish", (int)((publish_flags >> MQTT_PUBLISH_FLAG_QOS_BITSHIFT) & 0x3));
+        return NULL;
+    }
+
+    struct mqtt_prepared_publish *pp = mw_malloc(sizeof(struct mqtt_prepared_publish) + 2 + topic_len + 1);
+    if (!pp)
+        return NULL;
+    pp->first_byte = (MQTT_CPT_PUBLISH << 4) | (publish_flags & (MQTT_PUBLISH_FLAG_QOS_MASK | MQTT_PUBLISH_FLAG_RETAIN));
+    pp->qos = (publish_flags >> MQTT_PUBLISH_FLAG_QOS_BITSHIFT) & 0x3;
+    pp->topic_len = topic_len;
+    pp->encoded_topic[0] = topic_len >> 8;
+    pp->encoded_topic[1] = topic_len & 0xFF;
+    memcpy(&pp->encoded_topic[2], topic, topic_len + 1);
+    // until resolved topic is sent without alias
+    pp->hdr.cached = 0;
+    pp->hdr.send_topic = 1;
+    pp->hdr.props_len = 1;
+    pp->hdr.props[0] = 0;
+    pp->hdr.msg_len = SIZE_MAX;
+
+    pthread_mutex_lock(&client->prepared_mutex);
+    pp->prev = NULL;
+    pp->next = client->prepared;
+    if (pp->next)
+        pp->next->prev = pp;
+    client->prepared = pp;
+    pthread_mutex_unlock(&client->prepared_mutex);
+    return pp;
+}
+
+void mqtt_ng_prepared_publish_free(struct mqtt_ng_client *client, struct mqtt_prepared_publish *pp)
+{
+    if (!pp)
+        return;
+
+    pthread_mutex_lock(&client->prepared_mutex);
+    if (pp->prev)
+        pp->prev->next = pp->next;
+    else
+        client->prepared = pp->next;
+    if (pp->next)
+        pp->next->prev = pp->prev;
+    pthread_mutex_unlock(&client->prepared_mutex);
+    mw_free(pp);
+}
+
+// Variable Header of prepared publish, Topic Name is empty if alias was sent already
+#define PREPARED_VARHDR_SIZE(pp) (2 + ((pp)->hdr.send_topic ? (pp)->topic_len : 0) + ((pp)->qos ? 2 : 0) + (pp)->hdr.props_len)
+
+// expects trx_buf to be locked
+// topic (and alias) is copied into buffer, handle is not referenced once this returns
+static int mqtt_ng_generate_prepared_publish_locked(struct transaction_buffer *trx_buf,
+                                                    mqtt_wss_log_ctx_t log_ctx,
+                                                    struct mqtt_prepared_publish *pp,
+                                                    void *msg,
+                                                    free_fnc_t msg_free,
+                                                    size_t msg_len,
+                                                    uint16_t *packet_id)
+{
+    struct prepared_publish_hdr *hdr = &pp->hdr;
+    transaction_buffer_transaction_start_locked(trx_buf);
+
+    // Remaining Length is encoded again only when payload length changes
+    if (hdr->msg_len != msg_len) {
+        hdr->fixed[0] = pp->first_byte;
+        hdr->fixed_len = 1 + uint32_to_mqtt_vbi(PREPARED_VARHDR_SIZE(pp) + msg_len, &hdr->fixed[1]);
+        hdr->msg_len = msg_len;
+    }
+
+    struct buffer_fragment *frag = NULL;
+    mqtt_msg_data mqtt_msg = NULL;
+
+    BUFFER_TRANSACTION_NEW_FRAG(&trx_buf->hdr_buffer, BUFFER_FRAG_MQTT_PACKET_HEAD, frag, goto fail_rollback );
+    if (!pp->qos)
+        frag->flags |= BUFFER_FRAG_GARBAGE_COLLECT_ON_SEND;
+    mqtt_msg = frag;
+
+    size_t needed_bytes = hdr->fixed_len + PREPARED_VARHDR_SIZE(pp);
+    CHECK_BYTES_AVAILABLE(&trx_buf->hdr_buffer, needed_bytes, goto fail_rollback);
+
+    memcpy(WRITE_POS(frag), hdr->fixed, hdr->fixed_len);
+    DATA_ADVANCE(&trx_buf->hdr_buffer, hdr->fixed_len, frag);
+
+    if (hdr->send_topic) {
+        memcpy(WRITE_POS(frag), pp->encoded_topic, 2 + pp->topic_len);
+        DATA_ADVANCE(&trx_buf->hdr_buffer, 2 + pp->topic_len, frag);
+    } else
+        PACK_2B_INT(&trx_buf->hdr_buffer, 0, frag);
+
+    if (pp->qos) {
+        mqtt_msg->packet_id = get_unused_packet_id(trx_buf, log_ctx);
+        if (!mqtt_msg->packet_id)
+            goto fail_rollback;
+        PACK_2B_INT(&trx_buf->hdr_buffer, mqtt_msg->packet_id, frag);
+    }
+    *packet_id = mqtt_msg->packet_id;
+
+    memcpy(WRITE_POS(frag), hdr->props, hdr->props_len);
+    DATA_ADVANCE(&trx_buf->hdr_buffer, hdr->props_len, frag);
+
+    if( (frag = buffer_new_frag(&trx_buf->hdr_buffer, BUFFER_FRAG_DATA_EXTERNAL)) == NULL )
+        goto fail_rollback;
+
+    if (frag_set_external_data(log_ctx, trx_buf->alloc, frag, msg, msg_len, msg_free))
+        goto fail_rollback;
+
+    publish_generated(trx_buf, mqtt_msg, pp->qos, needed_bytes + msg_len);
+    return MQTT_NG_MSGGEN_OK;
+fail_rollback:
+    transaction_buffer_transaction_revert(trx_buf, mqtt_msg);
+    return MQTT_NG_MSGGEN_BUFFER_OOM;
+}
+
+const char *mqtt_ng_prepared_topic(const struct mqtt_prepared_publish *pp)
+{
+    return &pp->encoded_topic[2];
+}
+
+uint8_t mqtt_ng_prepared_flags(const struct mqtt_prepared_publish *pp)
+{
+    return pp->first_byte & 0xF;
+}
+
+// resolves alias of prepared publish into its header, expects buffer locked and
+// tx_topic_aliases.rwlock held, parameters same as for tx_topic_alias_lookup
+static void prepared_publish_resolve(struct mqtt_ng_client *client,
+                                     struct mqtt_prepared_publish *pp,
+                                     int exclusive,
+                                     int accounted,
+                                     int *auto_slot,
+                                     struct topic_alias_data **manual)
+{
+    struct topic_aliases_data *aliases = &client->tx_topic_aliases;
+    // read before lookup so that any change made meanwhile makes the result stale
+    uint32_t generation = __atomic_load_n(&aliases->generation, __ATOMIC_ACQUIRE);
+
+    char *topic = &pp->encoded_topic[2];
+    free_fnc_t topic_free = CALLER_RESPONSIBILITY;
+    uint16_t topic_alias = tx_topic_alias_lookup(client, &topic, &topic_free, exclusive, accounted, auto_slot, manual);
+    if (*auto_slot == MQTT_NG_ALIAS_ASSIGN)
+        return;
+
+    struct prepared_publish_hdr *hdr = &pp->hdr;
+    hdr->send_topic = topic != NULL;
+    hdr->props_len = 1;
+    hdr->props[0] = 0;
+    if (topic_alias) {
+        hdr->props[hdr->props_len++] = MQTT_PROP_TOPIC_ALIAS;
+        hdr->props[hdr->props_len++] = topic_alias >> 8;
+        hdr->props[hdr->props_len++] = topic_alias & 0xFF;
+        hdr->props[0] = 3;
+    }
+    hdr->msg_len = SIZE_MAX;
+
+    // publishes of topics which can get automatic alias have to be
+    // accounted by mqtt_ng_alias_cache_find until the alias is established
+    hdr->cached = *auto_slot < 0 && (!aliases->auto_cache || *manual || !hdr->send_topic || pp->topic_len < MQTT_NG_ALIAS_MIN_TOPIC_LEN);
+    hdr->generation = generation;
+}
+
+// expects buffer locked and header of pp resolved
+static int mqtt_ng_publish_prepared_locked(struct mqtt_ng_client *client,
+                                           struct mqtt_prepared_publish *pp,
+                                           void *msg,
+                                           free_fnc_t msg_free,
+                                           size_t msg_len,
+                                           uint16_t *packet_id)
+{
+    if (client->max_msg_size && PUBLISH_SP_SIZE + PREPARED_VARHDR_SIZE(pp) + msg_len > client->max_msg_size) {
+        mws_error(client->log, "Message too big for server: %zu", msg_len);
+        return MQTT_NG_MSGGEN_MSG_TOO_BIG;
+    }
+
+    int rc;
+#define GENERATE_PREPARED() GENERATE_TIMED(rc, mqtt_ng_generate_prepared_publish_locked, client, pp, msg, msg_free, msg_len, packet_id)
+    GENERATE_PREPARED();
+    if (rc == MQTT_NG_MSGGEN_BUFFER_OOM) {
+        client_garbage_collect(client);
+        GENERATE_PREPARED();
+        if (rc == MQTT_NG_MSGGEN_BUFFER_OOM) {
+            client_buffer_grow(client);
+            GENERATE_PREPARED();
+        }
+        if (rc == MQTT_NG_MSGGEN_BUFFER_OOM)
+            mws_error(client->log, "%s failed to generate message due to insufficient buffer space", __FUNCTION__);
+    }
+#undef GENERATE_PREPARED
+    return rc;
+}
+
+int mqtt_ng_publish_prepared(struct mqtt_ng_client *client,
+                             struct mqtt_prepared_publish *pp,
+                             void *msg,
+                             free_fnc_t msg_free,
+                             size_t msg_len,
+                             uint16_t *packet_id)
+{
+    struct topic_aliases_data *aliases = &client->tx_topic_aliases;
+    uint16_t unused_id;
+    if (!packet_id)
+        packet_id = &unused_id;
+
+    // header resolved before is used without alias lock while aliases don't change,
+    // it is checked with buffer locked as generation changes with reassigned alias
+    // before message with it can be generated (so this one can't overtake it)
+    LOCK_HDR_BUFFER(&client->main_buffer);
+    if (pp->hdr.cached && pp->hdr.generation == __atomic_load_n(&aliases->generation, __ATOMIC_ACQUIRE)) {
+        int rc = mqtt_ng_publish_prepared_locked(client, pp, msg, msg_free, msg_len, packet_id);
+        UNLOCK_HDR_BUFFER(&client->main_buffer);
+        if (rc == MQTT_NG_MSGGEN_OK)
+            STATS_ADD(client, tx_messages_queued, 1);
+        flow_control_update(client);
+        return rc;
+    }
+    UNLOCK_HDR_BUFFER(&client->main_buffer);
+
+    // alias is resolved now (not when preparing) as it can be set
+    // by mqtt_ng_set_topic_alias any time and is forgotten on reconnect,
+    // automatically aliased messages are generated with alias lock held (see mqtt_ng_publish)
+    int auto_slot;
+    struct topic_alias_data *alias;
+    pthread_rwlock_rdlock(&aliases->rwlock);
+    LOCK_HDR_BUFFER(&client->main_buffer);
+    prepared_publish_resolve(client, pp, 0, 0, &auto_slot, &alias);
+    if (auto_slot == MQTT_NG_ALIAS_ASSIGN) {
+        // alias lock is always taken before buffer lock
+        UNLOCK_HDR_BUFFER(&client->main_buffer);
+        pthread_rwlock_unlock(&aliases->rwlock);
+        pthread_rwlock_wrlock(&aliases->rwlock);
+        LOCK_HDR_BUFFER(&client->main_buffer);
+        prepared_publish_resolve(client, pp, 1, 1, &auto_slot, &alias);
+    }
+
+    int rc = mqtt_ng_publish_prepared_locked(client, pp, msg, msg_free, msg_len, packet_id);
+    if (rc == MQTT_NG_MSGGEN_OK) {
+        tx_topic_alias_used(aliases, alias);
+        tx_topic_alias_established(aliases, auto_slot);
+    }
+    UNLOCK_HDR_BUFFER(&client->main_buffer);
+    pthread_rwlock_unlock(&aliases->rwlock);
+
+    if (rc == MQTT_NG_MSGGEN_OK)
+        STATS_ADD(client, tx_messages_queued, 1);
+    flow_control_update(client);
+    return rc;
+}
+
+static int mqtt_ng_generate_publish_stream(struct transaction_buffer *trx_buf,
+                                           mqtt_wss_log_ctx_t log_ctx,
+                                           char *topic,
+                                           free_fnc_t topic_free,
+                                           struct publish_stream *stream,
+                                           size_t msg_len,
+                                           uint8_t publish_flags,
+                                           uint16_t *packet_id)
+{
+    LOCK_HDR_BUFFER(trx_buf);
+    // stream is given to the fragment only once the message is generated
+    // so that rollback doesn't free it before retrying
+    int rc = mqtt_ng_generate_publish_locked(trx_buf, log_ctx, topic, topic_free, stream, CALLER_RESPONSIBILITY, msg_len, publish_flags, packet_id, 0);
+    if (rc == MQTT_NG_MSGGEN_OK) {
+        struct buffer_fragment *tail = trx_buf->hdr_buffer.tail_frag;
+        tail->flags |= BUFFER_FRAG_DATA_STREAM;
+        tail->free_fnc = publish_stream_free;
+        // only single chunk of the payload is ever held
+        uint32_t held = tail->packet_len - msg_len + stream->src.chunk_size;
+        __atomic_store_n(&trx_buf->publish_bytes, trx_buf->publish_bytes - tail->packet_len + held, __ATOMIC_RELAXED);
+        tail->packet_len = held;
+    }
+    UNLOCK_HDR_BUFFER(trx_buf);
+    return rc;
+}
+
+static int mqtt_ng_publish_stream_generate(struct mqtt_ng_client *client,
+                                           char *topic,
+                                           free_fnc_t topic_free,
+                                           struct publish_stream *stream,
+                                           size_t msg_len,
+                                           uint8_t publish_flags,
+                                           uint16_t *packet_id)
+{
+    TRY_GENERATE_MESSAGE(mqtt_ng_generate_publish_stream, client, topic, topic_free, stream, msg_len, publish_flags, packet_id);
+}
+
+int mqtt_ng_publish_stream(struct mqtt_ng_client *client,
+                           char *topic,
+                           free_fnc_t topic_free,
+                           size_t msg_len,
+                           uint8_t publish_flags,
+                           const struct mqtt_stream_source *src,
+                           uint16_t *packet_id)
+{
+    uint16_t unused_id;
+    if (!packet_id)
+        packet_id = &unused_id;
+
+    if (topic == NULL || src == NULL || src->pull == NULL) {
+        mws_error(client->log, "Streamed message needs topic and pull callback");
+        return MQTT_NG_MSGGEN_USER_ERROR;
+    }
+
+    // Remaining Length has to fit into Variable Byte Integer
+    size_t size = mqtt_ng_publish_size(topic, msg_len, 0, (publish_flags >> 1) & 0x03);
+    if (size >= 256 * 1024 * 1024 || (client->max_msg_size && PUBLISH_SP_SIZE + size > client->max_msg_size)) {
+        mws_error(client->log, "Message too big for server: %zu", msg_len);
+        return MQTT_NG_MSGGEN_MSG_TOO_BIG;
+    }
+
+    size_t chunk_size = MIN(src->chunk_size ? src->chunk_size : PUBLISH_STREAM_DEFAULT_CHUNK, msg_len);
+    struct publish_stream *stream = mw_obj_malloc(client->main_buffer.alloc, sizeof(*stream) + chunk_size);
+    if (stream == NULL) {
+        mws_error(client->log, "OOM allocating stream buffer");
+        return MQTT_NG_MSGGEN_BUFFER_OOM;
+    }
+    stream->src = *src;
+    stream->src.chunk_size = chunk_size;
+    stream->chunk_offset = 0;
+    stream->chunk_len = 0;
+    stream->failed = 0;
+
+    int rc = mqtt_ng_publish_stream_generate(client, topic, topic_free, stream, msg_len, publish_flags, packet_id);
+    if (rc != MQTT_NG_MSGGEN_OK)
+        mw_obj_free(stream);
+    return rc;
+}
+
+static void publish_queue_push(struct publish_queue *queue, struct publish_queue_node *node)
+{
+    __atomic_store_n(&node->next, NULL, __ATOMIC_RELAXED);
+    struct publish_queue_node *prev = __atomic_exchange_n(&queue->head, node, __ATOMIC_ACQ_REL);
+    // between exchange and this store queue is "broken"
+    // consumer will see it as empty from prev onwards
+    __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+}
+
+// single consumer only
+static struct publish_queue_node *publish_queue_pop(struct publish_queue *queue)
+{
+    struct publish_queue_node *tail = queue->tail;
+    struct publish_queue_node *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+    if (tail == &queue->stub) {
+        if (next == NULL)
+            return NULL;
+        queue->tail = next;
+        tail = next;
+        next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    }
+
+    if (next) {
+        queue->tail = next;
+        return tail;
+    }
+
+    // producer is in the middle of push
+    if (tail != __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE))
+        return NULL;
+
+    // tail is last node, we can't take it without stub behind it
+    publish_queue_push(queue, &queue->stub);
+
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next) {
+        queue->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+static void publish_queue_free_copy(void *ptr)
+{
+    mw_obj_free(ptr);
+}
+
+static inline void free_user_data(void *data, free_fnc_t data_free)
+{
+    if (data && ptr2memory_mode(data_free) == EXTERNAL_FREE_AFTER_USE)
+        data_free(data);
+}
+
+int mqtt_ng_publish_enqueue(struct mqtt_ng_client *client,
+                            char *topic,
+                            free_fnc_t topic_free,
+                            void *msg,
+                            free_fnc_t msg_free,
+                            size_t msg_len,
+                            uint8_t publish_flags,
+                            void *msg_ctx)
+{
+    const struct mqtt_wss_allocator *alloc = __atomic_load_n(&client->main_buffer.alloc, __ATOMIC_RELAXED);
+    size_t topic_len = topic_free ? 0 : strlen(topic) + 1;
+    struct publish_queue_node *node = mw_obj_malloc(alloc, sizeof(*node) + topic_len);
+    if (!node) {
+        mws_error(client->log, "OOM allocating publish queue node");
+        return MQTT_NG_MSGGEN_BUFFER_OOM;
+    }
+
+    // caller might reuse its buffers right after we return
+    if (!msg_free && msg_len) {
+        void *copy = mw_obj_malloc(alloc, msg_len);
+        if (!copy) {
+            mws_error(client->log, "OOM copying message to publish queue");
+            mw_obj_free(node);
+            return MQTT_NG_MSGGEN_BUFFER_OOM;
+        }
+        memcpy(copy, msg, msg_len);
+        msg = copy;
+        msg_free = publish_queue_free_copy;
+    }
+
+    if (topic_len) {
+        memcpy(node + 1, topic, topic_len);
+        node->user_topic = NULL;
+        node->user_topic_free = NULL;
+        topic = (char *)(node + 1);
+    } else {
+        node->user_topic = topic;
+        node->user_topic_free = topic_free;
+    }
+
+    memset(&node->entry, 0, sizeof(node->entry));
+    node->entry.topic = topic;
+    node->entry.msg = msg;
+    node->entry.msg_free = msg_free;
+    node->entry.msg_len = msg_len;
+    node->entry.qos = (publish_flags >> MQTT_PUBLISH_FLAG_QOS_BITSHIFT) & 0x3;
+    node->entry.retain = publish_flags & MQTT_PUBLISH_FLAG_RETAIN;
+    node->entry.dup = !!(publish_flags & MQTT_PUBLISH_FLAG_DUP);
+    node->msg_ctx = msg_ctx;
+
+    publish_queue_push(&client->publish_queue, node);
+    return MQTT_NG_MSGGEN_OK;
+}
+
+static void publish_queue_node_done(struct mqtt_ng_client *client, struct publish_queue_node *node)
+{
+    struct mqtt_publish_batch_entry *entry = &node->entry;
+
+    // on success message belongs to transaction buffer now
+    if (entry->rc)
+        free_user_data(entry->msg, entry->msg_free);
+    free_user_data(node->user_topic, node->user_topic_free);
+
+    if (client->publish_queued_callback)
+        client->publish_queued_callback(client->publish_queued_ctx, node->msg_ctx, entry->packet_id, entry->rc);
+
+    mw_obj_free(node);
+}
+
+#define PUBLISH_QUEUE_BATCH 64
+static void publish_queue_drain(struct mqtt_ng_client *client)
+{
+    struct publish_queue_node *nodes[PUBLISH_QUEUE_BATCH];
+    struct mqtt_publish_batch_entry entries[PUBLISH_QUEUE_BATCH];
+    size_t count;
+
+    do {
+        for (count = 0; count < PUBLISH_QUEUE_BATCH; count++) {
+            if (!(nodes[count] = publish_queue_pop(&client->publish_queue)))
+                break;
+            entries[count] = nodes[count]->entry;
+        }
+        if (!count)
+            return;
+
+        mqtt_ng_publish_batch(client, entries, count);
+
+        for (size_t i = 0; i < count; i++) {
+            nodes[i]->entry.packet_id = entries[i].packet_id;
+            nodes[i]->entry.rc = entries[i].rc;
+            publish_queue_node_done(client, nodes[i]);
+        }
+    } while (count == PUBLISH_QUEUE_BATCH);
+}
+
+static void publish_queue_destroy(struct mqtt_ng_client *client)
+{
+    struct publish_queue_node *node;
+    while ((node = publish_queue_pop(&client->publish_queue))) {
+        node->entry.rc = MQTT_NG_MSGGEN_USER_ERROR;
+        publish_queue_node_done(client, node);
+    }
+}
+
+static inline size_t mqtt_ng_subscribe_size(struct mqtt_sub *subs, size_t sub_count, size_t props_len)
+{
+    size_t len = 2 /* Packet Identifier */ + 1 /* Properties Length */ + props_len;
+    len += sub_count * (2 /* topic filter string length */ + 1 /* [MQTT-3.8.3.1] Subscription Options Byte */);
+
+    for (size_t i = 0; i < sub_count; i++) {
+        len += strlen(subs[i].topic);
+    }
+    return len;
+}
+
+// sub_id 0 means no Subscription Identifier
+int mqtt_ng_generate_subscribe(struct transaction_buffer *trx_buf, mqtt_wss_log_ctx_t log_ctx, struct mqtt_sub *subs, size_t sub_count, uint32_t sub_id)
+{
+    // >> START THE RODEO <<
+    transaction_buffer_transaction_start(trx_buf);
+
+    // [MQTT-3.8.2.1.2] Subscription Identifier
+    char sub_id_vbi[MQTT_VBI_MAXBYTES];
+    size_t props_len = sub_id ? 1 + uint32_to_mqtt_vbi(sub_id, sub_id_vbi) : 0;
+
+    // Calculate the resulting message size sans fixed MQTT header
+    size_t size = mqtt_ng_subscribe_size(subs, sub_count, props_len);
 
     // Start generating the message
     struct buffer_fragment *frag = NULL;
@@ -1220,7 +2456,7 @@ int mqtt_ng_generate_subscribe(struct transaction_buffer *trx_buf, mqtt_wss_log_
     ret = frag;
 
     // MQTT Fixed Header
-    size_t needed_bytes = 1 /* Packet type */ + MQTT_VARSIZE_INT_BYTES(size) + 3 /*Packet ID + Property Length*/;
+    size_t needed_bytes = 1 /* Packet type */ + MQTT_VARSIZE_INT_BYTES(size) + 3 /*Packet ID + Property Length*/ + props_len;
     CHECK_BYTES_AVAILABLE(&trx_buf->hdr_buffer, needed_bytes, goto fail_rollback);
 
     *WRITE_POS(frag) = (MQTT_CPT_SUBSCRIBE << 4) | 0x2 /* [MQTT-3.8.1-1] */;
@@ -1229,17 +2465,26 @@ int mqtt_ng_generate_subscribe(struct transaction_buffer *trx_buf, mqtt_wss_log_
 
     // MQTT Variable Header
     // [MQTT-3.8.2] PacketID
-    ret->packet_id = get_unused_packet_id();
+    ret->packet_id = get_unused_packet_id(trx_buf, log_ctx);
+    if (!ret->packet_id)
+        goto fail_rollback;
     PACK_2B_INT(&trx_buf->hdr_buffer, ret->packet_id, frag);
 
-    // [MQTT-3.8.2.1.1] Property Length // TODO for now fixed 0
-    *WRITE_POS(frag) = 0;
+    // [MQTT-3.8.2.1.1] Property Length
+    *WRITE_POS(frag) = props_len;
     DATA_ADVANCE(&trx_buf->hdr_buffer, 1, frag);
 
+    if (sub_id) {
+        *WRITE_POS(frag) = MQTT_PROP_SUB_IDENTIFIER;
+        DATA_ADVANCE(&trx_buf->hdr_buffer, 1, frag);
+        memcpy(WRITE_POS(frag), sub_id_vbi, props_len - 1);
+        DATA_ADVANCE(&trx_buf->hdr_buffer, props_len - 1, frag);
+    }
+
     for (size_t i = 0; i < sub_count; i++) {
         BUFFER_TRANSACTION_NEW_FRAG(&trx_buf->hdr_buffer, 0, frag, goto fail_rollback);
         PACK_2B_INT(&trx_buf->hdr_buffer, strlen(subs[i].topic), frag);
-        if (_optimized_add(&trx_buf->hdr_buffer, log_ctx, subs[i].topic, strlen(subs[i].topic), subs[i].topic_free, &frag))
+        if (_optimized_add(&trx_buf->hdr_buffer, trx_buf->alloc, log_ctx, subs[i].topic, strlen(subs[i].topic), subs[i].topic_free, &frag))
             goto fail_rollback;
         BUFFER_TRANSACTION_NEW_FRAG(&trx_buf->hdr_buffer, 0, frag, goto fail_rollback);
         *WRITE_POS(frag) = subs[i].options;
@@ -1247,6 +2492,7 @@ int mqtt_ng_generate_subscribe(struct transaction_buffer *trx_buf, mqtt_wss_log_
     }
 
     trx_buf->hdr_buffer.tail_frag->flags |= BUFFER_FRAG_MQTT_PACKET_TAIL;
+    inflight_add(trx_buf, ret);
     transaction_buffer_transaction_commit(trx_buf);
     return MQTT_NG_MSGGEN_OK;
 fail_rollback:
@@ -1256,7 +2502,38 @@ fail_rollback:
 
 int mqtt_ng_subscribe(struct mqtt_ng_client *client, struct mqtt_sub *subs, size_t sub_count)
 {
-    TRY_GENERATE_MESSAGE(mqtt_ng_generate_subscribe, client, subs, sub_count);
+    TRY_GENERATE_MESSAGE(mqtt_ng_generate_subscribe, client, subs, sub_count, 0);
+}
+
+static int subscribe_route_generate(struct mqtt_ng_client *client, struct mqtt_sub *sub, uint32_t sub_id)
+{
+    TRY_GENERATE_MESSAGE(mqtt_ng_generate_subscribe, client, sub, 1, sub_id);
+}
+
+int mqtt_ng_subscribe_route(struct mqtt_ng_client *client, struct mqtt_sub *sub, mqtt_ng_msg_borrowed_callback_t callback, void *ctx)
+{
+    // route has to exist before SUBSCRIBE is queued (it carries its Subscription Identifier)
+    // so if that fails the previous state of the router is restored
+    mqtt_ng_route_callback_t old_callback = NULL;
+    void *old_ctx = NULL;
+    uint32_t old_id = mqtt_ng_router_lookup(client->router, sub->topic, &old_callback, &old_ctx);
+
+    uint32_t sub_id = mqtt_ng_router_add(client->router, sub->topic, callback, ctx);
+    if (!sub_id) {
+        mws_error(client->log, "Couldn't add route for topic filter \"%s\"", sub->topic);
+        return MQTT_NG_MSGGEN_USER_ERROR;
+    }
+
+    // without Subscription Identifiers the topic is matched against the filters
+    int rc = subscribe_route_generate(client, sub, client->sub_ids_available ? sub_id : 0);
+    if (rc == MQTT_NG_MSGGEN_OK)
+        return rc;
+
+    if (old_id)
+        mqtt_ng_router_add(client->router, sub->topic, old_callback, old_ctx);
+    else
+        mqtt_ng_router_remove(client->router, sub_id);
+    return rc;
 }
 
 int mqtt_ng_generate_disconnect(struct transaction_buffer *trx_buf, mqtt_wss_log_ctx_t log_ctx, uint8_t reason_code)
@@ -1365,13 +2642,35 @@ int mqtt_ng_ping(struct mqtt_ng_client *client)
 #define MQTT_NG_CLIENT_OOM                    -4
 #define MQTT_NG_CLIENT_INTERNAL_ERROR         -5
 
+static inline size_t rx_data_available(struct mqtt_ng_rx_data *data)
+{
+    size_t avail = rbuf_bytes_available(data->buf);
+    return MIN(avail, data->limit);
+}
+
+static inline size_t rx_data_pop(struct mqtt_ng_rx_data *data, char *dst, size_t len)
+{
+    size_t popped = rbuf_pop(data->buf, dst, MIN(len, data->limit));
+    if (data->limit != RX_DATA_UNLIMITED)
+        data->limit -= popped;
+    return popped;
+}
+
+static inline void rx_data_bump_tail(struct mqtt_ng_rx_data *data, size_t len)
+{
+    len = MIN(len, rx_data_available(data));
+    rbuf_bump_tail(data->buf, len);
+    if (data->limit != RX_DATA_UNLIMITED)
+        data->limit -= len;
+}
+
 #define BUF_READ_CHECK_AT_LEAST(buf, x)                 \
-    if (rbuf_bytes_available(buf) < (x)) \
+    if (rx_data_available(buf) < (x)) \
         return MQTT_NG_CLIENT_NEED_MORE_BYTES;
 
 #define vbi_parser_reset_ctx(ctx) memset(ctx, 0, sizeof(struct mqtt_vbi_parser_ctx))
 
-static int vbi_parser_parse(struct mqtt_vbi_parser_ctx *ctx, rbuf_t data, mqtt_wss_log_ctx_t log)
+static int vbi_parser_parse(struct mqtt_vbi_parser_ctx *ctx, struct mqtt_ng_rx_data *data, mqtt_wss_log_ctx_t log)
 {
     if (ctx->bytes > MQTT_VBI_MAXBYTES - 1) {
         mws_error(log, "MQTT Variable Byte Integer can't be longer than %d bytes", MQTT_VBI_MAXBYTES);
@@ -1380,7 +2679,7 @@ static int vbi_parser_parse(struct mqtt_vbi_parser_ctx *ctx, rbuf_t data, mqtt_w
     if (!ctx->bytes || ctx->data[ctx->bytes-1] & MQTT_VBI_CONTINUATION_FLAG) {
         BUF_READ_CHECK_AT_LEAST(data, 1);
         ctx->bytes++;
-        rbuf_pop(data, &ctx->data[ctx->bytes-1], 1);
+        rx_data_pop(data, &ctx->data[ctx->bytes-1], 1);
         if ( ctx->data[ctx->bytes-1] & MQTT_VBI_CONTINUATION_FLAG )
             return MQTT_NG_CLIENT_OK_CALL_AGAIN;
     }
@@ -1393,21 +2692,23 @@ static int vbi_parser_parse(struct mqtt_vbi_parser_ctx *ctx, rbuf_t data, mqtt_w
     return MQTT_NG_CLIENT_PARSE_DONE;
 }
 
+static void mqtt_properties_parser_ctx_destroy(struct mqtt_properties_parser_ctx *ctx)
+{
+    if (ctx->props != ctx->props_inline)
+        mw_free(ctx->props);
+    mw_free(ctx->arena);
+}
+
 static void mqtt_properties_parser_ctx_reset(struct mqtt_properties_parser_ctx *ctx)
 {
     ctx->state = PROPERTIES_LENGTH;
-    while (ctx->head) {
-        struct mqtt_property *f = ctx->head;
-        ctx->head = ctx->head->next;
-        if (f->type == MQTT_TYPE_STR || f->type == MQTT_TYPE_STR_PAIR)
-            mw_free(f->data.strings[0]);
-        if (f->type == MQTT_TYPE_STR_PAIR)
-            mw_free(f->data.strings[1]);
-        if (f->type == MQTT_TYPE_BIN)
-            mw_free(f->data.bindata);
-        mw_free(f);
-    }
-    ctx->tail = NULL;
+    if (!ctx->props) {
+        ctx->props = ctx->props_inline;
+        ctx->alloc = MQTT_PROPS_INLINE;
+    }
+    ctx->count = 0;
+    memset(ctx->by_id, 0, sizeof(ctx->by_id));
+    ctx->arena_used = 0;
     ctx->properties_length = 0;
     ctx->bytes_consumed = 0;
     vbi_parser_reset_ctx(&ctx->vbi_parser_ctx);
@@ -1419,60 +2720,106 @@ struct mqtt_property_type {
     const char* name;
 };
 
-const struct mqtt_property_type mqtt_property_types[] = {
-    { .id = MQTT_PROP_TOPIC_ALIAS,             .name = MQTT_PROP_TOPIC_ALIAS_NAME,             .datatype = MQTT_TYPE_UINT_16  },
-
-    { .id = MQTT_PROP_PAYLOAD_FMT_INDICATOR,   .name = MQTT_PROP_PAYLOAD_FMT_INDICATOR_NAME,   .datatype = MQTT_TYPE_UINT_8   },
-    { .id = MQTT_PROP_MSG_EXPIRY_INTERVAL,     .name = MQTT_PROP_MSG_EXPIRY_INTERVAL_NAME,     .datatype = MQTT_TYPE_UINT_32  },
-    { .id = MQTT_PROP_CONTENT_TYPE,            .name = MQTT_PROP_CONTENT_TYPE_NAME,            .datatype = MQTT_TYPE_STR      },
-    { .id = MQTT_PROP_RESPONSE_TOPIC,          .name = MQTT_PROP_RESPONSE_TOPIC_NAME,          .datatype = MQTT_TYPE_STR      },
-    { .id = MQTT_PROP_CORRELATION_DATA,        .name = MQTT_PROP_CORRELATION_DATA_NAME,        .datatype = MQTT_TYPE_BIN      },
-    { .id = MQTT_PROP_SUB_IDENTIFIER,          .name = MQTT_PROP_SUB_IDENTIFIER_NAME,          .datatype = MQTT_TYPE_VBI      },
-    { .id = MQTT_PROP_SESSION_EXPIRY_INTERVAL, .name = MQTT_PROP_SESSION_EXPIRY_INTERVAL_NAME, .datatype = MQTT_TYPE_UINT_32  },
-    { .id = MQTT_PROP_ASSIGNED_CLIENT_ID,      .name = MQTT_PROP_ASSIGNED_CLIENT_ID_NAME,      .datatype = MQTT_TYPE_STR      },
-    { .id = MQTT_PROP_SERVER_KEEP_ALIVE,       .name = MQTT_PROP_SERVER_KEEP_ALIVE_NAME,       .datatype = MQTT_TYPE_UINT_16  },
-    { .id = MQTT_PROP_AUTH_METHOD,             .name = MQTT_PROP_AUTH_METHOD_NAME,             .datatype = MQTT_TYPE_STR      },
-    { .id = MQTT_PROP_AUTH_DATA,               .name = MQTT_PROP_AUTH_DATA_NAME,               .datatype = MQTT_TYPE_BIN      },
-    { .id = MQTT_PROP_REQ_PROBLEM_INFO,        .name = MQTT_PROP_REQ_PROBLEM_INFO_NAME,        .datatype = MQTT_TYPE_UINT_8   },
-    { .id = MQTT_PROP_WILL_DELAY_INTERVAL,     .name = MQTT_PROP_WIIL_DELAY_INTERVAL_NAME,     .datatype = MQTT_TYPE_UINT_32  },
-    { .id = MQTT_PROP_REQ_RESP_INFORMATION,    .name = MQTT_PROP_REQ_RESP_INFORMATION_NAME,    .datatype = MQTT_TYPE_UINT_8   },
-    { .id = MQTT_PROP_RESP_INFORMATION,        .name = MQTT_PROP_RESP_INFORMATION_NAME,        .datatype = MQTT_TYPE_STR      },
-    { .id = MQTT_PROP_SERVER_REF,              .name = MQTT_PROP_SERVER_REF_NAME,              .datatype = MQTT_TYPE_STR      },
-    { .id = MQTT_PROP_REASON_STR,              .name = MQTT_PROP_REASON_STR_NAME,              .datatype = MQTT_TYPE_STR      },
-    { .id = MQTT_PROP_RECEIVE_MAX,             .name = MQTT_PROP_RECEIVE_MAX_NAME,             .datatype = MQTT_TYPE_UINT_16  },
-    { .id = MQTT_PROP_TOPIC_ALIAS_MAX,         .name = MQTT_PROP_TOPIC_ALIAS_MAX_NAME,         .datatype = MQTT_TYPE_UINT_16  },
-    // MQTT_PROP_TOPIC_ALIAS is first as it is most often used
-    { .id = MQTT_PROP_MAX_QOS,                 .name = MQTT_PROP_MAX_QOS_NAME,                 .datatype = MQTT_TYPE_UINT_8   },
-    { .id = MQTT_PROP_RETAIN_AVAIL,            .name = MQTT_PROP_RETAIN_AVAIL_NAME,            .datatype = MQTT_TYPE_UINT_8   },
-    { .id = MQTT_PROP_USR,                     .name = MQTT_PROP_USR_NAME,                     .datatype = MQTT_TYPE_STR_PAIR },
-    { .id = MQTT_PROP_MAX_PKT_SIZE,            .name = MQTT_PROP_MAX_PKT_SIZE_NAME,            .datatype = MQTT_TYPE_UINT_32  },
-    { .id = MQTT_PROP_WILDCARD_SUB_AVAIL,      .name = MQTT_PROP_WILDCARD_SUB_AVAIL_NAME,      .datatype = MQTT_TYPE_UINT_8   },
-    { .id = MQTT_PROP_SUB_ID_AVAIL,            .name = MQTT_PROP_SUB_ID_AVAIL_NAME,            .datatype = MQTT_TYPE_UINT_8   },
-    { .id = MQTT_PROP_SHARED_SUB_AVAIL,        .name = MQTT_PROP_SHARED_SUB_AVAIL_NAME,        .datatype = MQTT_TYPE_UINT_8   },
-    { .id = 0,                                 .name = NULL,                                   .datatype = MQTT_TYPE_UNKNOWN  }
+// indexed by property id
+const struct mqtt_property_type mqtt_property_types[MQTT_PROP_ID_MAX + 1] = {
+    [MQTT_PROP_TOPIC_ALIAS] =           { .id = MQTT_PROP_TOPIC_ALIAS,             .name = MQTT_PROP_TOPIC_ALIAS_NAME,             .datatype = MQTT_TYPE_UINT_16  },
+    [MQTT_PROP_PAYLOAD_FMT_INDICATOR] = { .id = MQTT_PROP_PAYLOAD_FMT_INDICATOR,   .name = MQTT_PROP_PAYLOAD_FMT_INDICATOR_NAME,   .datatype = MQTT_TYPE_UINT_8   },
+    [MQTT_PROP_MSG_EXPIRY_INTERVAL] =   { .id = MQTT_PROP_MSG_EXPIRY_INTERVAL,     .name = MQTT_PROP_MSG_EXPIRY_INTERVAL_NAME,     .datatype = MQTT_TYPE_UINT_32  },
+    [MQTT_PROP_CONTENT_TYPE] =          { .id = MQTT_PROP_CONTENT_TYPE,            .name = MQTT_PROP_CONTENT_TYPE_NAME,            .datatype = MQTT_TYPE_STR      },
+    [MQTT_PROP_RESPONSE_TOPIC] =        { .id = MQTT_PROP_RESPONSE_TOPIC,          .name = MQTT_PROP_RESPONSE_TOPIC_NAME,          .datatype = MQTT_TYPE_STR      },
+    [MQTT_PROP_CORRELATION_DATA] =      { .id = MQTT_PROP_CORRELATION_DATA,        .name = MQTT_PROP_CORRELATION_DATA_NAME,        .datatype = MQTT_TYPE_BIN      },
+    [MQTT_PROP_SUB_IDENTIFIER] =        { .id = MQTT_PROP_SUB_IDENTIFIER,          .name = MQTT_PROP_SUB_IDENTIFIER_NAME,          .datatype = MQTT_TYPE_VBI      },
+    [MQTT_PROP_SESSION_EXPIRY_INTERVAL] = { .id = MQTT_PROP_SESSION_EXPIRY_INTERVAL, .name = MQTT_PROP_SESSION_EXPIRY_INTERVAL_NAME, .datatype = MQTT_TYPE_UINT_32  },
+    [MQTT_PROP_ASSIGNED_CLIENT_ID] =    { .id = MQTT_PROP_ASSIGNED_CLIENT_ID,      .name = MQTT_PROP_ASSIGNED_CLIENT_ID_NAME,      .datatype = MQTT_TYPE_STR      },
+    [MQTT_PROP_SERVER_KEEP_ALIVE] =     { .id = MQTT_PROP_SERVER_KEEP_ALIVE,       .name = MQTT_PROP_SERVER_KEEP_ALIVE_NAME,       .datatype = MQTT_TYPE_UINT_16  },
+    [MQTT_PROP_AUTH_METHOD] =           { .id = MQTT_PROP_AUTH_METHOD,             .name = MQTT_PROP_AUTH_METHOD_NAME,             .datatype = MQTT_TYPE_STR      },
+    [MQTT_PROP_AUTH_DATA] =             { .id = MQTT_PROP_AUTH_DATA,               .name = MQTT_PROP_AUTH_DATA_NAME,               .datatype = MQTT_TYPE_BIN      },
+    [MQTT_PROP_REQ_PROBLEM_INFO] =      { .id = MQTT_PROP_REQ_PROBLEM_INFO,        .name = MQTT_PROP_REQ_PROBLEM_INFO_NAME,        .datatype = MQTT_TYPE_UINT_8   },
+    [MQTT_PROP_WILL_DELAY_INTERVAL] =   { .id = MQTT_PROP_WILL_DELAY_INTERVAL,     .name = MQTT_PROP_WIIL_DELAY_INTERVAL_NAME,     .datatype = MQTT_TYPE_UINT_32  },
+    [MQTT_PROP_REQ_RESP_INFORMATION] =  { .id = MQTT_PROP_REQ_RESP_INFORMATION,    .name = MQTT_PROP_REQ_RESP_INFORMATION_NAME,    .datatype = MQTT_TYPE_UINT_8   },
+    [MQTT_PROP_RESP_INFORMATION] =      { .id = MQTT_PROP_RESP_INFORMATION,        .name = MQTT_PROP_RESP_INFORMATION_NAME,        .datatype = MQTT_TYPE_STR      },
+    [MQTT_PROP_SERVER_REF] =            { .id = MQTT_PROP_SERVER_REF,              .name = MQTT_PROP_SERVER_REF_NAME,              .datatype = MQTT_TYPE_STR      },
+    [MQTT_PROP_REASON_STR] =            { .id = MQTT_PROP_REASON_STR,              .name = MQTT_PROP_REASON_STR_NAME,              .datatype = MQTT_TYPE_STR      },
+    [MQTT_PROP_RECEIVE_MAX] =           { .id = MQTT_PROP_RECEIVE_MAX,             .name = MQTT_PROP_RECEIVE_MAX_NAME,             .datatype = MQTT_TYPE_UINT_16  },
+    [MQTT_PROP_TOPIC_ALIAS_MAX] =       { .id = MQTT_PROP_TOPIC_ALIAS_MAX,         .name = MQTT_PROP_TOPIC_ALIAS_MAX_NAME,         .datatype = MQTT_TYPE_UINT_16  },
+    [MQTT_PROP_MAX_QOS] =               { .id = MQTT_PROP_MAX_QOS,                 .name = MQTT_PROP_MAX_QOS_NAME,                 .datatype = MQTT_TYPE_UINT_8   },
+    [MQTT_PROP_RETAIN_AVAIL] =          { .id = MQTT_PROP_RETAIN_AVAIL,            .name = MQTT_PROP_RETAIN_AVAIL_NAME,            .datatype = MQTT_TYPE_UINT_8   },
+    [MQTT_PROP_USR] =                   { .id = MQTT_PROP_USR,                     .name = MQTT_PROP_USR_NAME,                     .datatype = MQTT_TYPE_STR_PAIR },
+    [MQTT_PROP_MAX_PKT_SIZE] =          { .id = MQTT_PROP_MAX_PKT_SIZE,            .name = MQTT_PROP_MAX_PKT_SIZE_NAME,            .datatype = MQTT_TYPE_UINT_32  },
+    [MQTT_PROP_WILDCARD_SUB_AVAIL] =    { .id = MQTT_PROP_WILDCARD_SUB_AVAIL,      .name = MQTT_PROP_WILDCARD_SUB_AVAIL_NAME,      .datatype = MQTT_TYPE_UINT_8   },
+    [MQTT_PROP_SUB_ID_AVAIL] =          { .id = MQTT_PROP_SUB_ID_AVAIL,            .name = MQTT_PROP_SUB_ID_AVAIL_NAME,            .datatype = MQTT_TYPE_UINT_8   },
+    [MQTT_PROP_SHARED_SUB_AVAIL] =      { .id = MQTT_PROP_SHARED_SUB_AVAIL,        .name = MQTT_PROP_SHARED_SUB_AVAIL_NAME,        .datatype = MQTT_TYPE_UINT_8   },
 };
 
-static int get_property_type_by_id(uint8_t property_id) {
-    for (int i = 0; mqtt_property_types[i].datatype != MQTT_TYPE_UNKNOWN; i++) {
-        if (mqtt_property_types[i].id == property_id)
-            return mqtt_property_types[i].datatype;
-    }
-    return MQTT_TYPE_UNKNOWN;
+static inline int get_property_type_by_id(uint8_t property_id) {
+    if (property_id > MQTT_PROP_ID_MAX)
+        return MQTT_TYPE_UNKNOWN;
+    return mqtt_property_types[property_id].datatype;
 }
 
-struct mqtt_property *get_property_by_id(struct mqtt_property *props, uint8_t property_id)
+// returns first property with the id (use props array for properties allowed multiple times)
+struct mqtt_property *get_property_by_id(struct mqtt_properties_parser_ctx *ctx, uint8_t property_id)
 {
-    while (props) {
-        if (props->id == property_id) {
-            return props;
-        }
-        props = props->next;
-    }
-    return NULL;
+    if (property_id > MQTT_PROP_ID_MAX || !ctx->by_id[property_id])
+        return NULL;
+    return &ctx->props[ctx->by_id[property_id] - 1];
+}
+
+static int properties_grow(struct mqtt_properties_parser_ctx *ctx)
+{
+    size_t alloc = ctx->alloc * 2;
+    struct mqtt_property *props;
+    if (ctx->props == ctx->props_inline) {
+        props = mw_malloc(alloc * sizeof(struct mqtt_property));
+        if (props)
+            memcpy(props, ctx->props_inline, sizeof(ctx->props_inline));
+    } else
+        props = mw_realloc(ctx->props, alloc * sizeof(struct mqtt_property));
+    if (!props)
+        return 1;
+    ctx->props = props;
+    ctx->alloc = alloc;
+    return 0;
+}
+
+// every string takes at least 3 bytes of property array (id and length)
+// so there is at most that many 0x00 terminators to add
+#define PROPERTIES_ARENA_SIZE(properties_length) ((properties_length) + (properties_length) / 3 + 1)
+static int properties_arena_reserve(struct mqtt_properties_parser_ctx *ctx)
+{
+    size_t size = PROPERTIES_ARENA_SIZE(ctx->properties_length);
+    if (ctx->arena_size >= size)
+        return 0;
+    char *arena = mw_realloc(ctx->arena, size);
+    if (!arena)
+        return 1;
+    ctx->arena = arena;
+    ctx->arena_size = size;
+    return 0;
+}
+
+// returns NULL if data don't fit in the property array length announced
+static inline char *properties_arena_alloc(struct mqtt_properties_parser_ctx *ctx, size_t size)
+{
+    if (ctx->arena_used + size > PROPERTIES_ARENA_SIZE(ctx->properties_length))
+        return NULL;
+    char *ptr = &ctx->arena[ctx->arena_used];
+    ctx->arena_used += size;
+    return ptr;
 }
 
+#define PROP_TAIL(ctx) (&(ctx)->props[(ctx)->count - 1])
+
+// property array length (not the arena size) is what limits the data
+// malformed lengths must not make parser consume bytes after the array
+#define PROPERTIES_CHECK_LEFT(ctx, len, log) \
+    if ((ctx)->bytes_consumed - (ctx)->vbi_length + (len) > (ctx)->properties_length) { \
+        mws_error(log, "Property (id %d) exceeds property array length %u", (int)PROP_TAIL(ctx)->id, (unsigned)(ctx)->properties_length); \
+        return MQTT_NG_CLIENT_PROTOCOL_ERROR; \
+    }
+
 // Parses [MQTT-2.2.2]
-static int parse_properties_array(struct mqtt_properties_parser_ctx *ctx, rbuf_t data, mqtt_wss_log_ctx_t log)
+static int parse_properties_array(struct mqtt_properties_parser_ctx *ctx, struct mqtt_ng_rx_data *data, mqtt_wss_log_ctx_t log)
 {
     int rc;
     switch (ctx->state) {
@@ -1484,27 +2831,26 @@ static int parse_properties_array(struct mqtt_properties_parser_ctx *ctx, rbuf_t
                 ctx->vbi_length = ctx->vbi_parser_ctx.bytes;
                 if (!ctx->properties_length)
                     return MQTT_NG_CLIENT_PARSE_DONE;
+                if (properties_arena_reserve(ctx))
+                    return MQTT_NG_CLIENT_OOM;
                 ctx->state = PROPERTY_CREATE;
                 break;
             }
             return rc;
         case PROPERTY_CREATE:
             BUF_READ_CHECK_AT_LEAST(data, 1);
-            struct mqtt_property *prop = mw_calloc(1, sizeof(struct mqtt_property));
-            if (ctx->head == NULL) {
-                ctx->head = prop;
-                ctx->tail = prop;
-            } else {
-                ctx->tail->next = prop;
-                ctx->tail = ctx->tail->next;
-            }
+            if (ctx->count == ctx->alloc && properties_grow(ctx))
+                return MQTT_NG_CLIENT_OOM;
+            memset(&ctx->props[ctx->count++], 0, sizeof(struct mqtt_property));
             ctx->state = PROPERTY_ID;
             /* FALLTHROUGH */
         case PROPERTY_ID:
-            rbuf_pop(data, (char*)&ctx->tail->id, 1);
+            rx_data_pop(data, (char*)&PROP_TAIL(ctx)->id, 1);
             ctx->bytes_consumed += 1;
-            ctx->tail->type = get_property_type_by_id(ctx->tail->id);
-            switch (ctx->tail->type) {
+            PROP_TAIL(ctx)->type = get_property_type_by_id(PROP_TAIL(ctx)->id);
+            if (PROP_TAIL(ctx)->type != MQTT_TYPE_UNKNOWN && !ctx->by_id[PROP_TAIL(ctx)->id])
+                ctx->by_id[PROP_TAIL(ctx)->id] = ctx->count;
+            switch (PROP_TAIL(ctx)->type) {
                 case MQTT_TYPE_UINT_16:
                     ctx->state = PROPERTY_TYPE_UINT16;
                     break;
@@ -1526,16 +2872,17 @@ static int parse_properties_array(struct mqtt_properties_parser_ctx *ctx, rbuf_t
                     ctx->state = PROPERTY_TYPE_STR_BIN_LEN;
                     break;
                 default:
-                    mws_error(log, "Unsupported property type %d for property id %d.", (int)ctx->tail->type, (int)ctx->tail->id);
+                    mws_error(log, "Unsupported property type %d for property id %d.", (int)PROP_TAIL(ctx)->type, (int)PROP_TAIL(ctx)->id);
                     return MQTT_NG_CLIENT_PROTOCOL_ERROR;
             }
             break;
         case PROPERTY_TYPE_STR_BIN_LEN:
+            PROPERTIES_CHECK_LEFT(ctx, sizeof(uint16_t), log);
             BUF_READ_CHECK_AT_LEAST(data, sizeof(uint16_t));
-            rbuf_pop(data, (char*)&ctx->tail->bindata_len, sizeof(uint16_t));
-            ctx->tail->bindata_len = be16toh(ctx->tail->bindata_len);
+            rx_data_pop(data, (char*)&PROP_TAIL(ctx)->bindata_len, sizeof(uint16_t));
+            PROP_TAIL(ctx)->bindata_len = be16toh(PROP_TAIL(ctx)->bindata_len);
             ctx->bytes_consumed += 2;
-            switch (ctx->tail->type) {
+            switch (PROP_TAIL(ctx)->type) {
                 case MQTT_TYPE_BIN:
                     ctx->state = PROPERTY_TYPE_BIN;
                     break;
@@ -1544,56 +2891,70 @@ static int parse_properties_array(struct mqtt_properties_parser_ctx *ctx, rbuf_t
                     ctx->state = PROPERTY_TYPE_STR;
                     break;
                 default:
-                    mws_error(log, "Unexpected datatype in PROPERTY_TYPE_STR_BIN_LEN %d", (int)ctx->tail->type);
+                    mws_error(log, "Unexpected datatype in PROPERTY_TYPE_STR_BIN_LEN %d", (int)PROP_TAIL(ctx)->type);
                     return MQTT_NG_CLIENT_INTERNAL_ERROR;
             }
             break;
         case PROPERTY_TYPE_STR:
-            BUF_READ_CHECK_AT_LEAST(data, ctx->tail->bindata_len);
-            ctx->tail->data.strings[ctx->str_idx] = mw_malloc(ctx->tail->bindata_len + 1);
-            rbuf_pop(data, ctx->tail->data.strings[ctx->str_idx], ctx->tail->bindata_len);
-            ctx->tail->data.strings[ctx->str_idx][ctx->tail->bindata_len] = 0;
+            PROPERTIES_CHECK_LEFT(ctx, PROP_TAIL(ctx)->bindata_len, log);
+            BUF_READ_CHECK_AT_LEAST(data, PROP_TAIL(ctx)->bindata_len);
+            PROP_TAIL(ctx)->data.strings[ctx->str_idx] = properties_arena_alloc(ctx, PROP_TAIL(ctx)->bindata_len + 1);
+            if (!PROP_TAIL(ctx)->data.strings[ctx->str_idx]) {
+                mws_error(log, "Property string longer than property array");
+                return MQTT_NG_CLIENT_PROTOCOL_ERROR;
+            }
+            rx_data_pop(data, PROP_TAIL(ctx)->data.strings[ctx->str_idx], PROP_TAIL(ctx)->bindata_len);
+            PROP_TAIL(ctx)->data.strings[ctx->str_idx][PROP_TAIL(ctx)->bindata_len] = 0;
             ctx->str_idx++;
-            ctx->bytes_consumed += ctx->tail->bindata_len;
-            if (ctx->tail->type == MQTT_TYPE_STR_PAIR && ctx->str_idx < 2) {
+            ctx->bytes_consumed += PROP_TAIL(ctx)->bindata_len;
+            if (PROP_TAIL(ctx)->type == MQTT_TYPE_STR_PAIR && ctx->str_idx < 2) {
                 ctx->state = PROPERTY_TYPE_STR_BIN_LEN;
                 break;
             }
             ctx->state = PROPERTY_NEXT;
             break;
         case PROPERTY_TYPE_BIN:
-            BUF_READ_CHECK_AT_LEAST(data, ctx->tail->bindata_len);
-            ctx->tail->data.bindata = mw_malloc(ctx->tail->bindata_len);
-            rbuf_pop(data, ctx->tail->data.bindata, ctx->tail->bindata_len);
-            ctx->bytes_consumed += ctx->tail->bindata_len;
+            PROPERTIES_CHECK_LEFT(ctx, PROP_TAIL(ctx)->bindata_len, log);
+            BUF_READ_CHECK_AT_LEAST(data, PROP_TAIL(ctx)->bindata_len);
+            PROP_TAIL(ctx)->data.bindata = properties_arena_alloc(ctx, PROP_TAIL(ctx)->bindata_len);
+            if (!PROP_TAIL(ctx)->data.bindata) {
+                mws_error(log, "Property binary data longer than property array");
+                return MQTT_NG_CLIENT_PROTOCOL_ERROR;
+            }
+            rx_data_pop(data, PROP_TAIL(ctx)->data.bindata, PROP_TAIL(ctx)->bindata_len);
+            ctx->bytes_consumed += PROP_TAIL(ctx)->bindata_len;
             ctx->state = PROPERTY_NEXT;
             break;
         case PROPERTY_TYPE_VBI:
             rc = vbi_parser_parse(&ctx->vbi_parser_ctx, data, log);
             if (rc == MQTT_NG_CLIENT_PARSE_DONE) {
-                ctx->tail->data.uint32 = ctx->vbi_parser_ctx.result;
+                PROPERTIES_CHECK_LEFT(ctx, ctx->vbi_parser_ctx.bytes, log);
+                PROP_TAIL(ctx)->data.uint32 = ctx->vbi_parser_ctx.result;
                 ctx->bytes_consumed += ctx->vbi_parser_ctx.bytes;
                 ctx->state = PROPERTY_NEXT;
                 break;
             }
             return rc;
         case PROPERTY_TYPE_UINT8:
+            PROPERTIES_CHECK_LEFT(ctx, sizeof(uint8_t), log);
             BUF_READ_CHECK_AT_LEAST(data, sizeof(uint8_t));
-            rbuf_pop(data, (char*)&ctx->tail->data.uint8, sizeof(uint8_t));
+            rx_data_pop(data, (char*)&PROP_TAIL(ctx)->data.uint8, sizeof(uint8_t));
             ctx->bytes_consumed += sizeof(uint8_t);
             ctx->state = PROPERTY_NEXT;
             break;
         case PROPERTY_TYPE_UINT32:
+            PROPERTIES_CHECK_LEFT(ctx, sizeof(uint32_t), log);
             BUF_READ_CHECK_AT_LEAST(data, sizeof(uint32_t));
-            rbuf_pop(data, (char*)&ctx->tail->data.uint32, sizeof(uint32_t));
-            ctx->tail->data.uint32 = be32toh(ctx->tail->data.uint32);
+            rx_data_pop(data, (char*)&PROP_TAIL(ctx)->data.uint32, sizeof(uint32_t));
+            PROP_TAIL(ctx)->data.uint32 = be32toh(PROP_TAIL(ctx)->data.uint32);
             ctx->bytes_consumed += sizeof(uint32_t);
             ctx->state = PROPERTY_NEXT;
             break;
         case PROPERTY_TYPE_UINT16:
+            PROPERTIES_CHECK_LEFT(ctx, sizeof(uint16_t), log);
             BUF_READ_CHECK_AT_LEAST(data, sizeof(uint16_t));
-            rbuf_pop(data, (char*)&ctx->tail->data.uint16, sizeof(uint16_t));
-            ctx->tail->data.uint16 = be16toh(ctx->tail->data.uint16);
+            rx_data_pop(data, (char*)&PROP_TAIL(ctx)->data.uint16, sizeof(uint16_t));
+            PROP_TAIL(ctx)->data.uint16 = be16toh(PROP_TAIL(ctx)->data.uint16);
             ctx->bytes_consumed += sizeof(uint16_t);
             ctx->state = PROPERTY_NEXT;
             /* FALLTHROUGH */
@@ -1607,19 +2968,64 @@ static int parse_properties_array(struct mqtt_properties_parser_ctx *ctx, rbuf_t
     return MQTT_NG_CLIENT_OK_CALL_AGAIN;
 }
 
+#ifdef TESTS
+static int test_parse_properties(const char *bytes, size_t len, int expected_rc, mqtt_wss_log_ctx_t log)
+{
+    struct mqtt_properties_parser_ctx ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    mqtt_properties_parser_ctx_reset(&ctx);
+    struct mqtt_ng_rx_data data = { .buf = rbuf_create(64), .limit = RX_DATA_UNLIMITED };
+    rbuf_push(data.buf, bytes, len);
+
+    int rc;
+    while ((rc = parse_properties_array(&ctx, &data, log)) == MQTT_NG_CLIENT_OK_CALL_AGAIN)
+        ;
+    mqtt_properties_parser_ctx_destroy(&ctx);
+    rbuf_free(data.buf);
+    return rc != expected_rc;
+}
+
+int test_mqtt_properties_length()
+{
+    // Reason String "abc"
+    static const char valid[] = { 0x06, MQTT_PROP_REASON_STR, 0x00, 0x03, 'a', 'b', 'c' };
+    // string length points beyond the property array (into the payload)
+    static const char str_overrun[] = { 0x06, MQTT_PROP_REASON_STR, 0x00, 0x08, 'a', 'b', 'c', 'p', 'a', 'y', 'l', 'd' };
+    // Receive Maximum (2 bytes) announced with only 1 byte left in the array
+    static const char uint_overrun[] = { 0x02, MQTT_PROP_RECEIVE_MAX, 0x00, 0x10 };
+
+    mqtt_wss_log_ctx_t log = mqtt_wss_log_ctx_create("test_props", NULL);
+    int rc = 0;
+    if (test_parse_properties(valid, sizeof(valid), MQTT_NG_CLIENT_PARSE_DONE, log)) {
+        fprintf(stderr, "parse_properties_array(valid): Failed\n");
+        rc = 1;
+    }
+    if (test_parse_properties(str_overrun, sizeof(str_overrun), MQTT_NG_CLIENT_PROTOCOL_ERROR, log)) {
+        fprintf(stderr, "parse_properties_array(str_overrun): Should return protocol error but didnt\n");
+        rc = 1;
+    }
+    if (test_parse_properties(uint_overrun, sizeof(uint_overrun), MQTT_NG_CLIENT_PROTOCOL_ERROR, log)) {
+        fprintf(stderr, "parse_properties_array(uint_overrun): Should return protocol error but didnt\n");
+        rc = 1;
+    }
+    mqtt_wss_log_ctx_destroy(log);
+    return rc;
+}
+#endif /* TESTS */
+
 static int parse_connack_varhdr(struct mqtt_ng_client *client)
 {
     struct mqtt_ng_parser *parser = &client->parser;
     switch (parser->varhdr_state) {
         case MQTT_PARSE_VARHDR_INITIAL:
-            BUF_READ_CHECK_AT_LEAST(parser->received_data, 2);
-            rbuf_pop(parser->received_data, (char*)&parser->mqtt_packet.connack.flags, 1);
-            rbuf_pop(parser->received_data, (char*)&parser->mqtt_packet.connack.reason_code, 1);
+            BUF_READ_CHECK_AT_LEAST(&parser->received_data, 2);
+            rx_data_pop(&parser->received_data, (char*)&parser->mqtt_packet.connack.flags, 1);
+            rx_data_pop(&parser->received_data, (char*)&parser->mqtt_packet.connack.reason_code, 1);
             parser->varhdr_state = MQTT_PARSE_VARHDR_PROPS;
             mqtt_properties_parser_ctx_reset(&parser->properties_parser);
             break;
         case MQTT_PARSE_VARHDR_PROPS:
-            return parse_properties_array(&parser->properties_parser, parser->received_data, client->log);
+            return parse_properties_array(&parser->properties_parser, &parser->received_data, client->log);
         default:
             ERROR("invalid state for connack varhdr parser");
             return MQTT_NG_CLIENT_INTERNAL_ERROR;
@@ -1637,15 +3043,15 @@ static int parse_disconnect_varhdr(struct mqtt_ng_client *client)
                 parser->mqtt_packet.disconnect.reason_code = 0;
                 return MQTT_NG_CLIENT_PARSE_DONE;
             }
-            BUF_READ_CHECK_AT_LEAST(parser->received_data, 1);
-            rbuf_pop(parser->received_data, (char*)&parser->mqtt_packet.connack.reason_code, 1);
+            BUF_READ_CHECK_AT_LEAST(&parser->received_data, 1);
+            rx_data_pop(&parser->received_data, (char*)&parser->mqtt_packet.connack.reason_code, 1);
             if (parser->mqtt_fixed_hdr_remaining_length == 1)
                 return MQTT_NG_CLIENT_PARSE_DONE;
             parser->varhdr_state = MQTT_PARSE_VARHDR_PROPS;
             mqtt_properties_parser_ctx_reset(&parser->properties_parser);
             break;
         case MQTT_PARSE_VARHDR_PROPS:
-            return parse_properties_array(&parser->properties_parser, parser->received_data, client->log);
+            return parse_properties_array(&parser->properties_parser, &parser->received_data, client->log);
         default:
             ERROR("invalid state for connack varhdr parser");
             return MQTT_NG_CLIENT_INTERNAL_ERROR;
@@ -1658,8 +3064,8 @@ static int parse_puback_varhdr(struct mqtt_ng_client *client)
     struct mqtt_ng_parser *parser = &client->parser;
     switch (parser->varhdr_state) {
         case MQTT_PARSE_VARHDR_INITIAL:
-            BUF_READ_CHECK_AT_LEAST(parser->received_data, 2);
-            rbuf_pop(parser->received_data, (char*)&parser->mqtt_packet.puback.packet_id, 2);
+            BUF_READ_CHECK_AT_LEAST(&parser->received_data, 2);
+            rx_data_pop(&parser->received_data, (char*)&parser->mqtt_packet.puback.packet_id, 2);
             parser->mqtt_packet.puback.packet_id = be16toh(parser->mqtt_packet.puback.packet_id);
             if (parser->mqtt_fixed_hdr_remaining_length < 3) {
                 // [MQTT-3.4.2.1] if length is not big enough for reason code
@@ -1671,8 +3077,8 @@ static int parse_puback_varhdr(struct mqtt_ng_client *client)
             parser->varhdr_state = MQTT_PARSE_VARHDR_OPTIONAL_REASON_CODE;
             /* FALLTHROUGH */
         case MQTT_PARSE_VARHDR_OPTIONAL_REASON_CODE:
-            BUF_READ_CHECK_AT_LEAST(parser->received_data, 1);
-            rbuf_pop(parser->received_data, (char*)&parser->mqtt_packet.puback.reason_code, 1);
+            BUF_READ_CHECK_AT_LEAST(&parser->received_data, 1);
+            rx_data_pop(&parser->received_data, (char*)&parser->mqtt_packet.puback.reason_code, 1);
             // LOL so in CONNACK you have to have 0 byte to
             // signify empty properties list
             // but in PUBACK it can be omitted if remaining length doesn't allow it (sigh)
@@ -1683,7 +3089,7 @@ static int parse_puback_varhdr(struct mqtt_ng_client *client)
             mqtt_properties_parser_ctx_reset(&parser->properties_parser);
             /* FALLTHROUGH */
         case MQTT_PARSE_VARHDR_PROPS:
-            return parse_properties_array(&parser->properties_parser, parser->received_data, client->log);
+            return parse_properties_array(&parser->properties_parser, &parser->received_data, client->log);
         default:
             ERROR("invalid state for puback varhdr parser");
             return MQTT_NG_CLIENT_INTERNAL_ERROR;
@@ -1700,15 +3106,15 @@ static int parse_suback_varhdr(struct mqtt_ng_client *client)
     switch (parser->varhdr_state) {
         case MQTT_PARSE_VARHDR_INITIAL:
             suback->reason_codes = NULL;
-            BUF_READ_CHECK_AT_LEAST(parser->received_data, 2);
-            rbuf_pop(parser->received_data, (char*)&suback->packet_id, 2);
+            BUF_READ_CHECK_AT_LEAST(&parser->received_data, 2);
+            rx_data_pop(&parser->received_data, (char*)&suback->packet_id, 2);
             suback->packet_id = be16toh(suback->packet_id);
             parser->varhdr_state = MQTT_PARSE_VARHDR_PROPS;
             parser->mqtt_parsed_len = 2;
             mqtt_properties_parser_ctx_reset(&parser->properties_parser);
             /* FALLTHROUGH */
         case MQTT_PARSE_VARHDR_PROPS:
-           rc = parse_properties_array(&parser->properties_parser, parser->received_data, client->log);
+           rc = parse_properties_array(&parser->properties_parser, &parser->received_data, client->log);
             if (rc != MQTT_NG_CLIENT_PARSE_DONE) 
                 return rc;
             parser->mqtt_parsed_len += parser->properties_parser.bytes_consumed;
@@ -1718,11 +3124,11 @@ static int parse_suback_varhdr(struct mqtt_ng_client *client)
             parser->varhdr_state = MQTT_PARSE_REASONCODES;
             /* FALLTHROUGH */
         case MQTT_PARSE_REASONCODES:
-            avail = rbuf_bytes_available(parser->received_data);
+            avail = rx_data_available(&parser->received_data);
             if (avail < 1)
                 return MQTT_NG_CLIENT_NEED_MORE_BYTES;
 
-            suback->reason_codes_pending -= rbuf_pop(parser->received_data, (char*)suback->reason_codes, MIN(suback->reason_codes_pending, avail));
+            suback->reason_codes_pending -= rx_data_pop(&parser->received_data, (char*)suback->reason_codes, MIN(suback->reason_codes_pending, avail));
 
             if (!suback->reason_codes_pending)
                 return MQTT_NG_CLIENT_PARSE_DONE;
@@ -1735,6 +3141,136 @@ static int parse_suback_varhdr(struct mqtt_ng_client *client)
     return MQTT_NG_CLIENT_OK_CALL_AGAIN;
 }
 
+static int rx_scratch_reserve(struct mqtt_ng_parser *parser, size_t size)
+{
+    if (parser->rx_scratch_size >= size)
+        return 0;
+
+    char *scratch = mw_realloc(parser->rx_scratch, size);
+    if (!scratch)
+        return 1;
+    parser->rx_scratch = scratch;
+    parser->rx_scratch_size = size;
+    return 0;
+}
+
+// frees memory of incoming PUBLISH (or returns it to parser if borrowed)
+// if keep_topic is set topic ownership was taken by rx_aliases
+static void rx_publish_release(struct mqtt_ng_client *client, struct mqtt_publish *publish, int keep_topic)
+{
+    if (publish->borrowed) {
+        if (publish->data_in_place)
+            rx_data_bump_tail(&client->parser.received_data, publish->data_len);
+        publish->data_in_place = 0;
+    } else {
+        if (!keep_topic)
+            mw_obj_free(publish->topic);
+        mw_obj_free(publish->data);
+    }
+    publish->topic = NULL;
+    publish->data = NULL;
+}
+
+// applies Topic Alias property of incoming PUBLISH (if sent from server)
+// either taking topic from rx_aliases or setting the alias
+// on error caller has to release the message
+static int rx_publish_topic_alias(struct mqtt_ng_client *client, struct mqtt_publish *pub)
+{
+    struct mqtt_property *prop = get_property_by_id(&client->parser.properties_parser, MQTT_PROP_TOPIC_ALIAS);
+    if (prop == NULL)
+        return 0;
+
+    void *topic_ptr;
+    if (!c_rhash_get_ptr_by_uint64(client->rx_aliases, prop->data.uint8, &topic_ptr)) {
+        if (pub->topic != NULL) {
+            ERROR("We do not yet support topic alias reassignment");
+            return MQTT_NG_CLIENT_NOT_IMPL_YET;
+        }
+        pub->topic = topic_ptr;
+    } else {
+        if (pub->topic == NULL) {
+            ERROR("Topic alias with id %d unknown and topic not set by server!", prop->data.uint8);
+            return MQTT_NG_CLIENT_PROTOCOL_ERROR;
+        }
+        // borrowed topic lives in parser scratch memory
+        char *alias_topic = pub->borrowed ? mw_obj_strdup(client->main_buffer.alloc, pub->topic) : pub->topic;
+        if (alias_topic == NULL)
+            return MQTT_NG_CLIENT_OOM;
+        c_rhash_insert_uint64_ptr(client->rx_aliases, prop->data.uint8, alias_topic);
+    }
+    pub->topic_aliased = 1;
+    return 0;
+}
+
+// message matching overlapping subscriptions can carry more identifiers [MQTT-3.3.4-4]
+#define RX_SUB_IDS_MAX 8
+
+// Subscription Identifiers of PUBLISH being parsed
+static size_t rx_publish_sub_ids(struct mqtt_ng_client *client, uint32_t *sub_ids)
+{
+    size_t sub_id_count = 0;
+    struct mqtt_properties_parser_ctx *props = &client->parser.properties_parser;
+    for (size_t i = 0; i < props->count; i++) {
+        struct mqtt_property *prop = &props->props[i];
+        if (prop->id != MQTT_PROP_SUB_IDENTIFIER)
+            continue;
+        // rather match the topic than miss some of the routes
+        if (sub_id_count == RX_SUB_IDS_MAX)
+            return 0;
+        sub_ids[sub_id_count++] = prop->data.uint32;
+    }
+    return sub_id_count;
+}
+
+// returns 1 if PUBLISH (with payload not parsed yet) will be given to route callbacks
+// topic alias is only looked up, it is resolved later by rx_publish_topic_alias
+static int rx_publish_routed(struct mqtt_ng_client *client, struct mqtt_publish *pub)
+{
+    if (!mqtt_ng_router_active(client->router))
+        return 0;
+
+    uint32_t sub_ids[RX_SUB_IDS_MAX];
+    size_t sub_id_count = rx_publish_sub_ids(client, sub_ids);
+
+    const char *topic = pub->topic;
+    struct mqtt_property *prop;
+    void *topic_ptr;
+    if (topic == NULL && (prop = get_property_by_id(&client->parser.properties_parser, MQTT_PROP_TOPIC_ALIAS)) != NULL
+        && !c_rhash_get_ptr_by_uint64(client->rx_aliases, prop->data.uint8, &topic_ptr))
+        topic = topic_ptr;
+
+    return mqtt_ng_router_match(client->router, topic, sub_ids, sub_id_count) > 0;
+}
+
+// passes payload of incoming PUBLISH to chunk callback as it is available,
+// directly from the receive buffer
+static int rx_publish_deliver_chunks(struct mqtt_ng_client *client, struct mqtt_publish *pub)
+{
+    struct mqtt_ng_parser *parser = &client->parser;
+    while (pub->data_offset < pub->data_len) {
+        size_t linear;
+        char *ptr = rbuf_get_linear_read_range(parser->received_data.buf, &linear);
+        linear = MIN(linear, rx_data_available(&parser->received_data));
+        if (ptr == NULL || !linear)
+            return MQTT_NG_CLIENT_NEED_MORE_BYTES;
+
+        struct mqtt_rx_msg_chunk chunk = {
+            .topic = pub->topic,
+            .topic_len = pub->topic ? strlen(pub->topic) : 0,
+            .data = ptr,
+            .data_len = MIN(linear, pub->data_len - pub->data_offset),
+            .offset = pub->data_offset,
+            .total_len = pub->data_len,
+            .qos = pub->qos
+        };
+        client->msg_chunk_callback(client->msg_chunk_ctx, &chunk);
+        rx_data_bump_tail(&parser->received_data, chunk.data_len);
+        pub->data_offset += chunk.data_len;
+    }
+    parser->mqtt_parsed_len += pub->data_len;
+    return MQTT_NG_CLIENT_PARSE_DONE;
+}
+
 static int parse_publish_varhdr(struct mqtt_ng_client *client)
 {
     int rc;
@@ -1742,25 +3278,36 @@ static int parse_publish_varhdr(struct mqtt_ng_client *client)
     struct mqtt_publish *publish = &client->parser.mqtt_packet.publish;
     switch (parser->varhdr_state) {
         case MQTT_PARSE_VARHDR_INITIAL:
-            BUF_READ_CHECK_AT_LEAST(parser->received_data, 2);
+            BUF_READ_CHECK_AT_LEAST(&parser->received_data, 2);
             publish->topic = NULL;
+            publish->data = NULL;
             publish->qos = ((parser->mqtt_control_packet_type >> 1) & 0x03);
-            rbuf_pop(parser->received_data, (char*)&publish->topic_len, 2);
+            publish->borrowed = client->msg_borrowed_callback != NULL;
+            publish->data_in_place = 0;
+            publish->chunked = 0;
+            publish->topic_aliased = 0;
+            rx_data_pop(&parser->received_data, (char*)&publish->topic_len, 2);
             publish->topic_len = be16toh(publish->topic_len);
             parser->mqtt_parsed_len = 2;
             if (!publish->topic_len) {
                 parser->varhdr_state = MQTT_PARSE_VARHDR_POST_TOPICNAME;
                 break;
             }
-            publish->topic = mw_calloc(1, publish->topic_len + 1 /* add 0x00 */);
+            if (publish->borrowed) {
+                if (rx_scratch_reserve(parser, publish->topic_len + 1 /* add 0x00 */))
+                    return MQTT_NG_CLIENT_OOM;
+                publish->topic = parser->rx_scratch;
+                publish->topic[publish->topic_len] = 0;
+            } else if ((publish->topic = mw_obj_malloc(client->main_buffer.alloc, publish->topic_len + 1 /* add 0x00 */)) != NULL)
+                publish->topic[publish->topic_len] = 0;
             if (publish->topic == NULL)
                 return MQTT_NG_CLIENT_OOM;
             parser->varhdr_state = MQTT_PARSE_VARHDR_TOPICNAME;
             /* FALLTHROUGH */
         case MQTT_PARSE_VARHDR_TOPICNAME:
             // TODO check empty topic can be valid? In which case we have to skip this step
-            BUF_READ_CHECK_AT_LEAST(parser->received_data, publish->topic_len);
-            rbuf_pop(parser->received_data, publish->topic, publish->topic_len);
+            BUF_READ_CHECK_AT_LEAST(&parser->received_data, publish->topic_len);
+            rx_data_pop(&parser->received_data, publish->topic, publish->topic_len);
             parser->mqtt_parsed_len += publish->topic_len;
             parser->varhdr_state = MQTT_PARSE_VARHDR_POST_TOPICNAME;
             /* FALLTHROUGH */
@@ -1773,23 +3320,25 @@ static int parse_publish_varhdr(struct mqtt_ng_client *client)
             parser->varhdr_state = MQTT_PARSE_VARHDR_PACKET_ID;
             /* FALLTHROUGH */
         case MQTT_PARSE_VARHDR_PACKET_ID:
-            BUF_READ_CHECK_AT_LEAST(parser->received_data, 2);
-            rbuf_pop(parser->received_data, (char*)&publish->packet_id, 2);
+            BUF_READ_CHECK_AT_LEAST(&parser->received_data, 2);
+            rx_data_pop(&parser->received_data, (char*)&publish->packet_id, 2);
             publish->packet_id = be16toh(publish->packet_id);
             parser->varhdr_state = MQTT_PARSE_VARHDR_PROPS;
             parser->mqtt_parsed_len += 2;
             /* FALLTHROUGH */
         case MQTT_PARSE_VARHDR_PROPS:
-            rc = parse_properties_array(&parser->properties_parser, parser->received_data, client->log);
-            if (rc != MQTT_NG_CLIENT_PARSE_DONE) 
+            rc = parse_properties_array(&parser->properties_parser, &parser->received_data, client->log);
+            if (rc != MQTT_NG_CLIENT_PARSE_DONE) {
+                if (rc != MQTT_NG_CLIENT_NEED_MORE_BYTES && rc != MQTT_NG_CLIENT_OK_CALL_AGAIN)
+                    rx_publish_release(client, publish, 0);
                 return rc;
+            }
             parser->mqtt_parsed_len += parser->properties_parser.bytes_consumed;
             parser->varhdr_state = MQTT_PARSE_PAYLOAD;
             /* FALLTHROUGH */
         case MQTT_PARSE_PAYLOAD:
             if (parser->mqtt_fixed_hdr_remaining_length < parser->mqtt_parsed_len) {
-                mw_free(publish->topic);
-                publish->topic = NULL;
+                rx_publish_release(client, publish, 0);
                 ERROR("Error parsing PUBLISH message");
                 return MQTT_NG_CLIENT_PROTOCOL_ERROR;
             }
@@ -1798,19 +3347,54 @@ static int parse_publish_varhdr(struct mqtt_ng_client *client)
                 publish->data = NULL;
                 return MQTT_NG_CLIENT_PARSE_DONE; // 0 length payload is OK [MQTT-3.3.3]
             }
-            BUF_READ_CHECK_AT_LEAST(parser->received_data, publish->data_len);
+            // route callbacks get messages whole
+            if (client->msg_chunk_callback && publish->data_len > client->msg_chunk_min && publish->qos < 2 && !rx_publish_routed(client, publish)) {
+                // topic has to be known before the first chunk
+                if ( (rc = rx_publish_topic_alias(client, publish)) ) {
+                    rx_publish_release(client, publish, 0);
+                    return rc;
+                }
+                publish->chunked = 1;
+                publish->data_offset = 0;
+                parser->varhdr_state = MQTT_PARSE_PAYLOAD_CHUNKS;
+                return rx_publish_deliver_chunks(client, publish);
+            }
+            BUF_READ_CHECK_AT_LEAST(&parser->received_data, publish->data_len);
+
+            if (publish->borrowed) {
+                size_t linear;
+                char *ptr = rbuf_get_linear_read_range(parser->received_data.buf, &linear);
+                if (ptr && linear >= publish->data_len) {
+                    // no need to copy at all, consumed after the callback
+                    publish->data = ptr;
+                    publish->data_in_place = 1;
+                    parser->mqtt_parsed_len += publish->data_len;
+                    return MQTT_NG_CLIENT_PARSE_DONE;
+                }
+                // payload wraps around the end of the ring buffer
+                size_t topic_bytes = publish->topic ? publish->topic_len + 1 : 0;
+                if (rx_scratch_reserve(parser, topic_bytes + publish->data_len)) {
+                    rx_publish_release(client, publish, 0);
+                    return MQTT_NG_CLIENT_OOM;
+                }
+                // reserve could have moved the scratch memory
+                if (publish->topic)
+                    publish->topic = parser->rx_scratch;
+                publish->data = &parser->rx_scratch[topic_bytes];
+            } else
+                publish->data = mw_obj_malloc(client->main_buffer.alloc, publish->data_len);
 
-            publish->data = mw_malloc(publish->data_len);
             if (publish->data == NULL) {
-                mw_free(publish->topic);
-                publish->topic = NULL;
+                rx_publish_release(client, publish, 0);
                 return MQTT_NG_CLIENT_OOM;
             }
 
-            rbuf_pop(parser->received_data, publish->data, publish->data_len);
+            rx_data_pop(&parser->received_data, publish->data, publish->data_len);
             parser->mqtt_parsed_len += publish->data_len;
 
             return MQTT_NG_CLIENT_PARSE_DONE;
+        case MQTT_PARSE_PAYLOAD_CHUNKS:
+            return rx_publish_deliver_chunks(client, publish);
         default:
             ERROR("invalid state for publish varhdr parser");
             return MQTT_NG_CLIENT_INTERNAL_ERROR;
@@ -1826,13 +3410,13 @@ static int parse_data(struct mqtt_ng_client *client)
     struct mqtt_ng_parser *parser = &client->parser;
     switch(parser->state) {
         case MQTT_PARSE_FIXED_HEADER_PACKET_TYPE:
-            BUF_READ_CHECK_AT_LEAST(parser->received_data, 1);
-            rbuf_pop(parser->received_data, (char*)&parser->mqtt_control_packet_type, 1);
+            BUF_READ_CHECK_AT_LEAST(&parser->received_data, 1);
+            rx_data_pop(&parser->received_data, (char*)&parser->mqtt_control_packet_type, 1);
             vbi_parser_reset_ctx(&parser->vbi_parser);
             parser->state = MQTT_PARSE_FIXED_HEADER_LEN;
             break;
         case MQTT_PARSE_FIXED_HEADER_LEN:
-            rc = vbi_parser_parse(&parser->vbi_parser, parser->received_data, client->log);
+            rc = vbi_parser_parse(&parser->vbi_parser, &parser->received_data, client->log);
             if (rc == MQTT_NG_CLIENT_PARSE_DONE) {
                 parser->mqtt_fixed_hdr_remaining_length = parser->vbi_parser.result;
                 parser->state = MQTT_PARSE_VARIABLE_HEADER;
@@ -1889,7 +3473,7 @@ static int parse_data(struct mqtt_ng_client *client)
                     return rc;
                 default:
                     ERROR("Parsing Control Packet Type %" PRIu8 " not implemented yet.", get_control_packet_type(parser->mqtt_control_packet_type));
-                    rbuf_bump_tail(parser->received_data, parser->mqtt_fixed_hdr_remaining_length);
+                    rx_data_bump_tail(&parser->received_data, parser->mqtt_fixed_hdr_remaining_length);
                     parser->state = MQTT_PARSE_MQTT_PACKET_DONE;
                     return MQTT_NG_CLIENT_NOT_IMPL_YET;
             }
@@ -1903,6 +3487,49 @@ static int parse_data(struct mqtt_ng_client *client)
     return MQTT_NG_CLIENT_OK_CALL_AGAIN;
 }
 
+// takes place in Receive Maximum window for QOS1 PUBLISH about to be sent
+// returns 1 if there is none left (everything behind has to wait to keep the order)
+static inline int window_full(struct mqtt_ng_client *client, struct buffer_fragment *frag)
+{
+    if (!(frag->flags & BUFFER_FRAG_MQTT_PACKET_HEAD) || frag->sent || !frag->packet_id ||
+        (frag->flags & BUFFER_FRAG_WINDOW) || get_control_packet_type(*frag->data) != MQTT_CPT_PUBLISH)
+        return 0;
+
+    if (client->window_inflight >= client->receive_max) {
+        if (!client->window_blocked) {
+            client->window_blocked = 1;
+            STATS_ADD(client, tx_window_stalls, 1);
+        }
+        return 1;
+    }
+    client->window_blocked = 0;
+    client->main_buffer.bypass_cursor = NULL;
+    client->window_inflight++;
+    frag->flags |= BUFFER_FRAG_WINDOW;
+    return 0;
+}
+
+// packets other than PUBLISH (our PUBACKs, SUBSCRIBE) queued behind QOS1 PUBLISH
+// waiting for Receive Maximum window are sent ahead of it, otherwise
+// broker waiting for our PUBACKs before acking ours would deadlock with us
+// scan continues where previous one ended so every fragment is checked once per blocking
+static struct buffer_fragment *next_bypassing_window(struct transaction_buffer *buf, struct buffer_fragment *blocked)
+{
+    struct buffer_fragment *frag = buf->bypass_cursor ? buf->bypass_cursor->next : blocked->next;
+    for (; frag; frag = frag->next) {
+        buf->bypass_cursor = frag;
+        if (!(frag->flags & BUFFER_FRAG_MQTT_PACKET_HEAD) || frag->sent || get_control_packet_type(*frag->data) == MQTT_CPT_PUBLISH)
+            continue;
+        for (struct buffer_fragment *f = frag; f; f = f->next) {
+            f->flags |= BUFFER_FRAG_WINDOW_BYPASS;
+            if (f->flags & BUFFER_FRAG_MQTT_PACKET_TAIL)
+                break;
+        }
+        return frag;
+    }
+    return NULL;
+}
+
 // set next MQTT fragment to send
 // return 1 if nothing to send
 // return -1 on error
@@ -1916,20 +3543,26 @@ static int mqtt_ng_next_to_send(struct mqtt_ng_client *client) {
     if (client->client_state != CONNECTED)
         return -1;
 
-    struct buffer_fragment *frag = BUFFER_FIRST_FRAG(&client->main_buffer.hdr_buffer);
+    struct buffer_fragment *frag = send_cursor_frag(&client->main_buffer);
     while (frag) {
         if ( frag->sent != frag->len )
             break;
         frag = frag->next;
     }
+    client->main_buffer.send_cursor = frag ? frag : client->main_buffer.hdr_buffer.tail_frag;
 
     if ( client->ping_pending && (!frag || (frag->flags & BUFFER_FRAG_MQTT_PACKET_HEAD && frag->sent == 0)) ) {
         client->ping_pending = 0;
-        ping_frag.sent = 0;
-        client->main_buffer.sending_frag = &ping_frag;
+        client->ping_frag.sent = 0;
+        client->main_buffer.sending_frag = &client->ping_frag;
         return 0;
     }
 
+    if (frag && window_full(client, frag)) {
+        client->main_buffer.sending_frag = next_bypassing_window(&client->main_buffer, frag);
+        return client->main_buffer.sending_frag == NULL ? 1 : 0;
+    }
+
     client->main_buffer.sending_frag = frag;
     return frag == NULL ? 1 : 0;
 }
@@ -1939,31 +3572,49 @@ static int mqtt_ng_next_to_send(struct mqtt_ng_client *client) {
 // return -1 if send buffer was filled and
 // nothing could be written anymore
 // return 1 if last fragment of a message was fully sent
+// called when last fragment of MQTT packet was sent
+static inline void message_sent(struct mqtt_ng_client *client, struct buffer_fragment *tail)
+{
+    // QOS1 is done only when acknowledged (see mark_packet_acked)
+    if (tail->packet_len && (tail->flags & BUFFER_FRAG_GARBAGE_COLLECT_ON_SEND))
+        __atomic_store_n(&client->main_buffer.publish_bytes, client->main_buffer.publish_bytes - tail->packet_len, __ATOMIC_RELAXED);
+    if (tail != &client->ping_frag) {
+        STATS_ADD(client, tx_messages_queued, -1);
+        // from now on timestamp means time of sending
+        if (tail->timestamp) {
+            uint64_t now = mqtt_ng_now_usec();
+            latency_histogram_add(&client->stats.tx_queue_residency, now - tail->timestamp);
+            tail->timestamp = now;
+        }
+    }
+    STATS_ADD(client, tx_messages_sent, 1);
+}
+
 static int send_fragment(struct mqtt_ng_client *client) {
     struct buffer_fragment *frag = client->main_buffer.sending_frag;
 
     // for readability
-    char *ptr = frag->data + frag->sent;
-    size_t bytes = frag->len - frag->sent;
+    char *ptr;
+    size_t bytes = frag_send_ptr(client, frag, &ptr);
 
     size_t processed = 0;
 
     if (bytes)
         processed = client->send_fnc_ptr(client->user_ctx, ptr, bytes);
-    else
+    else if (frag->sent == frag->len)
         WARN("This fragment was fully sent already. This should not happen!");
 
     frag->sent += processed;
-    if (frag->sent != frag->len)
+    if (frag->sent != frag->len) {
+        // whole chunk of streamed payload was sent, pull the next one
+        if (bytes && processed == bytes)
+            return 0;
         return -1;
+    }
 
     if (frag->flags & BUFFER_FRAG_MQTT_PACKET_TAIL) {
         client->time_of_last_send = time(NULL);
-        pthread_mutex_lock(&client->stats_mutex);
-        if (client->main_buffer.sending_frag != &ping_frag)
-            client->stats.tx_messages_queued--;
-        client->stats.tx_messages_sent++;
-        pthread_mutex_unlock(&client->stats_mutex);
+        message_sent(client, frag);
         client->main_buffer.sending_frag = NULL;
         return 1;
     }
@@ -1980,7 +3631,136 @@ static int send_all_message_fragments(struct mqtt_ng_client *client) {
     return rc;
 }
 
+// maximum number of buffer fragments gathered into single sendv call
+#define MQTT_NG_SEND_IOV_MAX 64
+
+struct send_batch {
+    struct iovec iov[MQTT_NG_SEND_IOV_MAX];
+    int iovcnt;
+    size_t bytes;
+    // fragments gathered (including those with no data to send)
+    // and value of their sent member before gathering
+    struct buffer_fragment *frags[MQTT_NG_SEND_IOV_MAX];
+    size_t frags_sent[MQTT_NG_SEND_IOV_MAX];
+    int frag_count;
+};
+
+// collects fragments ready to be sent (across MQTT packets)
+// up to client->send_coalesce_limit bytes
+// fragments are optimistically marked as sent so mqtt_ng_next_to_send
+// can be used unchanged to pick next MQTT packet
+// real state is then fixed by send_batch_commit
+static size_t send_batch_gather(struct mqtt_ng_client *client, struct send_batch *batch)
+{
+    size_t bytes = 0;
+    batch->iovcnt = 0;
+    batch->frag_count = 0;
+
+    while (batch->frag_count < MQTT_NG_SEND_IOV_MAX && bytes < client->send_coalesce_limit) {
+        if (client->main_buffer.sending_frag == NULL && mqtt_ng_next_to_send(client))
+            break;
+
+        struct buffer_fragment *frag = client->main_buffer.sending_frag;
+        char *ptr;
+        size_t frag_bytes = frag_send_ptr(client, frag, &ptr);
+        if (frag_bytes) {
+            batch->iov[batch->iovcnt].iov_base = ptr;
+            batch->iov[batch->iovcnt].iov_len = frag_bytes;
+            batch->iovcnt++;
+            bytes += frag_bytes;
+        }
+        batch->frags[batch->frag_count] = frag;
+        batch->frags_sent[batch->frag_count] = frag->sent;
+        batch->frag_count++;
+
+        if (frag->sent + frag_bytes != frag->len) {
+            // next chunk of streamed payload can be pulled only once this one is sent
+            frag->sent += frag_bytes;
+            break;
+        }
+        frag->sent = frag->len;
+        client->main_buffer.sending_frag = (frag->flags & BUFFER_FRAG_MQTT_PACKET_TAIL) ? NULL : frag->next;
+    }
+    batch->bytes = bytes;
+    return batch->frag_count;
+}
+
+// distributes bytes actually sent among gathered fragments
+// return 0 if all gathered fragments were fully sent
+// return -1 if send buffer was filled
+static int send_batch_commit(struct mqtt_ng_client *client, struct send_batch *batch, size_t processed)
+{
+    struct buffer_fragment *resume = NULL;
+    int rewound = 0;
+    // rest of the packet resume belongs to, continued through sending_frag
+    int resume_packet_open = 0;
+    int all_sent = batch->bytes && processed == batch->bytes;
+
+    for (int i = 0; i < batch->frag_count; i++) {
+        struct buffer_fragment *frag = batch->frags[i];
+
+        if (resume != NULL) {
+            // nothing of this fragment was sent
+            frag->sent = batch->frags_sent[i];
+            if (!rewound)
+                rewound = send_cursor_rewind(client, frag);
+            // ping was already taken out of the queue
+            // by mqtt_ng_next_to_send, put it back
+            if (frag == &client->ping_frag)
+                client->ping_pending = 1;
+            if (resume_packet_open)
+                resume_packet_open = !(frag->flags & BUFFER_FRAG_MQTT_PACKET_TAIL);
+            else if (frag->flags & BUFFER_FRAG_WINDOW_BYPASS) {
+                // packet not started, next_bypassing_window has to find it again
+                frag->flags &= ~BUFFER_FRAG_WINDOW_BYPASS;
+                client->main_buffer.bypass_cursor = NULL;
+            }
+            continue;
+        }
+
+        size_t frag_bytes = MIN(processed, frag->len - batch->frags_sent[i]);
+        processed -= frag_bytes;
+        frag->sent = batch->frags_sent[i] + frag_bytes;
+
+        if (frag->sent != frag->len) {
+            resume = frag;
+            resume_packet_open = !(frag->flags & BUFFER_FRAG_MQTT_PACKET_TAIL);
+            rewound = send_cursor_rewind(client, frag);
+            continue;
+        }
+        frag->flags &= ~BUFFER_FRAG_WINDOW_BYPASS;
+
+        if (frag->flags & BUFFER_FRAG_MQTT_PACKET_TAIL) {
+            client->time_of_last_send = time(NULL);
+            message_sent(client, frag);
+        }
+    }
+
+    if (resume == NULL)
+        return 0;
+
+    client->main_buffer.sending_frag = resume;
+    // only streamed payload chunk ran out
+    return all_sent ? 0 : -1;
+}
+
+static void try_send_all_coalesced(struct mqtt_ng_client *client) {
+    struct send_batch batch;
+    while (send_batch_gather(client, &batch)) {
+        ssize_t rc = 0;
+        if (batch.iovcnt)
+            rc = client->sendv_fnc_ptr(client->user_ctx, batch.iov, batch.iovcnt);
+        if (send_batch_commit(client, &batch, rc > 0 ? (size_t)rc : 0))
+            return;
+    }
+}
+
 static void try_send_all(struct mqtt_ng_client *client) {
+    if (client->sendv_fnc_ptr != NULL && client->send_coalesce_limit) {
+        try_send_all_coalesced(client);
+        return;
+    }
+
     do {
         if (client->main_buffer.sending_frag == NULL && mqtt_ng_next_to_send(client))
             return;
@@ -2001,23 +3781,100 @@ static inline void mark_message_for_gc(struct buffer_fragment *frag)
 static int mark_packet_acked(struct mqtt_ng_client *client, uint16_t packet_id)
 {
     LOCK_HDR_BUFFER(&client->main_buffer);
-    struct buffer_fragment *frag = BUFFER_FIRST_FRAG(&client->main_buffer.hdr_buffer);
-    while (frag) {
-        if ( (frag->flags & BUFFER_FRAG_MQTT_PACKET_HEAD) && frag->packet_id == packet_id) {
-            if (!frag->sent) {
-                ERROR("Received packet_id (%" PRIu16 ") belongs to MQTT packet which was not yet sent!", packet_id);
-                UNLOCK_HDR_BUFFER(&client->main_buffer);
-                return 1;
-            }
-            mark_message_for_gc(frag);
-            UNLOCK_HDR_BUFFER(&client->main_buffer);
-            return 0;
-        }
-        frag = frag->next;
+    struct buffer_fragment *frag = inflight_get(&client->main_buffer, packet_id);
+    if (!frag) {
+        ERROR("Received packet_id (%" PRIu16 ") is unknown!", packet_id);
+        UNLOCK_HDR_BUFFER(&client->main_buffer);
+        return 1;
+    }
+#ifdef ADDITIONAL_CHECKS
+    if (!(frag->flags & BUFFER_FRAG_MQTT_PACKET_HEAD) || frag->packet_id != packet_id) {
+        ERROR("In flight index for packet_id (%" PRIu16 ") points to wrong fragment!", packet_id);
+        UNLOCK_HDR_BUFFER(&client->main_buffer);
+        return 1;
+    }
+#endif
+    if (!frag->sent) {
+        ERROR("Received packet_id (%" PRIu16 ") belongs to MQTT packet which was not yet sent!", packet_id);
+        UNLOCK_HDR_BUFFER(&client->main_buffer);
+        return 1;
     }
-    ERROR("Received packet_id (%" PRIu16 ") is unknown!", packet_id);
+    inflight_remove(&client->main_buffer.inflight, packet_id);
+    if (frag->flags & BUFFER_FRAG_WINDOW)
+        client->window_inflight--;
+    mark_message_for_gc(frag);
+    // subscribe has no timestamp
+    struct buffer_fragment *tail = frag;
+    while (!(tail->flags & BUFFER_FRAG_MQTT_PACKET_TAIL) && tail->next)
+        tail = tail->next;
+    if (tail->timestamp)
+        latency_histogram_add(&client->stats.tx_puback_rtt, mqtt_ng_now_usec() - tail->timestamp);
+    if (tail->packet_len)
+        __atomic_store_n(&client->main_buffer.publish_bytes, client->main_buffer.publish_bytes - tail->packet_len, __ATOMIC_RELAXED);
     UNLOCK_HDR_BUFFER(&client->main_buffer);
-    return 1;
+    return 0;
+}
+
+// retained messages are single allocation followed by topic and data
+struct mqtt_rx_msg_retained {
+    struct mqtt_rx_msg msg;
+    int refcount;
+};
+
+struct mqtt_rx_msg_retained *mqtt_rx_msg_retain(const struct mqtt_rx_msg *msg)
+{
+    struct mqtt_rx_msg_retained *copy = mw_malloc(sizeof(*copy) + msg->topic_len + 1 + msg->data_len);
+    if (!copy)
+        return NULL;
+
+    char *topic = (char *)&copy[1];
+    if (msg->topic_len)
+        memcpy(topic, msg->topic, msg->topic_len);
+    topic[msg->topic_len] = 0;
+    char *data = &topic[msg->topic_len + 1];
+    if (msg->data_len)
+        memcpy(data, msg->data, msg->data_len);
+
+    copy->msg = *msg;
+    copy->msg.topic = msg->topic ? topic : NULL;
+    copy->msg.data = msg->data_len ? data : NULL;
+    copy->refcount = 1;
+    return copy;
+}
+
+struct mqtt_rx_msg_retained *mqtt_rx_msg_retained_ref(struct mqtt_rx_msg_retained *retained)
+{
+    __atomic_add_fetch(&retained->refcount, 1, __ATOMIC_RELAXED);
+    return retained;
+}
+
+const struct mqtt_rx_msg *mqtt_rx_msg_retained_get(const struct mqtt_rx_msg_retained *retained)
+{
+    return &retained->msg;
+}
+
+void mqtt_rx_msg_release(struct mqtt_rx_msg_retained *retained)
+{
+    if (!__atomic_sub_fetch(&retained->refcount, 1, __ATOMIC_ACQ_REL))
+        mw_free(retained);
+}
+
+#define RX_MSG_INITIALIZER(pub) { \
+        .topic = (pub)->topic, \
+        .topic_len = (pub)->topic ? strlen((pub)->topic) : 0, \
+        .data = (pub)->data, \
+        .data_len = (pub)->data_len, \
+        .qos = (pub)->qos \
+    }
+
+// returns number of route callbacks called
+static int rx_publish_route(struct mqtt_ng_client *client, struct mqtt_publish *pub)
+{
+    uint32_t sub_ids[RX_SUB_IDS_MAX];
+    size_t sub_id_count = rx_publish_sub_ids(client, sub_ids);
+
+    struct mqtt_rx_msg msg = RX_MSG_INITIALIZER(pub);
+    return mqtt_ng_router_dispatch(client->router, &msg, sub_ids, sub_id_count);
 }
 
 int handle_incoming_traffic(struct mqtt_ng_client *client)
@@ -2030,9 +3887,7 @@ int handle_incoming_traffic(struct mqtt_ng_client *client)
 #ifdef MQTT_DEBUG_VERBOSE
         DEBUG("MQTT Packet Parsed Successfully!");
 #endif
-        pthread_mutex_lock(&client->stats_mutex);
-        client->stats.rx_messages_rcvd++;
-        pthread_mutex_unlock(&client->stats_mutex);
+        STATS_ADD(client, rx_messages_rcvd, 1);
 
         switch (get_control_packet_type(client->parser.mqtt_control_packet_type)) {
             case MQTT_CPT_CONNACK:
@@ -2048,10 +3903,26 @@ int handle_incoming_traffic(struct mqtt_ng_client *client)
                     client->client_state = ERROR;
                     return MQTT_NG_CLIENT_PROTOCOL_ERROR;
                 }
-                if ((prop = get_property_by_id(client->parser.properties_parser.head, MQTT_PROP_MAX_PKT_SIZE)) != NULL) {
+                if ((prop = get_property_by_id(&client->parser.properties_parser, MQTT_PROP_MAX_PKT_SIZE)) != NULL) {
                     INFO("MQTT server limits message size to %" PRIu32, prop->data.uint32);
                     client->max_msg_size = prop->data.uint32;
                 }
+                // absent means server doesn't accept topic aliases at all
+                prop = get_property_by_id(&client->parser.properties_parser, MQTT_PROP_TOPIC_ALIAS_MAX);
+                pthread_rwlock_wrlock(&client->tx_topic_aliases.rwlock);
+                client->tx_topic_aliases.server_max = prop ? prop->data.uint16 : 0;
+                tx_topic_aliases_changed(&client->tx_topic_aliases);
+                pthread_rwlock_unlock(&client->tx_topic_aliases.rwlock);
+                if (prop)
+                    INFO("MQTT server accepts up to %" PRIu16 " topic aliases", prop->data.uint16);
+                // absent means 65535, 0 is protocol error [MQTT-3.2.2.3.3]
+                prop = get_property_by_id(&client->parser.properties_parser, MQTT_PROP_RECEIVE_MAX);
+                client->receive_max = prop && prop->data.uint16 ? prop->data.uint16 : UINT16_MAX;
+                if (prop && prop->data.uint16 && prop->data.uint16 != UINT16_MAX)
+                    INFO("MQTT server accepts up to %" PRIu16 " unacknowledged QOS1 messages", prop->data.uint16);
+                // absent means available
+                prop = get_property_by_id(&client->parser.properties_parser, MQTT_PROP_SUB_ID_AVAIL);
+                client->sub_ids_available = prop ? prop->data.uint8 : 1;
                 if (client->connack_callback)
                     client->connack_callback(client->user_ctx, client->parser.mqtt_packet.connack.reason_code);
                 if (!client->parser.mqtt_packet.connack.reason_code) {
@@ -2065,10 +3936,12 @@ int handle_incoming_traffic(struct mqtt_ng_client *client)
 #ifdef MQTT_DEBUG_VERBOSE
                 DEBUG("Received PUBACK %" PRIu16, client->parser.mqtt_packet.puback.packet_id);
 #endif
-                if (mark_packet_acked(client, client->parser.mqtt_packet.puback.packet_id))
+                if (!RX_REPLAY(client) && mark_packet_acked(client, client->parser.mqtt_packet.puback.packet_id))
                     return MQTT_NG_CLIENT_PROTOCOL_ERROR;
                 if (client->puback_callback)
                     client->puback_callback(client->parser.mqtt_packet.puback.packet_id);
+                if (client->puback_ctx_callback)
+                    client->puback_ctx_callback(client->user_ctx, client->parser.mqtt_packet.puback.packet_id);
                 break;
             case MQTT_CPT_PINGRESP:
 #ifdef MQTT_DEBUG_VERBOSE
@@ -2079,7 +3952,7 @@ int handle_incoming_traffic(struct mqtt_ng_client *client)
 #ifdef MQTT_DEBUG_VERBOSE
                 DEBUG("Received SUBACK %" PRIu16, client->parser.mqtt_packet.suback.packet_id);
 #endif
-                if (mark_packet_acked(client, client->parser.mqtt_packet.suback.packet_id))
+                if (!RX_REPLAY(client) && mark_packet_acked(client, client->parser.mqtt_packet.suback.packet_id))
                     return MQTT_NG_CLIENT_PROTOCOL_ERROR;
                 break;
             case MQTT_CPT_PUBLISH:
@@ -2088,39 +3961,34 @@ int handle_incoming_traffic(struct mqtt_ng_client *client)
 #endif
                 pub = &client->parser.mqtt_packet.publish;
                 if (pub->qos > 1) {
-                    mw_free(pub->topic);
-                    mw_free(pub->data);
+                    rx_publish_release(client, pub, 0);
                     return MQTT_NG_CLIENT_NOT_IMPL_YET;
                 }
                 if ( pub->qos == 1 && (rc = mqtt_ng_puback(client, pub->packet_id, 0)) ) {
+                    rx_publish_release(client, pub, 0);
                     client->client_state = ERROR;
                     ERROR("Error generating PUBACK reply for PUBLISH");
                     return rc;
                 }
-                if ( (prop = get_property_by_id(client->parser.properties_parser.head, MQTT_PROP_TOPIC_ALIAS)) != NULL ) {
-                    // Topic Alias property was sent from server
-                    void *topic_ptr;
-                    if (!c_rhash_get_ptr_by_uint64(client->rx_aliases, prop->data.uint8, &topic_ptr)) {
-                        if (pub->topic != NULL) {
-                            ERROR("We do not yet support topic alias reassignment");
-                            return MQTT_NG_CLIENT_NOT_IMPL_YET;
-                        }
-                        pub->topic = topic_ptr;
-                    } else {
-                        if (pub->topic == NULL) {
-                            ERROR("Topic alias with id %d unknown and topic not set by server!", prop->data.uint8);
-                            return MQTT_NG_CLIENT_PROTOCOL_ERROR;
-                        }
-                        c_rhash_insert_uint64_ptr(client->rx_aliases, prop->data.uint8, pub->topic);
-                    }
+                // chunked payload was delivered while parsing already
+                if (pub->chunked) {
+                    rx_publish_release(client, pub, pub->topic_aliased);
+                    return MQTT_NG_CLIENT_WANT_WRITE;
+                }
+                if ( (rc = rx_publish_topic_alias(client, pub)) ) {
+                    rx_publish_release(client, pub, 0);
+                    return rc;
+                }
+                if (!(mqtt_ng_router_active(client->router) && rx_publish_route(client, pub))) {
+                    if (client->msg_borrowed_callback) {
+                        struct mqtt_rx_msg msg = RX_MSG_INITIALIZER(pub);
+                        client->msg_borrowed_callback(client->msg_borrowed_ctx, &msg);
+                    } else if (client->msg_callback)
+                        client->msg_callback(pub->topic, pub->data, pub->data_len, pub->qos);
                 }
-                if (client->msg_callback)
-                    client->msg_callback(pub->topic, pub->data, pub->data_len, pub->qos);
                 // in case we have property topic alias and we have topic we take over the string
                 // and add pointer to it into topic alias list
-                if (prop == NULL)
-                    mw_free(pub->topic);
-                mw_free(pub->data);
+                rx_publish_release(client, pub, pub->topic_aliased);
                 return MQTT_NG_CLIENT_WANT_WRITE;
             case MQTT_CPT_DISCONNECT:
                 INFO ("Got MQTT DISCONNECT control packet from server. Reason code: %d", (int)client->parser.mqtt_packet.disconnect.reason_code);
@@ -2132,6 +4000,7 @@ int handle_incoming_traffic(struct mqtt_ng_client *client)
     return rc;
 }
 
+static void publish_queue_drain(struct mqtt_ng_client *client);
 int mqtt_ng_sync(struct mqtt_ng_client *client)
 {
     if (client->client_state == RAW || client->client_state == DISCONNECTED)
@@ -2140,6 +4009,9 @@ int mqtt_ng_sync(struct mqtt_ng_client *client)
     if (client->client_state == ERROR)
         return 1;
 
+    if (client->client_state == CONNECTED)
+        publish_queue_drain(client);
+
     LOCK_HDR_BUFFER(&client->main_buffer);
     try_send_all(client);
     UNLOCK_HDR_BUFFER(&client->main_buffer);
@@ -2156,12 +4028,51 @@ int mqtt_ng_sync(struct mqtt_ng_client *client)
         }
     }
 
+    // acknowledgements and sending free the buffer
+    flow_control_update(client);
+
+    // e.g. streamed payload couldn't be pulled
+    if (client->client_state == ERROR)
+        return 1;
+
     if (rc < 0)
         return rc;
 
     return 0;
 }
 
+ssize_t mqtt_ng_process_rx(struct mqtt_ng_client *client, rbuf_t data, size_t max_bytes)
+{
+    if (client->client_state == RAW || client->client_state == DISCONNECTED || client->client_state == ERROR)
+        return 0;
+
+    if (!max_bytes)
+        return 0;
+
+    struct mqtt_ng_rx_data default_src = client->parser.received_data;
+    client->parser.received_data.buf = data;
+    client->parser.received_data.limit = max_bytes;
+
+    int rc;
+    while ((rc = handle_incoming_traffic(client)) != MQTT_NG_CLIENT_NEED_MORE_BYTES) {
+        if (rc < 0)
+            break;
+        if (rc == MQTT_NG_CLIENT_WANT_WRITE) {
+            LOCK_HDR_BUFFER(&client->main_buffer);
+            try_send_all(client);
+            UNLOCK_HDR_BUFFER(&client->main_buffer);
+        }
+    }
+
+    size_t consumed = max_bytes - client->parser.received_data.limit;
+    client->parser.received_data = default_src;
+
+    if (rc < 0)
+        return rc;
+
+    return consumed;
+}
+
 time_t mqtt_ng_last_send_time(struct mqtt_ng_client *client)
 {
     return client->time_of_last_send;
@@ -2172,34 +4083,106 @@ void mqtt_ng_set_max_mem(struct mqtt_ng_client *client, size_t bytes)
     client->max_mem_bytes = bytes;
 }
 
-void mqtt_ng_get_stats(struct mqtt_ng_client *client, struct mqtt_ng_stats *stats)
+int mqtt_ng_set_flow_control(struct mqtt_ng_client *client, size_t high, size_t low, mqtt_ng_flow_callback_t callback, void *ctx)
 {
-    pthread_mutex_lock(&client->stats_mutex);
-    memcpy(stats, &client->stats, sizeof(struct mqtt_ng_stats));
-    pthread_mutex_unlock(&client->stats_mutex);
+    if (callback && (!high || low >= high))
+        return 1;
 
-    stats->tx_bytes_queued = 0;
-    stats->tx_buffer_reclaimable = 0;
+    __atomic_store_n(&client->flow_callback, NULL, __ATOMIC_RELEASE);
+    client->flow_high = high;
+    client->flow_low = low;
+    client->flow_ctx = ctx;
+    __atomic_store_n(&client->flow_above, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&client->flow_callback, callback, __ATOMIC_RELEASE);
+    // report if we are above already
+    flow_control_update(client);
+    return 0;
+}
 
-    LOCK_HDR_BUFFER(&client->main_buffer);
-    stats->tx_buffer_used = BUFFER_BYTES_USED(&client->main_buffer.hdr_buffer);
-    stats->tx_buffer_free = BUFFER_BYTES_AVAILABLE(&client->main_buffer.hdr_buffer);
-    stats->tx_buffer_size = client->main_buffer.hdr_buffer.size;
-    struct buffer_fragment *frag = BUFFER_FIRST_FRAG(&client->main_buffer.hdr_buffer);
-    while (frag) {
-        stats->tx_bytes_queued += frag->len - frag->sent;
-        if (frag_is_marked_for_gc(frag))
-            stats->tx_buffer_reclaimable += FRAG_SIZE_IN_BUFFER(frag);
+size_t mqtt_ng_publish_credit(struct mqtt_ng_client *client)
+{
+    size_t limit = __atomic_load_n(&client->flow_callback, __ATOMIC_ACQUIRE) ? client->flow_high : MQTT_NG_MAX_MEM(client);
+    size_t bytes = __atomic_load_n(&client->main_buffer.publish_bytes, __ATOMIC_RELAXED);
+    return limit > bytes ? limit - bytes : 0;
+}
 
-        frag = frag->next;
-    }
+void mqtt_ng_set_msg_borrowed_callback(struct mqtt_ng_client *client, mqtt_ng_msg_borrowed_callback_t callback, void *ctx)
+{
+    client->msg_borrowed_callback = callback;
+    client->msg_borrowed_ctx = ctx;
+}
+
+void mqtt_ng_set_msg_chunk_callback(struct mqtt_ng_client *client, size_t min_len, mqtt_ng_msg_chunk_callback_t callback, void *ctx)
+{
+    client->msg_chunk_callback = callback;
+    client->msg_chunk_ctx = ctx;
+    client->msg_chunk_min = min_len;
+}
+
+void mqtt_ng_set_allocator(struct mqtt_ng_client *client, const struct mqtt_wss_allocator *allocator)
+{
+    // objects already allocated remember their allocator, no need to wait for them
+    LOCK_HDR_BUFFER(&client->main_buffer);
+    __atomic_store_n(&client->main_buffer.alloc, allocator, __ATOMIC_RELAXED);
     UNLOCK_HDR_BUFFER(&client->main_buffer);
 }
 
-int mqtt_ng_set_topic_alias(struct mqtt_ng_client *client, const char *topic)
+void mqtt_ng_set_publish_queued_callback(struct mqtt_ng_client *client, mqtt_ng_publish_queued_callback_t callback, void *ctx)
 {
-    uint16_t idx;
-    pthread_rwlock_wrlock(&client->tx_topic_aliases.rwlock);
+    client->publish_queued_callback = callback;
+    client->publish_queued_ctx = ctx;
+}
+
+void mqtt_ng_publish_queued_notify(struct mqtt_ng_client *client, void *msg_ctx, uint16_t packet_id, int rc)
+{
+    if (client->publish_queued_callback)
+        client->publish_queued_callback(client->publish_queued_ctx, msg_ctx, packet_id, rc);
+}
+
+void mqtt_ng_set_send_coalesce_limit(struct mqtt_ng_client *client, size_t bytes)
+{
+    LOCK_HDR_BUFFER(&client->main_buffer);
+    client->send_coalesce_limit = bytes;
+    UNLOCK_HDR_BUFFER(&client->main_buffer);
+}
+
+void mqtt_ng_get_stats(struct mqtt_ng_client *client, struct mqtt_ng_stats *stats)
+{
+    stats->tx_messages_queued = STATS_GET(client, tx_messages_queued);
+    stats->tx_messages_sent = STATS_GET(client, tx_messages_sent);
+    stats->rx_messages_rcvd = STATS_GET(client, rx_messages_rcvd);
+    latency_histogram_get(&client->stats.tx_queue_residency, &stats->tx_queue_residency);
+    latency_histogram_get(&client->stats.tx_puback_rtt, &stats->tx_puback_rtt);
+
+    stats->tx_bytes_queued = 0;
+    stats->tx_buffer_reclaimable = 0;
+    stats->tx_window_stalls = STATS_GET(client, tx_window_stalls);
+
+    LOCK_HDR_BUFFER(&client->main_buffer);
+    stats->tx_inflight = client->window_inflight;
+    stats->tx_receive_max = client->receive_max;
+    stats->tx_publish_bytes = client->main_buffer.publish_bytes;
+    size_t free_segments = 0;
+    for (struct buffer_segment *seg = client->main_buffer.seg_free; seg; seg = seg->next)
+        free_segments++;
+    stats->tx_buffer_size = client->main_buffer.seg_count * BUFFER_SEGMENT_SIZE;
+    stats->tx_buffer_free = BUFFER_BYTES_AVAILABLE(&client->main_buffer.hdr_buffer) + free_segments * BUFFER_SEGMENT_SIZE;
+    stats->tx_buffer_used = stats->tx_buffer_size - stats->tx_buffer_free;
+    struct buffer_fragment *frag = BUFFER_FIRST_FRAG(&client->main_buffer.hdr_buffer);
+    while (frag) {
+        stats->tx_bytes_queued += frag->len - frag->sent;
+        if (frag_is_marked_for_gc(frag))
+            stats->tx_buffer_reclaimable += FRAG_SIZE_IN_BUFFER(frag);
+
+        frag = frag->next;
+    }
+    UNLOCK_HDR_BUFFER(&client->main_buffer);
+}
+
+int mqtt_ng_set_topic_alias(struct mqtt_ng_client *client, const char *topic)
+{
+    uint16_t idx;
+    pthread_rwlock_wrlock(&client->tx_topic_aliases.rwlock);
 
     if (client->tx_topic_aliases.idx_assigned >= client->tx_topic_aliases.idx_max) {
         pthread_rwlock_unlock(&client->tx_topic_aliases.rwlock);
@@ -2223,7 +4206,939 @@ int mqtt_ng_set_topic_alias(struct mqtt_ng_client *client, const char *topic)
     __atomic_store_n(&alias->usage_count, 0, __ATOMIC_SEQ_CST);
 
     c_rhash_insert_str_ptr(client->tx_topic_aliases.stoi_dict, topic, (void*)alias);
+    tx_topic_aliases_changed(&client->tx_topic_aliases);
 
     pthread_rwlock_unlock(&client->tx_topic_aliases.rwlock);
     return idx;
 }
+
+int mqtt_ng_set_auto_topic_alias(struct mqtt_ng_client *client, uint16_t max_aliases)
+{
+    struct mqtt_ng_alias_cache *cache = NULL;
+    if (max_aliases && (cache = mqtt_ng_alias_cache_new(max_aliases)) == NULL) {
+        mws_error(client->log, "OOM allocating automatic topic alias cache");
+        return 1;
+    }
+
+    // aliases known to server are rebound as topic is sent
+    // again with the first use of every slot of the new cache
+    pthread_rwlock_wrlock(&client->tx_topic_aliases.rwlock);
+    mqtt_ng_alias_cache_destroy(client->tx_topic_aliases.auto_cache);
+    __atomic_store_n(&client->tx_topic_aliases.auto_cache, cache, __ATOMIC_RELEASE);
+    tx_topic_aliases_changed(&client->tx_topic_aliases);
+    pthread_rwlock_unlock(&client->tx_topic_aliases.rwlock);
+    return 0;
+}
+
+#ifdef TESTS
+// transport taking at most max_write bytes per call, records everything sent
+struct test_transport {
+    char data[512];
+    size_t len;
+    size_t max_write;
+};
+
+static ssize_t test_send_cb(void *user_ctx, const void *buf, size_t len)
+{
+    struct test_transport *t = user_ctx;
+    len = MIN(len, MIN(t->max_write, sizeof(t->data) - t->len));
+    memcpy(&t->data[t->len], buf, len);
+    t->len += len;
+    return len;
+}
+
+static ssize_t test_sendv_cb(void *user_ctx, const struct iovec *iov, int iovcnt)
+{
+    ssize_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        ssize_t rc = test_send_cb(user_ctx, iov[i].iov_base, iov[i].iov_len);
+        total += rc;
+        if ((size_t)rc != iov[i].iov_len)
+            break;
+    }
+    return total;
+}
+
+// control packet types sent so far (packets are shorter than 128 bytes)
+static int test_sent_types(struct test_transport *t, char *types)
+{
+    int count = 0;
+    for (size_t pos = 0; pos + 1 < t->len; pos += 2 + (uint8_t)t->data[pos + 1])
+        types[count++] = get_control_packet_type(t->data[pos]);
+    return count;
+}
+
+static int test_window_bypass_run(mqtt_wss_log_ctx_t log, int vectored, size_t max_write)
+{
+    struct test_transport t = { .len = 0, .max_write = max_write };
+    struct mqtt_ng_init settings = {
+        .log = log,
+        .data_out_fnc = &test_send_cb,
+        .data_outv_fnc = vectored ? &test_sendv_cb : NULL,
+        .user_ctx = &t
+    };
+    struct mqtt_ng_client *client = mqtt_ng_init(&settings);
+    if (!client)
+        return 1;
+    client->client_state = CONNECTED;
+    client->receive_max = 1;
+
+    char msg[16] = { 0 };
+    uint16_t first_id, second_id;
+    int rc = mqtt_ng_generate_publish(&client->main_buffer, log, "test/window", CALLER_RESPONSIBILITY, msg, CALLER_RESPONSIBILITY, sizeof(msg), 1 << MQTT_PUBLISH_FLAG_QOS_BITSHIFT, &first_id, 0);
+    rc = rc || mqtt_ng_generate_publish(&client->main_buffer, log, "test/window", CALLER_RESPONSIBILITY, msg, CALLER_RESPONSIBILITY, sizeof(msg), 1 << MQTT_PUBLISH_FLAG_QOS_BITSHIFT, &second_id, 0);
+    rc = rc || mqtt_generate_puback(&client->main_buffer, log, 1, 0);
+    rc = rc || mqtt_generate_puback(&client->main_buffer, log, 2, 0);
+
+    LOCK_HDR_BUFFER(&client->main_buffer);
+    for (int i = 0; !rc && i < 100; i++)
+        try_send_all(client);
+
+    // second PUBLISH waits for window, PUBACKs behind it go ahead
+    char types[8];
+    static const char expected_blocked[] = { MQTT_CPT_PUBLISH, MQTT_CPT_PUBACK, MQTT_CPT_PUBACK };
+    rc = rc || test_sent_types(&t, types) != sizeof(expected_blocked) || memcmp(types, expected_blocked, sizeof(expected_blocked));
+    UNLOCK_HDR_BUFFER(&client->main_buffer);
+
+    rc = rc || mark_packet_acked(client, first_id);
+
+    LOCK_HDR_BUFFER(&client->main_buffer);
+    for (int i = 0; !rc && i < 100; i++)
+        try_send_all(client);
+    static const char expected[] = { MQTT_CPT_PUBLISH, MQTT_CPT_PUBACK, MQTT_CPT_PUBACK, MQTT_CPT_PUBLISH };
+    rc = rc || test_sent_types(&t, types) != sizeof(expected) || memcmp(types, expected, sizeof(expected));
+    UNLOCK_HDR_BUFFER(&client->main_buffer);
+
+    mqtt_ng_destroy(client);
+    return rc;
+}
+
+int test_mqtt_ng_window_bypass()
+{
+    mqtt_wss_log_ctx_t log = mqtt_wss_log_ctx_create("test_window", NULL);
+    int rc = 0;
+    for (int vectored = 0; vectored < 2; vectored++) {
+        // partial writes must not make the waiting PUBLISH lost
+        static const size_t max_writes[] = { SIZE_MAX, 3 };
+        for (size_t i = 0; i < sizeof(max_writes) / sizeof(max_writes[0]); i++) {
+            if (test_window_bypass_run(log, vectored, max_writes[i])) {
+                fprintf(stderr, "mqtt_ng_next_to_send(vectored:%d, max_write:%zu): Wrong packets sent\n", vectored, max_writes[i]);
+                rc = 1;
+            }
+        }
+    }
+    mqtt_wss_log_ctx_destroy(log);
+    return rc;
+}
+
+// gives first chunk of payload, then fails
+static ssize_t test_stream_pull(void *ctx, size_t offset, char *buf, size_t len)
+{
+    int *calls = ctx;
+    if ((*calls)++)
+        return -1;
+    memset(buf, 'x', len);
+    (void)offset;
+    return len;
+}
+
+int test_mqtt_ng_stream_pull_error()
+{
+    mqtt_wss_log_ctx_t log = mqtt_wss_log_ctx_create("test_stream", NULL);
+    int rc = 0;
+    for (int vectored = 0; vectored < 2; vectored++) {
+        struct test_transport t = { .len = 0, .max_write = SIZE_MAX };
+        struct mqtt_ng_init settings = {
+            .log = log,
+            .data_out_fnc = &test_send_cb,
+            .data_outv_fnc = vectored ? &test_sendv_cb : NULL,
+            .user_ctx = &t
+        };
+        struct mqtt_ng_client *client = mqtt_ng_init(&settings);
+        if (!client) {
+            rc = 1;
+            break;
+        }
+        client->client_state = CONNECTED;
+
+        int calls = 0;
+        struct mqtt_stream_source src = { .pull = &test_stream_pull, .ctx = &calls, .chunk_size = 16 };
+        int run_rc = mqtt_ng_publish_stream(client, "test/stream", CALLER_RESPONSIBILITY, 64, 0, &src, NULL);
+
+        LOCK_HDR_BUFFER(&client->main_buffer);
+        for (int i = 0; !run_rc && i < 10; i++)
+            try_send_all(client);
+        UNLOCK_HDR_BUFFER(&client->main_buffer);
+
+        // connection has to be dropped, failed producer is not asked again
+        run_rc = run_rc || client->client_state != ERROR || calls != 2;
+        if (run_rc) {
+            fprintf(stderr, "mqtt_ng_publish_stream(vectored:%d): pull error didn't put client into ERROR state (pull called %d times)\n", vectored, calls);
+            rc = 1;
+        }
+        mqtt_ng_destroy(client);
+    }
+    mqtt_wss_log_ctx_destroy(log);
+    return rc;
+}
+
+static void test_chunk_cb(void *ctx, const struct mqtt_rx_msg_chunk *chunk)
+{
+    (void)chunk;
+    (*(int *)ctx)++;
+}
+
+static void test_route_cb(void *ctx, const struct mqtt_rx_msg *msg)
+{
+    // has to be whole
+    if (msg->data_len == 32)
+        (*(int *)ctx)++;
+}
+
+// QOS0 PUBLISH with 32 byte payload and no properties
+static size_t test_publish_packet(char *pkt, const char *topic)
+{
+    size_t topic_len = strlen(topic);
+    size_t len = 0;
+    pkt[len++] = MQTT_CPT_PUBLISH << 4;
+    pkt[len++] = 2 + topic_len + 1 + 32;
+    pkt[len++] = 0;
+    pkt[len++] = topic_len;
+    memcpy(&pkt[len], topic, topic_len);
+    len += topic_len;
+    pkt[len++] = 0;
+    memset(&pkt[len], 'x', 32);
+    return len + 32;
+}
+
+int test_mqtt_ng_chunk_route()
+{
+    mqtt_wss_log_ctx_t log = mqtt_wss_log_ctx_create("test_chunk", NULL);
+    struct test_transport t = { .len = 0, .max_write = SIZE_MAX };
+    struct mqtt_ng_init settings = {
+        .log = log,
+        .data_out_fnc = &test_send_cb,
+        .user_ctx = &t
+    };
+    struct mqtt_ng_client *client = mqtt_ng_init(&settings);
+    if (!client) {
+        mqtt_wss_log_ctx_destroy(log);
+        return 1;
+    }
+    client->client_state = CONNECTED;
+
+    int chunks = 0, routed = 0;
+    mqtt_ng_set_msg_chunk_callback(client, 16, &test_chunk_cb, &chunks);
+    int rc = !mqtt_ng_router_add(client->router, "test/routed/#", &test_route_cb, &routed);
+
+    char pkt[128];
+    rbuf_t rx = rbuf_create(1024);
+    rbuf_push(rx, pkt, test_publish_packet(pkt, "test/routed/a"));
+    rbuf_push(rx, pkt, test_publish_packet(pkt, "test/other"));
+    rc = rc || mqtt_ng_process_rx(client, rx, rbuf_bytes_available(rx)) <= 0;
+
+    // routed message goes whole to the route, the other one in chunks
+    rc = rc || routed != 1 || !chunks || rbuf_bytes_available(rx);
+    if (rc)
+        fprintf(stderr, "mqtt_ng_set_msg_chunk_callback: routed message delivered in chunks (routed:%d chunks:%d)\n", routed, chunks);
+
+    rbuf_free(rx);
+    mqtt_ng_destroy(client);
+    mqtt_wss_log_ctx_destroy(log);
+    return rc;
+}
+
+static void test_count_cb(void *ctx, const struct mqtt_rx_msg *msg)
+{
+    (void)msg;
+    (*(int *)ctx)++;
+}
+
+// queues unsent QOS0 PUBLISHes until the buffer can't grow anymore
+static int test_fill_buffer(struct mqtt_ng_client *client)
+{
+    char msg = 0;
+    uint16_t packet_id;
+    for (int i = 0; i < 1000000; i++) {
+        int rc = mqtt_ng_publish(client, "t", CALLER_RESPONSIBILITY, &msg, CALLER_RESPONSIBILITY, sizeof(msg), 0, &packet_id);
+        if (rc == MQTT_NG_MSGGEN_BUFFER_OOM)
+            return 0;
+        if (rc)
+            return 1;
+    }
+    return 1;
+}
+
+int test_mqtt_ng_subscribe_route_fail()
+{
+    mqtt_wss_log_ctx_t log = mqtt_wss_log_ctx_create("test_subscribe", NULL);
+    struct test_transport t = { .len = 0, .max_write = SIZE_MAX };
+    struct mqtt_ng_init settings = {
+        .log = log,
+        .data_out_fnc = &test_send_cb,
+        .user_ctx = &t
+    };
+    struct mqtt_ng_client *client = mqtt_ng_init(&settings);
+    if (!client) {
+        mqtt_wss_log_ctx_destroy(log);
+        return 1;
+    }
+    client->client_state = CONNECTED;
+    client->sub_ids_available = 1;
+
+    int kept = 0, replacing = 0, added = 0;
+    struct mqtt_sub kept_sub = { .topic = "test/kept/#", .topic_free = CALLER_RESPONSIBILITY };
+    struct mqtt_sub added_sub = { .topic = "test/added/#", .topic_free = CALLER_RESPONSIBILITY };
+    int rc = mqtt_ng_subscribe_route(client, &kept_sub, &test_count_cb, &kept);
+    rc = rc || test_fill_buffer(client);
+
+    // SUBSCRIBE can't be queued, routes have to be as they were before
+    rc = rc || mqtt_ng_subscribe_route(client, &kept_sub, &test_count_cb, &replacing) != MQTT_NG_MSGGEN_BUFFER_OOM;
+    rc = rc || mqtt_ng_subscribe_route(client, &added_sub, &test_count_cb, &added) != MQTT_NG_MSGGEN_BUFFER_OOM;
+    struct mqtt_rx_msg kept_msg = { .topic = "test/kept/a", .topic_len = strlen("test/kept/a") };
+    rc = rc || mqtt_ng_router_dispatch(client->router, &kept_msg, NULL, 0) != 1 || kept != 1 || replacing;
+    rc = rc || mqtt_ng_router_match(client->router, "test/added/a", NULL, 0);
+    if (rc)
+        fprintf(stderr, "mqtt_ng_subscribe_route: route left changed after failed SUBSCRIBE (kept:%d replacing:%d)\n", kept, replacing);
+
+    mqtt_ng_destroy(client);
+    mqtt_wss_log_ctx_destroy(log);
+    return rc;
+}
+
+int test_mqtt_ng_prepared_alias()
+{
+    mqtt_wss_log_ctx_t log = mqtt_wss_log_ctx_create("test_prepared", NULL);
+    struct test_transport t = { .len = 0, .max_write = SIZE_MAX };
+    struct mqtt_ng_init settings = {
+        .log = log,
+        .data_out_fnc = &test_send_cb,
+        .user_ctx = &t
+    };
+    struct mqtt_ng_client *client = mqtt_ng_init(&settings);
+    if (!client) {
+        mqtt_wss_log_ctx_destroy(log);
+        return 1;
+    }
+    client->client_state = CONNECTED;
+    client->tx_topic_aliases.server_max = 10;
+
+    // alias set after preparing has to be used
+    static const char topic[] = "test/prepared";
+    struct mqtt_prepared_publish *pp = mqtt_ng_prepare_publish(client, topic, 0);
+    uint16_t alias = mqtt_ng_set_topic_alias(client, topic);
+    char msg[4] = { 0 };
+    int rc = !pp || !alias;
+    rc = rc || mqtt_ng_publish_prepared(client, pp, msg, CALLER_RESPONSIBILITY, sizeof(msg), NULL);
+    rc = rc || mqtt_ng_publish_prepared(client, pp, msg, CALLER_RESPONSIBILITY, sizeof(msg), NULL);
+    // queued messages don't reference freed handle
+    mqtt_ng_prepared_publish_free(client, pp);
+
+    LOCK_HDR_BUFFER(&client->main_buffer);
+    for (int i = 0; !rc && i < 100; i++)
+        try_send_all(client);
+    UNLOCK_HDR_BUFFER(&client->main_buffer);
+
+    // first PUBLISH binds alias to topic, second one has empty Topic Name
+    // Properties: length 3, Topic Alias (alias < 256)
+    static const char expected_alias[] = { 3, MQTT_PROP_TOPIC_ALIAS, 0 };
+    size_t first_len = 2 + 2 + strlen(topic) + sizeof(expected_alias) + 1 + sizeof(msg);
+    char *second = &t.data[first_len];
+    rc = rc || t.len != first_len + 2 + 2 + sizeof(expected_alias) + 1 + sizeof(msg);
+    rc = rc || memcmp(&t.data[4], topic, strlen(topic));
+    rc = rc || memcmp(&t.data[4 + strlen(topic)], expected_alias, sizeof(expected_alias)) || t.data[4 + strlen(topic) + 3] != alias;
+    rc = rc || second[2] || second[3];
+    rc = rc || memcmp(&second[4], expected_alias, sizeof(expected_alias)) || second[4 + 3] != alias;
+    if (rc)
+        fprintf(stderr, "mqtt_ng_publish_prepared: topic alias set after preparing not applied\n");
+
+    mqtt_ng_destroy(client);
+    mqtt_wss_log_ctx_destroy(log);
+    return rc;
+}
+
+int test_mqtt_ng_inflight_index()
+{
+    struct transaction_buffer buf;
+    memset(&buf, 0, sizeof(buf));
+    if (transaction_buffer_init(&buf))
+        return 1;
+    struct inflight_index *idx = &buf.inflight;
+
+    // ids are given in order, packet is found by its id until removed
+    struct buffer_fragment frags[4];
+    memset(frags, 0, sizeof(frags));
+    int rc = 0;
+    for (int i = 0; !rc && i < 3; i++) {
+        frags[i].packet_id = inflight_get_unused_id(idx);
+        rc = frags[i].packet_id != i + 1;
+        inflight_add(&buf, &frags[i]);
+    }
+    rc = rc || inflight_get(&buf, 2) != &frags[1] || inflight_get(&buf, 4);
+    inflight_remove(idx, 2);
+    rc = rc || inflight_get(&buf, 2) || inflight_get(&buf, 3) != &frags[2] || idx->count != 2;
+    if (rc) {
+        fprintf(stderr, "inflight_get: Wrong packet found\n");
+        goto out;
+    }
+
+    // freed id is reused only after wrapping around, 0 and ids in use are skipped
+    idx->last_id = UINT16_MAX - 1;
+    frags[3].packet_id = UINT16_MAX;
+    inflight_add(&buf, &frags[3]);
+    rc = inflight_get_unused_id(idx) != 2 || inflight_get_unused_id(idx) != 4;
+    if (rc) {
+        fprintf(stderr, "inflight_get_unused_id: Wrong id after wrap around\n");
+        goto out;
+    }
+
+    // no id left until one is acknowledged
+    struct buffer_fragment frag;
+    memset(&frag, 0, sizeof(frag));
+    for (uint32_t id = 1; id <= UINT16_MAX; id++) {
+        if (inflight_is_set(idx, id))
+            continue;
+        frag.packet_id = id;
+        inflight_add(&buf, &frag);
+    }
+    rc = idx->count != UINT16_MAX || inflight_get_unused_id(idx);
+    inflight_remove(idx, 777);
+    rc = rc || inflight_get_unused_id(idx) != 777 || inflight_get(&buf, 777);
+    if (rc)
+        fprintf(stderr, "inflight_get_unused_id: Id in use given out or free one not found\n");
+
+out:
+    transaction_buffer_destroy(&buf);
+    return rc;
+}
+
+static ssize_t test_discard_cb(void *user_ctx, const void *buf, size_t len)
+{
+    (void)user_ctx;
+    (void)buf;
+    return len;
+}
+
+// queues QOS1 PUBLISH (stored in buffer whole), returns its packet id or 0
+static uint16_t test_publish_qos1(struct mqtt_ng_client *client)
+{
+    char msg[64] = { 0 };
+    uint16_t packet_id;
+    if (mqtt_ng_publish(client, "test/segments", NULL, msg, NULL, sizeof(msg), 1 << MQTT_PUBLISH_FLAG_QOS_BITSHIFT, &packet_id))
+        return 0;
+    return packet_id;
+}
+
+static int test_ack_in_segment(struct mqtt_ng_client *client, struct buffer_segment *seg, const uint16_t *ids, size_t count)
+{
+    size_t acked = 0;
+    for (size_t i = 0; i < count; i++) {
+        struct buffer_fragment *frag = inflight_get(&client->main_buffer, ids[i]);
+        if (frag && (!seg || SEGMENT_CONTAINS(seg, frag))) {
+            if (mark_packet_acked(client, ids[i]))
+                return -1;
+            acked++;
+        }
+    }
+    return acked;
+}
+
+static size_t test_packets_in_buffer(struct transaction_buffer *buf)
+{
+    size_t count = 0;
+    for (struct buffer_fragment *frag = buf->hdr_buffer.head_frag; frag; frag = frag->next)
+        count += !!(frag->flags & BUFFER_FRAG_MQTT_PACKET_HEAD);
+    return count;
+}
+
+#define TEST_SEGMENTS_MAX_MSGS 16384
+
+int test_mqtt_ng_buffer_segments()
+{
+    mqtt_wss_log_ctx_t log = mqtt_wss_log_ctx_create("test_segments", NULL);
+    struct mqtt_ng_init settings = {
+        .log = log,
+        .data_out_fnc = &test_discard_cb
+    };
+    struct mqtt_ng_client *client = mqtt_ng_init(&settings);
+    uint16_t *ids = mw_calloc(TEST_SEGMENTS_MAX_MSGS, sizeof(uint16_t));
+    if (!client || !ids) {
+        mw_free(ids);
+        mqtt_ng_destroy(client);
+        mqtt_wss_log_ctx_destroy(log);
+        return 1;
+    }
+    client->client_state = CONNECTED;
+    struct transaction_buffer *buf = &client->main_buffer;
+
+    // buffer grows by segments as messages waiting for PUBACK can't be collected
+    size_t count = 0;
+    int rc = 0;
+    while (!rc && buf->seg_count < 3 && count < TEST_SEGMENTS_MAX_MSGS)
+        rc = !(ids[count++] = test_publish_qos1(client));
+    rc = rc || buf->seg_count != 3;
+
+    LOCK_HDR_BUFFER(buf);
+    for (int i = 0; !rc && i < 1000 && buf->send_cursor != buf->hdr_buffer.tail_frag; i++)
+        try_send_all(client);
+    UNLOCK_HDR_BUFFER(buf);
+
+    // segment is released once all packets in it are acknowledged,
+    // segment with some packets still waiting is kept
+    struct buffer_segment *first = buf->seg_head, *second = first->next;
+    int acked_first = rc ? -1 : test_ack_in_segment(client, first, ids, count);
+    int acked_second = 0;
+    for (size_t i = 0; acked_first > 0 && acked_second >= 0 && i < count; i += 2)
+        acked_second += test_ack_in_segment(client, second, &ids[i], 1);
+    rc = rc || acked_first <= 0 || acked_second <= 0;
+
+    LOCK_HDR_BUFFER(buf);
+    if (!rc)
+        client_garbage_collect(client);
+    rc = rc || buf->seg_head != second || buf->seg_free != first || second->live_frags == 0;
+    rc = rc || test_packets_in_buffer(buf) != count - acked_first - acked_second;
+    UNLOCK_HDR_BUFFER(buf);
+    if (rc) {
+        fprintf(stderr, "transaction_buffer_garbage_collect: Segment not released (%zu messages, %d + %d acknowledged)\n", count, acked_first, acked_second);
+        goto out;
+    }
+
+    // released segment is reused rather than allocating new one
+    while (!rc && buf->seg_free && count < TEST_SEGMENTS_MAX_MSGS)
+        rc = !(ids[count++] = test_publish_qos1(client));
+    rc = rc || buf->seg_tail != first || buf->seg_count != 3;
+    if (rc) {
+        fprintf(stderr, "transaction_buffer_grow: Released segment not reused\n");
+        goto out;
+    }
+
+    // everything acknowledged, writing starts from the beginning of the last segment
+    LOCK_HDR_BUFFER(buf);
+    for (int i = 0; i < 1000 && buf->send_cursor != buf->hdr_buffer.tail_frag; i++)
+        try_send_all(client);
+    UNLOCK_HDR_BUFFER(buf);
+    rc = test_ack_in_segment(client, NULL, ids, count) < 0;
+    LOCK_HDR_BUFFER(buf);
+    client_garbage_collect(client);
+    rc = rc || buf->hdr_buffer.head_frag || buf->seg_head != buf->seg_tail || buf->hdr_buffer.tail != buf->seg_tail->data;
+    rc = rc || buf->inflight.count || buf->publish_bytes;
+    UNLOCK_HDR_BUFFER(buf);
+    if (rc)
+        fprintf(stderr, "transaction_buffer_garbage_collect: Buffer not empty after all messages were acknowledged\n");
+
+out:
+    mw_free(ids);
+    mqtt_ng_destroy(client);
+    mqtt_wss_log_ctx_destroy(log);
+    return rc;
+}
+
+#define TEST_QUEUE_PRODUCERS 4
+#define TEST_QUEUE_MSGS 100000
+
+struct test_queue_producer {
+    struct publish_queue *queue;
+    struct publish_queue_node *nodes;
+};
+
+static void *test_queue_producer(void *arg)
+{
+    struct test_queue_producer *producer = arg;
+    for (size_t i = 0; i < TEST_QUEUE_MSGS; i++)
+        publish_queue_push(producer->queue, &producer->nodes[i]);
+    return NULL;
+}
+
+int test_mqtt_ng_publish_queue()
+{
+    struct publish_queue queue;
+    memset(&queue, 0, sizeof(queue));
+    queue.head = queue.tail = &queue.stub;
+
+    // single node can be taken only with stub pushed behind it
+    struct publish_queue_node single;
+    publish_queue_push(&queue, &single);
+    int rc = publish_queue_pop(&queue) != &single || queue.head != &queue.stub || publish_queue_pop(&queue);
+    if (rc) {
+        fprintf(stderr, "publish_queue_pop: Last node not taken\n");
+        return 1;
+    }
+
+    // consumer keeps emptying the queue while producers push, so stub
+    // is pushed again among nodes of concurrent producers many times
+    struct test_queue_producer producers[TEST_QUEUE_PRODUCERS];
+    pthread_t threads[TEST_QUEUE_PRODUCERS];
+    size_t next_seq[TEST_QUEUE_PRODUCERS] = { 0 };
+    int started = 0;
+    for (int p = 0; p < TEST_QUEUE_PRODUCERS; p++) {
+        producers[p].queue = &queue;
+        producers[p].nodes = mw_calloc(TEST_QUEUE_MSGS, sizeof(struct publish_queue_node));
+        if (!producers[p].nodes) {
+            rc = 1;
+            break;
+        }
+        // producer in msg_ctx, sequence number in msg_len
+        for (size_t i = 0; i < TEST_QUEUE_MSGS; i++) {
+            producers[p].nodes[i].msg_ctx = &producers[p];
+            producers[p].nodes[i].entry.msg_len = i;
+        }
+    }
+    for (; !rc && started < TEST_QUEUE_PRODUCERS; started++) {
+        if (pthread_create(&threads[started], NULL, test_queue_producer, &producers[started]))
+            break;
+    }
+
+    size_t received = 0;
+    while (!rc && started == TEST_QUEUE_PRODUCERS && received < TEST_QUEUE_PRODUCERS * TEST_QUEUE_MSGS) {
+        struct publish_queue_node *node = publish_queue_pop(&queue);
+        if (!node)
+            continue;
+        received++;
+        if (node == &queue.stub) {
+            rc = 1;
+            break;
+        }
+        int p = (struct test_queue_producer *)node->msg_ctx - producers;
+        // every message exactly once, in order of its producer
+        if (node->entry.msg_len != next_seq[p]++)
+            rc = 1;
+    }
+    for (int p = 0; p < started; p++)
+        pthread_join(threads[p], NULL);
+    rc = rc || started != TEST_QUEUE_PRODUCERS || publish_queue_pop(&queue);
+    if (rc)
+        fprintf(stderr, "publish_queue_pop: Messages lost, duplicated or reordered (received %zu)\n", received);
+
+    for (int p = 0; p < TEST_QUEUE_PRODUCERS; p++)
+        mw_free(producers[p].nodes);
+    return rc;
+}
+
+// Topic Name length and Topic Alias (0 if none) of QOS0 PUBLISH packets sent
+static int test_sent_aliases(struct test_transport *t, int *topic_lens, int *aliases)
+{
+    int count = 0;
+    for (size_t pos = 0; pos + 1 < t->len; pos += 2 + (uint8_t)t->data[pos + 1]) {
+        const char *topic = &t->data[pos + 2];
+        topic_lens[count] = ((uint8_t)topic[0] << 8) | (uint8_t)topic[1];
+        const char *props = &topic[2 + topic_lens[count]];
+        aliases[count++] = props[0] ? ((uint8_t)props[2] << 8) | (uint8_t)props[3] : 0;
+    }
+    return count;
+}
+
+int test_mqtt_ng_prepared_auto_alias()
+{
+    mqtt_wss_log_ctx_t log = mqtt_wss_log_ctx_create("test_prepared", NULL);
+    struct test_transport t = { .len = 0, .max_write = SIZE_MAX };
+    struct mqtt_ng_init settings = {
+        .log = log,
+        .data_out_fnc = &test_send_cb,
+        .user_ctx = &t
+    };
+    struct mqtt_ng_client *client = mqtt_ng_init(&settings);
+    if (!client) {
+        mqtt_wss_log_ctx_destroy(log);
+        return 1;
+    }
+    client->client_state = CONNECTED;
+    client->tx_topic_aliases.server_max = 10;
+
+    static const char topic[] = "test/prepared/auto";
+    struct mqtt_prepared_publish *pp = mqtt_ng_prepare_publish(client, topic, 0);
+    char msg[4] = { 0 };
+    int rc = !pp || mqtt_ng_set_auto_topic_alias(client, 4);
+    // admitted on second publish, omitted from third one on (resolved header is kept)
+    for (int i = 0; !rc && i < 4; i++)
+        rc = mqtt_ng_publish_prepared(client, pp, msg, CALLER_RESPONSIBILITY, sizeof(msg), NULL);
+    rc = rc || !pp->hdr.cached;
+    // aliases known to server are forgotten with the cache
+    rc = rc || mqtt_ng_set_auto_topic_alias(client, 0);
+    rc = rc || mqtt_ng_publish_prepared(client, pp, msg, CALLER_RESPONSIBILITY, sizeof(msg), NULL);
+
+    LOCK_HDR_BUFFER(&client->main_buffer);
+    for (int i = 0; !rc && i < 100; i++)
+        try_send_all(client);
+    UNLOCK_HDR_BUFFER(&client->main_buffer);
+
+    int topic_lens[8], aliases[8];
+    const int len = strlen(topic);
+    static const int expected_aliases[] = { 0, 10, 10, 10, 0 };
+    rc = rc || test_sent_aliases(&t, topic_lens, aliases) != 5;
+    rc = rc || topic_lens[0] != len || topic_lens[1] != len || topic_lens[2] || topic_lens[3] || topic_lens[4] != len;
+    rc = rc || memcmp(aliases, expected_aliases, sizeof(expected_aliases));
+    if (rc)
+        fprintf(stderr, "mqtt_ng_publish_prepared: automatic topic alias not applied\n");
+
+    mqtt_ng_prepared_publish_free(client, pp);
+    mqtt_ng_destroy(client);
+    mqtt_wss_log_ctx_destroy(log);
+    return rc;
+}
+#endif /* TESTS */
+
+#ifdef MQTT_WSS_BENCH
+// microbenchmarks of mqtt_ng internals (driven by bench_micro.c)
+// all of them return average nanoseconds per operation or -1 on error
+
+static ssize_t bench_send_cb(void *user_ctx, const void *buf, size_t len)
+{
+    (void)user_ctx;
+    (void)buf;
+    return len;
+}
+
+static ssize_t bench_sendv_cb(void *user_ctx, const struct iovec *iov, int iovcnt)
+{
+    (void)user_ctx;
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+    return len;
+}
+
+static void bench_msg_borrowed_cb(void *ctx, const struct mqtt_rx_msg *msg)
+{
+    *(size_t *)ctx += msg->data_len;
+}
+
+// client which is "connected" to transport accepting everything
+// data_in is not set, mqtt_ng_sync must not be used
+static struct mqtt_ng_client *bench_client_new(mqtt_wss_log_ctx_t log)
+{
+    struct mqtt_ng_init settings = {
+        .log = log,
+        .data_out_fnc = &bench_send_cb,
+        .data_outv_fnc = &bench_sendv_cb
+    };
+    struct mqtt_ng_client *client = mqtt_ng_init(&settings);
+    if (client)
+        client->client_state = CONNECTED;
+    return client;
+}
+
+#define BENCH_TOPIC "bench/topic/name"
+
+// generation of QOS0 PUBLISH (message and topic not copied)
+// sending and GC are done outside of measured time whenever buffer fills up
+double bench_mqtt_ng_generate_publish(mqtt_wss_log_ctx_t log, size_t msg_len, size_t count)
+{
+    struct mqtt_ng_client *client = bench_client_new(log);
+    if (!client)
+        return -1;
+    char *msg = mw_calloc(1, msg_len ? msg_len : 1);
+    uint64_t total = 0;
+    size_t done = 0;
+
+    while (done < count) {
+        size_t batch = 0;
+        uint64_t start = mqtt_wss_instr_now_ns();
+        for (; done < count; done++, batch++) {
+            uint16_t packet_id;
+            int rc = mqtt_ng_generate_publish(&client->main_buffer, log, BENCH_TOPIC, CALLER_RESPONSIBILITY, msg, CALLER_RESPONSIBILITY, msg_len, 0, &packet_id, 0);
+            if (rc == MQTT_NG_MSGGEN_BUFFER_OOM)
+                break;
+            if (rc)
+                goto err;
+        }
+        total += mqtt_wss_instr_now_ns() - start;
+        if (done < count && !batch)
+            goto err;
+
+        LOCK_HDR_BUFFER(&client->main_buffer);
+        try_send_all(client);
+        transaction_buffer_garbage_collect(&client->main_buffer, log);
+        UNLOCK_HDR_BUFFER(&client->main_buffer);
+    }
+
+    mw_free(msg);
+    mqtt_ng_destroy(client);
+    return count ? (double)total / count : 0;
+err:
+    mw_free(msg);
+    mqtt_ng_destroy(client);
+    return -1;
+}
+
+// same as bench_mqtt_ng_generate_publish using mqtt_ng_prepare_publish handle
+double bench_mqtt_ng_generate_prepared_publish(mqtt_wss_log_ctx_t log, size_t msg_len, size_t count)
+{
+    struct mqtt_ng_client *client = bench_client_new(log);
+    if (!client)
+        return -1;
+    struct mqtt_prepared_publish *pp = mqtt_ng_prepare_publish(client, BENCH_TOPIC, 0);
+    char *msg = mw_calloc(1, msg_len ? msg_len : 1);
+    uint64_t total = 0;
+    size_t done = 0;
+    if (!pp)
+        goto err;
+
+    while (done < count) {
+        size_t batch = 0;
+        uint64_t start = mqtt_wss_instr_now_ns();
+        for (; done < count; done++, batch++) {
+            uint16_t packet_id;
+            LOCK_HDR_BUFFER(&client->main_buffer);
+            int rc = mqtt_ng_generate_prepared_publish_locked(&client->main_buffer, log, pp, msg, CALLER_RESPONSIBILITY, msg_len, &packet_id);
+            UNLOCK_HDR_BUFFER(&client->main_buffer);
+            if (rc == MQTT_NG_MSGGEN_BUFFER_OOM)
+                break;
+            if (rc)
+                goto err;
+        }
+        total += mqtt_wss_instr_now_ns() - start;
+        if (done < count && !batch)
+            goto err;
+
+        LOCK_HDR_BUFFER(&client->main_buffer);
+        try_send_all(client);
+        transaction_buffer_garbage_collect(&client->main_buffer, log);
+        UNLOCK_HDR_BUFFER(&client->main_buffer);
+    }
+
+    mw_free(msg);
+    mqtt_ng_destroy(client);
+    return count ? (double)total / count : 0;
+err:
+    mw_free(msg);
+    mqtt_ng_destroy(client);
+    return -1;
+}
+
+// parsing of incoming QOS0 PUBLISH delivered to borrowing callback
+double bench_mqtt_ng_parse_publish(mqtt_wss_log_ctx_t log, size_t msg_len, size_t count)
+{
+    struct mqtt_ng_client *client = bench_client_new(log);
+    if (!client)
+        return -1;
+    size_t delivered = 0;
+    mqtt_ng_set_msg_borrowed_callback(client, &bench_msg_borrowed_cb, &delivered);
+
+    size_t topic_len = strlen(BENCH_TOPIC);
+    size_t remaining = 2 + topic_len + 1 /* property length */ + msg_len;
+    char *pkt = mw_calloc(1, 1 + MQTT_VARSIZE_INT_BYTES(remaining) + remaining);
+    size_t pkt_len = 0;
+    pkt[pkt_len++] = MQTT_CPT_PUBLISH << 4;
+    pkt_len += uint32_to_mqtt_vbi(remaining, &pkt[pkt_len]);
+    pkt[pkt_len++] = topic_len >> 8;
+    pkt[pkt_len++] = topic_len & 0xFF;
+    memcpy(&pkt[pkt_len], BENCH_TOPIC, topic_len);
+    pkt_len += topic_len;
+    pkt[pkt_len++] = 0;
+    pkt_len += msg_len;
+
+    size_t rx_size = pkt_len * 16 > 1024 * 1024 ? pkt_len * 16 : 1024 * 1024;
+    rbuf_t rx = rbuf_create(rx_size);
+    uint64_t total = 0;
+    size_t pushed = 0;
+    while (pushed < count) {
+        while (pushed < count && rbuf_bytes_free(rx) >= pkt_len) {
+            rbuf_push(rx, pkt, pkt_len);
+            pushed++;
+        }
+        uint64_t start = mqtt_wss_instr_now_ns();
+        ssize_t rc = mqtt_ng_process_rx(client, rx, rbuf_bytes_available(rx));
+        total += mqtt_wss_instr_now_ns() - start;
+        if (rc <= 0)
+            break;
+    }
+
+    int ok = (delivered == count * msg_len && !rbuf_bytes_available(rx));
+    rbuf_free(rx);
+    mw_free(pkt);
+    mqtt_ng_destroy(client);
+    if (!ok)
+        return -1;
+    return count ? (double)total / count : 0;
+}
+
+// client for bench_replay, process incoming data exactly as in live session
+// starting with CONNACK (capture begins with the server reply to CONNECT)
+struct mqtt_ng_client *bench_mqtt_ng_replay_client_new(mqtt_wss_log_ctx_t log, rbuf_t data_in)
+{
+    struct mqtt_ng_init settings = {
+        .log = log,
+        .data_in = data_in,
+        .data_out_fnc = &bench_send_cb,
+        .data_outv_fnc = &bench_sendv_cb
+    };
+    struct mqtt_ng_client *client = mqtt_ng_init(&settings);
+    if (client) {
+        client->client_state = CONNECTING;
+        client->rx_replay = 1;
+    }
+    return client;
+}
+
+// single GC pass over buffer of given number of sent PUBLISH packets
+// every other one is QOS1 waiting for PUBACK (can't be freed)
+double bench_mqtt_ng_garbage_collect(mqtt_wss_log_ctx_t log, size_t packets, int rounds)
+{
+    char msg[64] = { 0 };
+    uint64_t total = 0;
+
+    for (int round = 0; round < rounds; round++) {
+        struct mqtt_ng_client *client = bench_client_new(log);
+        if (!client)
+            return -1;
+        LOCK_HDR_BUFFER(&client->main_buffer);
+        for (size_t i = 0; i < packets; i++) {
+            uint16_t packet_id;
+            uint8_t flags = (i % 2) << MQTT_PUBLISH_FLAG_QOS_BITSHIFT;
+            int rc = mqtt_ng_generate_publish_locked(&client->main_buffer, log, BENCH_TOPIC, CALLER_RESPONSIBILITY, msg, CALLER_RESPONSIBILITY, sizeof(msg), flags, &packet_id, 0);
+            if (rc == MQTT_NG_MSGGEN_BUFFER_OOM) {
+                if (transaction_buffer_grow(&client->main_buffer, log, SIZE_MAX)) {
+                    UNLOCK_HDR_BUFFER(&client->main_buffer);
+                    mqtt_ng_destroy(client);
+                    return -1;
+                }
+                i--;
+                continue;
+            }
+        }
+        try_send_all(client);
+
+        uint64_t start = mqtt_wss_instr_now_ns();
+        transaction_buffer_garbage_collect(&client->main_buffer, log);
+        total += mqtt_wss_instr_now_ns() - start;
+        UNLOCK_HDR_BUFFER(&client->main_buffer);
+        mqtt_ng_destroy(client);
+    }
+    return rounds ? (double)total / rounds : 0;
+}
+
+// queuing and sending of QOS0 PUBLISH one by one while given number
+// of sent QOS1 PUBLISH packets wait for PUBACK in front of them
+double bench_mqtt_ng_send_behind_unacked(mqtt_wss_log_ctx_t log, size_t unacked, size_t count)
+{
+    char msg[64] = { 0 };
+    uint64_t total = 0;
+    struct mqtt_ng_client *client = bench_client_new(log);
+    if (!client)
+        return -1;
+
+    LOCK_HDR_BUFFER(&client->main_buffer);
+    for (size_t i = 0; i < unacked + count; i++) {
+        uint16_t packet_id;
+        uint8_t flags = (i < unacked) << MQTT_PUBLISH_FLAG_QOS_BITSHIFT;
+        uint64_t start = mqtt_wss_instr_now_ns();
+        int rc = mqtt_ng_generate_publish_locked(&client->main_buffer, log, BENCH_TOPIC, CALLER_RESPONSIBILITY, msg, CALLER_RESPONSIBILITY, sizeof(msg), flags, &packet_id, 0);
+        if (rc == MQTT_NG_MSGGEN_BUFFER_OOM) {
+            transaction_buffer_garbage_collect(&client->main_buffer, log);
+            if (transaction_buffer_grow(&client->main_buffer, log, SIZE_MAX)) {
+                UNLOCK_HDR_BUFFER(&client->main_buffer);
+                mqtt_ng_destroy(client);
+                return -1;
+            }
+            i--;
+            continue;
+        }
+        try_send_all(client);
+        if (i >= unacked)
+            total += mqtt_wss_instr_now_ns() - start;
+    }
+    UNLOCK_HDR_BUFFER(&client->main_buffer);
+    mqtt_ng_destroy(client);
+    return count ? (double)total / count : 0;
+}
+#endif /* MQTT_WSS_BENCH */
@@ -0,0 +1,430 @@
+// SPDX-License-Identifier: GPL-3.0-only
+//
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free Software Foundation, version 3.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+// See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with this program.
+// If not, see <https://www.gnu.org/licenses/>.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "mqtt_ng_alias.h"
+#include "common_internal.h"
+
+#define SKETCH_DEPTH 4
+#define SKETCH_WIDTH 1024 // must be power of 2
+// counters are halved after this many samples so that
+// topics which were hot long time ago give up their slots eventually
+#define SKETCH_AGING_PERIOD (SKETCH_WIDTH * 8)
+
+// how many slots are compared to find the coldest one
+#define EVICTION_SAMPLES 8
+// topic published just once doesn't get a slot
+#define ADMISSION_MIN_FREQ 2
+
+#define INDEX_MIN_SIZE 16
+
+struct alias_slot {
+    char *topic; // NULL if slot is free
+    uint64_t hash;
+    int established; // set concurrently under shared lock
+};
+
+struct mqtt_ng_alias_cache {
+    uint8_t sketch[SKETCH_DEPTH][SKETCH_WIDTH];
+    uint32_t samples;
+
+    struct alias_slot *slots;
+    uint16_t slot_count;
+    // slots are filled in order, once all are used eviction replaces them in place
+    uint16_t slots_filled;
+    // where next eviction sampling starts
+    uint16_t hand;
+
+    // topic -> slot index + 1 (0 is empty), open addressing with linear probing
+    // at least twice as big as slot_count so there is always an empty entry
+    uint32_t *index;
+    uint32_t index_mask;
+};
+
+struct mqtt_ng_alias_cache *mqtt_ng_alias_cache_new(uint16_t slot_count)
+{
+    struct mqtt_ng_alias_cache *cache = mw_calloc(1, sizeof(struct mqtt_ng_alias_cache));
+    if (!cache)
+        return NULL;
+
+    uint32_t index_size = INDEX_MIN_SIZE;
+    while (index_size < 2 * (uint32_t)slot_count)
+        index_size <<= 1;
+
+    cache->slots = mw_calloc(slot_count, sizeof(struct alias_slot));
+    cache->index = mw_calloc(index_size, sizeof(uint32_t));
+    if (!cache->slots || !cache->index) {
+        mw_free(cache->slots);
+        mw_free(cache->index);
+        mw_free(cache);
+        return NULL;
+    }
+    cache->slot_count = slot_count;
+    cache->index_mask = index_size - 1;
+    return cache;
+}
+
+void mqtt_ng_alias_cache_reset(struct mqtt_ng_alias_cache *cache)
+{
+    // frequencies are kept, they are still valid for the new connection
+    for (uint16_t i = 0; i < cache->slot_count; i++) {
+        mw_free(cache->slots[i].topic);
+        cache->slots[i].topic = NULL;
+    }
+    memset(cache->index, 0, (cache->index_mask + 1) * sizeof(uint32_t));
+    cache->slots_filled = 0;
+    cache->hand = 0;
+}
+
+void mqtt_ng_alias_cache_destroy(struct mqtt_ng_alias_cache *cache)
+{
+    if (!cache)
+        return;
+    mqtt_ng_alias_cache_reset(cache);
+    mw_free(cache->slots);
+    mw_free(cache->index);
+    mw_free(cache);
+}
+
+// FNV-1a
+static uint64_t topic_hash(const char *topic, size_t *len)
+{
+    const char *c = topic;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    while (*c) {
+        hash ^= (uint8_t)*c++;
+        hash *= 0x100000001b3ULL;
+    }
+    *len = c - topic;
+    return hash;
+}
+
+// rows are derived from the two halves of single hash [Kirsch, Mitzenmacher]
+static inline uint32_t sketch_pos(uint64_t hash, int row)
+{
+    uint32_t h1 = (uint32_t)hash;
+    uint32_t h2 = (uint32_t)(hash >> 32) | 1;
+    return (h1 + row * h2) & (SKETCH_WIDTH - 1);
+}
+
+// sketch is updated under shared lock by many threads at once, counters are
+// accessed atomically but updates are not, increments lost to races only
+// make the (approximate) frequencies a bit lower
+static uint8_t sketch_estimate(struct mqtt_ng_alias_cache *cache, uint64_t hash)
+{
+    uint8_t min = UINT8_MAX;
+    for (int row = 0; row < SKETCH_DEPTH; row++) {
+        uint8_t cnt = __atomic_load_n(&cache->sketch[row][sketch_pos(hash, row)], __ATOMIC_RELAXED);
+        if (cnt < min)
+            min = cnt;
+    }
+    return min;
+}
+
+static void sketch_age(struct mqtt_ng_alias_cache *cache)
+{
+    for (int row = 0; row < SKETCH_DEPTH; row++) {
+        for (int i = 0; i < SKETCH_WIDTH; i++)
+            __atomic_store_n(&cache->sketch[row][i], __atomic_load_n(&cache->sketch[row][i], __ATOMIC_RELAXED) >> 1, __ATOMIC_RELAXED);
+    }
+}
+
+// conservative update (only counters equal to the estimate are incremented)
+// keeps overestimation of rare topics colliding with hot ones low
+static uint8_t sketch_add(struct mqtt_ng_alias_cache *cache, uint64_t hash)
+{
+    uint8_t est = sketch_estimate(cache, hash);
+    if (est < UINT8_MAX) {
+        for (int row = 0; row < SKETCH_DEPTH; row++) {
+            uint8_t *cnt = &cache->sketch[row][sketch_pos(hash, row)];
+            if (__atomic_load_n(cnt, __ATOMIC_RELAXED) == est)
+                __atomic_store_n(cnt, est + 1, __ATOMIC_RELAXED);
+        }
+        est++;
+    }
+    // only one thread sees the counter reach the period
+    if (__atomic_add_fetch(&cache->samples, 1, __ATOMIC_RELAXED) == SKETCH_AGING_PERIOD) {
+        sketch_age(cache);
+        __atomic_store_n(&cache->samples, 0, __ATOMIC_RELAXED);
+    }
+    return est;
+}
+
+// returns entry of topic or empty entry where it should be inserted
+static uint32_t *index_find(struct mqtt_ng_alias_cache *cache, uint64_t hash, const char *topic)
+{
+    for (uint32_t pos = hash & cache->index_mask; ; pos = (pos + 1) & cache->index_mask) {
+        uint32_t *entry = &cache->index[pos];
+        if (!*entry)
+            return entry;
+        struct alias_slot *slot = &cache->slots[*entry - 1];
+        if (slot->hash == hash && !strcmp(slot->topic, topic))
+            return entry;
+    }
+}
+
+// backward shift deletion, following entries are moved into the hole
+// unless the hole lies before their home position
+static void index_remove(struct mqtt_ng_alias_cache *cache, uint32_t *entry)
+{
+    uint32_t mask = cache->index_mask;
+    uint32_t hole = entry - cache->index;
+    uint32_t pos = hole;
+
+    for (;;) {
+        pos = (pos + 1) & mask;
+        if (!cache->index[pos])
+            break;
+        uint32_t home = cache->slots[cache->index[pos] - 1].hash & mask;
+        if (((pos - home) & mask) >= ((pos - hole) & mask)) {
+            cache->index[hole] = cache->index[pos];
+            hole = pos;
+        }
+    }
+    cache->index[hole] = 0;
+}
+
+static void slot_release(struct mqtt_ng_alias_cache *cache, int idx)
+{
+    struct alias_slot *slot = &cache->slots[idx];
+    index_remove(cache, index_find(cache, slot->hash, slot->topic));
+    mw_free(slot->topic);
+    slot->topic = NULL;
+}
+
+// returns slot to be given to topic of frequency freq or -1
+static int slot_for_topic(struct mqtt_ng_alias_cache *cache, uint8_t freq, uint16_t capacity)
+{
+    if (cache->slots_filled < capacity)
+        return cache->slots_filled++;
+
+    int victim = -1;
+    uint8_t victim_freq = UINT8_MAX;
+    for (int i = 0; i < EVICTION_SAMPLES && i < capacity; i++) {
+        int candidate = (cache->hand + i) % capacity;
+        if (!cache->slots[candidate].topic) {
+            victim = candidate;
+            victim_freq = 0;
+            break;
+        }
+        uint8_t candidate_freq = sketch_estimate(cache, cache->slots[candidate].hash);
+        if (candidate_freq < victim_freq) {
+            victim = candidate;
+            victim_freq = candidate_freq;
+        }
+    }
+    cache->hand = (cache->hand + EVICTION_SAMPLES) % capacity;
+
+    // new topic has to be hotter than the one it replaces
+    // otherwise two topics could keep stealing the slot from each other
+    if (freq <= victim_freq)
+        return -1;
+
+    if (cache->slots[victim].topic)
+        slot_release(cache, victim);
+    return victim;
+}
+
+int mqtt_ng_alias_cache_find(struct mqtt_ng_alias_cache *cache, const char *topic, uint16_t capacity, int *established)
+{
+    if (capacity > cache->slot_count)
+        capacity = cache->slot_count;
+    if (!capacity)
+        return -1;
+
+    size_t len;
+    uint64_t hash = topic_hash(topic, &len);
+    uint8_t freq = sketch_add(cache, hash);
+
+    uint32_t *entry = index_find(cache, hash, topic);
+    if (*entry) {
+        int idx = *entry - 1;
+        if (idx < capacity) {
+            *established = __atomic_load_n(&cache->slots[idx].established, __ATOMIC_ACQUIRE);
+            return idx;
+        }
+        // capacity shrunk (server limit or manually assigned aliases), slot has to be released
+        return MQTT_NG_ALIAS_ASSIGN;
+    }
+
+    if (freq < ADMISSION_MIN_FREQ || len < MQTT_NG_ALIAS_MIN_TOPIC_LEN)
+        return -1;
+    return MQTT_NG_ALIAS_ASSIGN;
+}
+
+int mqtt_ng_alias_cache_assign(struct mqtt_ng_alias_cache *cache, const char *topic, uint16_t capacity, int *established)
+{
+    if (capacity > cache->slot_count)
+        capacity = cache->slot_count;
+    if (!capacity)
+        return -1;
+
+    size_t len;
+    uint64_t hash = topic_hash(topic, &len);
+    uint8_t freq = sketch_estimate(cache, hash);
+
+    // could have been assigned by another thread since mqtt_ng_alias_cache_find
+    uint32_t *entry = index_find(cache, hash, topic);
+    if (*entry) {
+        int idx = *entry - 1;
+        if (idx < capacity) {
+            *established = cache->slots[idx].established;
+            return idx;
+        }
+        slot_release(cache, idx);
+    }
+
+    if (freq < ADMISSION_MIN_FREQ || len < MQTT_NG_ALIAS_MIN_TOPIC_LEN)
+        return -1;
+
+    int idx = slot_for_topic(cache, freq, capacity);
+    if (idx < 0)
+        return -1;
+
+    char *copy = mw_malloc(len + 1);
+    if (!copy)
+        return -1;
+    memcpy(copy, topic, len + 1);
+
+    struct alias_slot *slot = &cache->slots[idx];
+    slot->topic = copy;
+    slot->hash = hash;
+    slot->established = 0;
+    // index could have been reshuffled by releasing slots
+    *index_find(cache, hash, topic) = idx + 1;
+
+    *established = 0;
+    return idx;
+}
+
+void mqtt_ng_alias_cache_established(struct mqtt_ng_alias_cache *cache, int slot)
+{
+    if (slot >= 0 && slot < cache->slot_count && cache->slots[slot].topic)
+        __atomic_store_n(&cache->slots[slot].established, 1, __ATOMIC_RELEASE);
+}
+
+#ifdef TESTS
+#include <stdio.h>
+
+// accounts topic count times, returns result of the last find (assigned if needed)
+static int test_publish(struct mqtt_ng_alias_cache *cache, const char *topic, uint16_t capacity, int count)
+{
+    int established, slot = -1;
+    for (int i = 0; i < count; i++) {
+        slot = mqtt_ng_alias_cache_find(cache, topic, capacity, &established);
+        if (slot == MQTT_NG_ALIAS_ASSIGN)
+            slot = mqtt_ng_alias_cache_assign(cache, topic, capacity, &established);
+    }
+    return slot;
+}
+
+// every slot is found through index and every entry is reachable from its home position
+static int test_index_consistent(struct mqtt_ng_alias_cache *cache)
+{
+    uint32_t used = 0, entries = 0;
+    for (uint16_t i = 0; i < cache->slot_count; i++) {
+        if (!cache->slots[i].topic)
+            continue;
+        used++;
+        if (*index_find(cache, cache->slots[i].hash, cache->slots[i].topic) != (uint32_t)i + 1)
+            return 1;
+    }
+    for (uint32_t pos = 0; pos <= cache->index_mask; pos++) {
+        if (!cache->index[pos])
+            continue;
+        entries++;
+        for (uint32_t p = cache->slots[cache->index[pos] - 1].hash & cache->index_mask; p != pos; p = (p + 1) & cache->index_mask) {
+            if (!cache->index[p])
+                return 1;
+        }
+    }
+    return used != entries;
+}
+
+int test_mqtt_ng_alias_cache()
+{
+    struct mqtt_ng_alias_cache *cache = mqtt_ng_alias_cache_new(4);
+    if (!cache)
+        return 1;
+
+    // admission needs ADMISSION_MIN_FREQ publishes and long enough topic
+    int established;
+    int rc = mqtt_ng_alias_cache_find(cache, "test/admission", 4, &established) != -1;
+    rc = rc || mqtt_ng_alias_cache_find(cache, "test/admission", 4, &established) != MQTT_NG_ALIAS_ASSIGN;
+    rc = rc || mqtt_ng_alias_cache_assign(cache, "test/admission", 4, &established) != 0 || established;
+    mqtt_ng_alias_cache_established(cache, 0);
+    rc = rc || mqtt_ng_alias_cache_find(cache, "test/admission", 4, &established) != 0 || !established;
+    rc = rc || test_publish(cache, "short", 4, 10) != -1;
+    if (rc) {
+        fprintf(stderr, "mqtt_ng_alias_cache_find: Wrong admission\n");
+        goto out;
+    }
+
+    // capacity shrunk below the slot, it is released
+    rc = test_publish(cache, "test/slot/1", 4, 2) != 1 || test_publish(cache, "test/slot/2", 4, 2) != 2;
+    rc = rc || test_publish(cache, "test/slot/2", 2, 1) >= 2 || cache->slots[2].topic || test_index_consistent(cache);
+    if (rc) {
+        fprintf(stderr, "mqtt_ng_alias_cache_assign: Slot above capacity not released\n");
+        goto out;
+    }
+    mqtt_ng_alias_cache_destroy(cache);
+
+    // coldest of sampled slots is evicted, only by hotter topic
+    cache = mqtt_ng_alias_cache_new(2);
+    if (!cache)
+        return 1;
+    rc = test_publish(cache, "test/evict/hot", 2, 10) != 0 || test_publish(cache, "test/evict/cold", 2, 2) != 1;
+    rc = rc || test_publish(cache, "test/evict/new", 2, 2) != -1;
+    rc = rc || test_publish(cache, "test/evict/new", 2, 1) != 1;
+    rc = rc || mqtt_ng_alias_cache_find(cache, "test/evict/hot", 2, &established) != 0;
+    rc = rc || mqtt_ng_alias_cache_find(cache, "test/evict/cold", 2, &established) != MQTT_NG_ALIAS_ASSIGN;
+    rc = rc || test_index_consistent(cache);
+    if (rc) {
+        fprintf(stderr, "mqtt_ng_alias_cache_assign: Wrong slot evicted\n");
+        goto out;
+    }
+    mqtt_ng_alias_cache_destroy(cache);
+
+    // topics with home positions at the end of index so that the probe sequences
+    // collide and wrap around, removal has to keep all the others reachable
+    cache = mqtt_ng_alias_cache_new(16);
+    if (!cache)
+        return 1;
+    char topics[12][32];
+    int count = 0;
+    for (int i = 0; count < 12 && i < 100000; i++) {
+        size_t len;
+        snprintf(topics[count], sizeof(topics[count]), "test/collision/%d", i);
+        if ((topic_hash(topics[count], &len) & cache->index_mask) >= cache->index_mask - 1)
+            count++;
+    }
+    rc = count != 12;
+    for (int i = 0; !rc && i < count; i++)
+        rc = test_publish(cache, topics[i], 16, 2) != i;
+    rc = rc || test_index_consistent(cache);
+    static const int removal_order[] = { 0, 5, 1, 11, 6, 2, 10, 3, 9, 4, 8, 7 };
+    for (int i = 0; !rc && i < count; i++) {
+        slot_release(cache, removal_order[i]);
+        rc = test_index_consistent(cache);
+        for (int j = i + 1; !rc && j < count; j++)
+            rc = mqtt_ng_alias_cache_find(cache, topics[removal_order[j]], 16, &established) != removal_order[j];
+    }
+    if (rc)
+        fprintf(stderr, "index_remove: Entries lost after removing colliding topics\n");
+
+out:
+    mqtt_ng_alias_cache_destroy(cache);
+    return rc;
+}
+#endif /* TESTS */
@@ -0,0 +1,572 @@
+// SPDX-License-Identifier: GPL-3.0-only
+//
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free Software Foundation, version 3.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+// See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with this program.
+// If not, see <https://www.gnu.org/licenses/>.
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "mqtt_ng_router.h"
+#include "common_internal.h"
+
+// [MQTT-3.3.2.3.8] Subscription Identifier is VBI 1 to 268,435,455
+#define SUB_ID_MAX 268435455
+
+#define PTR_VEC_STACK 16
+#define CHILDREN_INITIAL_ALLOC 4
+
+// routes are immutable, replacing callback creates new route
+// and the old one is kept until router is destroyed (dispatch could still be using it)
+struct router_route {
+    mqtt_ng_route_callback_t callback;
+    void *ctx;
+    uint32_t id;
+    // trie node of the filter
+    struct router_node *node;
+    struct router_route *retired_next;
+};
+
+struct router_node {
+    // sorted by level for binary search
+    struct router_node **children;
+    size_t child_count;
+    size_t child_alloc;
+
+    struct router_node *plus;   // "+" child
+    struct router_node *hash;   // "#" child (always leaf)
+    struct router_route *route; // filter ending at this node
+
+    size_t level_len;
+    char level[];
+};
+
+struct mqtt_ng_router {
+    pthread_rwlock_t rwlock;
+    struct router_node *root;
+
+    // route of Subscription Identifier id is by_id[id - 1] (NULL once removed)
+    struct router_route **by_id;
+    uint32_t id_count;
+    uint32_t id_alloc;
+
+    struct router_route *retired;
+    int active;
+};
+
+// growable array of pointers starting on the stack
+struct ptr_vec {
+    void **items;
+    size_t count;
+    size_t alloc;
+    void *stack[PTR_VEC_STACK];
+};
+
+static void ptr_vec_init(struct ptr_vec *vec)
+{
+    vec->items = vec->stack;
+    vec->count = 0;
+    vec->alloc = PTR_VEC_STACK;
+}
+
+static void ptr_vec_free(struct ptr_vec *vec)
+{
+    if (vec->items != vec->stack)
+        mw_free(vec->items);
+}
+
+static int ptr_vec_push(struct ptr_vec *vec, void *ptr)
+{
+    if (vec->count == vec->alloc) {
+        void **items = mw_malloc(vec->alloc * 2 * sizeof(void *));
+        if (!items)
+            return 1;
+        memcpy(items, vec->items, vec->count * sizeof(void *));
+        ptr_vec_free(vec);
+        vec->items = items;
+        vec->alloc *= 2;
+    }
+    vec->items[vec->count++] = ptr;
+    return 0;
+}
+
+static struct router_node *node_new(const char *level, size_t len)
+{
+    struct router_node *node = mw_calloc(1, sizeof(struct router_node) + len);
+    if (!node)
+        return NULL;
+    memcpy(node->level, level, len);
+    node->level_len = len;
+    return node;
+}
+
+static void node_destroy(struct router_node *root)
+{
+    struct ptr_vec stack;
+    ptr_vec_init(&stack);
+    // nodes which couldn't be pushed because of OOM are leaked rather than recursing
+    ptr_vec_push(&stack, root);
+    while (stack.count) {
+        struct router_node *node = stack.items[--stack.count];
+        for (size_t i = 0; i < node->child_count; i++)
+            ptr_vec_push(&stack, node->children[i]);
+        if (node->plus)
+            ptr_vec_push(&stack, node->plus);
+        if (node->hash)
+            ptr_vec_push(&stack, node->hash);
+        mw_free(node->children);
+        mw_free(node);
+    }
+    ptr_vec_free(&stack);
+}
+
+static inline int level_cmp(const struct router_node *node, const char *level, size_t len)
+{
+    int rc = memcmp(node->level, level, node->level_len < len ? node->level_len : len);
+    if (rc)
+        return rc;
+    return node->level_len < len ? -1 : node->level_len > len;
+}
+
+// returns index of child with given level or where it should be inserted
+static size_t child_find(const struct router_node *node, const char *level, size_t len, int *found)
+{
+    size_t lo = 0, hi = node->child_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int rc = level_cmp(node->children[mid], level, len);
+        if (!rc) {
+            *found = 1;
+            return mid;
+        }
+        if (rc < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    *found = 0;
+    return lo;
+}
+
+static struct router_node *child_get_or_add(struct router_node *node, const char *level, size_t len)
+{
+    if (len == 1 && (*level == '+' || *level == '#')) {
+        struct router_node **wildcard = *level == '+' ? &node->plus : &node->hash;
+        if (!*wildcard)
+            *wildcard = node_new(level, len);
+        return *wildcard;
+    }
+
+    int found;
+    size_t idx = child_find(node, level, len, &found);
+    if (found)
+        return node->children[idx];
+
+    if (node->child_count == node->child_alloc) {
+        size_t alloc = node->child_alloc ? node->child_alloc * 2 : CHILDREN_INITIAL_ALLOC;
+        struct router_node **children = mw_realloc(node->children, alloc * sizeof(struct router_node *));
+        if (!children)
+            return NULL;
+        node->children = children;
+        node->child_alloc = alloc;
+    }
+
+    struct router_node *child = node_new(level, len);
+    if (!child)
+        return NULL;
+    memmove(&node->children[idx + 1], &node->children[idx], (node->child_count - idx) * sizeof(struct router_node *));
+    node->children[idx] = child;
+    node->child_count++;
+    return child;
+}
+
+// returns node of filter or NULL if there is none
+static struct router_node *filter_node_find(struct router_node *node, const char *filter)
+{
+    const char *level = filter;
+    for (;;) {
+        const char *end = strchr(level, '/');
+        size_t len = end ? (size_t)(end - level) : strlen(level);
+        if (len == 1 && (*level == '+' || *level == '#'))
+            node = *level == '+' ? node->plus : node->hash;
+        else {
+            int found;
+            size_t idx = child_find(node, level, len, &found);
+            node = found ? node->children[idx] : NULL;
+        }
+        if (!node || !end)
+            return node;
+        level = end + 1;
+    }
+}
+
+// wildcards have to occupy whole level and "#" has to be the last one [MQTT-4.7.1]
+static int filter_valid(const char *filter)
+{
+    if (!*filter)
+        return 0;
+    const char *level = filter;
+    for (;;) {
+        const char *end = strchr(level, '/');
+        size_t len = end ? (size_t)(end - level) : strlen(level);
+        for (size_t i = 0; i < len; i++) {
+            if ((level[i] == '+' || level[i] == '#') && len != 1)
+                return 0;
+        }
+        if (len == 1 && *level == '#' && end)
+            return 0;
+        if (!end)
+            return 1;
+        level = end + 1;
+    }
+}
+
+struct mqtt_ng_router *mqtt_ng_router_new(void)
+{
+    struct mqtt_ng_router *router = mw_calloc(1, sizeof(struct mqtt_ng_router));
+    if (!router)
+        return NULL;
+
+    if (!(router->root = node_new("", 0)))
+        goto fail;
+
+    if (pthread_rwlock_init(&router->rwlock, NULL))
+        goto fail_root;
+
+    return router;
+
+fail_root:
+    mw_free(router->root);
+fail:
+    mw_free(router);
+    return NULL;
+}
+
+void mqtt_ng_router_destroy(struct mqtt_ng_router *router)
+{
+    if (!router)
+        return;
+
+    // removed routes are retired
+    for (uint32_t i = 0; i < router->id_count; i++)
+        mw_free(router->by_id[i]);
+    mw_free(router->by_id);
+
+    while (router->retired) {
+        struct router_route *route = router->retired;
+        router->retired = route->retired_next;
+        mw_free(route);
+    }
+
+    node_destroy(router->root);
+    pthread_rwlock_destroy(&router->rwlock);
+    mw_free(router);
+}
+
+static uint32_t router_new_id(struct mqtt_ng_router *router, struct router_route *route)
+{
+    if (router->id_count >= SUB_ID_MAX)
+        return 0;
+
+    if (router->id_count == router->id_alloc) {
+        uint32_t alloc = router->id_alloc ? router->id_alloc * 2 : CHILDREN_INITIAL_ALLOC;
+        struct router_route **by_id = mw_realloc(router->by_id, alloc * sizeof(struct router_route *));
+        if (!by_id)
+            return 0;
+        router->by_id = by_id;
+        router->id_alloc = alloc;
+    }
+    router->by_id[router->id_count++] = route;
+    return router->id_count;
+}
+
+uint32_t mqtt_ng_router_add(struct mqtt_ng_router *router, const char *filter, mqtt_ng_route_callback_t callback, void *ctx)
+{
+    if (!filter_valid(filter))
+        return 0;
+
+    struct router_route *route = mw_calloc(1, sizeof(struct router_route));
+    if (!route)
+        return 0;
+    route->callback = callback;
+    route->ctx = ctx;
+
+    pthread_rwlock_wrlock(&router->rwlock);
+
+    struct router_node *node = router->root;
+    const char *level = filter;
+    for (;;) {
+        const char *end = strchr(level, '/');
+        size_t len = end ? (size_t)(end - level) : strlen(level);
+        // nodes already added on OOM are left empty, they are harmless
+        if (!(node = child_get_or_add(node, level, len)))
+            goto fail;
+        if (!end)
+            break;
+        level = end + 1;
+    }
+
+    if (node->route) {
+        // server replaces the subscription [MQTT-3.8.4-3] so we keep its identifier
+        route->id = node->route->id;
+        node->route->retired_next = router->retired;
+        router->retired = node->route;
+        router->by_id[route->id - 1] = route;
+    } else if (!(route->id = router_new_id(router, route)))
+        goto fail;
+
+    route->node = node;
+    node->route = route;
+    __atomic_store_n(&router->active, 1, __ATOMIC_RELEASE);
+    pthread_rwlock_unlock(&router->rwlock);
+    return route->id;
+
+fail:
+    pthread_rwlock_unlock(&router->rwlock);
+    mw_free(route);
+    return 0;
+}
+
+uint32_t mqtt_ng_router_lookup(struct mqtt_ng_router *router, const char *filter, mqtt_ng_route_callback_t *callback, void **ctx)
+{
+    if (!filter_valid(filter))
+        return 0;
+
+    uint32_t id = 0;
+    pthread_rwlock_rdlock(&router->rwlock);
+    struct router_node *node = filter_node_find(router->root, filter);
+    if (node && node->route) {
+        id = node->route->id;
+        *callback = node->route->callback;
+        *ctx = node->route->ctx;
+    }
+    pthread_rwlock_unlock(&router->rwlock);
+    return id;
+}
+
+int mqtt_ng_router_remove(struct mqtt_ng_router *router, uint32_t sub_id)
+{
+    pthread_rwlock_wrlock(&router->rwlock);
+    struct router_route *route = sub_id && sub_id <= router->id_count ? router->by_id[sub_id - 1] : NULL;
+    if (!route) {
+        pthread_rwlock_unlock(&router->rwlock);
+        return 1;
+    }
+    // trie nodes are left in place (empty ones are harmless)
+    route->node->route = NULL;
+    router->by_id[sub_id - 1] = NULL;
+    route->retired_next = router->retired;
+    router->retired = route;
+    pthread_rwlock_unlock(&router->rwlock);
+    return 0;
+}
+
+int mqtt_ng_router_active(struct mqtt_ng_router *router)
+{
+    return __atomic_load_n(&router->active, __ATOMIC_ACQUIRE);
+}
+
+static inline void collect_route(struct ptr_vec *routes, struct router_node *node)
+{
+    if (node && node->route)
+        ptr_vec_push(routes, node->route);
+}
+
+// walks all trie branches matching topic level by level at once
+// (single level wildcards make more branches match)
+static void trie_match(struct router_node *root, const char *topic, struct ptr_vec *routes)
+{
+    struct ptr_vec vec_a, vec_b;
+    struct ptr_vec *cur = &vec_a, *next = &vec_b;
+    ptr_vec_init(cur);
+    ptr_vec_init(next);
+    ptr_vec_push(cur, root);
+
+    // wildcards at the first level don't match topics starting with '$' [MQTT-4.7.2-1]
+    int dollar = *topic == '$';
+    const char *level = topic;
+    for (;;) {
+        const char *end = strchr(level, '/');
+        size_t len = end ? (size_t)(end - level) : strlen(level);
+
+        next->count = 0;
+        for (size_t i = 0; i < cur->count; i++) {
+            struct router_node *node = cur->items[i];
+            if (!dollar) {
+                collect_route(routes, node->hash);
+                if (node->plus)
+                    ptr_vec_push(next, node->plus);
+            }
+            int found;
+            size_t idx = child_find(node, level, len, &found);
+            if (found)
+                ptr_vec_push(next, node->children[idx]);
+        }
+        dollar = 0;
+
+        struct ptr_vec *tmp = cur;
+        cur = next;
+        next = tmp;
+        if (!end || !cur->count)
+            break;
+        level = end + 1;
+    }
+
+    // filters ending at the last level match and so do the ones followed by "#"
+    // as it matches the parent level too ("a/#" matches "a")
+    // (cur is empty if matching stopped before the last level)
+    for (size_t i = 0; i < cur->count; i++) {
+        struct router_node *node = cur->items[i];
+        collect_route(routes, node);
+        collect_route(routes, node->hash);
+    }
+
+    ptr_vec_free(&vec_a);
+    ptr_vec_free(&vec_b);
+}
+
+static void router_find(struct mqtt_ng_router *router, const char *topic, const uint32_t *sub_ids, size_t sub_id_count, struct ptr_vec *routes)
+{
+    pthread_rwlock_rdlock(&router->rwlock);
+    for (size_t i = 0; i < sub_id_count; i++) {
+        // unknown identifiers can come from persistent session of previous process
+        if (sub_ids[i] && sub_ids[i] <= router->id_count && router->by_id[sub_ids[i] - 1])
+            ptr_vec_push(routes, router->by_id[sub_ids[i] - 1]);
+    }
+    if (!routes->count && topic)
+        trie_match(router->root, topic, routes);
+    pthread_rwlock_unlock(&router->rwlock);
+}
+
+int mqtt_ng_router_match(struct mqtt_ng_router *router, const char *topic, const uint32_t *sub_ids, size_t sub_id_count)
+{
+    struct ptr_vec routes;
+    ptr_vec_init(&routes);
+    router_find(router, topic, sub_ids, sub_id_count, &routes);
+    int count = routes.count;
+    ptr_vec_free(&routes);
+    return count;
+}
+
+int mqtt_ng_router_dispatch(struct mqtt_ng_router *router, const struct mqtt_rx_msg *msg, const uint32_t *sub_ids, size_t sub_id_count)
+{
+    struct ptr_vec routes;
+    ptr_vec_init(&routes);
+    router_find(router, msg->topic, sub_ids, sub_id_count, &routes);
+
+    for (size_t i = 0; i < routes.count; i++) {
+        struct router_route *route = routes.items[i];
+        route->callback(route->ctx, msg);
+    }
+
+    int count = routes.count;
+    ptr_vec_free(&routes);
+    return count;
+}
+
+#ifdef TESTS
+#include <stdio.h>
+
+static void test_router_cb(void *ctx, const struct mqtt_rx_msg *msg)
+{
+    (void)msg;
+    (*(int *)ctx)++;
+}
+
+int test_mqtt_ng_router()
+{
+    static const char *filters[] = { "a/+/c", "a/#", "#", "+/b/+", "$SYS/#", "$SYS/+/x", "x/y" };
+    static const struct {
+        const char *topic;
+        int expected[7];
+    } cases[] = {
+        { "a/b/c",      { 1, 1, 1, 1, 0, 0, 0 } },
+        // "#" matches the parent level too [MQTT-4.7.1.2]
+        { "a",          { 0, 1, 1, 0, 0, 0, 0 } },
+        { "a/b",        { 0, 1, 1, 0, 0, 0, 0 } },
+        { "a/b/c/d",    { 0, 1, 1, 0, 0, 0, 0 } },
+        { "x/y",        { 0, 0, 1, 0, 0, 0, 1 } },
+        { "x/y/z",      { 0, 0, 1, 0, 0, 0, 0 } },
+        // empty levels are levels too
+        { "/b/",        { 0, 0, 1, 1, 0, 0, 0 } },
+        // wildcards at the first level don't match '$' topics [MQTT-4.7.2-1]
+        { "$SYS/b/c",   { 0, 0, 0, 0, 1, 0, 0 } },
+        { "$SYS/b/x",   { 0, 0, 0, 0, 1, 1, 0 } },
+    };
+    const size_t filter_count = sizeof(filters) / sizeof(filters[0]);
+
+    struct mqtt_ng_router *router = mqtt_ng_router_new();
+    if (!router)
+        return 1;
+
+    int rc = 0;
+    int hits[sizeof(filters) / sizeof(filters[0])];
+    uint32_t ids[sizeof(filters) / sizeof(filters[0])];
+    for (size_t i = 0; i < filter_count; i++) {
+        ids[i] = mqtt_ng_router_add(router, filters[i], &test_router_cb, &hits[i]);
+        if (!ids[i]) {
+            fprintf(stderr, "mqtt_ng_router_add(\"%s\"): Valid filter refused\n", filters[i]);
+            rc = 1;
+        }
+    }
+    static const char *invalid[] = { "a/b#", "a/#/c", "a+/b", "" };
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+        if (mqtt_ng_router_add(router, invalid[i], &test_router_cb, NULL)) {
+            fprintf(stderr, "mqtt_ng_router_add(\"%s\"): Invalid filter accepted\n", invalid[i]);
+            rc = 1;
+        }
+    }
+
+    for (int removed = 0; !rc && removed < 2; removed++) {
+        // second pass with "#" removed
+        for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+            memset(hits, 0, sizeof(hits));
+            struct mqtt_rx_msg msg = { .topic = cases[c].topic, .topic_len = strlen(cases[c].topic) };
+            int count = mqtt_ng_router_dispatch(router, &msg, NULL, 0);
+            int expected_count = 0;
+            for (size_t i = 0; i < filter_count; i++) {
+                int expected = removed && i == 2 ? 0 : cases[c].expected[i];
+                expected_count += expected;
+                if (hits[i] != expected) {
+                    fprintf(stderr, "mqtt_ng_router_dispatch(\"%s\", removed:%d): Filter \"%s\" called %d times\n", cases[c].topic, removed, filters[i], hits[i]);
+                    rc = 1;
+                }
+            }
+            if (count != expected_count || mqtt_ng_router_match(router, cases[c].topic, NULL, 0) != expected_count) {
+                fprintf(stderr, "mqtt_ng_router_dispatch(\"%s\", removed:%d): Wrong route count %d\n", cases[c].topic, removed, count);
+                rc = 1;
+            }
+        }
+        if (!removed && (mqtt_ng_router_remove(router, ids[2]) || !mqtt_ng_router_remove(router, ids[2]))) {
+            fprintf(stderr, "mqtt_ng_router_remove: Wrong result\n");
+            rc = 1;
+        }
+    }
+
+    // Subscription Identifiers select routes directly, removed one is not found
+    mqtt_ng_route_callback_t callback;
+    void *ctx;
+    uint32_t sub_ids[] = { ids[2], ids[6], 1000 };
+    rc = rc || mqtt_ng_router_match(router, "a/b/c", sub_ids, 3) != 1;
+    rc = rc || mqtt_ng_router_lookup(router, "#", &callback, &ctx);
+    rc = rc || mqtt_ng_router_lookup(router, "x/y", &callback, &ctx) != ids[6] || ctx != &hits[6];
+    // identifier of replaced route is kept
+    rc = rc || mqtt_ng_router_add(router, "x/y", &test_router_cb, &hits[0]) != ids[6];
+    // identifier of removed route is not reused
+    uint32_t id = mqtt_ng_router_add(router, "#", &test_router_cb, &hits[2]);
+    for (size_t i = 0; !rc && i < filter_count; i++)
+        rc = id == ids[i];
+    if (rc)
+        fprintf(stderr, "mqtt_ng_router: Subscription Identifiers handled wrong\n");
+
+    mqtt_ng_router_destroy(router);
+    return rc;
+}
+#endif /* TESTS */
@@ -0,0 +1,236 @@
+// SPDX-License-Identifier: GPL-3.0-only
+//
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free Software Foundation, version 3.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+// See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with this program.
+// If not, see <https://www.gnu.org/licenses/>.
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "mqtt_wss_alloc.h"
+#include "common_internal.h"
+
+// smallest class is 32 bytes, every next one doubles (up to 4 KiB)
+#define POOL_MIN_BLOCK_SHIFT 5
+#define POOL_SLAB_SIZE (64 * 1024)
+
+// keeps user data aligned the same way malloc does
+union obj_hdr {
+    struct {
+        const struct mqtt_wss_allocator *alloc;
+        size_t size; // including this header
+    } h;
+    long double align;
+};
+
+struct pool_block {
+    struct pool_block *next;
+};
+
+struct pool_slab {
+    struct pool_slab *next;
+    union obj_hdr align; // blocks start aligned after this
+};
+
+struct pool_class {
+    pthread_mutex_t lock;
+    struct pool_block *free_list;
+    // part of the newest slab not carved into blocks yet
+    char *carve;
+    char *carve_end;
+    struct pool_slab *slabs;
+
+    size_t block_size;
+    size_t blocks_total;
+    size_t blocks_used;
+    uint64_t allocs;
+};
+
+struct mqtt_wss_pool {
+    struct pool_class classes[MQTT_WSS_POOL_CLASSES];
+    struct mqtt_wss_allocator allocator;
+
+    uint64_t slab_allocs;
+    size_t slab_bytes;
+    uint64_t oversized_allocs;
+};
+
+static void *system_malloc(void *ctx, size_t size)
+{
+    (void)ctx;
+    return mw_malloc(size);
+}
+
+static void system_free(void *ctx, void *ptr, size_t size)
+{
+    (void)ctx;
+    (void)size;
+    mw_free(ptr);
+}
+
+const struct mqtt_wss_allocator mqtt_wss_system_allocator = {
+    .malloc = system_malloc,
+    .free = system_free,
+    .ctx = NULL
+};
+
+void *mw_obj_malloc(const struct mqtt_wss_allocator *alloc, size_t size)
+{
+    if (!alloc)
+        alloc = &mqtt_wss_system_allocator;
+    size += sizeof(union obj_hdr);
+    union obj_hdr *hdr = alloc->malloc(alloc->ctx, size);
+    if (!hdr)
+        return NULL;
+    hdr->h.alloc = alloc;
+    hdr->h.size = size;
+    return hdr + 1;
+}
+
+char *mw_obj_strdup(const struct mqtt_wss_allocator *alloc, const char *str)
+{
+    size_t len = strlen(str) + 1;
+    char *copy = mw_obj_malloc(alloc, len);
+    if (copy)
+        memcpy(copy, str, len);
+    return copy;
+}
+
+void mw_obj_free(void *ptr)
+{
+    if (!ptr)
+        return;
+    union obj_hdr *hdr = (union obj_hdr *)ptr - 1;
+    hdr->h.alloc->free(hdr->h.alloc->ctx, hdr, hdr->h.size);
+}
+
+// returns -1 if size is too large for any class
+static inline int pool_class_idx(size_t size)
+{
+    if (size <= (1 << POOL_MIN_BLOCK_SHIFT))
+        return 0;
+    int idx = (int)(sizeof(unsigned long long) * 8) - __builtin_clzll(size - 1) - POOL_MIN_BLOCK_SHIFT;
+    return idx < MQTT_WSS_POOL_CLASSES ? idx : -1;
+}
+
+static int pool_class_grow(struct mqtt_wss_pool *pool, struct pool_class *class)
+{
+    struct pool_slab *slab = mw_malloc(POOL_SLAB_SIZE);
+    if (!slab)
+        return 1;
+    slab->next = class->slabs;
+    class->slabs = slab;
+    class->carve = (char *)&slab->align;
+    class->carve_end = (char *)slab + POOL_SLAB_SIZE;
+    __atomic_fetch_add(&pool->slab_allocs, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&pool->slab_bytes, POOL_SLAB_SIZE, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static void *pool_malloc(void *ctx, size_t size)
+{
+    struct mqtt_wss_pool *pool = ctx;
+    int idx = pool_class_idx(size);
+    if (idx < 0) {
+        __atomic_fetch_add(&pool->oversized_allocs, 1, __ATOMIC_RELAXED);
+        return mw_malloc(size);
+    }
+
+    struct pool_class *class = &pool->classes[idx];
+    void *block = NULL;
+    pthread_mutex_lock(&class->lock);
+    if (class->free_list) {
+        block = class->free_list;
+        class->free_list = class->free_list->next;
+    } else {
+        if (class->carve_end - class->carve < (ptrdiff_t)class->block_size && pool_class_grow(pool, class))
+            goto exit;
+        block = class->carve;
+        class->carve += class->block_size;
+        class->blocks_total++;
+    }
+    class->blocks_used++;
+    class->allocs++;
+exit:
+    pthread_mutex_unlock(&class->lock);
+    return block;
+}
+
+static void pool_free(void *ctx, void *ptr, size_t size)
+{
+    struct mqtt_wss_pool *pool = ctx;
+    int idx = pool_class_idx(size);
+    if (idx < 0) {
+        mw_free(ptr);
+        return;
+    }
+
+    struct pool_class *class = &pool->classes[idx];
+    struct pool_block *block = ptr;
+    pthread_mutex_lock(&class->lock);
+    block->next = class->free_list;
+    class->free_list = block;
+    class->blocks_used--;
+    pthread_mutex_unlock(&class->lock);
+}
+
+struct mqtt_wss_pool *mqtt_wss_pool_new(void)
+{
+    struct mqtt_wss_pool *pool = mw_calloc(1, sizeof(struct mqtt_wss_pool));
+    if (!pool)
+        return NULL;
+
+    for (int i = 0; i < MQTT_WSS_POOL_CLASSES; i++) {
+        pthread_mutex_init(&pool->classes[i].lock, NULL);
+        pool->classes[i].block_size = (size_t)1 << (POOL_MIN_BLOCK_SHIFT + i);
+    }
+    pool->allocator.malloc = pool_malloc;
+    pool->allocator.free = pool_free;
+    pool->allocator.ctx = pool;
+    return pool;
+}
+
+void mqtt_wss_pool_destroy(struct mqtt_wss_pool *pool)
+{
+    if (!pool)
+        return;
+    for (int i = 0; i < MQTT_WSS_POOL_CLASSES; i++) {
+        struct pool_class *class = &pool->classes[i];
+        while (class->slabs) {
+            struct pool_slab *slab = class->slabs;
+            class->slabs = slab->next;
+            mw_free(slab);
+        }
+        pthread_mutex_destroy(&class->lock);
+    }
+    mw_free(pool);
+}
+
+const struct mqtt_wss_allocator *mqtt_wss_pool_allocator(struct mqtt_wss_pool *pool)
+{
+    return &pool->allocator;
+}
+
+void mqtt_wss_pool_get_stats(struct mqtt_wss_pool *pool, struct mqtt_wss_pool_stats *stats)
+{
+    for (int i = 0; i < MQTT_WSS_POOL_CLASSES; i++) {
+        struct pool_class *class = &pool->classes[i];
+        pthread_mutex_lock(&class->lock);
+        stats->classes[i].block_size = class->block_size;
+        stats->classes[i].blocks_total = class->blocks_total;
+        stats->classes[i].blocks_used = class->blocks_used;
+        stats->classes[i].allocs = class->allocs;
+        pthread_mutex_unlock(&class->lock);
+    }
+    stats->slab_allocs = __atomic_load_n(&pool->slab_allocs, __ATOMIC_RELAXED);
+    stats->slab_bytes = __atomic_load_n(&pool->slab_bytes, __ATOMIC_RELAXED);
+    stats->oversized_allocs = __atomic_load_n(&pool->oversized_allocs, __ATOMIC_RELAXED);
+}
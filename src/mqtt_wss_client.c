@@ -13,7 +13,14 @@
 #define _GNU_SOURCE
 
 #include "mqtt_wss_client.h"
+#include "mqtt_wss_client_internal.h"
+#include "mqtt_wss_instr.h"
+#include "mqtt_wss_alloc.h"
+#include "mqtt_wss_spool.h"
+#include "mqtt_wss_dns.h"
+#include "mqtt_wss_tcp.h"
 #include "mqtt_ng.h"
+#include "mqtt_constants.h"
 #include "ws_client.h"
 #include "common_internal.h"
 
@@ -30,6 +37,10 @@
 #include <netinet/tcp.h> //TCP_NODELAY
 #include <netdb.h>
 
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
 #include <openssl/err.h>
 #include <openssl/ssl.h>
 
@@ -37,13 +48,24 @@
 #define PIPE_WRITE_END 1
 #define POLLFD_SOCKET  0
 #define POLLFD_PIPE    1
+// further attempts of the TCP connect race (first one uses POLLFD_SOCKET)
+#define POLLFD_RACE    2
+#define POLLFD_COUNT   (POLLFD_RACE + MWS_TCP_MAX_ATTEMPTS - 1)
 
 #if (OPENSSL_VERSION_NUMBER < OPENSSL_VERSION_110) && (SSLEAY_VERSION_NUMBER >= OPENSSL_VERSION_097)
 #include <openssl/conf.h>
 #endif
 
-//TODO MQTT_PUBLISH_RETAIN should not be needed anymore
-#define MQTT_PUBLISH_RETAIN 0x01
+#if defined(__linux__) && OPENSSL_VERSION_NUMBER >= OPENSSL_VERSION_300 && !defined(OPENSSL_NO_KTLS)
+#define MQTT_WSS_KTLS
+#include <linux/tls.h>
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+#define TLS_RECORD_TYPE_ALERT 21
+#define TLS_RECORD_TYPE_DATA  23
+#endif
+
 #define MQTT_CONNECT_CLEAN_SESSION 0x02
 #define MQTT_CONNECT_WILL_RETAIN 0x20
 
@@ -103,12 +125,63 @@ struct mqtt_wss_client_struct {
 
 // nonblock IO related
     int sockfd;
+    // pipe, on Linux both ends are the same eventfd
     int write_notif_pipe[2];
-    struct pollfd poll_fds[2];
+    // set by the first mqtt_wss_wakeup after service thread went through wakeup_clear,
+    // later ones don't signal anything until then
+    int wakeup_pending;
+    // fd mqtt_wss_wakeup signals instead of write_notif_pipe (see mqtt_wss_set_wakeup_target)
+    int wakeup_target;
+    // held while wakeup_target is signalled or changed so that nobody
+    // signals fd which was closed (and its number reused) in the meantime
+    pthread_mutex_t wakeup_lock;
+    struct pollfd poll_fds[POLLFD_COUNT];
+    nfds_t poll_nfds;
+// bumped every time sockets in poll_fds change (see mqtt_wss_get_socket_fds)
+    unsigned int socket_generation;
+
+// non blocking connect (see mqtt_wss_connect_async)
+    enum mqtt_wss_connect_state conn_state;
+    int conn_error;
+    int connect_timeout_ms;
+    long long int conn_deadline_ms;
+    struct mws_dns_query *dns_query;
+    struct mws_tcp_race tcp_race;
+// HTTP CONNECT request and then reply of the proxy
+    rbuf_t proxy_buf;
+    int proxy_request_sent;
+// what proxy and TLS phase wait for on the socket
+    short conn_events;
 
     SSL_CTX *ssl_ctx;
     SSL *ssl;
     int ssl_flags;
+// ssl_ctx (with loaded trust store) is kept across reconnects,
+// recreated only if certificate checking flags change
+    int ssl_ctx_flags;
+// last session (TLS 1.2 session ID or TLS 1.3 ticket) the server gave us,
+// offered on reconnect to the same host to skip the full handshake
+    SSL_SESSION *ssl_session;
+    char *ssl_session_host;
+    int ssl_session_port;
+
+// TLS write path
+// buf_write is written in records of up to tx_record_size bytes
+// if ring buffer wraps around both parts are joined in tx_record
+    size_t tx_record_size;
+    char *tx_record;
+// when SSL_write would block it has to be retried with the same arguments
+    const char *tx_retry_ptr;
+    size_t tx_retry_len;
+    int tx_retry_staged;
+// updated from OpenSSL callbacks, moved to stats after each write pass
+    uint64_t tx_tls_records;
+    uint64_t tx_syscalls;
+
+// kernel TLS requested by user and offload active on current connection
+    int ktls;
+    int ktls_tx;
+    int ktls_rx;
 
     struct mqtt_ng_client *mqtt;
 
@@ -124,23 +197,50 @@ struct mqtt_wss_client_struct {
     unsigned int mqtt_connected:1;
     unsigned int mqtt_disconnecting:1;
 
+// last SSL_read/SSL_write ended with SSL_ERROR_WANT_*
+// (needed by edge triggered event loops, see mqtt_wss_reactor)
+// not bitfields as they are written on every service pass
+// while the flags above are read by publishing threads
+    int ssl_read_blocked;
+    int ssl_write_blocked;
+// SSL_read was not attempted as there was no space in read buffer
+    int ssl_read_skipped;
+
 // Application layer callback pointers
     void (*msg_callback)(const char *, const void *, size_t, int);
     void (*puback_callback)(uint16_t packet_id);
 
-    pthread_mutex_t stat_lock;
+    // updated by relaxed atomics (see STATS_ADD)
     struct mqtt_wss_stats stats;
 
+    struct mqtt_wss_instr instr;
+    // default allocator, kept even if user sets own one (it can have objects still allocated)
+    struct mqtt_wss_pool *pool;
+    // persistent outbound queue (see mqtt_wss_set_spool)
+    struct mqtt_wss_spool *spool;
+// time spent parsing MQTT from within ws_client_process (not part of WS parse time)
+    uint64_t instr_rx_mqtt_ns;
+
 #ifdef MQTT_WSS_DEBUG
     void (*ssl_ctx_keylog_cb)(const SSL *ssl, const char *line);
+// decrypted incoming stream is appended here (see mqtt_wss_set_rx_capture)
+    char *rx_capture_path;
+    int rx_capture_fd;
 #endif
 };
 
+// stats are read (and reset) by other threads without any lock
+#define STATS_ADD(client, field, n) __atomic_fetch_add(&(client)->stats.field, (n), __ATOMIC_RELAXED)
+#define STATS_GET_RESET(client, field) __atomic_exchange_n(&(client)->stats.field, 0, __ATOMIC_RELAXED)
+
 static void mws_connack_callback_ng(void *user_ctx, int code)
 {
     mqtt_wss_client client = user_ctx;
     switch(code) {
         case 0:
+            // before publishers see us connected and start draining
+            if (client->spool)
+                mqtt_wss_spool_rewind(client->spool);
             client->mqtt_connected = 1;
             return;
 //TODO manual labor: all the CONNACK error codes with some nice error message
@@ -150,6 +250,16 @@ static void mws_connack_callback_ng(void *user_ctx, int code)
     }
 }
 
+static void mws_puback_callback_ng(void *user_ctx, uint16_t packet_id)
+{
+    mqtt_wss_client client = user_ctx;
+    // messages published through the spool are not known to the user by packet id
+    if (client->spool && mqtt_wss_spool_ack(client->spool, packet_id))
+        return;
+    if (client->puback_callback)
+        client->puback_callback(packet_id);
+}
+
 static ssize_t mqtt_send_cb(void *user_ctx, const void* buf, size_t len)
 {
     mqtt_wss_client mqtt_wss_client = user_ctx;
@@ -162,10 +272,48 @@ static ssize_t mqtt_send_cb(void *user_ctx, const void* buf, size_t len)
         mws_debug(mqtt_wss_client->log, "Not complete message sent (Msg=%d,Sent=%d). Need to arm POLLOUT!", len, ret);
 #endif
         mqtt_wss_client->mqtt_didnt_finish_write = 1;
+        mqtt_wss_instr_event(&mqtt_wss_client->instr, MQTT_WSS_EVENT_TX_BUFFER_FULL);
+    }
+    return ret;
+}
+
+static ssize_t mqtt_sendv_cb(void *user_ctx, const struct iovec *iov, int iovcnt)
+{
+    mqtt_wss_client mqtt_wss_client = user_ctx;
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+#ifdef DEBUG_ULTRA_VERBOSE
+    mws_debug(mqtt_wss_client->log, "mqtt_sendv_cb(iovcnt=%d, len=%zu)", iovcnt, len);
+#endif
+    int ret = ws_client_sendv(mqtt_wss_client->ws_client, WS_OP_BINARY_FRAME, iov, iovcnt);
+    if (ret >= 0 && (size_t)ret != len) {
+#ifdef DEBUG_ULTRA_VERBOSE
+        mws_debug(mqtt_wss_client->log, "Not complete message sent (Msg=%zu,Sent=%d). Need to arm POLLOUT!", len, ret);
+#endif
+        mqtt_wss_client->mqtt_didnt_finish_write = 1;
+        mqtt_wss_instr_event(&mqtt_wss_client->instr, MQTT_WSS_EVENT_TX_BUFFER_FULL);
     }
     return ret;
 }
 
+static ssize_t mqtt_rx_payload_cb(void *user_ctx, rbuf_t data, size_t max_bytes)
+{
+    mqtt_wss_client client = user_ctx;
+    uint64_t start = mqtt_wss_instr_start(&client->instr);
+    ssize_t ret = mqtt_ng_process_rx(client->mqtt, data, max_bytes);
+    client->instr_rx_mqtt_ns += mqtt_wss_instr_stop(&client->instr, MQTT_WSS_STAGE_MQTT_PARSE, start);
+    return ret;
+}
+
+static void wakeup_close(mqtt_wss_client client)
+{
+    close(client->write_notif_pipe[PIPE_READ_END]);
+#ifndef __linux__
+    close(client->write_notif_pipe[PIPE_WRITE_END]);
+#endif
+}
+
 mqtt_wss_client mqtt_wss_new(const char *log_prefix,
                              mqtt_wss_log_callback_t log_callback,
                              msg_callback_fnc_t msg_callback,
@@ -187,7 +335,24 @@ mqtt_wss_client mqtt_wss_new(const char *log_prefix,
     }
 
     pthread_mutex_init(&client->pub_lock, NULL);
-    pthread_mutex_init(&client->stat_lock, NULL);
+    pthread_mutex_init(&client->wakeup_lock, NULL);
+    mqtt_wss_instr_init(&client->instr);
+#ifdef MQTT_WSS_DEBUG
+    client->rx_capture_fd = -1;
+#endif
+
+    client->tx_record_size = MQTT_WSS_DEFAULT_TX_RECORD_SIZE;
+    client->tx_record = mw_malloc(client->tx_record_size);
+    if (!client->tx_record) {
+        mws_error(log, "OOM alocating TLS record buffer");
+        goto fail_0;
+    }
+
+    client->pool = mqtt_wss_pool_new();
+    if (!client->pool) {
+        mws_error(log, "OOM alocating memory pool");
+        goto fail_1;
+    }
 
     client->msg_callback = msg_callback;
     client->puback_callback = puback_callback;
@@ -195,11 +360,20 @@ mqtt_wss_client mqtt_wss_new(const char *log_prefix,
     client->ws_client = ws_client_new(0, &client->target_host, log);
     if (!client->ws_client) {
         mws_error(log, "Error creating ws_client");
-        goto fail_1;
+        goto fail_pool;
     }
+    ws_client_set_allocator(client->ws_client, mqtt_wss_pool_allocator(client->pool));
 
     client->log = log;
 
+#ifdef __linux__
+    client->write_notif_pipe[PIPE_READ_END] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (client->write_notif_pipe[PIPE_READ_END] < 0) {
+        mws_error(log, "Couldn't create eventfd \"%s\"", strerror(errno));
+        goto fail_2;
+    }
+    client->write_notif_pipe[PIPE_WRITE_END] = client->write_notif_pipe[PIPE_READ_END];
+#else
 #ifdef __APPLE__
     if (pipe(client->write_notif_pipe)) {
 #else
@@ -209,50 +383,183 @@ mqtt_wss_client mqtt_wss_new(const char *log_prefix,
         goto fail_2;
     }
 
+    // allows us to empty the pipe completely (required by edge triggered readiness)
+    if (fcntl(client->write_notif_pipe[PIPE_READ_END], F_SETFL, fcntl(client->write_notif_pipe[PIPE_READ_END], F_GETFL, 0) | O_NONBLOCK) == -1) {
+        mws_error(log, "Error setting O_NONBLOCK to pipe. \"%s\"", strerror(errno));
+        goto fail_3;
+    }
+#endif
+    client->wakeup_target = -1;
+
     client->poll_fds[POLLFD_PIPE].fd = client->write_notif_pipe[PIPE_READ_END];
     client->poll_fds[POLLFD_PIPE].events = POLLIN;
 
+    client->sockfd = -1;
+    for (int i = 0; i < POLLFD_COUNT; i++) {
+        if (i != POLLFD_PIPE)
+            client->poll_fds[i].fd = -1;
+    }
+    client->poll_nfds = POLLFD_RACE;
     client->poll_fds[POLLFD_SOCKET].events = POLLIN;
+    client->connect_timeout_ms = MQTT_WSS_DEFAULT_CONNECT_TIMEOUT_MS;
 
     struct mqtt_ng_init settings = {
         .log = log,
         .data_in = client->ws_client->buf_to_mqtt,
         .data_out_fnc = &mqtt_send_cb,
+        .data_outv_fnc = &mqtt_sendv_cb,
         .user_ctx = client,
         .connack_callback = &mws_connack_callback_ng,
-        .puback_callback = puback_callback,
-        .msg_callback = msg_callback
+        .puback_ctx_callback = &mws_puback_callback_ng,
+        .msg_callback = msg_callback,
+        .instr = &client->instr,
+        .allocator = mqtt_wss_pool_allocator(client->pool)
     };
     if ( (client->mqtt = mqtt_ng_init(&settings)) == NULL ) {
         mws_error(log, "Error initializing internal MQTT client");
         goto fail_3;
     }
 
+    // parse MQTT directly from the socket read buffer
+    ws_client_set_rx_payload_cb(client->ws_client, &mqtt_rx_payload_cb, client);
+
     return client;
 
 fail_3:
-    close(client->write_notif_pipe[PIPE_WRITE_END]);
-    close(client->write_notif_pipe[PIPE_READ_END]);
+    wakeup_close(client);
 fail_2:
     ws_client_destroy(client->ws_client);
+fail_pool:
+    mqtt_wss_pool_destroy(client->pool);
 fail_1:
+    mw_free(client->tx_record);
+fail_0:
+    pthread_mutex_destroy(&client->pub_lock);
+    pthread_mutex_destroy(&client->wakeup_lock);
     mw_free(client);
 fail:
     mqtt_wss_log_ctx_destroy(log);
     return NULL;
 }
 
+void mqtt_wss_set_log_level(mqtt_wss_client client, mqtt_wss_log_type_t min_severity)
+{
+    mqtt_wss_log_ctx_set_level(client->log, min_severity);
+}
+
+int mqtt_wss_set_log_async(mqtt_wss_client client, size_t records)
+{
+    return mqtt_wss_log_ctx_set_async(client->log, records);
+}
+
 void mqtt_wss_set_max_buf_size(mqtt_wss_client client, size_t size)
 {
     mqtt_ng_set_max_mem(client->mqtt, size);
 }
 
+int mqtt_wss_set_flow_control(mqtt_wss_client client, size_t high, size_t low, flow_control_callback_fnc_t callback, void *ctx)
+{
+    return mqtt_ng_set_flow_control(client->mqtt, high, low, callback, ctx);
+}
+
+size_t mqtt_wss_publish_credit(mqtt_wss_client client)
+{
+    return mqtt_ng_publish_credit(client->mqtt);
+}
+
+void mqtt_wss_set_msg_borrowed_callback(mqtt_wss_client client, msg_borrowed_callback_fnc_t callback, void *ctx)
+{
+    mqtt_ng_set_msg_borrowed_callback(client->mqtt, callback, ctx);
+}
+
+void mqtt_wss_set_msg_chunk_callback(mqtt_wss_client client, size_t min_len, msg_chunk_callback_fnc_t callback, void *ctx)
+{
+    mqtt_ng_set_msg_chunk_callback(client->mqtt, min_len, callback, ctx);
+}
+
+void mqtt_wss_set_send_coalesce_limit(mqtt_wss_client client, size_t bytes)
+{
+    mqtt_ng_set_send_coalesce_limit(client->mqtt, bytes);
+}
+
+int mqtt_wss_set_mask_pool_size(mqtt_wss_client client, size_t bytes)
+{
+    return ws_client_set_mask_pool_size(client->ws_client, bytes);
+}
+
+int mqtt_wss_set_compression(mqtt_wss_client client, const struct mqtt_wss_deflate_params *params)
+{
+    return ws_client_set_deflate(client->ws_client, params);
+}
+
+int mqtt_wss_set_tx_record_size(mqtt_wss_client client, size_t bytes)
+{
+    if (bytes > MQTT_WSS_MAX_TX_RECORD_SIZE)
+        bytes = MQTT_WSS_MAX_TX_RECORD_SIZE;
+
+    if (client->tx_retry_ptr) {
+        mws_error(client->log, "Can't change TLS record size while write is pending");
+        return 1;
+    }
+
+    char *record = NULL;
+    if (bytes) {
+        record = mw_malloc(bytes);
+        if (!record) {
+            mws_error(client->log, "OOM alocating TLS record buffer");
+            return 1;
+        }
+    }
+
+    mw_free(client->tx_record);
+    client->tx_record = record;
+    client->tx_record_size = bytes;
+    return 0;
+}
+
+int mqtt_wss_set_ktls(mqtt_wss_client client, int enable)
+{
+#ifdef MQTT_WSS_KTLS
+    client->ktls = enable ? 1 : 0;
+    return 0;
+#else
+    if (!enable)
+        return 0;
+    mws_error(client->log, "kTLS is not supported by this build");
+    return 1;
+#endif
+}
+
+int mqtt_wss_get_ktls(mqtt_wss_client client)
+{
+    return (client->ktls_tx ? MQTT_WSS_KTLS_TX : 0) | (client->ktls_rx ? MQTT_WSS_KTLS_RX : 0);
+}
+
+void mqtt_wss_set_connect_timeout(mqtt_wss_client client, int timeout_ms)
+{
+    client->connect_timeout_ms = timeout_ms > 0 ? timeout_ms : 0;
+}
+
+// drops resources of connection attempt in progress (not the connected socket)
+static void conn_abort(mqtt_wss_client client)
+{
+    mws_dns_query_release(client->dns_query);
+    client->dns_query = NULL;
+    mws_tcp_race_cancel(&client->tcp_race);
+    if (client->proxy_buf) {
+        rbuf_free(client->proxy_buf);
+        client->proxy_buf = NULL;
+    }
+}
+
 void mqtt_wss_destroy(mqtt_wss_client client)
 {
+    conn_abort(client);
     mqtt_ng_destroy(client->mqtt);
+    // after mqtt_ng which could still reference the mapping
+    mqtt_wss_spool_close(client->spool);
 
-    close(client->write_notif_pipe[PIPE_WRITE_END]);
-    close(client->write_notif_pipe[PIPE_READ_END]);
+    wakeup_close(client);
 
     ws_client_destroy(client->ws_client);
 
@@ -269,7 +576,11 @@ void mqtt_wss_destroy(mqtt_wss_client client)
 
     if (client->ssl)
         SSL_free(client->ssl);
-    
+
+    if (client->ssl_session)
+        SSL_SESSION_free(client->ssl_session);
+    mw_free(client->ssl_session_host);
+
     if (client->ssl_ctx)
         SSL_CTX_free(client->ssl_ctx);
 
@@ -277,12 +588,47 @@ void mqtt_wss_destroy(mqtt_wss_client client)
         close(client->sockfd);
 
     pthread_mutex_destroy(&client->pub_lock);
-    pthread_mutex_destroy(&client->stat_lock);
+    pthread_mutex_destroy(&client->wakeup_lock);
+
+    mw_free(client->tx_record);
+
+    // after everything that could hold memory from it
+    mqtt_wss_pool_destroy(client->pool);
+
+#ifdef MQTT_WSS_DEBUG
+    if (client->rx_capture_fd >= 0)
+        close(client->rx_capture_fd);
+    mw_free(client->rx_capture_path);
+#endif
 
     mqtt_wss_log_ctx_destroy(client->log);
     mw_free(client);
 }
 
+#if OPENSSL_VERSION_NUMBER >= OPENSSL_VERSION_110
+// called by OpenSSL for every record header sent or received
+static void ssl_msg_callback(int write_p, int version, int content_type, const void *buf, size_t len, SSL *ssl, void *arg)
+{
+    (void)version; (void)buf; (void)len; (void)ssl;
+    mqtt_wss_client client = arg;
+    if (write_p && content_type == SSL3_RT_HEADER)
+        client->tx_tls_records++;
+}
+#endif
+
+#if OPENSSL_VERSION_NUMBER >= OPENSSL_VERSION_111
+// called by OpenSSL after every write to the socket
+static long bio_write_callback(BIO *b, int oper, const char *argp, size_t len, int argi, long argl, int ret, size_t *processed)
+{
+    (void)argp; (void)len; (void)argi; (void)argl; (void)processed;
+    if (oper == (BIO_CB_WRITE | BIO_CB_RETURN)) {
+        mqtt_wss_client client = (mqtt_wss_client)BIO_get_callback_arg(b);
+        client->tx_syscalls++;
+    }
+    return ret;
+}
+#endif
+
 static int cert_verify_callback(int preverify_ok, X509_STORE_CTX *ctx)
 {
     SSL *ssl;
@@ -319,6 +665,86 @@ static int cert_verify_callback(int preverify_ok, X509_STORE_CTX *ctx)
     return preverify_ok;
 }
 
+// called by OpenSSL when server sends new session (for TLS 1.3 possibly
+// several times after the handshake), returning 1 takes ownership of it
+static int ssl_new_session_callback(SSL *ssl, SSL_SESSION *session)
+{
+    mqtt_wss_client client = SSL_get_ex_data(ssl, 0);
+    if (!client)
+        return 0;
+
+    if (!client->ssl_session_host || strcmp(client->ssl_session_host, client->target_host)) {
+        char *host = mw_strdup(client->target_host);
+        if (!host)
+            return 0;
+        mw_free(client->ssl_session_host);
+        client->ssl_session_host = host;
+    }
+    client->ssl_session_port = client->target_port;
+
+    if (client->ssl_session)
+        SSL_SESSION_free(client->ssl_session);
+    client->ssl_session = session;
+    return 1;
+}
+
+static void ssl_drop_session(mqtt_wss_client client)
+{
+    if (client->ssl_session)
+        SSL_SESSION_free(client->ssl_session);
+    client->ssl_session = NULL;
+}
+
+#define SSL_CTX_FLAGS_MASK (MQTT_WSS_SSL_ALLOW_SELF_SIGNED | MQTT_WSS_SSL_DONT_CHECK_CERTS)
+static int ssl_ctx_prepare(mqtt_wss_client client)
+{
+    if (client->ssl_ctx && client->ssl_ctx_flags == (client->ssl_flags & SSL_CTX_FLAGS_MASK))
+        return 0;
+
+    if (client->ssl_ctx)
+        SSL_CTX_free(client->ssl_ctx);
+    // session established with different certificate checking must not be resumed
+    ssl_drop_session(client);
+
+    client->ssl_ctx = SSL_CTX_new(SSLv23_client_method());
+    if (!client->ssl_ctx) {
+        mws_error(client->log, "Could not create SSL_CTX");
+        return 1;
+    }
+    client->ssl_ctx_flags = client->ssl_flags & SSL_CTX_FLAGS_MASK;
+
+    if (!(client->ssl_flags & MQTT_WSS_SSL_DONT_CHECK_CERTS)) {
+        SSL_CTX_set_default_verify_paths(client->ssl_ctx);
+        SSL_CTX_set_verify(client->ssl_ctx, SSL_VERIFY_PEER | SSL_VERIFY_CLIENT_ONCE, cert_verify_callback);
+    } else
+        mws_error(client->log, "SSL Certificate checking completely disabled!!!");
+
+    // we keep only the last session ourselves (see ssl_new_session_callback)
+    SSL_CTX_set_session_cache_mode(client->ssl_ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(client->ssl_ctx, ssl_new_session_callback);
+    return 0;
+}
+
+// offers cached session if it belongs to the host we connect to now
+static void ssl_offer_session(mqtt_wss_client client)
+{
+    if (!client->ssl_session)
+        return;
+
+    if (strcmp(client->ssl_session_host, client->target_host) || client->ssl_session_port != client->target_port) {
+        ssl_drop_session(client);
+        return;
+    }
+#if OPENSSL_VERSION_NUMBER >= OPENSSL_VERSION_111
+    if (!SSL_SESSION_is_resumable(client->ssl_session)) {
+        ssl_drop_session(client);
+        return;
+    }
+#endif
+    if (!SSL_set_session(client->ssl, client->ssl_session))
+        mws_error(client->log, "Could not set TLS session to resume");
+}
+
 #define PROXY_CONNECT "CONNECT"
 #define PROXY_HTTP "HTTP/1.1"
 #define HTTP_ENDLINE "\x0D\x0A"
@@ -434,252 +860,533 @@ inline static int base64_encode_helper(unsigned char *out, int *outl, const unsi
     return 0;
 }
 
-static int http_proxy_connect(mqtt_wss_client client)
+// prepares HTTP CONNECT request into client->proxy_buf
+static int http_proxy_prepare(mqtt_wss_client client)
 {
-    int rc;
-    struct pollfd poll_fd;
-    rbuf_t r_buf = rbuf_create(4096);
-    if (!r_buf)
-        return 1;
-    char *r_buf_ptr;
-    size_t r_buf_linear_insert_capacity;
-
-    poll_fd.fd = client->sockfd;
-    poll_fd.events = POLLIN;
-
-    r_buf_ptr = rbuf_get_linear_insert_range(r_buf, &r_buf_linear_insert_capacity);
-    snprintf(r_buf_ptr, r_buf_linear_insert_capacity,"%s %s:%d %s" HTTP_ENDLINE, PROXY_CONNECT, client->target_host, client->target_port, PROXY_HTTP);
-    write(client->sockfd, r_buf_ptr, strlen(r_buf_ptr));
+    char *creds_base64 = NULL;
+    char *ptr;
+    size_t size;
+    int len;
 
     if (client->proxy_uname) {
-        size_t creds_plain_len = strlen(client->proxy_uname) + strlen(client->proxy_passwd) + 2;
+        const char *passwd = client->proxy_passwd ? client->proxy_passwd : "";
+        size_t creds_plain_len = strlen(client->proxy_uname) + strlen(passwd) + 2;
         char *creds_plain = mw_malloc(creds_plain_len);
         if (!creds_plain) {
             mws_error(client->log, "OOM creds_plain");
-            rc = 6;
-            goto cleanup;
+            return 1;
         }
         int creds_base64_len = (((4 * creds_plain_len / 3) + 3) & ~3);
         // OpenSSL encoder puts newline every 64 output bytes
         // we remove those but during encoding we need that space in the buffer
         creds_base64_len += (1+(creds_base64_len/64)) * strlen("\n");
-        char *creds_base64 = mw_malloc(creds_base64_len + 1);
+        creds_base64 = mw_malloc(creds_base64_len + 1);
         if (!creds_base64) {
             mw_free(creds_plain);
             mws_error(client->log, "OOM creds_base64");
-            rc = 6;
-            goto cleanup;
+            return 1;
         }
-        char *ptr = creds_plain;
+        ptr = creds_plain;
         strcpy(ptr, client->proxy_uname);
         ptr += strlen(client->proxy_uname);
         *ptr++ = ':';
-        strcpy(ptr, client->proxy_passwd);
+        strcpy(ptr, passwd);
 
         int b64_len;
         base64_encode_helper((unsigned char*)creds_base64, &b64_len, (unsigned char*)creds_plain, strlen(creds_plain));
         mw_free(creds_plain);
+    }
 
-        r_buf_ptr = rbuf_get_linear_insert_range(r_buf, &r_buf_linear_insert_capacity);
-        snprintf(r_buf_ptr, r_buf_linear_insert_capacity,"Proxy-Authorization: Basic %s" HTTP_ENDLINE, creds_base64);
-        write(client->sockfd, r_buf_ptr, strlen(r_buf_ptr));
+    client->proxy_buf = rbuf_create(4096);
+    if (!client->proxy_buf) {
         mw_free(creds_base64);
+        return 1;
+    }
+
+    ptr = rbuf_get_linear_insert_range(client->proxy_buf, &size);
+    if (creds_base64)
+        len = snprintf(ptr, size, "%s %s:%d %s" HTTP_ENDLINE "Proxy-Authorization: Basic %s" HTTP_ENDLINE HTTP_ENDLINE,
+                       PROXY_CONNECT, client->target_host, client->target_port, PROXY_HTTP, creds_base64);
+    else
+        len = snprintf(ptr, size, "%s %s:%d %s" HTTP_ENDLINE HTTP_ENDLINE,
+                       PROXY_CONNECT, client->target_host, client->target_port, PROXY_HTTP);
+    mw_free(creds_base64);
+
+    if (len < 0 || (size_t)len >= size) {
+        mws_error(client->log, "http_proxy CONNECT request too long");
+        return 1;
+    }
+    rbuf_bump_head(client->proxy_buf, len);
+    client->proxy_request_sent = 0;
+    return 0;
+}
+
+// sends the CONNECT request and reads the reply as far as socket allows
+// returns 0 when tunnel is established, 1 if it has to wait for the socket, -1 on error
+static int http_proxy_step(mqtt_wss_client client)
+{
+    rbuf_t buf = client->proxy_buf;
+    char *ptr;
+    size_t size;
+    ssize_t rc;
+    int idx;
+
+    while (!client->proxy_request_sent) {
+        if (!(ptr = rbuf_get_linear_read_range(buf, &size))) {
+            client->proxy_request_sent = 1;
+            break;
+        }
+        if ((rc = write(client->sockfd, ptr, size)) < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EWOULDBLOCK || errno == EAGAIN) {
+                client->conn_events = POLLOUT;
+                return 1;
+            }
+            mws_error(client->log, "http_proxy error writing to socket \"%s\"", strerror(errno));
+            return -1;
+        }
+        rbuf_bump_tail(buf, rc);
     }
-    write(client->sockfd, HTTP_ENDLINE, strlen(HTTP_ENDLINE));
 
     // read until you find CRLF, CRLF (HTTP HDR end)
     // or ring buffer is full
-    // or timeout
-    while ((rc = poll(&poll_fd, 1, 1000)) >= 0) {
-        if (!rc) {
-            mws_error(client->log, "http_proxy timeout waiting reply from proxy server");
-            rc = 2;
-            goto cleanup;
-        }
-        r_buf_ptr = rbuf_get_linear_insert_range(r_buf, &r_buf_linear_insert_capacity);
-        if (!r_buf_ptr) {
+    for (;;) {
+        if (!(ptr = rbuf_get_linear_insert_range(buf, &size))) {
             mws_error(client->log, "http_proxy read ring buffer full");
-            rc = 3;
-            goto cleanup;
+            return -1;
         }
-        if ((rc = read(client->sockfd, r_buf_ptr, r_buf_linear_insert_capacity)) < 0) {
-            if (errno == EWOULDBLOCK || errno == EAGAIN) {
+        if ((rc = read(client->sockfd, ptr, size)) < 0) {
+            if (errno == EINTR)
                 continue;
+            if (errno == EWOULDBLOCK || errno == EAGAIN) {
+                client->conn_events = POLLIN;
+                return 1;
             }
             mws_error(client->log, "http_proxy error reading from socket \"%s\"", strerror(errno));
-            rc = 4;
-            goto cleanup;
+            return -1;
         }
-        rbuf_bump_head(r_buf, rc);
-        if (rbuf_find_bytes(r_buf, HTTP_HDR_TERMINATOR, strlen(HTTP_HDR_TERMINATOR), &rc)) {
-            rc = 0;
-            if (http_parse_reply(client, r_buf))
-                rc = 5;
-
-            goto cleanup;
+        if (!rc) {
+            mws_error(client->log, "http_proxy closed connection before replying");
+            return -1;
         }
+        rbuf_bump_head(buf, rc);
+        if (rbuf_find_bytes(buf, HTTP_HDR_TERMINATOR, strlen(HTTP_HDR_TERMINATOR), &idx))
+            return http_parse_reply(client, buf) ? -1 : 0;
     }
-    mws_error(client->log, "proxy negotiation poll error \"%s\"", strerror(errno));
-    rc = 5;
-cleanup:
-    rbuf_free(r_buf);
-    return rc;
 }
 
-int mqtt_wss_connect(mqtt_wss_client client, char *host, int port, struct mqtt_connect_params *mqtt_params, int ssl_flags, struct mqtt_wss_proxy *proxy)
+#ifdef MQTT_WSS_DEBUG
+// every connection starts new capture so that file always
+// holds single session (beginning with the HTTP upgrade response)
+static void rx_capture_open(mqtt_wss_client client)
 {
-    struct sockaddr_in addr;
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-
-    struct hostent *he;
-    struct in_addr **addr_list;
+    if (client->rx_capture_fd >= 0)
+        close(client->rx_capture_fd);
+    client->rx_capture_fd = -1;
+    if (!client->rx_capture_path)
+        return;
+
+    client->rx_capture_fd = open(client->rx_capture_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (client->rx_capture_fd < 0)
+        mws_error(client->log, "Couldn't open RX capture file \"%s\": %s", client->rx_capture_path, strerror(errno));
+}
 
-    if (!mqtt_params) {
-        mws_error(client->log, "mqtt_params can't be null!");
-        return -1;
+static void rx_capture_write(mqtt_wss_client client, const char *data, size_t len)
+{
+    while (len) {
+        ssize_t ret = write(client->rx_capture_fd, data, len);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            mws_error(client->log, "Error writing RX capture (%s), capture stopped", strerror(errno));
+            close(client->rx_capture_fd);
+            client->rx_capture_fd = -1;
+            return;
+        }
+        data += ret;
+        len -= ret;
     }
+}
+#endif
 
-    // reset state in case this is reconnect
-    client->mqtt_didnt_finish_write = 0;
-    client->mqtt_connected = 0;
-    client->mqtt_disconnecting = 0;
-    ws_client_reset(client->ws_client);
-
-    if (client->target_host == client->host)
-        client->target_host = NULL;
-    if (client->target_host)
-        mw_free(client->target_host);
-    if (client->host)
-        mw_free(client->host);
+#ifndef __linux__
+#define THROWAWAY_BUF_SIZE 32
+char throwaway[THROWAWAY_BUF_SIZE];
+static inline void util_clear_pipe(int fd)
+{
+    while (read(fd, throwaway, THROWAWAY_BUF_SIZE) == THROWAWAY_BUF_SIZE);
+}
+#endif
 
-    if (proxy && proxy->type != MQTT_WSS_DIRECT) {
-        client->host = mw_strdup(proxy->host);
-        client->port = proxy->port;
-        client->target_host = mw_strdup(host);
-        client->target_port = port;
-        client->proxy_type = proxy->type;
-        if (proxy->username)
-            client->proxy_uname = mw_strdup(proxy->username);
-        if (proxy->password)
-            client->proxy_passwd = mw_strdup(proxy->password);
-    } else {
-        client->host = mw_strdup(host);
-        client->port = port;
-        client->target_host = client->host;
-        client->target_port = port;
+// called by service thread before it looks for work, producers coming after this
+// signal again (signalled - write_notif_pipe was found readable)
+static void wakeup_clear(mqtt_wss_client client, int signalled)
+{
+    if (signalled) {
+#ifdef __linux__
+        uint64_t count;
+        // resets the eventfd counter
+        if (read(client->write_notif_pipe[PIPE_READ_END], &count, sizeof(count)) < 0 && errno != EAGAIN)
+            mws_error(client->log, "Error reading eventfd \"%s\"", strerror(errno));
+#else
+        util_clear_pipe(client->write_notif_pipe[PIPE_READ_END]);
+#endif
     }
+    __atomic_store_n(&client->wakeup_pending, 0, __ATOMIC_SEQ_CST);
+}
 
-    client->ssl_flags = ssl_flags;
+static long long int monotonic_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long int)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-    //TODO gethostbyname -> getaddinfo
-    //     hstrerror -> gai_strerror
-    if ((he = gethostbyname(client->host)) == NULL) {
-        mws_error(client->log, "gethostbyname() error \"%s\"", hstrerror(h_errno));
-        return -1;
-    }
+static inline int conn_in_progress(mqtt_wss_client client)
+{
+    return client->conn_state > MQTT_WSS_CONN_IDLE && client->conn_state < MQTT_WSS_CONN_CONNECTED;
+}
 
-    addr_list = (struct in_addr **)he->h_addr_list;
-    if(!addr_list[0]) {
-        mws_error(client->log, "No IP addr resolved");
-        return -1;
+// puts sockets to be watched into poll_fds (first one into POLLFD_SOCKET)
+static void conn_set_sockets(mqtt_wss_client client, const int *fds, int count, short events)
+{
+    for (int i = 0; i < MWS_TCP_MAX_ATTEMPTS; i++) {
+        int slot = i ? POLLFD_RACE + i - 1 : POLLFD_SOCKET;
+        client->poll_fds[slot].fd = i < count ? fds[i] : -1;
+        client->poll_fds[slot].events = events;
+        client->poll_fds[slot].revents = 0;
     }
-    mws_debug(client->log, "Resolved IP: %s", inet_ntoa(*addr_list[0]));
-    addr.sin_addr = *addr_list[0];
-    addr.sin_port = htons(client->port);
+    client->poll_nfds = count > 1 ? POLLFD_RACE + count - 1 : POLLFD_RACE;
+    // closed socket's number might be reused by the next one
+    // so we don't try to find out what actually changed
+    client->socket_generation++;
+}
 
-    if (client->sockfd > 0)
+static int conn_fail(mqtt_wss_client client, int error)
+{
+    conn_abort(client);
+    if (client->sockfd >= 0) {
         close(client->sockfd);
-    client->sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (client->sockfd < 0) {
-        mws_error(client->log, "Couldn't create socket()");
-        return -1;
+        client->sockfd = -1;
     }
+    conn_set_sockets(client, NULL, 0, 0);
+    client->conn_state = MQTT_WSS_CONN_FAILED;
+    client->conn_error = error;
+    return MQTT_WSS_ERR_CONNECT_FAILED;
+}
 
-    int flag = 1;
-    int result = setsockopt(client->sockfd,
-                            IPPROTO_TCP,
-                            TCP_NODELAY,
-                            &flag,
-                            sizeof(int));
-    if (result < 0)
-       mws_error(client->log, "Could not dissable NAGLE");
-
-    if (connect(client->sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-        mws_error(client->log, "Could not connect to remote endpoint \"%s\", port %d.\n", client->host, client->port);
-        return -3;
+// error code mqtt_wss_connect reports if we fail (or time out) in given phase
+static int conn_phase_error(enum mqtt_wss_connect_state state)
+{
+    switch (state) {
+        case MQTT_WSS_CONN_RESOLVING:
+            return -1;
+        case MQTT_WSS_CONN_TCP:
+            return -3;
+        case MQTT_WSS_CONN_PROXY:
+            return -4;
+        case MQTT_WSS_CONN_TLS:
+            return -6;
+        default:
+            return 2;
     }
+}
 
-    client->poll_fds[POLLFD_SOCKET].fd = client->sockfd;
-
-    if (fcntl(client->sockfd, F_SETFL, fcntl(client->sockfd, F_GETFL, 0) | O_NONBLOCK) == -1) {
-        mws_error(client->log, "Error setting O_NONBLOCK to TCP socket. \"%s\"", strerror(errno));
-        return -8;
+static long long int conn_timer_in_ms(mqtt_wss_client client, long long int now)
+{
+    long long int ret = -1;
+    if (client->conn_deadline_ms)
+        ret = client->conn_deadline_ms > now ? client->conn_deadline_ms - now : 0;
+    if (client->conn_state == MQTT_WSS_CONN_TCP) {
+        long long int next_attempt = mws_tcp_race_timeout_ms(&client->tcp_race, now);
+        if (next_attempt >= 0 && (ret < 0 || next_attempt < ret))
+            ret = next_attempt;
     }
+    return ret;
+}
 
-    if (client->proxy_type != MQTT_WSS_DIRECT)
-        if (http_proxy_connect(client))
-            return -4;
-
-#if OPENSSL_VERSION_NUMBER < OPENSSL_VERSION_110
-#if (SSLEAY_VERSION_NUMBER >= OPENSSL_VERSION_097)
-    OPENSSL_config(NULL);
-#endif
-    SSL_load_error_strings();
-    SSL_library_init();
-#else
-    if (OPENSSL_init_ssl(OPENSSL_INIT_LOAD_CONFIG, NULL) != 1) {
-        mws_error(client->log, "Failed to initialize SSL");
-        return -1;
-    };
-#endif
-
-    // free SSL structs from possible previous connections
-    if (client->ssl)
+// sets up TLS on connected socket
+// returns 0 or mqtt_wss_connect error code
+static int tls_start(mqtt_wss_client client)
+{
+    // free SSL struct from possible previous connection
+    // SSL_CTX is reused unless certificate checking flags changed
+    if (client->ssl) {
+        // OpenSSL invalidates session of connection closed without close_notify
+        // which is no longer required since TLS 1.1 [RFC4346 7.2.1],
+        // we want to resume after connection was lost as well
+        SSL_set_shutdown(client->ssl, SSL_get_shutdown(client->ssl) | SSL_SENT_SHUTDOWN);
         SSL_free(client->ssl);
-    if (client->ssl_ctx)
-        SSL_CTX_free(client->ssl_ctx);
-
-    client->ssl_ctx = SSL_CTX_new(SSLv23_client_method());
-    if (!(client->ssl_flags & MQTT_WSS_SSL_DONT_CHECK_CERTS)) {
-        SSL_CTX_set_default_verify_paths(client->ssl_ctx);
-        SSL_CTX_set_verify(client->ssl_ctx, SSL_VERIFY_PEER | SSL_VERIFY_CLIENT_ONCE, cert_verify_callback);
-    } else
-        mws_error(client->log, "SSL Certificate checking completely disabled!!!");
+        client->ssl = NULL;
+    }
+    if (ssl_ctx_prepare(client))
+        return -1;
 
 #ifdef MQTT_WSS_DEBUG
     if(client->ssl_ctx_keylog_cb)
         SSL_CTX_set_keylog_callback(client->ssl_ctx, client->ssl_ctx_keylog_cb);
+    rx_capture_open(client);
 #endif
 
     client->ssl = SSL_new(client->ssl_ctx);
-    if (!(client->ssl_flags & MQTT_WSS_SSL_DONT_CHECK_CERTS)) {
-        if (!SSL_set_ex_data(client->ssl, 0, client)) {
-            mws_error(client->log, "Could not SSL_set_ex_data");
-            return -4;
-        }
+    if (!client->ssl) {
+        mws_error(client->log, "Could not create SSL");
+        return -1;
+    }
+    // needed by cert_verify_callback and ssl_new_session_callback
+    if (!SSL_set_ex_data(client->ssl, 0, client)) {
+        mws_error(client->log, "Could not SSL_set_ex_data");
+        return -4;
     }
     SSL_set_fd(client->ssl, client->sockfd);
     SSL_set_connect_state(client->ssl);
+    ssl_offer_session(client);
+
+    client->ktls_tx = 0;
+    client->ktls_rx = 0;
+#ifdef MQTT_WSS_KTLS
+    // keys are handed to kernel during handshake if it (and the cipher) allows
+    if (client->ktls)
+        SSL_set_options(client->ssl, SSL_OP_ENABLE_KTLS);
+#endif
+
+    // pending write (if any) belongs to previous SSL connection
+    client->tx_retry_ptr = NULL;
+    client->tx_retry_len = 0;
+
+#if OPENSSL_VERSION_NUMBER >= OPENSSL_VERSION_110
+    SSL_set_msg_callback(client->ssl, ssl_msg_callback);
+    SSL_set_msg_callback_arg(client->ssl, client);
+#endif
+#if OPENSSL_VERSION_NUMBER >= OPENSSL_VERSION_111
+    BIO_set_callback_ex(SSL_get_wbio(client->ssl), bio_write_callback);
+    BIO_set_callback_arg(SSL_get_wbio(client->ssl), (char *)client);
+#endif
 
     if (!SSL_set_tlsext_host_name(client->ssl, client->target_host)) {
         mws_error(client->log, "Error setting TLS SNI host");
         return -7;
     }
+    return 0;
+}
 
-    result = SSL_connect(client->ssl);
-    if (result != -1 && result != 1) {
+// returns 0 when TLS handshake is done, 1 if it has to wait for the socket
+// or mqtt_wss_connect error code
+static int tls_step(mqtt_wss_client client)
+{
+    int result = SSL_connect(client->ssl);
+    if (result == 1)
+        return 0;
+
+    int ec = SSL_get_error(client->ssl, result);
+    if (ec == SSL_ERROR_WANT_READ) {
+        client->conn_events = POLLIN;
+        return 1;
+    }
+    if (ec == SSL_ERROR_WANT_WRITE) {
+        client->conn_events = POLLOUT;
+        return 1;
+    }
+    if (result != -1) {
         mws_error(client->log, "SSL could not connect");
         return -5;
     }
-    if (result == -1) {
-        int ec = SSL_get_error(client->ssl, result);
-        if (ec != SSL_ERROR_WANT_READ && ec != SSL_ERROR_WANT_WRITE) {
-            mws_error(client->log, "Failed to start SSL connection");
-            return -6;
+    mws_error(client->log, "Failed to start SSL connection: %s", util_openssl_ret_err(ec));
+    return -6;
+}
+
+static void ktls_detect(mqtt_wss_client client)
+{
+#ifdef MQTT_WSS_KTLS
+    if (!client->ktls)
+        return;
+    client->ktls_tx = BIO_get_ktls_send(SSL_get_wbio(client->ssl)) ? 1 : 0;
+    // TLS 1.3 session tickets and key updates can come anytime and have to
+    // be processed by OpenSSL, TLS 1.2 has nothing after the handshake
+    // we would have to pass to it (renegotiation is not supported)
+    client->ktls_rx = BIO_get_ktls_recv(SSL_get_rbio(client->ssl)) &&
+                      SSL_version(client->ssl) == TLS1_2_VERSION &&
+                      !SSL_has_pending(client->ssl);
+    mws_info(client->log, "kTLS offload TX %s, RX %s", client->ktls_tx ? "on" : "off", client->ktls_rx ? "on" : "off");
+#else
+    (void)client;
+#endif
+}
+
+static int service_connection(mqtt_wss_client client, int send_keepalive);
+
+// advances connection attempt as far as it gets without blocking
+static int mqtt_wss_connect_step(mqtt_wss_client client, int wakeup_pending)
+{
+    struct mws_addr_list *addrs;
+    int fds[MWS_TCP_MAX_ATTEMPTS];
+    int rc;
+
+    // wakeup pipe is also how resolver tells us it is done
+    wakeup_clear(client, wakeup_pending);
+
+    if (client->conn_state == MQTT_WSS_CONN_FAILED)
+        return MQTT_WSS_ERR_CONNECT_FAILED;
+
+    long long int now = monotonic_ms();
+    if (client->conn_deadline_ms && now >= client->conn_deadline_ms) {
+        mws_error(client->log, "Timeout connecting to \"%s\", port %d.", client->host, client->port);
+        return conn_fail(client, conn_phase_error(client->conn_state));
+    }
+
+    for (;;) {
+        switch (client->conn_state) {
+            case MQTT_WSS_CONN_RESOLVING:
+                if (!mws_dns_query_done(client->dns_query))
+                    return MQTT_WSS_OK;
+                addrs = mws_dns_query_result(client->dns_query, client->log);
+                mws_dns_query_release(client->dns_query);
+                client->dns_query = NULL;
+                if (!addrs)
+                    return conn_fail(client, -1);
+                if (mws_tcp_race_start(&client->tcp_race, addrs, now, client->log))
+                    return conn_fail(client, -3);
+                client->conn_state = MQTT_WSS_CONN_TCP;
+                continue;
+            case MQTT_WSS_CONN_TCP:
+                rc = mws_tcp_race_process(&client->tcp_race, now, client->log);
+                if (rc == MWS_TCP_RACE_PENDING) {
+                    rc = mws_tcp_race_get_fds(&client->tcp_race, fds, MWS_TCP_MAX_ATTEMPTS);
+                    conn_set_sockets(client, fds, rc, POLLOUT);
+                    return MQTT_WSS_OK;
+                }
+                if (rc == MWS_TCP_RACE_FAILED) {
+                    // cached addresses might be stale
+                    mws_dns_cache_invalidate(client->host);
+                    mws_error(client->log, "Could not connect to remote endpoint \"%s\", port %d.", client->host, client->port);
+                    return conn_fail(client, -3);
+                }
+                client->sockfd = rc;
+                mws_tcp_race_cancel(&client->tcp_race);
+                conn_set_sockets(client, &client->sockfd, 1, 0);
+                if (client->proxy_type != MQTT_WSS_DIRECT) {
+                    if (http_proxy_prepare(client))
+                        return conn_fail(client, -4);
+                    client->conn_state = MQTT_WSS_CONN_PROXY;
+                    continue;
+                }
+                if ((rc = tls_start(client)))
+                    return conn_fail(client, rc);
+                client->conn_state = MQTT_WSS_CONN_TLS;
+                continue;
+            case MQTT_WSS_CONN_PROXY:
+                rc = http_proxy_step(client);
+                if (rc > 0)
+                    break;
+                if (rc < 0)
+                    return conn_fail(client, -4);
+                rbuf_free(client->proxy_buf);
+                client->proxy_buf = NULL;
+                if ((rc = tls_start(client)))
+                    return conn_fail(client, rc);
+                client->conn_state = MQTT_WSS_CONN_TLS;
+                continue;
+            case MQTT_WSS_CONN_TLS:
+                rc = tls_step(client);
+                if (rc > 0)
+                    break;
+                if (rc < 0)
+                    return conn_fail(client, rc);
+                ktls_detect(client);
+                client->conn_state = MQTT_WSS_CONN_HANDSHAKE;
+                continue;
+            case MQTT_WSS_CONN_HANDSHAKE:
+                // WebSocket upgrade, MQTT CONNECT and CONNACK
+                if (service_connection(client, 0)) {
+                    mws_error(client->log, "Error connecting to MQTT WSS server \"%s\", port %d.", client->target_host, client->target_port);
+                    return conn_fail(client, 2);
+                }
+                if (!client->mqtt_connected)
+                    return MQTT_WSS_OK;
+
+                client->conn_state = MQTT_WSS_CONN_CONNECTED;
+                // there might be no socket event to get us to drain the spool
+                if (client->spool && mqtt_wss_spool_has_pending(client->spool))
+                    mqtt_wss_wakeup(client);
+                STATS_ADD(client, tls_handshakes, 1);
+                if (SSL_session_reused(client->ssl)) {
+                    STATS_ADD(client, tls_resumed, 1);
+                    mws_info(client->log, "TLS session resumed");
+                }
+                return MQTT_WSS_OK;
+            default:
+                return MQTT_WSS_OK;
         }
+        // proxy or TLS handshake waits for the socket
+        client->poll_fds[POLLFD_SOCKET].events = client->conn_events;
+        return MQTT_WSS_OK;
+    }
+}
+
+int mqtt_wss_connect_async(mqtt_wss_client client, char *host, int port, struct mqtt_connect_params *mqtt_params, int ssl_flags, struct mqtt_wss_proxy *proxy)
+{
+    int rc = -1;
+
+    if (!mqtt_params) {
+        mws_error(client->log, "mqtt_params can't be null!");
+        return -1;
     }
 
+    // drops previous attempt or connection
+    // state stays MQTT_WSS_CONN_FAILED until new attempt starts
+    conn_fail(client, rc);
+
+    // reset state in case this is reconnect
+    client->mqtt_didnt_finish_write = 0;
+    client->mqtt_connected = 0;
+    client->mqtt_disconnecting = 0;
+    ws_client_reset(client->ws_client);
+
+    if (client->target_host == client->host)
+        client->target_host = NULL;
+    if (client->target_host)
+        mw_free(client->target_host);
+    if (client->host)
+        mw_free(client->host);
+    mw_free(client->proxy_uname);
+    mw_free(client->proxy_passwd);
+    client->proxy_uname = NULL;
+    client->proxy_passwd = NULL;
+
+    if (proxy && proxy->type != MQTT_WSS_DIRECT) {
+        client->host = mw_strdup(proxy->host);
+        client->port = proxy->port;
+        client->target_host = mw_strdup(host);
+        client->target_port = port;
+        client->proxy_type = proxy->type;
+        if (proxy->username)
+            client->proxy_uname = mw_strdup(proxy->username);
+        if (proxy->password)
+            client->proxy_passwd = mw_strdup(proxy->password);
+    } else {
+        client->host = mw_strdup(host);
+        client->port = port;
+        client->target_host = client->host;
+        client->target_port = port;
+        client->proxy_type = MQTT_WSS_DIRECT;
+    }
+
+    client->ssl_flags = ssl_flags;
+
+#if OPENSSL_VERSION_NUMBER < OPENSSL_VERSION_110
+#if (SSLEAY_VERSION_NUMBER >= OPENSSL_VERSION_097)
+    OPENSSL_config(NULL);
+#endif
+    SSL_load_error_strings();
+    SSL_library_init();
+#else
+    if (OPENSSL_init_ssl(OPENSSL_INIT_LOAD_CONFIG, NULL) != 1) {
+        mws_error(client->log, "Failed to initialize SSL");
+        goto fail;
+    };
+#endif
+
     uint8_t mqtt_flags = (mqtt_params->will_flags & MQTT_WSS_PUB_QOSMASK) << 3;
     if (mqtt_params->will_flags & MQTT_WSS_PUB_RETAIN)
         mqtt_flags |= MQTT_CONNECT_WILL_RETAIN;
@@ -687,6 +1394,8 @@ int mqtt_wss_connect(mqtt_wss_client client, char *host, int port, struct mqtt_c
 
     client->mqtt_keepalive = (mqtt_params->keep_alive ? mqtt_params->keep_alive : 400);
 
+    // CONNECT is queued now (mqtt_params don't have to outlive this call)
+    // and sent once WebSocket is established
     mws_info(client->log, "Going to connect using internal MQTT 5 implementation");
     struct mqtt_auth_properties auth;
     auth.client_id = (char*)mqtt_params->clientid;
@@ -703,23 +1412,49 @@ int mqtt_wss_connect(mqtt_wss_client client, char *host, int port, struct mqtt_c
     lwt.will_message_size = mqtt_params->will_msg_len;
     lwt.will_qos = (mqtt_params->will_flags & MQTT_WSS_PUB_QOSMASK);
     lwt.will_retain = mqtt_params->will_flags & MQTT_WSS_PUB_RETAIN;
-    int ret = mqtt_ng_connect(client->mqtt, &auth, mqtt_params->will_msg ? &lwt : NULL, 1, client->mqtt_keepalive);
-    if (ret) {
+    if (mqtt_ng_connect(client->mqtt, &auth, mqtt_params->will_msg ? &lwt : NULL, 1, client->mqtt_keepalive)) {
         mws_error(client->log, "Error generating MQTT connect");
-        return 1;
+        rc = 1;
+        goto fail;
     }
 
-    client->poll_fds[POLLFD_PIPE].events = POLLIN;
-    client->poll_fds[POLLFD_SOCKET].events = POLLIN;
-    // wait till MQTT connection is established
-    while (!client->mqtt_connected) {
-        if(mqtt_wss_service(client, -1)) {
-            mws_error(client->log, "Error connecting to MQTT WSS server \"%s\", port %d.", host, port);
-            return 2;
-        }
-    }
+    client->conn_deadline_ms = client->connect_timeout_ms ? monotonic_ms() + client->connect_timeout_ms : 0;
+    client->dns_query = mws_dns_resolve(client->host, client->port, client->write_notif_pipe[PIPE_WRITE_END], client->log);
+    if (!client->dns_query)
+        goto fail;
+    client->conn_state = MQTT_WSS_CONN_RESOLVING;
 
+    // IP addresses and cached names are resolved already
+    if (mqtt_wss_connect_step(client, 0))
+        return client->conn_error;
     return 0;
+
+fail:
+    client->conn_error = rc;
+    return rc;
+}
+
+int mqtt_wss_connect(mqtt_wss_client client, char *host, int port, struct mqtt_connect_params *mqtt_params, int ssl_flags, struct mqtt_wss_proxy *proxy)
+{
+    int rc = mqtt_wss_connect_async(client, host, port, mqtt_params, ssl_flags, proxy);
+    if (rc)
+        return rc;
+
+    // wait till MQTT connection is established
+    while (conn_in_progress(client))
+        mqtt_wss_service(client, -1);
+
+    return client->conn_state == MQTT_WSS_CONN_CONNECTED ? 0 : client->conn_error;
+}
+
+enum mqtt_wss_connect_state mqtt_wss_get_connect_state(mqtt_wss_client client)
+{
+    return client->conn_state;
+}
+
+int mqtt_wss_get_connect_error(mqtt_wss_client client)
+{
+    return client->conn_state == MQTT_WSS_CONN_FAILED ? client->conn_error : 0;
 }
 
 #define NSEC_PER_USEC   1000ULL
@@ -775,6 +1510,17 @@ void mqtt_wss_disconnect(mqtt_wss_client client, int timeout_ms)
 {
     int ret;
 
+    if (client->conn_state != MQTT_WSS_CONN_CONNECTED && client->conn_state != MQTT_WSS_CONN_IDLE) {
+        // nothing to close gracefully before we are connected
+        conn_fail(client, client->conn_error);
+        client->conn_state = MQTT_WSS_CONN_IDLE;
+        return;
+    }
+
+    // never connected (or disconnected already)
+    if (client->ssl == NULL || client->sockfd < 0)
+        return;
+
     // block application from sending more MQTT messages
     client->mqtt_disconnecting = 1;
 
@@ -817,23 +1563,50 @@ void mqtt_wss_disconnect(mqtt_wss_client client, int timeout_ms)
     // or timeout happens (unusual) in which case we close
     mqtt_wss_service_all(client, timeout_ms / 4);
 
+    // best effort close_notify, remote might have closed the connection already
+    SSL_shutdown(client->ssl);
+    ERR_clear_error();
+
     close(client->sockfd);
     client->sockfd = -1;
+    conn_set_sockets(client, NULL, 0, 0);
+    client->conn_state = MQTT_WSS_CONN_IDLE;
+}
+
+static inline void wakeup_signal(int fd)
+{
+    // 8 bytes as eventfd requires, works for pipe as well
+    uint64_t one = 1;
+    while (write(fd, &one, sizeof(one)) < 0 && errno == EINTR);
 }
 
-static inline void mqtt_wss_wakeup(mqtt_wss_client client)
+// only the first call after service thread cleared wakeup_pending makes a syscall
+// (and takes wakeup_lock)
+void mqtt_wss_wakeup(mqtt_wss_client client)
 {
+    if (__atomic_exchange_n(&client->wakeup_pending, 1, __ATOMIC_SEQ_CST))
+        return;
 #ifdef DEBUG_ULTRA_VERBOSE
     mws_debug(client->log, "mqtt_wss_wakup - forcing wake up of main loop");
 #endif
-    write(client->write_notif_pipe[PIPE_WRITE_END], " ", 1);
+    pthread_mutex_lock(&client->wakeup_lock);
+    wakeup_signal(client->wakeup_target >= 0 ? client->wakeup_target : client->write_notif_pipe[PIPE_WRITE_END]);
+    pthread_mutex_unlock(&client->wakeup_lock);
 }
 
-#define THROWAWAY_BUF_SIZE 32
-char throwaway[THROWAWAY_BUF_SIZE];
-static inline void util_clear_pipe(int fd)
+void mqtt_wss_set_wakeup_target(mqtt_wss_client client, int fd)
 {
-    (void)read(fd, throwaway, THROWAWAY_BUF_SIZE);
+    pthread_mutex_lock(&client->wakeup_lock);
+    client->wakeup_target = fd;
+    // wakeup that went to the previous target might never be noticed
+    if (__atomic_load_n(&client->wakeup_pending, __ATOMIC_SEQ_CST))
+        wakeup_signal(fd >= 0 ? fd : client->write_notif_pipe[PIPE_WRITE_END]);
+    pthread_mutex_unlock(&client->wakeup_lock);
+}
+
+int mqtt_wss_wakeup_pending(mqtt_wss_client client)
+{
+    return __atomic_load_n(&client->wakeup_pending, __ATOMIC_SEQ_CST);
 }
 
 static inline void set_socket_pollfds(mqtt_wss_client client, int ssl_ret) {
@@ -863,28 +1636,210 @@ static inline long long int t_till_next_keepalive_ms(mqtt_wss_client client)
     return(next_mqtt_keep_alive - (time(NULL) * SEC_TO_MSEC));
 }
 
-#ifdef MQTT_WSS_CPUSTATS
-static inline uint64_t mqtt_wss_now_usec(mqtt_wss_client client) {
-    struct timespec ts;
-    if(clock_gettime(CLOCK_MONOTONIC, &ts) == -1) {
-        mws_error(client->log, "clock_gettime(CLOCK_MONOTONIC, &timespec) failed.");
+#ifdef MQTT_WSS_KTLS
+// kernel does the TLS records so buf_write is sent as is
+// (no SSL_write retry rules, no staging of the wrapped around part)
+static int mqtt_wss_write_ktls(mqtt_wss_client client)
+{
+    rbuf_t buf = client->ws_client->buf_write;
+    size_t written = 0;
+    size_t size;
+    char *ptr;
+
+    client->ssl_write_blocked = 0;
+    while ((ptr = rbuf_get_linear_read_range(buf, &size))) {
+        // if ring buffer wraps around kernel keeps the record open for the rest
+        int flags = MSG_NOSIGNAL | (size < rbuf_bytes_available(buf) ? MSG_MORE : 0);
+        uint64_t start = mqtt_wss_instr_start(&client->instr);
+        ssize_t ret = send(client->sockfd, ptr, size, flags);
+        mqtt_wss_instr_stop(&client->instr, MQTT_WSS_STAGE_SSL_WRITE, start);
+        client->tx_syscalls++;
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                client->poll_fds[POLLFD_SOCKET].events |= POLLOUT;
+                client->ssl_write_blocked = 1;
+                mqtt_wss_instr_event(&client->instr, MQTT_WSS_EVENT_PARTIAL_WRITE);
+                break;
+            }
+            mws_error(client->log, "kTLS send error: %d %s", errno, strerror(errno));
+            return 1;
+        }
+        rbuf_bump_tail(buf, ret);
+        written += ret;
+    }
+
+    STATS_ADD(client, bytes_tx, written);
+    STATS_ADD(client, tx_syscalls, client->tx_syscalls);
+    client->tx_syscalls = 0;
+    return 0;
+}
+
+// reads application data decrypted by kernel
+// returns what SSL_read would and sets *err as SSL_get_error would
+static int ktls_read(mqtt_wss_client client, char *ptr, size_t size, int *err)
+{
+    char cmsg_buf[CMSG_SPACE(sizeof(unsigned char))];
+    struct iovec iov = { .iov_base = ptr, .iov_len = size };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = cmsg_buf,
+        .msg_controllen = sizeof(cmsg_buf)
+    };
+
+    ssize_t ret = recvmsg(client->sockfd, &msg, 0);
+    if (ret < 0) {
+        *err = (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? SSL_ERROR_WANT_READ : SSL_ERROR_SYSCALL;
+        return -1;
+    }
+    if (!ret) {
+        // closed without close_notify
+        *err = SSL_ERROR_SYSCALL;
         return 0;
     }
-    return (uint64_t)ts.tv_sec * USEC_PER_SEC + (ts.tv_nsec % NSEC_PER_SEC) / NSEC_PER_USEC;
+
+    // records other than application data come with their type
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_TLS && cmsg->cmsg_type == TLS_GET_RECORD_TYPE) {
+        unsigned char type = *CMSG_DATA(cmsg);
+        if (type != TLS_RECORD_TYPE_DATA) {
+            // alert description 0 is close_notify
+            if (type == TLS_RECORD_TYPE_ALERT && ret >= 2 && !ptr[1]) {
+                *err = SSL_ERROR_ZERO_RETURN;
+                return 0;
+            }
+            mws_error(client->log, "kTLS received unexpected TLS record type %u", type);
+            *err = SSL_ERROR_SSL;
+            return -1;
+        }
+    }
+    return ret;
+}
+#endif
+
+static inline int tls_read(mqtt_wss_client client, char *ptr, size_t size, int *err)
+{
+#ifdef MQTT_WSS_KTLS
+    if (client->ktls_rx)
+        return ktls_read(client, ptr, size, err);
+#endif
+    int ret = SSL_read(client->ssl, ptr, size);
+    if (ret <= 0)
+        *err = SSL_get_error(client->ssl, ret);
+    return ret;
 }
+
+// writes buf_write to TLS until it is empty or TLS would block
+static int mqtt_wss_write_tls(mqtt_wss_client client)
+{
+    rbuf_t buf = client->ws_client->buf_write;
+    size_t written = 0;
+    int ret;
+
+#ifdef MQTT_WSS_KTLS
+    if (client->ktls_tx)
+        return mqtt_wss_write_ktls(client);
+#endif
+
+    client->ssl_write_blocked = 0;
+    for (;;) {
+        const char *ptr = client->tx_retry_ptr;
+        size_t size = client->tx_retry_len;
+        int staged = client->tx_retry_staged;
+
+        if (!ptr) {
+            if (!(ptr = rbuf_get_linear_read_range(buf, &size)))
+                break;
+            staged = 0;
+            if (client->tx_record_size) {
+                if (size > client->tx_record_size)
+                    size = client->tx_record_size;
+                else if (size < client->tx_record_size && size < rbuf_bytes_available(buf)) {
+                    // ring buffer wraps around, join both parts into single write
+                    size = rbuf_pop(buf, client->tx_record, client->tx_record_size);
+                    ptr = client->tx_record;
+                    staged = 1;
+                }
+            }
+        }
+
+#ifdef DEBUG_ULTRA_VERBOSE
+        mws_debug(client->log, "Have data to write to SSL");
+#endif
+        uint64_t start = mqtt_wss_instr_start(&client->instr);
+        ret = SSL_write(client->ssl, ptr, size);
+        mqtt_wss_instr_stop(&client->instr, MQTT_WSS_STAGE_SSL_WRITE, start);
+        if (ret > 0) {
+#ifdef DEBUG_ULTRA_VERBOSE
+            mws_debug(client->log, "SSL_Write: Written %d of avail %zu.", ret, size);
 #endif
+            client->tx_retry_ptr = NULL;
+            client->tx_retry_len = 0;
+            if (!staged)
+                rbuf_bump_tail(buf, ret);
+            written += ret;
+            continue;
+        }
+
+        int errnobkp = errno;
+        ret = SSL_get_error(client->ssl, ret);
+#ifdef DEBUG_ULTRA_VERBOSE
+        mws_debug(client->log, "Write Err: %s", util_openssl_ret_err(ret));
+#endif
+        set_socket_pollfds(client, ret);
+        if (ret != SSL_ERROR_WANT_READ &&
+            ret != SSL_ERROR_WANT_WRITE) {
+            mws_error(client->log, "SSL_write error: %d %s", ret, util_openssl_ret_err(ret));
+            if (ret == SSL_ERROR_SYSCALL)
+                mws_error(client->log, "SSL_write SYSCALL errno: %d %s", errnobkp, strerror(errnobkp));
+            return 1;
+        }
+        client->tx_retry_ptr = ptr;
+        client->tx_retry_len = size;
+        client->tx_retry_staged = staged;
+        client->ssl_write_blocked = 1;
+        mqtt_wss_instr_event(&client->instr, MQTT_WSS_EVENT_PARTIAL_WRITE);
+        break;
+    }
+
+    STATS_ADD(client, bytes_tx, written);
+    STATS_ADD(client, tx_tls_records, client->tx_tls_records);
+    STATS_ADD(client, tx_syscalls, client->tx_syscalls);
+    client->tx_tls_records = 0;
+    client->tx_syscalls = 0;
+    return 0;
+}
+
+// mqtt_wss_service while connection is being established
+static int mqtt_wss_service_connecting(mqtt_wss_client client, int timeout_ms)
+{
+    if (client->conn_state == MQTT_WSS_CONN_FAILED)
+        return MQTT_WSS_ERR_CONNECT_FAILED;
+
+    long long int timer = conn_timer_in_ms(client, monotonic_ms());
+    if (timer >= 0 && (timeout_ms < 0 || timer < timeout_ms))
+        timeout_ms = timer;
+
+    int ret = poll(client->poll_fds, client->poll_nfds, timeout_ms >= 0 ? timeout_ms : -1);
+    if (ret < 0) {
+        if (errno == EINTR)
+            return 0;
+        mws_error(client->log, "poll error \"%s\"", strerror(errno));
+        return conn_fail(client, 2);
+    }
+
+    return mqtt_wss_connect_step(client, client->poll_fds[POLLFD_PIPE].revents & POLLIN);
+}
 
 int mqtt_wss_service(mqtt_wss_client client, int timeout_ms)
 {
-    char *ptr;
-    size_t size;
     int ret;
     int send_keepalive = 0;
 
-#ifdef MQTT_WSS_CPUSTATS
-    uint64_t t1,t2;
-    t1 = mqtt_wss_now_usec(client);
-#endif
+    if (conn_in_progress(client) || client->conn_state == MQTT_WSS_CONN_FAILED)
+        return mqtt_wss_service_connecting(client, timeout_ms);
 
 #ifdef DEBUG_ULTRA_VERBOSE
     mws_debug(client->log, ">>>>> mqtt_wss_service <<<<<");
@@ -896,6 +1851,9 @@ int mqtt_wss_service(mqtt_wss_client client, int timeout_ms)
 
     // Check user requested TO doesn't interfere with MQTT keep alives
     long long int till_next_keep_alive = t_till_next_keepalive_ms(client);
+    // overdue keep-alive must not make poll wait forever
+    if (till_next_keep_alive < 0)
+        till_next_keep_alive = 0;
     if (client->mqtt_connected && (timeout_ms < 0 || timeout_ms >= till_next_keep_alive)) {
         #ifdef DEBUG_ULTRA_VERBOSE
             mws_debug(client->log, "Shortening Timeout requested %d to %lld to ensure keep-alive can be sent", timeout_ms, till_next_keep_alive);
@@ -904,12 +1862,10 @@ int mqtt_wss_service(mqtt_wss_client client, int timeout_ms)
         send_keepalive = 1;
     }
 
-#ifdef MQTT_WSS_CPUSTATS
-    t2 = mqtt_wss_now_usec(client);
-    client->stats.time_keepalive += t2 - t1;
-#endif
-
-    if ((ret = poll(client->poll_fds, 2, timeout_ms >= 0 ? timeout_ms : -1)) < 0) {
+    uint64_t poll_start = mqtt_wss_instr_start(&client->instr);
+    ret = poll(client->poll_fds, 2, timeout_ms >= 0 ? timeout_ms : -1);
+    mqtt_wss_instr_stop(&client->instr, MQTT_WSS_STAGE_POLL_WAIT, poll_start);
+    if (ret < 0) {
         if (errno == EINTR) {
             mws_warn(client->log, "poll interrupted by EINTR");
             return 0;
@@ -926,44 +1882,64 @@ int mqtt_wss_service(mqtt_wss_client client, int timeout_ms)
         (!ret) ? "POLL_TIMEOUT" : "");
 #endif
 
-#ifdef MQTT_WSS_CPUSTATS
-    t1 = mqtt_wss_now_usec(client);
-#endif
+    // if poll timed out and user requested timeout was being used
+    // return here let user do his work and he will call us back soon
+    // otherwise we shortened the timeout ourselves to take care of
+    // MQTT keep alives
+    if (ret == 0 && !send_keepalive)
+        return 0;
 
-    if (ret == 0) {
-        if (send_keepalive) {
-            // otherwise we shortened the timeout ourselves to take care of
-            // MQTT keep alives
+    return mqtt_wss_service_events(client, client->poll_fds[POLLFD_PIPE].revents & POLLIN, ret == 0);
+}
+
+int mqtt_wss_service_events(mqtt_wss_client client, int wakeup_pending, int send_keepalive)
+{
+    if (conn_in_progress(client) || client->conn_state == MQTT_WSS_CONN_FAILED)
+        return mqtt_wss_connect_step(client, wakeup_pending);
+    // before looking at anything producers could have queued
+    wakeup_clear(client, wakeup_pending);
+    if (client->spool && client->mqtt_connected)
+        mqtt_wss_spool_drain(client->spool, client->mqtt);
+    return service_connection(client, send_keepalive);
+}
+
+static int service_connection(mqtt_wss_client client, int send_keepalive)
+{
+    char *ptr;
+    size_t size;
+    int ret;
+    uint64_t start;
+
+    if (send_keepalive) {
 #ifdef DEBUG_ULTRA_VERBOSE
-            mws_debug(client->log, "Forcing MQTT Ping/keep-alive");
+        mws_debug(client->log, "Forcing MQTT Ping/keep-alive");
 #endif
-            mqtt_ng_ping(client->mqtt);
-        } else {
-            // if poll timed out and user requested timeout was being used
-            // return here let user do his work and he will call us back soon
-            return 0;
-        }
+        mqtt_ng_ping(client->mqtt);
     }
 
-#ifdef MQTT_WSS_CPUSTATS
-    t2 = mqtt_wss_now_usec(client);
-    client->stats.time_keepalive += t2 - t1;
-#endif
-
     client->poll_fds[POLLFD_SOCKET].events = 0;
 
+    // we didn't try to read from socket yet
+    client->ssl_read_blocked = 0;
+    client->ssl_read_skipped = 0;
     if ((ptr = rbuf_get_linear_insert_range(client->ws_client->buf_read, &size))) {
-        if((ret = SSL_read(client->ssl, ptr, size)) > 0) {
+        start = mqtt_wss_instr_start(&client->instr);
+        int ssl_err = SSL_ERROR_NONE;
+        ret = tls_read(client, ptr, size, &ssl_err);
+        mqtt_wss_instr_stop(&client->instr, MQTT_WSS_STAGE_SSL_READ, start);
+        if (ret > 0) {
 #ifdef DEBUG_ULTRA_VERBOSE
             mws_debug(client->log, "SSL_Read: Read %d.", ret);
 #endif
-            pthread_mutex_lock(&client->stat_lock);
-            client->stats.bytes_rx += ret;
-            pthread_mutex_unlock(&client->stat_lock);
+            STATS_ADD(client, bytes_rx, ret);
             rbuf_bump_head(client->ws_client->buf_read, ret);
+#ifdef MQTT_WSS_DEBUG
+            if (client->rx_capture_fd >= 0)
+                rx_capture_write(client, ptr, ret);
+#endif
         } else {
             int errnobkp = errno;
-            ret = SSL_get_error(client->ssl, ret);
+            ret = ssl_err;
 #ifdef DEBUG_ULTRA_VERBOSE
             mws_debug(client->log, "Read Err: %s", util_openssl_ret_err(ret));
 #endif
@@ -975,15 +1951,21 @@ int mqtt_wss_service(mqtt_wss_client client, int timeout_ms)
                     mws_error(client->log, "SSL_read SYSCALL errno: %d %s", errnobkp, strerror(errnobkp));
                 return MQTT_WSS_ERR_CONN_DROP;
             }
+            client->ssl_read_blocked = 1;
         }
+    } else {
+        client->ssl_read_skipped = 1;
+        mqtt_wss_instr_event(&client->instr, MQTT_WSS_EVENT_RX_BUFFER_FULL);
     }
 
-#ifdef MQTT_WSS_CPUSTATS
-    t1 = mqtt_wss_now_usec(client);
-    client->stats.time_read_socket += t1 - t2;
-#endif
-
+    client->instr_rx_mqtt_ns = 0;
+    start = mqtt_wss_instr_start(&client->instr);
     ret = ws_client_process(client->ws_client);
+    if (start) {
+        uint64_t ns = mqtt_wss_instr_now_ns() - start;
+        mqtt_wss_instr_record(&client->instr, MQTT_WSS_STAGE_WS_PARSE,
+            ns > client->instr_rx_mqtt_ns ? ns - client->instr_rx_mqtt_ns : 0);
+    }
     switch(ret) {
         case WS_CLIENT_PROTOCOL_ERROR:
             return MQTT_WSS_ERR_PROTO_WS;
@@ -995,13 +1977,12 @@ int mqtt_wss_service(mqtt_wss_client client, int timeout_ms)
             break;
         case WS_CLIENT_CONNECTION_CLOSED:
             return MQTT_WSS_ERR_CONN_DROP;
+        case WS_CLIENT_CONSUMER_ERROR:
+            mws_error(client->log, "MQTT error while processing incoming data");
+            client->mqtt_connected = 0;
+            return MQTT_WSS_ERR_PROTO_MQTT;
     }
 
-#ifdef MQTT_WSS_CPUSTATS
-    t2 = mqtt_wss_now_usec(client);
-    client->stats.time_process_websocket += t2 - t1;
-#endif
-
     // process MQTT stuff
     if(client->ws_client->state == WS_ESTABLISHED)
         if (handle_mqtt_internal(client))
@@ -1012,49 +1993,90 @@ int mqtt_wss_service(mqtt_wss_client client, int timeout_ms)
         client->poll_fds[POLLFD_SOCKET].events |= POLLOUT;
     }
 
-#ifdef MQTT_WSS_CPUSTATS
-    t1 = mqtt_wss_now_usec(client);
-    client->stats.time_process_mqtt += t1 - t2;
-#endif
+    if (mqtt_wss_write_tls(client))
+        return MQTT_WSS_ERR_CONN_DROP;
 
-    if ((ptr = rbuf_get_linear_read_range(client->ws_client->buf_write, &size))) {
-#ifdef DEBUG_ULTRA_VERBOSE
-        mws_debug(client->log, "Have data to write to SSL");
-#endif
-        if ((ret = SSL_write(client->ssl, ptr, size)) > 0) {
-#ifdef DEBUG_ULTRA_VERBOSE
-            mws_debug(client->log, "SSL_Write: Written %d of avail %d.", ret, size);
-#endif
-            pthread_mutex_lock(&client->stat_lock);
-            client->stats.bytes_tx += ret;
-            pthread_mutex_unlock(&client->stat_lock);
-            rbuf_bump_tail(client->ws_client->buf_write, ret);
-        } else {
-            int errnobkp = errno;
-            ret = SSL_get_error(client->ssl, ret);
-#ifdef DEBUG_ULTRA_VERBOSE
-            mws_debug(client->log, "Write Err: %s", util_openssl_ret_err(ret));
-#endif
-            set_socket_pollfds(client, ret);
-            if (ret != SSL_ERROR_WANT_READ &&
-                ret != SSL_ERROR_WANT_WRITE) {
-                mws_error(client->log, "SSL_write error: %d %s", ret, util_openssl_ret_err(ret));
-                if (ret == SSL_ERROR_SYSCALL)
-                    mws_error(client->log, "SSL_write SYSCALL errno: %d %s", errnobkp, strerror(errnobkp));
-                return MQTT_WSS_ERR_CONN_DROP;
-            }
-        }
+    return MQTT_WSS_OK;
+}
+
+int mqtt_wss_get_socket_fd(mqtt_wss_client client)
+{
+    return client->sockfd;
+}
+
+int mqtt_wss_get_wakeup_fd(mqtt_wss_client client)
+{
+    return client->write_notif_pipe[PIPE_READ_END];
+}
+
+int mqtt_wss_get_socket_fds(mqtt_wss_client client, int *fds, int max)
+{
+    int count = 0;
+    for (nfds_t i = 0; i < client->poll_nfds && count < max; i++) {
+        if (i != POLLFD_PIPE && client->poll_fds[i].fd >= 0)
+            fds[count++] = client->poll_fds[i].fd;
     }
+    return count;
+}
 
-    if(client->poll_fds[POLLFD_PIPE].revents & POLLIN)
-        util_clear_pipe(client->write_notif_pipe[PIPE_READ_END]);
+unsigned int mqtt_wss_socket_generation(mqtt_wss_client client)
+{
+    return client->socket_generation;
+}
 
-#ifdef MQTT_WSS_CPUSTATS
-    t2 = mqtt_wss_now_usec(client);
-    client->stats.time_write_socket += t2 - t1;
-#endif
+long long int mqtt_wss_timer_in_ms(mqtt_wss_client client)
+{
+    if (conn_in_progress(client))
+        return conn_timer_in_ms(client, monotonic_ms());
+    if (!client->mqtt_connected)
+        return -1;
+    long long int ret = t_till_next_keepalive_ms(client);
+    return ret > 0 ? ret : 0;
+}
 
-    return MQTT_WSS_OK;
+int mqtt_wss_has_pending_work(mqtt_wss_client client)
+{
+    // until handshake everything is read/written till it would block
+    if (client->conn_state == MQTT_WSS_CONN_FAILED ||
+        (conn_in_progress(client) && client->conn_state != MQTT_WSS_CONN_HANDSHAKE))
+        return 0;
+    // socket might still have data we didn't read
+    // (if it was skipped for lack of buffer space it is worth retrying
+    // only once processing freed some up)
+    if (client->ssl_read_skipped) {
+        if (rbuf_bytes_free(client->ws_client->buf_read))
+            return 1;
+    } else if (!client->ssl_read_blocked)
+        return 1;
+    // we want to write but socket didn't tell us it can't take more
+    if ((client->poll_fds[POLLFD_SOCKET].events & POLLOUT) && !client->ssl_write_blocked)
+        return 1;
+    return 0;
+}
+
+// messages are copied into the spool so user data can be freed right away
+// (on failure they stay owned by the caller like when publishing directly)
+static size_t spool_publish(mqtt_wss_client client, struct mqtt_publish_batch_entry *entries, size_t count)
+{
+    size_t failed = 0;
+    for (size_t i = 0; i < count; i++) {
+        struct mqtt_publish_batch_entry *entry = &entries[i];
+        entry->packet_id = 0;
+        entry->rc = mqtt_wss_spool_append(client->spool, entry->topic, entry->msg, entry->msg_len, entry->qos, entry->retain);
+        if (entry->rc) {
+            failed++;
+            continue;
+        }
+        if (entry->topic_free && entry->topic_free != CALLER_RESPONSIBILITY)
+            entry->topic_free(entry->topic);
+        if (entry->msg_free && entry->msg_free != CALLER_RESPONSIBILITY)
+            entry->msg_free(entry->msg);
+    }
+
+    // spool is drained by the service thread
+    if (failed < count && client->mqtt_connected)
+        mqtt_wss_wakeup(client);
+    return failed;
 }
 
 int mqtt_wss_publish5(mqtt_wss_client client,
@@ -1071,6 +2093,21 @@ int mqtt_wss_publish5(mqtt_wss_client client,
         return 1;
     }
 
+    if (client->spool && (!client->mqtt_connected || (publish_flags & MQTT_WSS_PUB_QOSMASK) || mqtt_wss_spool_has_pending(client->spool))) {
+        if (packet_id)
+            *packet_id = 0;
+        struct mqtt_publish_batch_entry entry = {
+            .topic = topic,
+            .topic_free = topic_free,
+            .msg = msg,
+            .msg_free = msg_free,
+            .msg_len = msg_len,
+            .qos = publish_flags & MQTT_WSS_PUB_QOSMASK,
+            .retain = !!(publish_flags & MQTT_WSS_PUB_RETAIN)
+        };
+        return spool_publish(client, &entry, 1);
+    }
+
     if (!client->mqtt_connected) {
         mws_error(client->log, "MQTT is offline. Can't send message.");
         return 1;
@@ -1079,7 +2116,7 @@ int mqtt_wss_publish5(mqtt_wss_client client,
 
     mqtt_flags = (publish_flags & MQTT_WSS_PUB_QOSMASK) << 1;
     if (publish_flags & MQTT_WSS_PUB_RETAIN)
-        mqtt_flags |= MQTT_PUBLISH_RETAIN;
+        mqtt_flags |= MQTT_PUBLISH_FLAG_RETAIN;
 
     int rc = mqtt_ng_publish(client->mqtt, topic, topic_free, msg, msg_free, msg_len, mqtt_flags, packet_id);
     if (rc == MQTT_NG_MSGGEN_MSG_TOO_BIG)
@@ -1090,7 +2127,189 @@ int mqtt_wss_publish5(mqtt_wss_client client,
     return rc;
 }
 
-int mqtt_wss_subscribe(mqtt_wss_client client, char *topic, int max_qos_level)
+struct mqtt_prepared_publish *mqtt_wss_prepare_publish(mqtt_wss_client client, const char *topic, uint8_t publish_flags)
+{
+    uint8_t mqtt_flags = (publish_flags & MQTT_WSS_PUB_QOSMASK) << 1;
+    if (publish_flags & MQTT_WSS_PUB_RETAIN)
+        mqtt_flags |= MQTT_PUBLISH_FLAG_RETAIN;
+
+    return mqtt_ng_prepare_publish(client->mqtt, topic, mqtt_flags);
+}
+
+void mqtt_wss_prepared_publish_free(mqtt_wss_client client, struct mqtt_prepared_publish *pp)
+{
+    mqtt_ng_prepared_publish_free(client->mqtt, pp);
+}
+
+int mqtt_wss_publish_prepared(mqtt_wss_client client,
+                              struct mqtt_prepared_publish *pp,
+                              void *msg,
+                              free_fnc_t msg_free,
+                              size_t msg_len,
+                              uint16_t *packet_id)
+{
+    if (client->mqtt_disconnecting) {
+        mws_error(client->log, "mqtt_wss is disconnecting can't publish");
+        return 1;
+    }
+
+    uint8_t mqtt_flags = mqtt_ng_prepared_flags(pp);
+    uint8_t qos = (mqtt_flags >> 1) & MQTT_WSS_PUB_QOSMASK;
+    if (client->spool && (!client->mqtt_connected || qos || mqtt_wss_spool_has_pending(client->spool))) {
+        if (packet_id)
+            *packet_id = 0;
+        struct mqtt_publish_batch_entry entry = {
+            .topic = (char *)mqtt_ng_prepared_topic(pp),
+            .topic_free = CALLER_RESPONSIBILITY,
+            .msg = msg,
+            .msg_free = msg_free,
+            .msg_len = msg_len,
+            .qos = qos,
+            .retain = !!(mqtt_flags & MQTT_PUBLISH_FLAG_RETAIN)
+        };
+        return spool_publish(client, &entry, 1);
+    }
+
+    if (!client->mqtt_connected) {
+        mws_error(client->log, "MQTT is offline. Can't send message.");
+        return 1;
+    }
+
+    int rc = mqtt_ng_publish_prepared(client->mqtt, pp, msg, msg_free, msg_len, packet_id);
+    if (rc == MQTT_NG_MSGGEN_MSG_TOO_BIG)
+        return MQTT_WSS_ERR_TOO_BIG_FOR_SERVER;
+
+    mqtt_wss_wakeup(client);
+
+    return rc;
+}
+
+int mqtt_wss_publish_stream(mqtt_wss_client client,
+                            char *topic,
+                            free_fnc_t topic_free,
+                            size_t msg_len,
+                            uint8_t publish_flags,
+                            const struct mqtt_stream_source *src,
+                            uint16_t *packet_id)
+{
+    if (client->mqtt_disconnecting) {
+        mws_error(client->log, "mqtt_wss is disconnecting can't publish");
+        return 1;
+    }
+
+    // payload can't be spooled as it is produced only while sending
+    if (!client->mqtt_connected) {
+        mws_error(client->log, "MQTT is offline. Can't send message.");
+        return 1;
+    }
+
+    uint8_t mqtt_flags = (publish_flags & MQTT_WSS_PUB_QOSMASK) << 1;
+    if (publish_flags & MQTT_WSS_PUB_RETAIN)
+        mqtt_flags |= MQTT_PUBLISH_FLAG_RETAIN;
+
+    int rc = mqtt_ng_publish_stream(client->mqtt, topic, topic_free, msg_len, mqtt_flags, src, packet_id);
+    if (rc == MQTT_NG_MSGGEN_MSG_TOO_BIG)
+        return MQTT_WSS_ERR_TOO_BIG_FOR_SERVER;
+
+    mqtt_wss_wakeup(client);
+
+    return rc;
+}
+
+int mqtt_wss_publish5_enqueue(mqtt_wss_client client,
+                              char *topic,
+                              free_fnc_t topic_free,
+                              void *msg,
+                              free_fnc_t msg_free,
+                              size_t msg_len,
+                              uint8_t publish_flags,
+                              void *msg_ctx)
+{
+    if (client->mqtt_disconnecting) {
+        mws_error(client->log, "mqtt_wss is disconnecting can't publish");
+        return 1;
+    }
+
+    // same rules as mqtt_wss_publish5 so that spooled messages keep their order
+    if (client->spool && (!client->mqtt_connected || (publish_flags & MQTT_WSS_PUB_QOSMASK) || mqtt_wss_spool_has_pending(client->spool))) {
+        struct mqtt_publish_batch_entry entry = {
+            .topic = topic,
+            .topic_free = topic_free,
+            .msg = msg,
+            .msg_free = msg_free,
+            .msg_len = msg_len,
+            .qos = publish_flags & MQTT_WSS_PUB_QOSMASK,
+            .retain = !!(publish_flags & MQTT_WSS_PUB_RETAIN)
+        };
+        if (spool_publish(client, &entry, 1))
+            return entry.rc;
+        mqtt_ng_publish_queued_notify(client->mqtt, msg_ctx, 0, 0);
+        return 0;
+    }
+
+    if (!client->mqtt_connected) {
+        mws_error(client->log, "MQTT is offline. Can't send message.");
+        return 1;
+    }
+    uint8_t mqtt_flags = 0;
+
+    mqtt_flags = (publish_flags & MQTT_WSS_PUB_QOSMASK) << 1;
+    if (publish_flags & MQTT_WSS_PUB_RETAIN)
+        mqtt_flags |= MQTT_PUBLISH_FLAG_RETAIN;
+
+    int rc = mqtt_ng_publish_enqueue(client->mqtt, topic, topic_free, msg, msg_free, msg_len, mqtt_flags, msg_ctx);
+
+    // wakeup_pending is cleared before the queue is drained so only the first
+    // message since then signals service thread
+    if (rc == MQTT_NG_MSGGEN_OK)
+        mqtt_wss_wakeup(client);
+
+    return rc;
+}
+
+void mqtt_wss_set_publish_queued_callback(mqtt_wss_client client, publish_queued_callback_fnc_t callback, void *ctx)
+{
+    mqtt_ng_set_publish_queued_callback(client->mqtt, callback, ctx);
+}
+
+size_t mqtt_wss_publish_batch(mqtt_wss_client client, struct mqtt_publish_batch_entry *entries, size_t count)
+{
+    if (client->mqtt_disconnecting) {
+        mws_error(client->log, "mqtt_wss is disconnecting can't publish");
+        for (size_t i = 0; i < count; i++)
+            entries[i].rc = 1;
+        return count;
+    }
+
+    if (client->spool) {
+        int spool = !client->mqtt_connected || mqtt_wss_spool_has_pending(client->spool);
+        // whole batch goes one way to keep the order
+        for (size_t i = 0; i < count && !spool; i++)
+            spool = entries[i].qos;
+        if (spool)
+            return spool_publish(client, entries, count);
+    }
+
+    if (!client->mqtt_connected) {
+        mws_error(client->log, "MQTT is offline. Can't send message.");
+        for (size_t i = 0; i < count; i++)
+            entries[i].rc = 1;
+        return count;
+    }
+
+    size_t failed = mqtt_ng_publish_batch(client->mqtt, entries, count);
+    for (size_t i = 0; i < count; i++) {
+        if (entries[i].rc == MQTT_NG_MSGGEN_MSG_TOO_BIG)
+            entries[i].rc = MQTT_WSS_ERR_TOO_BIG_FOR_SERVER;
+    }
+
+    if (failed < count)
+        mqtt_wss_wakeup(client);
+
+    return failed;
+}
+
+static int mqtt_wss_subscribe_common(mqtt_wss_client client, char *topic, int max_qos_level, msg_borrowed_callback_fnc_t callback, void *ctx)
 {
     (void)max_qos_level; //TODO now hardcoded
     if (!client->mqtt_connected) {
@@ -1108,31 +2327,115 @@ int mqtt_wss_subscribe(mqtt_wss_client client, char *topic, int max_qos_level)
         .topic_free = NULL,
         .options = /* max_qos_level & 0x3 TODO when QOS > 1 implemented */ 0x01 | (0x01 << 3)
     };
-    mqtt_ng_subscribe(client->mqtt, &sub, 1);
+    if (callback) {
+        if (mqtt_ng_subscribe_route(client->mqtt, &sub, callback, ctx))
+            return 1;
+    } else
+        mqtt_ng_subscribe(client->mqtt, &sub, 1);
 
     mqtt_wss_wakeup(client);
     return 0;
 }
 
+int mqtt_wss_subscribe(mqtt_wss_client client, char *topic, int max_qos_level)
+{
+    return mqtt_wss_subscribe_common(client, topic, max_qos_level, NULL, NULL);
+}
+
+int mqtt_wss_subscribe_route(mqtt_wss_client client, char *topic, int max_qos_level, msg_borrowed_callback_fnc_t callback, void *ctx)
+{
+    if (!callback)
+        return 1;
+    return mqtt_wss_subscribe_common(client, topic, max_qos_level, callback, ctx);
+}
+
 struct mqtt_wss_stats mqtt_wss_get_stats(mqtt_wss_client client)
 {
     struct mqtt_wss_stats current;
-    pthread_mutex_lock(&client->stat_lock);
-    current = client->stats;
-    memset(&client->stats, 0, sizeof(client->stats));
-    pthread_mutex_unlock(&client->stat_lock);
+    current.bytes_tx = STATS_GET_RESET(client, bytes_tx);
+    current.bytes_rx = STATS_GET_RESET(client, bytes_rx);
+    current.tx_tls_records = STATS_GET_RESET(client, tx_tls_records);
+    current.tx_syscalls = STATS_GET_RESET(client, tx_syscalls);
+    current.tls_handshakes = STATS_GET_RESET(client, tls_handshakes);
+    current.tls_resumed = STATS_GET_RESET(client, tls_resumed);
     mqtt_ng_get_stats(client->mqtt, &current.mqtt);
+    mqtt_wss_pool_get_stats(client->pool, &current.pool);
+    memset(&current.spool, 0, sizeof(current.spool));
+    if (client->spool)
+        mqtt_wss_spool_get_stats(client->spool, &current.spool);
     return current;
 }
 
+int mqtt_wss_set_spool(mqtt_wss_client client, const struct mqtt_wss_spool_params *params)
+{
+    if (client->mqtt_connected || conn_in_progress(client)) {
+        mws_error(client->log, "Spool can be changed only while disconnected");
+        return 1;
+    }
+
+    struct mqtt_wss_spool *spool = NULL;
+    if (params && !(spool = mqtt_wss_spool_open(params, client->log)))
+        return 1;
+
+    // transaction buffer can still point into the old mapping
+    // but it is purged before anything is sent over next connection
+    mqtt_wss_spool_close(client->spool);
+    client->spool = spool;
+    return 0;
+}
+
+int mqtt_wss_set_allocator(mqtt_wss_client client, const struct mqtt_wss_allocator *allocator)
+{
+    if (!allocator)
+        allocator = mqtt_wss_pool_allocator(client->pool);
+    else if (!allocator->malloc || !allocator->free) {
+        mws_error(client->log, "Allocator has to provide both malloc and free");
+        return 1;
+    }
+    mqtt_ng_set_allocator(client->mqtt, allocator);
+    ws_client_set_allocator(client->ws_client, allocator);
+    return 0;
+}
+
+void mqtt_wss_set_instrumentation(mqtt_wss_client client, int enabled)
+{
+    mqtt_wss_instr_set_enabled(&client->instr, enabled);
+}
+
+void mqtt_wss_get_instrumentation(mqtt_wss_client client, struct mqtt_wss_instr_snapshot *snapshot)
+{
+    mqtt_wss_instr_snapshot(&client->instr, snapshot);
+}
+
 int mqtt_wss_set_topic_alias(mqtt_wss_client client, const char *topic)
 {
     return mqtt_ng_set_topic_alias(client->mqtt, topic);
 }
 
+int mqtt_wss_set_auto_topic_alias(mqtt_wss_client client, uint16_t max_aliases)
+{
+    return mqtt_ng_set_auto_topic_alias(client->mqtt, max_aliases);
+}
+
 #ifdef MQTT_WSS_DEBUG
 void mqtt_wss_set_SSL_CTX_keylog_cb(mqtt_wss_client client, void (*ssl_ctx_keylog_cb)(const SSL *ssl, const char *line))
 {
     client->ssl_ctx_keylog_cb = ssl_ctx_keylog_cb;
 }
+
+int mqtt_wss_set_rx_capture(mqtt_wss_client client, const char *path)
+{
+    char *path_copy = NULL;
+    if (path && !(path_copy = mw_strdup(path))) {
+        mws_error(client->log, "OOM copying RX capture path");
+        return 1;
+    }
+    mw_free(client->rx_capture_path);
+    client->rx_capture_path = path_copy;
+    if (!path && client->rx_capture_fd >= 0) {
+        close(client->rx_capture_fd);
+        client->rx_capture_fd = -1;
+    }
+    return 0;
+}
 #endif
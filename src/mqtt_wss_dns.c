@@ -0,0 +1,308 @@
+// SPDX-License-Identifier: GPL-3.0-only
+//
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free Software Foundation, version 3.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+// See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with this program.
+// If not, see <https://www.gnu.org/licenses/>.
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <netinet/in.h>
+
+#include "mqtt_wss_dns.h"
+#include "common_internal.h"
+
+#define UNIT_LOG_PREFIX "mqtt_wss_dns: "
+#define ERROR(fmt, ...) mws_error(log, UNIT_LOG_PREFIX fmt, ##__VA_ARGS__)
+
+#define MWS_DNS_CACHE_SIZE 16
+
+struct mws_dns_query {
+    // owned by the caller and by the resolver thread
+    int refcount;
+    int done;
+
+    // dup of callers fd so that caller can close its own anytime
+    int notify_fd;
+
+    char *host;
+    int port;
+
+    // set by resolver thread before done
+    int gai_rc;
+    struct mws_addr_list *result;
+};
+
+struct dns_cache_entry {
+    char *host;
+    struct mws_addr_list *addrs; // port is not set
+    time_t expires;
+};
+
+static struct dns_cache_entry dns_cache[MWS_DNS_CACHE_SIZE];
+static pthread_mutex_t dns_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static time_t monotonic_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static struct mws_addr_list *addr_list_copy(const struct mws_addr_list *list, int port)
+{
+    size_t size = sizeof(struct mws_addr_list) + list->count * sizeof(struct mws_addr);
+    struct mws_addr_list *copy = mw_malloc(size);
+    if (!copy)
+        return NULL;
+    memcpy(copy, list, size);
+
+    for (size_t i = 0; i < copy->count; i++) {
+        struct sockaddr *sa = (struct sockaddr *)&copy->addrs[i].addr;
+        if (sa->sa_family == AF_INET6)
+            ((struct sockaddr_in6 *)sa)->sin6_port = htons(port);
+        else
+            ((struct sockaddr_in *)sa)->sin_port = htons(port);
+    }
+    return copy;
+}
+
+// returns copy of cached result with port set or NULL
+static struct mws_addr_list *dns_cache_get(const char *host, int port)
+{
+    struct mws_addr_list *ret = NULL;
+    time_t now = monotonic_sec();
+
+    pthread_mutex_lock(&dns_cache_lock);
+    for (int i = 0; i < MWS_DNS_CACHE_SIZE; i++) {
+        if (dns_cache[i].host && dns_cache[i].expires > now && !strcmp(dns_cache[i].host, host)) {
+            ret = addr_list_copy(dns_cache[i].addrs, port);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&dns_cache_lock);
+    return ret;
+}
+
+static void dns_cache_entry_free(struct dns_cache_entry *entry)
+{
+    mw_free(entry->host);
+    mw_free(entry->addrs);
+    entry->host = NULL;
+    entry->addrs = NULL;
+}
+
+static void dns_cache_put(const char *host, const struct mws_addr_list *addrs)
+{
+    char *host_copy = mw_strdup(host);
+    struct mws_addr_list *addrs_copy = addr_list_copy(addrs, 0);
+    if (!host_copy || !addrs_copy) {
+        mw_free(host_copy);
+        mw_free(addrs_copy);
+        return;
+    }
+
+    pthread_mutex_lock(&dns_cache_lock);
+    // replace entry of the same host, otherwise the one expiring first
+    struct dns_cache_entry *victim = &dns_cache[0];
+    for (int i = 0; i < MWS_DNS_CACHE_SIZE; i++) {
+        if (dns_cache[i].host && !strcmp(dns_cache[i].host, host)) {
+            victim = &dns_cache[i];
+            break;
+        }
+        if (!dns_cache[i].host || dns_cache[i].expires < victim->expires)
+            victim = &dns_cache[i];
+    }
+    dns_cache_entry_free(victim);
+    victim->host = host_copy;
+    victim->addrs = addrs_copy;
+    victim->expires = monotonic_sec() + MWS_DNS_CACHE_TTL_SEC;
+    pthread_mutex_unlock(&dns_cache_lock);
+}
+
+void mws_dns_cache_invalidate(const char *host)
+{
+    pthread_mutex_lock(&dns_cache_lock);
+    for (int i = 0; i < MWS_DNS_CACHE_SIZE; i++) {
+        if (dns_cache[i].host && !strcmp(dns_cache[i].host, host))
+            dns_cache_entry_free(&dns_cache[i]);
+    }
+    pthread_mutex_unlock(&dns_cache_lock);
+}
+
+// orders addresses so that families alternate starting with the
+// family getaddrinfo preferred (which already sorted them per RFC6724)
+static struct mws_addr_list *addr_list_from_addrinfo(struct addrinfo *res, int port)
+{
+    size_t count = 0;
+    for (struct addrinfo *ai = res; ai; ai = ai->ai_next) {
+        if ((ai->ai_family == AF_INET || ai->ai_family == AF_INET6) && ai->ai_addrlen <= sizeof(struct sockaddr_storage))
+            count++;
+    }
+    if (!count)
+        return NULL;
+
+    struct mws_addr_list *list = mw_malloc(sizeof(struct mws_addr_list) + count * sizeof(struct mws_addr));
+    if (!list)
+        return NULL;
+    list->count = 0;
+
+    int family = 0;
+    struct addrinfo *next[2] = { res, res }; // [0] preferred family, [1] the other one
+    while (list->count < count) {
+        for (int f = 0; f < 2; f++) {
+            struct addrinfo *ai = next[f];
+            while (ai && (ai->ai_addrlen > sizeof(struct sockaddr_storage) ||
+                          (ai->ai_family != AF_INET && ai->ai_family != AF_INET6) ||
+                          (family && (ai->ai_family == family) != !f)))
+                ai = ai->ai_next;
+            if (!ai)
+                continue;
+            if (!family)
+                family = ai->ai_family;
+            next[f] = ai->ai_next;
+            memcpy(&list->addrs[list->count].addr, ai->ai_addr, ai->ai_addrlen);
+            list->addrs[list->count].len = ai->ai_addrlen;
+            list->count++;
+        }
+    }
+
+    struct mws_addr_list *ret = addr_list_copy(list, port);
+    mw_free(list);
+    return ret;
+}
+
+static void dns_query_unref(struct mws_dns_query *query)
+{
+    if (__atomic_sub_fetch(&query->refcount, 1, __ATOMIC_ACQ_REL))
+        return;
+    mw_free(query->host);
+    mw_free(query->result);
+    mw_free(query);
+}
+
+static int dns_getaddrinfo(struct mws_dns_query *query, int flags)
+{
+    struct addrinfo hints, *res = NULL;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = flags;
+
+    int rc = getaddrinfo(query->host, NULL, &hints, &res);
+    if (rc)
+        return rc;
+    query->result = addr_list_from_addrinfo(res, query->port);
+    freeaddrinfo(res);
+    return query->result ? 0 : EAI_MEMORY;
+}
+
+static void *dns_resolver_thread(void *arg)
+{
+    struct mws_dns_query *query = arg;
+
+    query->gai_rc = dns_getaddrinfo(query, AI_ADDRCONFIG);
+    if (!query->gai_rc)
+        dns_cache_put(query->host, query->result);
+
+    __atomic_store_n(&query->done, 1, __ATOMIC_RELEASE);
+    if (query->notify_fd >= 0) {
+        // 8 bytes as eventfd requires, works for pipe as well
+        uint64_t one = 1;
+        while (write(query->notify_fd, &one, sizeof(one)) < 0 && errno == EINTR);
+        close(query->notify_fd);
+        query->notify_fd = -1;
+    }
+
+    dns_query_unref(query);
+    return NULL;
+}
+
+struct mws_dns_query *mws_dns_resolve(const char *host, int port, int notify_fd, mqtt_wss_log_ctx_t log)
+{
+    struct mws_dns_query *query = mw_calloc(1, sizeof(struct mws_dns_query));
+    if (!query) {
+        ERROR("OOM allocating DNS query");
+        return NULL;
+    }
+    query->notify_fd = -1;
+    query->port = port;
+    query->refcount = 1;
+
+    if ((query->result = dns_cache_get(host, port))) {
+        query->done = 1;
+        return query;
+    }
+
+    if (!(query->host = mw_strdup(host))) {
+        ERROR("OOM allocating DNS query");
+        goto fail;
+    }
+
+    // IP address literals don't need the resolver thread
+    // (nor AI_ADDRCONFIG which would reject 127.0.0.1 on hosts with loopback only)
+    if (!dns_getaddrinfo(query, AI_NUMERICHOST)) {
+        query->done = 1;
+        return query;
+    }
+
+    query->notify_fd = fcntl(notify_fd, F_DUPFD_CLOEXEC, 0);
+    if (query->notify_fd < 0) {
+        ERROR("Couldn't dup notification fd \"%s\"", strerror(errno));
+        goto fail;
+    }
+
+    pthread_attr_t attr;
+    pthread_t thread;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    query->refcount = 2;
+    int rc = pthread_create(&thread, &attr, dns_resolver_thread, query);
+    pthread_attr_destroy(&attr);
+    if (rc) {
+        // resolve in place rather than fail the connection
+        ERROR("Couldn't start resolver thread (%s), resolving synchronously", strerror(rc));
+        dns_resolver_thread(query);
+    }
+    return query;
+
+fail:
+    dns_query_unref(query);
+    return NULL;
+}
+
+int mws_dns_query_done(struct mws_dns_query *query)
+{
+    return __atomic_load_n(&query->done, __ATOMIC_ACQUIRE);
+}
+
+struct mws_addr_list *mws_dns_query_result(struct mws_dns_query *query, mqtt_wss_log_ctx_t log)
+{
+    if (!mws_dns_query_done(query))
+        return NULL;
+    if (!query->result) {
+        ERROR("Resolving \"%s\" failed \"%s\"", query->host ? query->host : "", gai_strerror(query->gai_rc));
+        return NULL;
+    }
+    struct mws_addr_list *ret = query->result;
+    query->result = NULL;
+    return ret;
+}
+
+void mws_dns_query_release(struct mws_dns_query *query)
+{
+    if (query)
+        dns_query_unref(query);
+}
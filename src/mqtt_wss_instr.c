@@ -0,0 +1,189 @@
+// SPDX-License-Identifier: GPL-3.0-only
+//
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free Software Foundation, version 3.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+// See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with this program.
+// If not, see <https://www.gnu.org/licenses/>.
+
+#include <string.h>
+
+#include "mqtt_wss_instr.h"
+
+#define SUB_BUCKET_BITS 2
+#if (1 << SUB_BUCKET_BITS) != MQTT_WSS_TIMING_SUB_BUCKETS
+#error "SUB_BUCKET_BITS doesn't match MQTT_WSS_TIMING_SUB_BUCKETS"
+#endif
+
+static const char *stage_names[MQTT_WSS_STAGE_COUNT] = {
+    [MQTT_WSS_STAGE_POLL_WAIT]    = "poll_wait",
+    [MQTT_WSS_STAGE_SSL_READ]     = "ssl_read",
+    [MQTT_WSS_STAGE_WS_PARSE]     = "ws_parse",
+    [MQTT_WSS_STAGE_MQTT_PARSE]   = "mqtt_parse",
+    [MQTT_WSS_STAGE_MSG_GENERATE] = "msg_generate",
+    [MQTT_WSS_STAGE_GC]           = "gc",
+    [MQTT_WSS_STAGE_BUFFER_GROW]  = "buffer_grow",
+    [MQTT_WSS_STAGE_SSL_WRITE]    = "ssl_write"
+};
+
+static const char *event_names[MQTT_WSS_EVENT_COUNT] = {
+    [MQTT_WSS_EVENT_GC_RUN]         = "gc_run",
+    [MQTT_WSS_EVENT_BUFFER_GROW]    = "buffer_grow",
+    [MQTT_WSS_EVENT_PARTIAL_WRITE]  = "partial_write",
+    [MQTT_WSS_EVENT_RX_BUFFER_FULL] = "rx_buffer_full",
+    [MQTT_WSS_EVENT_TX_BUFFER_FULL] = "tx_buffer_full"
+};
+
+const char *mqtt_wss_instr_stage_name(enum mqtt_wss_instr_stage stage)
+{
+    if ((unsigned)stage >= MQTT_WSS_STAGE_COUNT)
+        return "unknown";
+    return stage_names[stage];
+}
+
+const char *mqtt_wss_instr_event_name(enum mqtt_wss_instr_event event)
+{
+    if ((unsigned)event >= MQTT_WSS_EVENT_COUNT)
+        return "unknown";
+    return event_names[event];
+}
+
+static inline int timing_bucket(uint64_t ns)
+{
+    if (ns < MQTT_WSS_TIMING_SUB_BUCKETS)
+        return ns;
+    int exp = 63 - __builtin_clzll(ns);
+    int sub = (ns >> (exp - SUB_BUCKET_BITS)) & (MQTT_WSS_TIMING_SUB_BUCKETS - 1);
+    int bucket = (exp - SUB_BUCKET_BITS + 1) * MQTT_WSS_TIMING_SUB_BUCKETS + sub;
+    return bucket < MQTT_WSS_TIMING_BUCKETS ? bucket : MQTT_WSS_TIMING_BUCKETS - 1;
+}
+
+// highest value falling into the bucket
+static inline uint64_t timing_bucket_max(int bucket)
+{
+    if (bucket < MQTT_WSS_TIMING_SUB_BUCKETS)
+        return bucket;
+    int shift = bucket / MQTT_WSS_TIMING_SUB_BUCKETS - 1;
+    uint64_t sub = bucket % MQTT_WSS_TIMING_SUB_BUCKETS;
+    return ((MQTT_WSS_TIMING_SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+void mqtt_wss_instr_init(struct mqtt_wss_instr *instr)
+{
+    memset(instr, 0, sizeof(*instr));
+    for (int i = 0; i < MQTT_WSS_STAGE_COUNT; i++)
+        instr->stages[i].min_ns = UINT64_MAX;
+}
+
+void mqtt_wss_instr_set_enabled(struct mqtt_wss_instr *instr, int enabled)
+{
+    __atomic_store_n(&instr->enabled, !!enabled, __ATOMIC_RELAXED);
+}
+
+void mqtt_wss_instr_record(struct mqtt_wss_instr *instr, enum mqtt_wss_instr_stage stage, uint64_t ns)
+{
+    struct mqtt_wss_timing *timing = &instr->stages[stage];
+
+    __atomic_fetch_add(&timing->buckets[timing_bucket(ns)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&timing->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&timing->sum_ns, ns, __ATOMIC_RELAXED);
+    // publishing threads record concurrently (e.g. MSG_GENERATE)
+    uint64_t cur = __atomic_load_n(&timing->min_ns, __ATOMIC_RELAXED);
+    while (ns < cur && !__atomic_compare_exchange_n(&timing->min_ns, &cur, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+    cur = __atomic_load_n(&timing->max_ns, __ATOMIC_RELAXED);
+    while (ns > cur && !__atomic_compare_exchange_n(&timing->max_ns, &cur, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+void mqtt_wss_instr_snapshot(struct mqtt_wss_instr *instr, struct mqtt_wss_instr_snapshot *snapshot)
+{
+    snapshot->enabled = __atomic_load_n(&instr->enabled, __ATOMIC_RELAXED);
+    for (int i = 0; i < MQTT_WSS_STAGE_COUNT; i++) {
+        struct mqtt_wss_timing *src = &instr->stages[i];
+        struct mqtt_wss_timing *dst = &snapshot->stages[i];
+        dst->count = __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+        dst->sum_ns = __atomic_load_n(&src->sum_ns, __ATOMIC_RELAXED);
+        dst->min_ns = __atomic_load_n(&src->min_ns, __ATOMIC_RELAXED);
+        dst->max_ns = __atomic_load_n(&src->max_ns, __ATOMIC_RELAXED);
+        if (dst->min_ns == UINT64_MAX)
+            dst->min_ns = 0;
+        for (int j = 0; j < MQTT_WSS_TIMING_BUCKETS; j++)
+            dst->buckets[j] = __atomic_load_n(&src->buckets[j], __ATOMIC_RELAXED);
+    }
+    for (int i = 0; i < MQTT_WSS_EVENT_COUNT; i++)
+        snapshot->events[i] = __atomic_load_n(&instr->events[i], __ATOMIC_RELAXED);
+}
+
+uint64_t mqtt_wss_timing_percentile(const struct mqtt_wss_timing *timing, double percentile)
+{
+    // snapshot is not atomic as a whole, count can differ from sum of buckets
+    uint64_t total = 0;
+    for (int i = 0; i < MQTT_WSS_TIMING_BUCKETS; i++)
+        total += timing->buckets[i];
+    if (!total)
+        return 0;
+
+    if (percentile < 0)
+        percentile = 0;
+    if (percentile > 100)
+        percentile = 100;
+    uint64_t rank = (uint64_t)(percentile / 100 * total + 0.999999);
+    if (!rank)
+        rank = 1;
+
+    uint64_t seen = 0;
+    int bucket;
+    for (bucket = 0; bucket < MQTT_WSS_TIMING_BUCKETS - 1; bucket++) {
+        seen += timing->buckets[bucket];
+        if (seen >= rank)
+            break;
+    }
+
+    uint64_t ret = timing_bucket_max(bucket);
+    if (ret > timing->max_ns)
+        ret = timing->max_ns;
+    if (ret < timing->min_ns)
+        ret = timing->min_ns;
+    return ret;
+}
+
+#ifdef TESTS
+#include <stdio.h>
+
+int test_mqtt_wss_instr()
+{
+    // bucket boundaries have to be continuous and monotonic
+    for (int i = 1; i < MQTT_WSS_TIMING_BUCKETS; i++) {
+        uint64_t first = timing_bucket_max(i - 1) + 1;
+        if (timing_bucket(first) != i || timing_bucket(timing_bucket_max(i)) != i) {
+            fprintf(stderr, "timing_bucket(%d): Wrong bucket boundaries\n", i);
+            return 1;
+        }
+    }
+
+    struct mqtt_wss_instr instr;
+    struct mqtt_wss_instr_snapshot snap;
+    mqtt_wss_instr_init(&instr);
+    for (uint64_t ns = 1; ns <= 1000; ns++)
+        mqtt_wss_instr_record(&instr, MQTT_WSS_STAGE_GC, ns * 1000);
+    mqtt_wss_instr_snapshot(&instr, &snap);
+
+    struct mqtt_wss_timing *gc = &snap.stages[MQTT_WSS_STAGE_GC];
+    uint64_t p50 = mqtt_wss_timing_percentile(gc, 50);
+    uint64_t p99 = mqtt_wss_timing_percentile(gc, 99);
+    if (gc->count != 1000 || gc->min_ns != 1000 || gc->max_ns != 1000000
+        || p50 < 500000 || p50 > 500000 * 5 / 4
+        || p99 < 990000 || p99 > 1000000
+        || snap.stages[MQTT_WSS_STAGE_SSL_READ].min_ns != 0) {
+        fprintf(stderr, "mqtt_wss_timing_percentile: Wrong result (p50 %llu, p99 %llu)\n",
+            (unsigned long long)p50, (unsigned long long)p99);
+        return 1;
+    }
+    return 0;
+}
+#endif /* TESTS */
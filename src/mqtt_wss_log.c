@@ -3,9 +3,42 @@
 #include <stdarg.h>
 #include <string.h>
 #include <stdio.h>
+#include <pthread.h>
+#include <time.h>
 #include "common_internal.h"
 
+#define LOG_RECORD_SIZE 1024
+// consumer sleeps at most this long even if wakeup is missed
+#define LOG_ASYNC_IDLE_MS 100
+
+struct log_record {
+    // Vyukov bounded queue, record is free for producer at position seq
+    // and holds message for consumer at position seq - 1
+    size_t seq;
+    int severity;
+    char line[LOG_RECORD_SIZE];
+};
+
+// formatted messages waiting for background thread (multiple producers, single consumer)
+struct log_async {
+    struct log_record *records;
+    size_t mask;
+    size_t head;
+    size_t tail;
+    uint64_t dropped;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int sleeping;
+    int stop;
+};
+
 struct mqtt_wss_log_ctx {
+    // has to be first, see mws_log_enabled
+    struct mqtt_wss_log_gate gate;
+    struct log_async *async;
+
     mqtt_wss_log_callback_t extern_log_fnc;
     char *ctx_prefix;
     char *buffer;
@@ -26,6 +59,8 @@ mqtt_wss_log_ctx_t mqtt_wss_log_ctx_create(const char *ctx_prefix, mqtt_wss_log_
     if(!ctx)
         return NULL;
 
+    ctx->gate.min_severity = MQTT_WSS_LOG_DEBUG;
+
     if(log_callback) {
         ctx->extern_log_fnc = log_callback;
         ctx->buffer = mw_calloc(1, LOG_BUFFER_SIZE);
@@ -61,8 +96,12 @@ cleanup:
     return NULL;
 }
 
+static void log_async_stop(struct log_async *async);
+
 void mqtt_wss_log_ctx_destroy(mqtt_wss_log_ctx_t ctx)
 {
+    if (ctx->async)
+        log_async_stop(ctx->async);
     mw_free(ctx->ctx_prefix);
     mw_free(ctx->buffer);
     mw_free(ctx);
@@ -86,10 +125,185 @@ static inline char severity_to_c(int severity)
     }
 }
 
+void mqtt_wss_log_ctx_set_level(mqtt_wss_log_ctx_t ctx, mqtt_wss_log_type_t min_severity)
+{
+    __atomic_store_n(&ctx->gate.min_severity, (int)min_severity, __ATOMIC_RELAXED);
+}
+
+// writes "[prefix] S: " the same way synchronous logging does
+static size_t format_line_header(mqtt_wss_log_ctx_t ctx, int severity, char *dst, size_t size)
+{
+    if (ctx->extern_log_fnc) {
+        size_t len = ctx->buffer_w_ptr - ctx->buffer;
+        memcpy(dst, ctx->buffer, len);
+        dst[len - 3] = severity_to_c(severity);
+        return len;
+    }
+    if (ctx->ctx_prefix)
+        return snprintf(dst, size, "[%s] %c: ", ctx->ctx_prefix, severity_to_c(severity));
+    return snprintf(dst, size, "%c: ", severity_to_c(severity));
+}
+
+static void log_output(mqtt_wss_log_ctx_t ctx, int severity, const char *line)
+{
+    if (ctx->extern_log_fnc)
+        ctx->extern_log_fnc(severity, line);
+    else
+        puts(line);
+}
+
+static void log_async_wakeup(struct log_async *async)
+{
+    // pairs with the fence in log_async_worker, either consumer sees the record
+    // or we see it is going to sleep
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&async->sleeping, __ATOMIC_RELAXED))
+        return;
+    pthread_mutex_lock(&async->lock);
+    pthread_cond_signal(&async->cond);
+    pthread_mutex_unlock(&async->lock);
+}
+
+static void log_async_push(mqtt_wss_log_ctx_t ctx, int severity, const char *fmt, va_list args)
+{
+    struct log_async *async = ctx->async;
+    struct log_record *rec;
+    size_t pos = __atomic_load_n(&async->head, __ATOMIC_RELAXED);
+    for (;;) {
+        rec = &async->records[pos & async->mask];
+        size_t seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (!diff) {
+            if (__atomic_compare_exchange_n(&async->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            __atomic_fetch_add(&async->dropped, 1, __ATOMIC_RELAXED);
+            return;
+        } else
+            pos = __atomic_load_n(&async->head, __ATOMIC_RELAXED);
+    }
+
+    size_t len = format_line_header(ctx, severity, rec->line, LOG_RECORD_SIZE);
+    size_t size = vsnprintf(rec->line + len, LOG_RECORD_SIZE - len, fmt, args);
+    if (size >= LOG_RECORD_SIZE - len)
+        memcpy(rec->line + LOG_RECORD_SIZE - 4, "...", 4);
+    rec->severity = severity;
+    __atomic_store_n(&rec->seq, pos + 1, __ATOMIC_RELEASE);
+
+    log_async_wakeup(async);
+}
+
+// returns 1 if there was nothing to log
+static int log_async_pop(mqtt_wss_log_ctx_t ctx)
+{
+    struct log_async *async = ctx->async;
+    struct log_record *rec = &async->records[async->tail & async->mask];
+    if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) != async->tail + 1)
+        return 1;
+    log_output(ctx, rec->severity, rec->line);
+    __atomic_store_n(&rec->seq, async->tail + async->mask + 1, __ATOMIC_RELEASE);
+    async->tail++;
+    return 0;
+}
+
+static void *log_async_worker(void *ptr)
+{
+    mqtt_wss_log_ctx_t ctx = ptr;
+    struct log_async *async = ctx->async;
+
+    for (;;) {
+        while (!log_async_pop(ctx))
+            ;
+        if (__atomic_load_n(&async->stop, __ATOMIC_ACQUIRE)) {
+            // producers are gone, log what they left
+            while (!log_async_pop(ctx))
+                ;
+            return NULL;
+        }
+
+        pthread_mutex_lock(&async->lock);
+        __atomic_store_n(&async->sleeping, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        struct log_record *rec = &async->records[async->tail & async->mask];
+        if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) != async->tail + 1 && !__atomic_load_n(&async->stop, __ATOMIC_ACQUIRE)) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += LOG_ASYNC_IDLE_MS * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&async->cond, &async->lock, &deadline);
+        }
+        __atomic_store_n(&async->sleeping, 0, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&async->lock);
+    }
+}
+
+int mqtt_wss_log_ctx_set_async(mqtt_wss_log_ctx_t ctx, size_t records)
+{
+    if (ctx->async || !records)
+        return 1;
+
+    size_t count = 1;
+    while (count < records)
+        count <<= 1;
+
+    struct log_async *async = mw_calloc(1, sizeof(struct log_async));
+    if (!async)
+        return 1;
+    async->records = mw_malloc(count * sizeof(struct log_record));
+    if (!async->records)
+        goto fail;
+    for (size_t i = 0; i < count; i++)
+        async->records[i].seq = i;
+    async->mask = count - 1;
+    pthread_mutex_init(&async->lock, NULL);
+    pthread_cond_init(&async->cond, NULL);
+
+    ctx->async = async;
+    if (pthread_create(&async->thread, NULL, log_async_worker, ctx)) {
+        ctx->async = NULL;
+        pthread_cond_destroy(&async->cond);
+        pthread_mutex_destroy(&async->lock);
+        goto fail;
+    }
+    return 0;
+
+fail:
+    mw_free(async->records);
+    mw_free(async);
+    return 1;
+}
+
+static void log_async_stop(struct log_async *async)
+{
+    __atomic_store_n(&async->stop, 1, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&async->lock);
+    pthread_cond_signal(&async->cond);
+    pthread_mutex_unlock(&async->lock);
+    pthread_join(async->thread, NULL);
+
+    pthread_cond_destroy(&async->cond);
+    pthread_mutex_destroy(&async->lock);
+    mw_free(async->records);
+    mw_free(async);
+}
+
+uint64_t mqtt_wss_log_ctx_dropped(mqtt_wss_log_ctx_t ctx)
+{
+    return ctx->async ? __atomic_load_n(&ctx->async->dropped, __ATOMIC_RELAXED) : 0;
+}
+
 void mws_log(int severity, mqtt_wss_log_ctx_t ctx, const char *fmt, va_list args)
 {
     size_t size;
 
+    if (ctx->async) {
+        log_async_push(ctx, severity, fmt, args);
+        return;
+    }
+
     if(ctx->extern_log_fnc) {
         size = vsnprintf(ctx->buffer_w_ptr, ctx->buffer_bytes_avail, fmt, args);
         *(ctx->buffer_w_ptr - 3) = severity_to_c(severity);
@@ -111,8 +325,9 @@ void mws_log(int severity, mqtt_wss_log_ctx_t ctx, const char *fmt, va_list args
     putchar('\n');
 }
 
+// parentheses keep the level checking macros from expanding
 #define DEFINE_MWS_SEV_FNC(severity_fncname, severity) \
-void mws_ ## severity_fncname(mqtt_wss_log_ctx_t ctx, const char *fmt, ...) \
+void (mws_ ## severity_fncname)(mqtt_wss_log_ctx_t ctx, const char *fmt, ...) \
 { \
     va_list args; \
     va_start(args, fmt); \
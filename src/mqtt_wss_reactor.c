@@ -0,0 +1,550 @@
+// SPDX-License-Identifier: GPL-3.0-only
+//
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free Software Foundation, version 3.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+// See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with this program.
+// If not, see <https://www.gnu.org/licenses/>.
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+#include "mqtt_wss_reactor.h"
+#include "mqtt_wss_client_internal.h"
+#include "mqtt_wss_log.h"
+#include "common_internal.h"
+
+#define REACTOR_MAX_EVENTS 64
+#define REACTOR_NO_DEADLINE LLONG_MAX
+#define REACTOR_HEAP_INITIAL_SIZE 16
+
+struct reactor_client;
+
+// epoll_event.data.ptr points to one of these
+// so we know which fd of which client it is
+// (owner is NULL for wakeup fd shared by all clients)
+struct reactor_fd {
+    struct reactor_client *owner;
+    int is_wakeup;
+};
+
+struct reactor_client {
+    mqtt_wss_client client;
+    mqtt_wss_reactor_error_cb_t error_cb;
+    void *error_cb_ctx;
+
+    // all sockets of the client (several while connect attempts race) share this one
+    struct reactor_fd socket;
+    struct reactor_fd wakeup;
+    unsigned int socket_generation;
+    int wakeup_fd;
+
+    // keep-alive or connect timer (monotonic ms)
+    long long int deadline;
+    size_t heap_idx;
+
+    unsigned int wakeup_pending:1;
+    unsigned int keepalive_due:1;
+    unsigned int ready:1;
+    unsigned int removed:1;
+
+    struct reactor_client *next_ready;
+
+    struct reactor_client *prev;
+    struct reactor_client *next;
+};
+
+struct mqtt_wss_reactor {
+    mqtt_wss_log_ctx_t log;
+    int epoll_fd;
+
+    // publishing threads wake up clients through this one
+    // (see mqtt_wss_set_wakeup_target), own wakeup fds of clients
+    // are watched too as resolver signals those
+    int wakeup_fd;
+    struct reactor_fd wakeup;
+
+    // all registered clients
+    struct reactor_client *clients;
+
+    // clients to be serviced in this (or next) run
+    struct reactor_client *ready;
+
+    // removed during run, freed once run is finished
+    // as epoll events might still point to them
+    struct reactor_client *removed;
+
+    // min-heap of timer deadlines
+    struct reactor_client **heap;
+    size_t heap_len;
+    size_t heap_size;
+};
+
+static long long int reactor_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long int)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static inline void heap_swap(struct reactor_client **heap, size_t a, size_t b)
+{
+    struct reactor_client *tmp = heap[a];
+    heap[a] = heap[b];
+    heap[b] = tmp;
+    heap[a]->heap_idx = a;
+    heap[b]->heap_idx = b;
+}
+
+static void heap_sift_up(struct reactor_client **heap, size_t idx)
+{
+    while (idx) {
+        size_t parent = (idx - 1) / 2;
+        if (heap[parent]->deadline <= heap[idx]->deadline)
+            return;
+        heap_swap(heap, parent, idx);
+        idx = parent;
+    }
+}
+
+static void heap_sift_down(struct reactor_client **heap, size_t len, size_t idx)
+{
+    for (;;) {
+        size_t min = idx;
+        size_t left = idx * 2 + 1;
+        size_t right = left + 1;
+        if (left < len && heap[left]->deadline < heap[min]->deadline)
+            min = left;
+        if (right < len && heap[right]->deadline < heap[min]->deadline)
+            min = right;
+        if (min == idx)
+            return;
+        heap_swap(heap, min, idx);
+        idx = min;
+    }
+}
+
+static int heap_insert(struct mqtt_wss_reactor *reactor, struct reactor_client *rc)
+{
+    if (reactor->heap_len == reactor->heap_size) {
+        size_t new_size = reactor->heap_size ? reactor->heap_size * 2 : REACTOR_HEAP_INITIAL_SIZE;
+        struct reactor_client **heap = mw_realloc(reactor->heap, new_size * sizeof(*heap));
+        if (!heap)
+            return 1;
+        reactor->heap = heap;
+        reactor->heap_size = new_size;
+    }
+    rc->heap_idx = reactor->heap_len++;
+    reactor->heap[rc->heap_idx] = rc;
+    heap_sift_up(reactor->heap, rc->heap_idx);
+    return 0;
+}
+
+static void heap_remove(struct mqtt_wss_reactor *reactor, struct reactor_client *rc)
+{
+    size_t idx = rc->heap_idx;
+    reactor->heap_len--;
+    if (idx == reactor->heap_len)
+        return;
+    heap_swap(reactor->heap, idx, reactor->heap_len);
+    heap_sift_down(reactor->heap, reactor->heap_len, idx);
+    heap_sift_up(reactor->heap, idx);
+}
+
+static void reactor_update_deadline(struct mqtt_wss_reactor *reactor, struct reactor_client *rc, long long int now)
+{
+    long long int in_ms = mqtt_wss_timer_in_ms(rc->client);
+    long long int old = rc->deadline;
+    rc->deadline = in_ms < 0 ? REACTOR_NO_DEADLINE : now + in_ms;
+    if (rc->deadline < old)
+        heap_sift_up(reactor->heap, rc->heap_idx);
+    else if (rc->deadline > old)
+        heap_sift_down(reactor->heap, reactor->heap_len, rc->heap_idx);
+}
+
+static inline void reactor_mark_ready(struct mqtt_wss_reactor *reactor, struct reactor_client *rc)
+{
+    if (rc->ready)
+        return;
+    rc->ready = 1;
+    rc->next_ready = reactor->ready;
+    reactor->ready = rc;
+}
+
+#ifdef __linux__
+mqtt_wss_reactor mqtt_wss_reactor_new(const char *log_prefix, mqtt_wss_log_callback_t log_callback)
+{
+    mqtt_wss_log_ctx_t log = mqtt_wss_log_ctx_create(log_prefix, log_callback);
+    if (!log)
+        return NULL;
+
+    struct mqtt_wss_reactor *reactor = mw_calloc(1, sizeof(struct mqtt_wss_reactor));
+    if (!reactor) {
+        mws_error(log, "OOM allocating mqtt_wss_reactor");
+        goto fail;
+    }
+
+    reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (reactor->epoll_fd < 0) {
+        mws_error(log, "epoll_create1 failed \"%s\"", strerror(errno));
+        goto fail_1;
+    }
+
+    reactor->wakeup_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (reactor->wakeup_fd < 0) {
+        mws_error(log, "eventfd failed \"%s\"", strerror(errno));
+        goto fail_2;
+    }
+    reactor->wakeup.is_wakeup = 1;
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLET, .data.ptr = &reactor->wakeup };
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->wakeup_fd, &ev)) {
+        mws_error(log, "epoll_ctl(EPOLL_CTL_ADD) failed \"%s\"", strerror(errno));
+        goto fail_3;
+    }
+
+    reactor->log = log;
+    return reactor;
+
+fail_3:
+    close(reactor->wakeup_fd);
+fail_2:
+    close(reactor->epoll_fd);
+fail_1:
+    mw_free(reactor);
+fail:
+    mqtt_wss_log_ctx_destroy(log);
+    return NULL;
+}
+#else
+mqtt_wss_reactor mqtt_wss_reactor_new(const char *log_prefix, mqtt_wss_log_callback_t log_callback)
+{
+    mqtt_wss_log_ctx_t log = mqtt_wss_log_ctx_create(log_prefix, log_callback);
+    if (log) {
+        mws_error(log, "mqtt_wss_reactor is not supported on this platform");
+        mqtt_wss_log_ctx_destroy(log);
+    }
+    return NULL;
+}
+#endif
+
+// removed clients still in ready list are kept till
+// the run that skips them
+static void reactor_free_removed(struct mqtt_wss_reactor *reactor, int all)
+{
+    struct reactor_client **link = &reactor->removed;
+    while (*link) {
+        struct reactor_client *rc = *link;
+        if (rc->ready && !all) {
+            link = &rc->next;
+            continue;
+        }
+        *link = rc->next;
+        mw_free(rc);
+    }
+}
+
+void mqtt_wss_reactor_destroy(mqtt_wss_reactor reactor)
+{
+    while (reactor->clients)
+        mqtt_wss_reactor_remove(reactor, reactor->clients->client);
+    reactor_free_removed(reactor, 1);
+
+    // publishing threads can't signal it anymore, mqtt_wss_set_wakeup_target
+    // called by remove waits for the ones signalling it right now
+    close(reactor->wakeup_fd);
+    close(reactor->epoll_fd);
+    mw_free(reactor->heap);
+    mqtt_wss_log_ctx_destroy(reactor->log);
+    mw_free(reactor);
+}
+
+#ifdef __linux__
+static int reactor_epoll_add(struct mqtt_wss_reactor *reactor, int fd, struct reactor_fd *rfd, uint32_t events)
+{
+    struct epoll_event ev = { .events = events | EPOLLET, .data.ptr = rfd };
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, fd, &ev)) {
+        // socket registered by previous reactor_sync_sockets
+        if (errno == EEXIST)
+            return 0;
+        mws_error(reactor->log, "epoll_ctl(EPOLL_CTL_ADD) failed \"%s\"", strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+static void reactor_epoll_del(struct mqtt_wss_reactor *reactor, int fd)
+{
+    // fd might be closed already (client disconnected before remove)
+    // in which case kernel removed it from the set itself
+    epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+#endif
+
+// registers sockets client started using since last call (e.g. new connect attempt)
+// sockets client closed are removed from epoll set by kernel already
+static int reactor_sync_sockets(struct mqtt_wss_reactor *reactor, struct reactor_client *rc)
+{
+#ifdef __linux__
+    int fds[MQTT_WSS_MAX_SOCKETS];
+    unsigned int generation = mqtt_wss_socket_generation(rc->client);
+    if (generation == rc->socket_generation)
+        return 0;
+    rc->socket_generation = generation;
+
+    int count = mqtt_wss_get_socket_fds(rc->client, fds, MQTT_WSS_MAX_SOCKETS);
+    for (int i = 0; i < count; i++) {
+        // edge triggered so we don't have to touch epoll set every time
+        // client changes its mind about wanting to write
+        if (reactor_epoll_add(reactor, fds[i], &rc->socket, EPOLLIN | EPOLLOUT))
+            return 1;
+    }
+#else
+    (void)reactor; (void)rc;
+#endif
+    return 0;
+}
+
+#ifdef __linux__
+static void reactor_del_sockets(struct mqtt_wss_reactor *reactor, struct reactor_client *rc)
+{
+    int fds[MQTT_WSS_MAX_SOCKETS];
+    int count = mqtt_wss_get_socket_fds(rc->client, fds, MQTT_WSS_MAX_SOCKETS);
+    for (int i = 0; i < count; i++)
+        reactor_epoll_del(reactor, fds[i]);
+}
+#endif
+
+static struct reactor_client *reactor_find(struct mqtt_wss_reactor *reactor, mqtt_wss_client client)
+{
+    for (struct reactor_client *rc = reactor->clients; rc; rc = rc->next) {
+        if (rc->client == client)
+            return rc;
+    }
+    return NULL;
+}
+
+int mqtt_wss_reactor_add(mqtt_wss_reactor reactor, mqtt_wss_client client, mqtt_wss_reactor_error_cb_t error_cb, void *ctx)
+{
+#ifdef __linux__
+    if (reactor_find(reactor, client)) {
+        mws_error(reactor->log, "Client is already registered with reactor");
+        return 1;
+    }
+
+    struct reactor_client *rc = mw_calloc(1, sizeof(struct reactor_client));
+    if (!rc) {
+        mws_error(reactor->log, "OOM allocating reactor client");
+        return 1;
+    }
+
+    rc->client = client;
+    rc->error_cb = error_cb;
+    rc->error_cb_ctx = ctx;
+    rc->socket.owner = rc;
+    rc->wakeup.owner = rc;
+    rc->wakeup.is_wakeup = 1;
+    rc->wakeup_fd = mqtt_wss_get_wakeup_fd(client);
+    rc->deadline = REACTOR_NO_DEADLINE;
+    // forces registration of current sockets
+    rc->socket_generation = mqtt_wss_socket_generation(client) - 1;
+
+    enum mqtt_wss_connect_state state = mqtt_wss_get_connect_state(client);
+    if (state == MQTT_WSS_CONN_FAILED || (state == MQTT_WSS_CONN_IDLE && mqtt_wss_get_socket_fd(client) < 0)) {
+        mws_error(reactor->log, "Can't add client which is neither connected nor connecting");
+        goto fail;
+    }
+
+    if (heap_insert(reactor, rc)) {
+        mws_error(reactor->log, "OOM growing reactor timer heap");
+        goto fail;
+    }
+
+    if (reactor_sync_sockets(reactor, rc))
+        goto fail_1;
+    if (reactor_epoll_add(reactor, rc->wakeup_fd, &rc->wakeup, EPOLLIN))
+        goto fail_1;
+    mqtt_wss_set_wakeup_target(client, reactor->wakeup_fd);
+
+    rc->next = reactor->clients;
+    if (reactor->clients)
+        reactor->clients->prev = rc;
+    reactor->clients = rc;
+
+    reactor_update_deadline(reactor, rc, reactor_now_ms());
+
+    // there might be data already (e.g. received together with CONNACK)
+    // that edge triggered epoll would not tell us about
+    reactor_mark_ready(reactor, rc);
+    return 0;
+
+fail_1:
+    reactor_del_sockets(reactor, rc);
+    heap_remove(reactor, rc);
+fail:
+    mw_free(rc);
+    return 1;
+#else
+    (void)client; (void)error_cb; (void)ctx;
+    mws_error(reactor->log, "mqtt_wss_reactor is not supported on this platform");
+    return 1;
+#endif
+}
+
+int mqtt_wss_reactor_remove(mqtt_wss_reactor reactor, mqtt_wss_client client)
+{
+    struct reactor_client *rc = reactor_find(reactor, client);
+    if (!rc)
+        return 1;
+
+#ifdef __linux__
+    mqtt_wss_set_wakeup_target(client, -1);
+    reactor_del_sockets(reactor, rc);
+    reactor_epoll_del(reactor, rc->wakeup_fd);
+#endif
+    heap_remove(reactor, rc);
+
+    if (rc->prev)
+        rc->prev->next = rc->next;
+    else
+        reactor->clients = rc->next;
+    if (rc->next)
+        rc->next->prev = rc->prev;
+
+    // stays in ready list (if it is there) until run skips it
+    rc->removed = 1;
+    rc->prev = NULL;
+    rc->next = reactor->removed;
+    reactor->removed = rc;
+    return 0;
+}
+
+#ifdef __linux__
+static int reactor_wait(struct mqtt_wss_reactor *reactor, int timeout_ms)
+{
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+
+    // shorten the timeout so that we send keep-alives in time
+    if (reactor->heap_len && reactor->heap[0]->deadline != REACTOR_NO_DEADLINE) {
+        long long int till_deadline = reactor->heap[0]->deadline - reactor_now_ms();
+        if (till_deadline < 0)
+            till_deadline = 0;
+        if (timeout_ms < 0 || timeout_ms > till_deadline)
+            timeout_ms = till_deadline;
+    }
+
+    // clients with pending work don't wait for new events
+    if (reactor->ready)
+        timeout_ms = 0;
+
+    int n = epoll_wait(reactor->epoll_fd, events, REACTOR_MAX_EVENTS, timeout_ms);
+    if (n < 0) {
+        if (errno == EINTR) {
+            mws_warn(reactor->log, "epoll_wait interrupted by EINTR");
+            return 0;
+        }
+        mws_error(reactor->log, "epoll_wait error \"%s\"", strerror(errno));
+        return -2;
+    }
+
+    int shared_wakeup = 0;
+    for (int i = 0; i < n; i++) {
+        struct reactor_fd *rfd = events[i].data.ptr;
+        if (!rfd->owner) {
+            shared_wakeup = 1;
+            continue;
+        }
+        if (rfd->is_wakeup)
+            rfd->owner->wakeup_pending = 1;
+        // socket errors and hang ups are found out by SSL_read
+        reactor_mark_ready(reactor, rfd->owner);
+    }
+
+    // single signal for any number of clients (and publishes), find out which ones
+    // were woken up, clients which are woken up after the read signal again
+    if (shared_wakeup) {
+        uint64_t count;
+        if (read(reactor->wakeup_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+            mws_error(reactor->log, "Error reading eventfd \"%s\"", strerror(errno));
+        for (struct reactor_client *rc = reactor->clients; rc; rc = rc->next) {
+            if (mqtt_wss_wakeup_pending(rc->client))
+                reactor_mark_ready(reactor, rc);
+        }
+    }
+    return 0;
+}
+#endif
+
+int mqtt_wss_reactor_run(mqtt_wss_reactor reactor, int timeout_ms)
+{
+#ifdef __linux__
+    int ret = reactor_wait(reactor, timeout_ms);
+    if (ret)
+        return ret;
+#else
+    (void)timeout_ms;
+    return -1;
+#endif
+
+    long long int now = reactor_now_ms();
+    while (reactor->heap_len && reactor->heap[0]->deadline <= now) {
+        struct reactor_client *rc = reactor->heap[0];
+        rc->keepalive_due = 1;
+        // real deadline is set again after it is serviced
+        rc->deadline = REACTOR_NO_DEADLINE;
+        heap_sift_down(reactor->heap, reactor->heap_len, 0);
+        reactor_mark_ready(reactor, rc);
+    }
+
+    // clients which still have work after being serviced
+    // are put into next run
+    struct reactor_client *ready = reactor->ready;
+    reactor->ready = NULL;
+
+    int serviced = 0;
+    while (ready) {
+        struct reactor_client *rc = ready;
+        ready = rc->next_ready;
+        rc->ready = 0;
+        if (rc->removed)
+            continue;
+
+        int wakeup_pending = rc->wakeup_pending;
+        int keepalive_due = rc->keepalive_due;
+        rc->wakeup_pending = 0;
+        rc->keepalive_due = 0;
+
+        ret = mqtt_wss_service_events(rc->client, wakeup_pending, keepalive_due);
+        serviced++;
+        if (ret >= 0 && reactor_sync_sockets(reactor, rc))
+            ret = MQTT_WSS_ERR_CONN_DROP;
+        if (ret < 0) {
+            mqtt_wss_client client = rc->client;
+            mqtt_wss_reactor_error_cb_t error_cb = rc->error_cb;
+            void *ctx = rc->error_cb_ctx;
+            mqtt_wss_reactor_remove(reactor, client);
+            if (error_cb)
+                error_cb(ctx, client, ret);
+            continue;
+        }
+
+        reactor_update_deadline(reactor, rc, now);
+        if (mqtt_wss_has_pending_work(rc->client))
+            reactor_mark_ready(reactor, rc);
+    }
+
+    reactor_free_removed(reactor, 0);
+    return serviced;
+}
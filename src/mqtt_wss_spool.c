@@ -0,0 +1,819 @@
+// SPDX-License-Identifier: GPL-3.0-only
+//
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free Software Foundation, version 3.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+// See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with this program.
+// If not, see <https://www.gnu.org/licenses/>.
+
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <zlib.h>
+
+#include "mqtt_wss_spool.h"
+#include "mqtt_ng.h"
+#include "common_internal.h"
+
+#define SPOOL_FILE_MAGIC 0x4c505357 // "WSPL"
+#define SPOOL_FILE_VERSION 1
+#define SPOOL_REC_MAGIC  0x43455257 // "WREC"
+#define SPOOL_WRAP_MAGIC 0x50525757 // "WWRP"
+
+// first page holds file header only
+#define SPOOL_DATA_START 4096
+#define SPOOL_DEFAULT_FILE_SIZE (64 * 1024 * 1024)
+#define SPOOL_MIN_FILE_SIZE (SPOOL_DATA_START + 64 * 1024)
+#define SPOOL_DEFAULT_MAX_INFLIGHT (8 * 1024 * 1024)
+
+#define SPOOL_DRAIN_BATCH 64
+#define SPOOL_ALIGN(x) (((x) + 7) & ~(size_t)7)
+
+struct spool_file_hdr {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t size;
+    // seq of the record at head << 32 | offset of head
+    // (single store so that crash can't leave them inconsistent)
+    uint64_t head_pos;
+};
+
+enum spool_rec_state {
+    REC_PENDING = 0,
+    REC_SENT,   // handed to mqtt_ng, waiting for PUBACK
+    REC_ACKED   // can be overwritten once head moves past it
+};
+
+// sent before, DUP flag has to be set when sending again
+#define REC_FLAG_DUP 0x01
+
+// Record header, followed by topic (with terminating 0) and message.
+// Records are consecutive (seq increments by 1) from head to tail
+// and never cross the end of the file. Writer continues from the data start
+// either after wrap marker (which has seq of its own) or if there is
+// no room for record header left at the end.
+struct spool_rec {
+    uint32_t magic; // stored last, record is valid only once this is set
+    uint32_t len;   // including this header and padding
+    uint32_t seq;
+    uint32_t crc;   // of topic and message
+    uint32_t msg_len;
+    uint16_t topic_len;
+    uint16_t packet_id;
+    uint8_t qos;
+    uint8_t retain;
+    uint8_t state;
+    uint8_t flags;
+    uint8_t reserved[4];
+};
+
+struct mqtt_wss_spool {
+    pthread_mutex_t lock;
+    mqtt_wss_log_ctx_t log;
+
+    int fd;
+    char *map;
+    size_t size;
+    int sync;
+    size_t max_inflight;
+
+    // offsets of the oldest record, where next one will be written
+    // and of the next record to look at when draining
+    uint32_t head;
+    uint32_t tail;
+    uint32_t send;
+    uint32_t head_seq;
+    uint32_t next_seq;
+
+    size_t records;
+    size_t pending; // read without lock by mqtt_wss_spool_has_pending
+    size_t inflight;
+
+    // offset + 1 of the record sent with given packet id
+    uint32_t *by_packet_id;
+
+    uint64_t appended;
+    uint64_t replayed;
+    uint64_t rejected;
+    uint64_t dropped;
+};
+
+#define REC_AT(spool, off) ((struct spool_rec *)((spool)->map + (off)))
+#define FILE_HDR(spool) ((struct spool_file_hdr *)(spool)->map)
+#define PENDING_ADD(spool, n) __atomic_store_n(&(spool)->pending, (spool)->pending + (n), __ATOMIC_RELAXED)
+
+static inline int at_wrap(struct mqtt_wss_spool *spool, uint32_t off)
+{
+    return off + sizeof(struct spool_rec) > spool->size || REC_AT(spool, off)->magic == SPOOL_WRAP_MAGIC;
+}
+
+// wrap marker (unlike wrapping for lack of space) takes seq
+static inline void skip_wrap(struct mqtt_wss_spool *spool, uint32_t *off, uint32_t *seq)
+{
+    if (seq && *off + sizeof(struct spool_rec) <= spool->size)
+        (*seq)++;
+    *off = SPOOL_DATA_START;
+}
+
+static void spool_store_head(struct mqtt_wss_spool *spool)
+{
+    __atomic_store_n(&FILE_HDR(spool)->head_pos, ((uint64_t)spool->head_seq << 32) | spool->head, __ATOMIC_RELEASE);
+}
+
+static void spool_advance_head(struct mqtt_wss_spool *spool)
+{
+    uint32_t head = spool->head;
+
+    while (spool->head != spool->tail) {
+        uint32_t prev = spool->head;
+        if (at_wrap(spool, spool->head))
+            skip_wrap(spool, &spool->head, &spool->head_seq);
+        else {
+            struct spool_rec *rec = REC_AT(spool, spool->head);
+            if (rec->state != REC_ACKED)
+                break;
+            spool->head += rec->len;
+            spool->head_seq++;
+            spool->records--;
+        }
+        // send cursor can stay at record that was sent out of order
+        if (spool->send == prev)
+            spool->send = spool->head;
+    }
+
+    // empty, start from the beginning again to avoid wrapping
+    if (spool->head == spool->tail)
+        spool->head = spool->tail = spool->send = SPOOL_DATA_START;
+
+    if (spool->head != head)
+        spool_store_head(spool);
+}
+
+static void spool_msync(struct mqtt_wss_spool *spool, uint32_t off, uint32_t len)
+{
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)(spool->map + off) & ~(page - 1);
+    if (msync((void *)start, (uintptr_t)(spool->map + off + len) - start, MS_SYNC))
+        mws_error(spool->log, "Error syncing spool file: %s", strerror(errno));
+}
+
+static int spool_rec_valid(struct mqtt_wss_spool *spool, struct spool_rec *rec, uint32_t off)
+{
+    if (rec->magic != SPOOL_REC_MAGIC || rec->len & 7 || rec->len < sizeof(struct spool_rec) || rec->len > spool->size - off)
+        return 0;
+    if (!rec->topic_len || sizeof(struct spool_rec) + rec->topic_len + (size_t)rec->msg_len > rec->len)
+        return 0;
+    if (rec->qos > 1 || rec->state > REC_ACKED)
+        return 0;
+    const char *topic = (const char *)(rec + 1);
+    if (topic[rec->topic_len - 1])
+        return 0;
+    return crc32(0, (const Bytef *)topic, rec->topic_len + rec->msg_len) == rec->crc;
+}
+
+// walks records from head for as long as they are valid and consecutive
+// anything after that was not fully written before the crash
+static void spool_recover(struct mqtt_wss_spool *spool)
+{
+    uint64_t head_pos = FILE_HDR(spool)->head_pos;
+    uint32_t off = head_pos & UINT32_MAX;
+    uint32_t seq = head_pos >> 32;
+
+    if (off < SPOOL_DATA_START || off >= spool->size || off & 7) {
+        mws_error(spool->log, "Spool head is corrupted, previous content is lost");
+        off = SPOOL_DATA_START;
+    }
+    spool->head = off;
+    spool->head_seq = seq;
+
+    uint32_t tail = off;
+    int wrapped = 0;
+    for (;;) {
+        if (off + sizeof(struct spool_rec) > spool->size) {
+            if (wrapped)
+                break;
+            wrapped = 1;
+            off = SPOOL_DATA_START;
+            continue;
+        }
+        if (wrapped && off >= spool->head)
+            break;
+
+        struct spool_rec *rec = REC_AT(spool, off);
+        if (rec->seq != seq)
+            break;
+        if (rec->magic == SPOOL_WRAP_MAGIC) {
+            if (wrapped)
+                break;
+            wrapped = 1;
+            seq++;
+            off = tail = SPOOL_DATA_START;
+            continue;
+        }
+        if (!spool_rec_valid(spool, rec, off) || (wrapped && off + rec->len >= spool->head))
+            break;
+
+        // we don't know whether it reached the server
+        if (rec->state == REC_SENT) {
+            rec->state = REC_PENDING;
+            rec->flags |= REC_FLAG_DUP;
+        }
+        if (rec->state == REC_PENDING)
+            spool->pending++;
+        spool->records++;
+
+        off += rec->len;
+        tail = off;
+        seq++;
+    }
+
+    spool->tail = tail;
+    spool->send = spool->head;
+    spool->next_seq = seq;
+    spool_advance_head(spool);
+}
+
+struct mqtt_wss_spool *mqtt_wss_spool_open(const struct mqtt_wss_spool_params *params, mqtt_wss_log_ctx_t log)
+{
+    size_t size = params->max_file_size ? params->max_file_size : SPOOL_DEFAULT_FILE_SIZE;
+    struct stat st;
+
+    if (!params->path) {
+        mws_error(log, "Spool path can't be NULL");
+        return NULL;
+    }
+    if (size < SPOOL_MIN_FILE_SIZE || size > UINT32_MAX) {
+        mws_error(log, "Spool file size has to be between %d and %" PRIu32 " bytes", SPOOL_MIN_FILE_SIZE, UINT32_MAX);
+        return NULL;
+    }
+
+    struct mqtt_wss_spool *spool = mw_calloc(1, sizeof(struct mqtt_wss_spool));
+    if (!spool) {
+        mws_error(log, "OOM allocating spool");
+        return NULL;
+    }
+    spool->log = log;
+    spool->sync = params->sync;
+    spool->max_inflight = params->max_inflight_bytes ? params->max_inflight_bytes : SPOOL_DEFAULT_MAX_INFLIGHT;
+
+    spool->by_packet_id = mw_calloc(UINT16_MAX + 1, sizeof(uint32_t));
+    if (!spool->by_packet_id) {
+        mws_error(log, "OOM allocating spool packet id map");
+        goto fail;
+    }
+
+    spool->fd = open(params->path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (spool->fd < 0) {
+        mws_error(log, "Couldn't open spool file \"%s\": %s", params->path, strerror(errno));
+        goto fail;
+    }
+
+    if (flock(spool->fd, LOCK_EX | LOCK_NB)) {
+        mws_error(log, "Spool file \"%s\" is used by other process", params->path);
+        goto fail_fd;
+    }
+
+    if (fstat(spool->fd, &st)) {
+        mws_error(log, "Couldn't stat spool file \"%s\": %s", params->path, strerror(errno));
+        goto fail_fd;
+    }
+
+    // smaller file is leftover of interrupted creation
+    int create = st.st_size < SPOOL_DATA_START;
+    if (create) {
+        size &= ~(size_t)7;
+        if (ftruncate(spool->fd, 0)) {
+            mws_error(log, "Couldn't truncate spool file \"%s\": %s", params->path, strerror(errno));
+            goto fail_fd;
+        }
+#ifdef __APPLE__
+        int rc = ftruncate(spool->fd, size) ? errno : 0;
+#else
+        // reserve the space now rather than getting SIGBUS on full disk later
+        int rc = posix_fallocate(spool->fd, 0, size);
+#endif
+        if (rc) {
+            mws_error(log, "Couldn't reserve %zu bytes for spool file \"%s\": %s", size, params->path, strerror(rc));
+            goto fail_fd;
+        }
+    } else {
+        struct spool_file_hdr hdr;
+        if (pread(spool->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+            hdr.magic != SPOOL_FILE_MAGIC || hdr.version != SPOOL_FILE_VERSION ||
+            hdr.size != (uint64_t)st.st_size || hdr.size < SPOOL_MIN_FILE_SIZE || hdr.size > UINT32_MAX) {
+            mws_error(log, "\"%s\" is not a valid spool file", params->path);
+            goto fail_fd;
+        }
+        if (hdr.size != size)
+            mws_info(log, "Spool file \"%s\" keeps its size of %" PRIu64 " bytes", params->path, hdr.size);
+        size = hdr.size;
+    }
+    spool->size = size;
+
+    spool->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, spool->fd, 0);
+    if (spool->map == MAP_FAILED) {
+        mws_error(log, "Couldn't mmap spool file \"%s\": %s", params->path, strerror(errno));
+        goto fail_fd;
+    }
+
+    if (create) {
+        struct spool_file_hdr *hdr = FILE_HDR(spool);
+        hdr->version = SPOOL_FILE_VERSION;
+        hdr->size = size;
+        hdr->head_pos = SPOOL_DATA_START;
+        __atomic_store_n(&hdr->magic, SPOOL_FILE_MAGIC, __ATOMIC_RELEASE);
+        spool_msync(spool, 0, sizeof(struct spool_file_hdr));
+        spool->head = spool->tail = spool->send = SPOOL_DATA_START;
+    } else {
+        spool_recover(spool);
+        mws_info(log, "Spool \"%s\" recovered with %zu messages (%zu not sent yet)", params->path, spool->records, spool->pending);
+    }
+
+    pthread_mutex_init(&spool->lock, NULL);
+    return spool;
+
+fail_fd:
+    close(spool->fd);
+fail:
+    mw_free(spool->by_packet_id);
+    mw_free(spool);
+    return NULL;
+}
+
+void mqtt_wss_spool_close(struct mqtt_wss_spool *spool)
+{
+    if (!spool)
+        return;
+    munmap(spool->map, spool->size);
+    // releases flock as well
+    close(spool->fd);
+    pthread_mutex_destroy(&spool->lock);
+    mw_free(spool->by_packet_id);
+    mw_free(spool);
+}
+
+int mqtt_wss_spool_append(struct mqtt_wss_spool *spool, const char *topic, const void *msg, size_t msg_len, uint8_t qos, uint8_t retain)
+{
+    size_t topic_len = strlen(topic) + 1;
+    size_t need = SPOOL_ALIGN(sizeof(struct spool_rec) + topic_len + msg_len);
+
+    if (qos > 1) {
+        mws_error(spool->log, "Spool supports QOS 0 and 1 only");
+        return 1;
+    }
+
+    pthread_mutex_lock(&spool->lock);
+
+    // room for wrap marker is always left at the end
+    if (topic_len > UINT16_MAX || need > spool->size - SPOOL_DATA_START - sizeof(struct spool_rec)) {
+        mws_error(spool->log, "Message of %zu bytes can never fit into the spool", msg_len);
+        goto fail;
+    }
+
+    uint32_t off = spool->tail;
+    int wrap = 0;
+    if (off >= spool->head) {
+        if (off + need > spool->size) {
+            if (SPOOL_DATA_START + need >= spool->head)
+                goto full;
+            wrap = 1;
+        }
+    } else if (off + need >= spool->head)
+        goto full;
+
+    uint32_t sync_off = off;
+    if (wrap) {
+        if (off + sizeof(struct spool_rec) <= spool->size) {
+            struct spool_rec *marker = REC_AT(spool, off);
+            memset(marker, 0, sizeof(struct spool_rec));
+            marker->seq = spool->next_seq++;
+            __atomic_store_n(&marker->magic, SPOOL_WRAP_MAGIC, __ATOMIC_RELEASE);
+            if (spool->sync)
+                spool_msync(spool, off, sizeof(struct spool_rec));
+        }
+        off = sync_off = SPOOL_DATA_START;
+    }
+
+    struct spool_rec *rec = REC_AT(spool, off);
+    memset(rec, 0, sizeof(struct spool_rec));
+    rec->len = need;
+    rec->seq = spool->next_seq++;
+    rec->msg_len = msg_len;
+    rec->topic_len = topic_len;
+    rec->qos = qos;
+    rec->retain = retain;
+    rec->state = REC_PENDING;
+
+    char *data = (char *)(rec + 1);
+    memcpy(data, topic, topic_len);
+    memcpy(data + topic_len, msg, msg_len);
+    rec->crc = crc32(0, (const Bytef *)data, topic_len + msg_len);
+    __atomic_store_n(&rec->magic, SPOOL_REC_MAGIC, __ATOMIC_RELEASE);
+
+    if (spool->sync)
+        spool_msync(spool, sync_off, off + need - sync_off);
+
+    spool->tail = off + need;
+    spool->records++;
+    PENDING_ADD(spool, 1);
+    spool->appended++;
+
+    pthread_mutex_unlock(&spool->lock);
+    return 0;
+
+full:
+    mws_error(spool->log, "Spool is full, message of %zu bytes rejected", msg_len);
+fail:
+    spool->rejected++;
+    pthread_mutex_unlock(&spool->lock);
+    return 1;
+}
+
+void mqtt_wss_spool_rewind(struct mqtt_wss_spool *spool)
+{
+    pthread_mutex_lock(&spool->lock);
+
+    // packet ids of previous connection are meaningless now
+    memset(spool->by_packet_id, 0, (UINT16_MAX + 1) * sizeof(uint32_t));
+    spool->inflight = 0;
+
+    uint32_t off = spool->head;
+    while (off != spool->tail) {
+        if (at_wrap(spool, off)) {
+            skip_wrap(spool, &off, NULL);
+            continue;
+        }
+        struct spool_rec *rec = REC_AT(spool, off);
+        if (rec->state == REC_SENT) {
+            rec->state = REC_PENDING;
+            rec->flags |= REC_FLAG_DUP;
+            PENDING_ADD(spool, 1);
+        }
+        off += rec->len;
+    }
+    spool->send = spool->head;
+
+    pthread_mutex_unlock(&spool->lock);
+}
+
+int mqtt_wss_spool_has_pending(struct mqtt_wss_spool *spool)
+{
+    return __atomic_load_n(&spool->pending, __ATOMIC_RELAXED) != 0;
+}
+
+size_t mqtt_wss_spool_drain(struct mqtt_wss_spool *spool, struct mqtt_ng_client *mqtt)
+{
+    struct mqtt_publish_batch_entry entries[SPOOL_DRAIN_BATCH];
+    uint32_t offsets[SPOOL_DRAIN_BATCH];
+    size_t handed = 0;
+    int buffer_full = 0;
+
+    if (!mqtt_wss_spool_has_pending(spool))
+        return 0;
+
+    pthread_mutex_lock(&spool->lock);
+    while (!buffer_full && spool->pending && spool->inflight < spool->max_inflight) {
+        size_t count = 0;
+        size_t inflight = spool->inflight;
+        while (count < SPOOL_DRAIN_BATCH && spool->send != spool->tail && inflight < spool->max_inflight) {
+            if (at_wrap(spool, spool->send)) {
+                skip_wrap(spool, &spool->send, NULL);
+                continue;
+            }
+            uint32_t off = spool->send;
+            struct spool_rec *rec = REC_AT(spool, off);
+            spool->send += rec->len;
+            if (rec->state != REC_PENDING)
+                continue;
+
+            char *topic = (char *)(rec + 1);
+            struct mqtt_publish_batch_entry *entry = &entries[count];
+            memset(entry, 0, sizeof(*entry));
+            // topic is copied as alias tables can keep it longer than the record lives
+            entry->topic = topic;
+            entry->topic_free = NULL;
+            entry->msg = topic + rec->topic_len;
+            entry->msg_len = rec->msg_len;
+            // QOS1 record stays until PUBACK so it can be sent from the mapping directly
+            entry->msg_free = rec->qos ? CALLER_RESPONSIBILITY : NULL;
+            entry->qos = rec->qos;
+            entry->retain = rec->retain;
+            entry->dup = rec->flags & REC_FLAG_DUP;
+            if (rec->qos)
+                inflight += rec->len;
+            offsets[count++] = off;
+        }
+        if (!count)
+            break;
+
+        mqtt_ng_publish_batch(mqtt, entries, count);
+
+        for (size_t i = 0; i < count; i++) {
+            struct spool_rec *rec = REC_AT(spool, offsets[i]);
+            struct mqtt_publish_batch_entry *entry = &entries[i];
+            if (entry->rc == MQTT_NG_MSGGEN_OK) {
+                handed++;
+                PENDING_ADD(spool, -1);
+                if (rec->flags & REC_FLAG_DUP)
+                    spool->replayed++;
+                if (rec->qos) {
+                    rec->packet_id = entry->packet_id;
+                    rec->state = REC_SENT;
+                    spool->by_packet_id[entry->packet_id] = offsets[i] + 1;
+                    spool->inflight += rec->len;
+                } else
+                    rec->state = REC_ACKED;
+                continue;
+            }
+            if (entry->rc == MQTT_NG_MSGGEN_BUFFER_OOM) {
+                // continue from here once transaction buffer has room again
+                if (!buffer_full)
+                    spool->send = offsets[i];
+                buffer_full = 1;
+                continue;
+            }
+            mws_error(spool->log, "Dropping spooled message to \"%s\" which can't be sent (%d)", entry->topic, entry->rc);
+            rec->state = REC_ACKED;
+            PENDING_ADD(spool, -1);
+            spool->dropped++;
+        }
+        spool_advance_head(spool);
+    }
+    pthread_mutex_unlock(&spool->lock);
+
+    return handed;
+}
+
+int mqtt_wss_spool_ack(struct mqtt_wss_spool *spool, uint16_t packet_id)
+{
+    pthread_mutex_lock(&spool->lock);
+    uint32_t off = spool->by_packet_id[packet_id];
+    if (!off) {
+        pthread_mutex_unlock(&spool->lock);
+        return 0;
+    }
+    spool->by_packet_id[packet_id] = 0;
+
+    struct spool_rec *rec = REC_AT(spool, off - 1);
+    rec->state = REC_ACKED;
+    spool->inflight -= rec->len;
+    spool_advance_head(spool);
+
+    pthread_mutex_unlock(&spool->lock);
+    return 1;
+}
+
+void mqtt_wss_spool_get_stats(struct mqtt_wss_spool *spool, struct mqtt_wss_spool_stats *stats)
+{
+    pthread_mutex_lock(&spool->lock);
+    stats->enabled = 1;
+    stats->file_size = spool->size;
+    if (spool->tail >= spool->head)
+        stats->bytes_used = spool->tail - spool->head;
+    else
+        stats->bytes_used = (spool->size - spool->head) + (spool->tail - SPOOL_DATA_START);
+    stats->records = spool->records;
+    stats->records_pending = spool->pending;
+    stats->inflight_bytes = spool->inflight;
+    stats->appended = spool->appended;
+    stats->replayed = spool->replayed;
+    stats->rejected = spool->rejected;
+    stats->dropped = spool->dropped;
+    pthread_mutex_unlock(&spool->lock);
+}
+
+#ifdef TESTS
+#include <stdio.h>
+
+#define TEST_SPOOL_MSG_LEN 1000
+
+static ssize_t test_spool_send(void *user_ctx, const void *buf, size_t len)
+{
+    (void)user_ctx;
+    (void)buf;
+    return len;
+}
+
+static struct mqtt_wss_spool *test_spool_open(const char *path, size_t max_inflight, mqtt_wss_log_ctx_t log)
+{
+    struct mqtt_wss_spool_params params = {
+        .path = path,
+        .max_file_size = SPOOL_MIN_FILE_SIZE,
+        .max_inflight_bytes = max_inflight
+    };
+    return mqtt_wss_spool_open(&params, log);
+}
+
+// message carries its number so that order can be checked
+static int test_spool_append(struct mqtt_wss_spool *spool, uint32_t n)
+{
+    char msg[TEST_SPOOL_MSG_LEN] = { 0 };
+    memcpy(msg, &n, sizeof(n));
+    return mqtt_wss_spool_append(spool, "test/spool", msg, sizeof(msg), 1, 0);
+}
+
+static uint32_t test_spool_rec_number(struct spool_rec *rec)
+{
+    uint32_t n;
+    memcpy(&n, (char *)(rec + 1) + rec->topic_len, sizeof(n));
+    return n;
+}
+
+// acknowledges oldest record (messages are acknowledged in order)
+static int test_spool_ack_head(struct mqtt_wss_spool *spool, uint32_t expected)
+{
+    struct spool_rec *rec = REC_AT(spool, spool->head);
+    if (rec->magic != SPOOL_REC_MAGIC || rec->state != REC_SENT || test_spool_rec_number(rec) != expected)
+        return 1;
+    return !mqtt_wss_spool_ack(spool, rec->packet_id);
+}
+
+// records after crash are recovered up to first one not written completely,
+// the ones which were sent get DUP
+static int test_spool_recover(const char *path, mqtt_wss_log_ctx_t log, struct mqtt_ng_init *settings)
+{
+    struct mqtt_ng_client *mqtt = mqtt_ng_init(settings);
+    struct mqtt_wss_spool *spool = test_spool_open(path, 0, log);
+    int rc = !mqtt || !spool;
+    for (uint32_t i = 0; !rc && i < 6; i++)
+        rc = test_spool_append(spool, i);
+    rc = rc || mqtt_wss_spool_drain(spool, mqtt) != 6;
+    rc = rc || test_spool_ack_head(spool, 0) || test_spool_ack_head(spool, 1);
+    for (uint32_t i = 6; !rc && i < 8; i++)
+        rc = test_spool_append(spool, i);
+    // close doesn't write anything, file is left as it would be after crash
+    mqtt_wss_spool_close(spool);
+    mqtt_ng_destroy(mqtt);
+    if (rc)
+        return rc;
+
+    struct mqtt_wss_spool_stats stats;
+    mqtt = mqtt_ng_init(settings);
+    spool = test_spool_open(path, 0, log);
+    rc = !mqtt || !spool;
+    if (!rc) {
+        mqtt_wss_spool_get_stats(spool, &stats);
+        rc = stats.records != 6 || stats.records_pending != 6;
+    }
+    uint32_t off = rc ? 0 : spool->head;
+    for (uint32_t i = 2; !rc && i < 8; i++) {
+        struct spool_rec *rec = REC_AT(spool, off);
+        rc = test_spool_rec_number(rec) != i || !(rec->flags & REC_FLAG_DUP) != (i >= 6);
+        off += rec->len;
+    }
+    rc = rc || mqtt_wss_spool_drain(spool, mqtt) != 6;
+    if (!rc) {
+        mqtt_wss_spool_get_stats(spool, &stats);
+        rc = stats.replayed != 4;
+    }
+    if (rc) {
+        fprintf(stderr, "mqtt_wss_spool_open: Sent records not recovered with DUP\n");
+        goto out;
+    }
+
+    // record with wrong CRC and everything after it was not written completely
+    struct spool_rec *rec = REC_AT(spool, spool->head);
+    for (int i = 0; i < 3; i++)
+        rec = (struct spool_rec *)((char *)rec + rec->len);
+    ((char *)(rec + 1))[rec->topic_len + 10] ^= 1;
+    mqtt_wss_spool_close(spool);
+    spool = test_spool_open(path, 0, log);
+    rc = !spool;
+    if (!rc) {
+        mqtt_wss_spool_get_stats(spool, &stats);
+        rc = stats.records != 3;
+    }
+    if (rc) {
+        fprintf(stderr, "mqtt_wss_spool_open: Record with wrong CRC recovered\n");
+        goto out;
+    }
+
+    // so is the one out of sequence (e.g. left from before wrapping)
+    rec = REC_AT(spool, spool->head + REC_AT(spool, spool->head)->len);
+    rec->seq += 100;
+    mqtt_wss_spool_close(spool);
+    spool = test_spool_open(path, 0, log);
+    rc = !spool;
+    if (!rc) {
+        mqtt_wss_spool_get_stats(spool, &stats);
+        rc = stats.records != 1;
+    }
+    if (rc)
+        fprintf(stderr, "mqtt_wss_spool_open: Record out of sequence recovered\n");
+
+out:
+    mqtt_wss_spool_close(spool);
+    mqtt_ng_destroy(mqtt);
+    return rc;
+}
+
+// fills the spool, frees its first half and fills it again so that it wraps around,
+// messages have to come out in order (across restart too)
+static int test_spool_wrap(const char *path, mqtt_wss_log_ctx_t log, struct mqtt_ng_init *settings)
+{
+    struct mqtt_ng_client *mqtt = mqtt_ng_init(settings);
+    // only one QOS1 message is sent at a time
+    struct mqtt_wss_spool *spool = test_spool_open(path, 1, log);
+    if (!mqtt || !spool) {
+        mqtt_wss_spool_close(spool);
+        mqtt_ng_destroy(mqtt);
+        return 1;
+    }
+
+    struct mqtt_wss_spool_stats stats;
+    static char big[SPOOL_MIN_FILE_SIZE];
+    int rc = !mqtt_wss_spool_append(spool, "test/spool", big, sizeof(big), 1, 0);
+
+    uint32_t appended = 0;
+    while (!test_spool_append(spool, appended))
+        appended++;
+    mqtt_wss_spool_get_stats(spool, &stats);
+    rc = rc || stats.rejected != 2 || stats.records != appended || appended < 8;
+    if (rc) {
+        fprintf(stderr, "mqtt_wss_spool_append: File size limit not kept (%" PRIu32 " appended)\n", appended);
+        goto out;
+    }
+
+    // inflight limit holds next message back until the previous one is acknowledged
+    uint32_t acked = 0;
+    for (; !rc && acked < appended / 2; acked++) {
+        rc = mqtt_wss_spool_drain(spool, mqtt) != 1 || mqtt_wss_spool_drain(spool, mqtt);
+        rc = rc || test_spool_ack_head(spool, acked);
+    }
+    if (rc) {
+        fprintf(stderr, "mqtt_wss_spool_drain: Inflight limit not kept\n");
+        goto out;
+    }
+
+    uint32_t wrapped_from = appended;
+    while (!test_spool_append(spool, appended))
+        appended++;
+    rc = appended - wrapped_from < appended / 4 || spool->tail >= spool->head;
+    if (rc) {
+        fprintf(stderr, "mqtt_wss_spool_append: Ring didn't wrap around\n");
+        goto out;
+    }
+
+    mqtt_wss_spool_close(spool);
+    mqtt_ng_destroy(mqtt);
+    mqtt = mqtt_ng_init(settings);
+    spool = test_spool_open(path, 1, log);
+    if (!mqtt || !spool) {
+        rc = 1;
+        goto out;
+    }
+    mqtt_wss_spool_get_stats(spool, &stats);
+    rc = stats.records != appended - acked;
+
+    for (; !rc && acked < appended; acked++) {
+        rc = mqtt_wss_spool_drain(spool, mqtt) != 1;
+        rc = rc || test_spool_ack_head(spool, acked);
+    }
+    if (!rc) {
+        mqtt_wss_spool_get_stats(spool, &stats);
+        rc = stats.records || stats.bytes_used || stats.inflight_bytes;
+    }
+    if (rc)
+        fprintf(stderr, "mqtt_wss_spool_drain: Messages lost or out of order after wrap (%" PRIu32 " of %" PRIu32 " acknowledged)\n", acked, appended);
+
+out:
+    mqtt_wss_spool_close(spool);
+    mqtt_ng_destroy(mqtt);
+    return rc;
+}
+
+int test_mqtt_wss_spool()
+{
+    char path[] = "/tmp/mqtt_wss_spool_test_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0)
+        return 1;
+    close(fd);
+
+    mqtt_wss_log_ctx_t log = mqtt_wss_log_ctx_create("test_spool", NULL);
+    struct mqtt_ng_init settings = {
+        .log = log,
+        .data_out_fnc = &test_spool_send
+    };
+
+    int rc = test_spool_recover(path, log, &settings);
+    // spool file is created again
+    unlink(path);
+    rc = rc || test_spool_wrap(path, log, &settings);
+
+    unlink(path);
+    mqtt_wss_log_ctx_destroy(log);
+    return rc;
+}
+#endif /* TESTS */
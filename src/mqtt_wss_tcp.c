@@ -0,0 +1,180 @@
+// SPDX-License-Identifier: GPL-3.0-only
+//
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free Software Foundation, version 3.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+// See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with this program.
+// If not, see <https://www.gnu.org/licenses/>.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h> //TCP_NODELAY
+
+#include "mqtt_wss_tcp.h"
+#include "common_internal.h"
+
+#define UNIT_LOG_PREFIX "mqtt_wss_tcp: "
+#define ERROR(fmt, ...) mws_error(log, UNIT_LOG_PREFIX fmt, ##__VA_ARGS__)
+#define INFO(fmt, ...) mws_info(log, UNIT_LOG_PREFIX fmt, ##__VA_ARGS__)
+#define DEBUG(fmt, ...) mws_debug(log, UNIT_LOG_PREFIX fmt, ##__VA_ARGS__)
+
+static const char *addr_to_str(const struct mws_addr *addr, char *buf, size_t size)
+{
+    if (getnameinfo((const struct sockaddr *)&addr->addr, addr->len, buf, size, NULL, 0, NI_NUMERICHOST))
+        snprintf(buf, size, "?");
+    return buf;
+}
+
+// starts attempt to connect to next address which doesn't fail right away
+// returns 0 if attempt was started
+static int race_start_attempt(struct mws_tcp_race *race, mqtt_wss_log_ctx_t log)
+{
+    char addr_str[NI_MAXHOST];
+
+    while (race->next_addr < race->addrs->count) {
+        size_t idx = race->next_addr++;
+        const struct mws_addr *addr = &race->addrs->addrs[idx];
+
+        int fd = socket(addr->addr.ss_family, SOCK_STREAM, 0);
+        if (fd < 0) {
+            race->last_errno = errno;
+            continue;
+        }
+        // readiness of new sockets is watched by mqtt_wss_service or the reactor,
+        // connected socket is handed over to OpenSSL
+        if (fcntl(fd, F_SETFD, FD_CLOEXEC) == -1 ||
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) == -1) {
+            race->last_errno = errno;
+            ERROR("Error setting O_NONBLOCK to TCP socket. \"%s\"", strerror(errno));
+            close(fd);
+            continue;
+        }
+
+        int flag = 1;
+        if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(int)) < 0)
+            ERROR("Could not dissable NAGLE");
+
+        DEBUG("Connecting to %s", addr_to_str(addr, addr_str, sizeof(addr_str)));
+        if (connect(fd, (const struct sockaddr *)&addr->addr, addr->len) < 0 && errno != EINPROGRESS) {
+            race->last_errno = errno;
+            DEBUG("Connecting to %s failed \"%s\"", addr_str, strerror(errno));
+            close(fd);
+            continue;
+        }
+
+        // even immediately connected socket is reported by the next poll
+        race->fds[race->attempts] = fd;
+        race->fd_addr[race->attempts] = idx;
+        race->attempts++;
+        return 0;
+    }
+    return 1;
+}
+
+static void race_close_attempt(struct mws_tcp_race *race, int i)
+{
+    close(race->fds[i]);
+    race->attempts--;
+    race->fds[i] = race->fds[race->attempts];
+    race->fd_addr[i] = race->fd_addr[race->attempts];
+}
+
+int mws_tcp_race_start(struct mws_tcp_race *race, struct mws_addr_list *addrs, long long int now_ms, mqtt_wss_log_ctx_t log)
+{
+    memset(race, 0, sizeof(*race));
+    race->addrs = addrs;
+    race->next_attempt_ms = now_ms + MWS_TCP_ATTEMPT_DELAY_MS;
+    if (race_start_attempt(race, log)) {
+        ERROR("Could not start connecting to any of %zu addresses, last error \"%s\"", addrs->count, strerror(race->last_errno));
+        return 1;
+    }
+    return 0;
+}
+
+int mws_tcp_race_process(struct mws_tcp_race *race, long long int now_ms, mqtt_wss_log_ctx_t log)
+{
+    struct pollfd fds[MWS_TCP_MAX_ATTEMPTS];
+    char addr_str[NI_MAXHOST];
+
+    for (int i = 0; i < race->attempts; i++) {
+        fds[i].fd = race->fds[i];
+        fds[i].events = POLLOUT;
+        fds[i].revents = 0;
+    }
+
+    if (race->attempts && poll(fds, race->attempts, 0) < 0 && errno != EINTR) {
+        ERROR("poll error \"%s\"", strerror(errno));
+        return MWS_TCP_RACE_FAILED;
+    }
+
+    // walk backwards as closing an attempt moves the last one into its place
+    for (int i = race->attempts - 1; i >= 0; i--) {
+        if (!fds[i].revents)
+            continue;
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(race->fds[i], SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+            err = errno;
+        if (!err) {
+            int fd = race->fds[i];
+            INFO("Connected to %s", addr_to_str(&race->addrs->addrs[race->fd_addr[i]], addr_str, sizeof(addr_str)));
+            race->fds[i] = -1;
+            for (int j = 0; j < race->attempts; j++) {
+                if (race->fds[j] >= 0)
+                    close(race->fds[j]);
+            }
+            race->attempts = 0;
+            return fd;
+        }
+        race->last_errno = err;
+        DEBUG("Connecting to %s failed \"%s\"", addr_to_str(&race->addrs->addrs[race->fd_addr[i]], addr_str, sizeof(addr_str)), strerror(err));
+        race_close_attempt(race, i);
+        fds[i] = fds[race->attempts];
+    }
+
+    // failed attempt doesn't have to wait for the delay [RFC8305 5]
+    if (!race->attempts || (now_ms >= race->next_attempt_ms && race->attempts < MWS_TCP_MAX_ATTEMPTS)) {
+        if (!race_start_attempt(race, log))
+            race->next_attempt_ms = now_ms + MWS_TCP_ATTEMPT_DELAY_MS;
+    }
+
+    if (!race->attempts) {
+        ERROR("Could not connect to any of %zu addresses, last error \"%s\"", race->addrs->count, strerror(race->last_errno));
+        return MWS_TCP_RACE_FAILED;
+    }
+    return MWS_TCP_RACE_PENDING;
+}
+
+long long int mws_tcp_race_timeout_ms(struct mws_tcp_race *race, long long int now_ms)
+{
+    if (!race->addrs || race->next_addr >= race->addrs->count || race->attempts >= MWS_TCP_MAX_ATTEMPTS)
+        return -1;
+    return race->next_attempt_ms > now_ms ? race->next_attempt_ms - now_ms : 0;
+}
+
+int mws_tcp_race_get_fds(struct mws_tcp_race *race, int *fds, int max)
+{
+    int i;
+    for (i = 0; i < race->attempts && i < max; i++)
+        fds[i] = race->fds[i];
+    return i;
+}
+
+void mws_tcp_race_cancel(struct mws_tcp_race *race)
+{
+    for (int i = 0; i < race->attempts; i++)
+        close(race->fds[i]);
+    race->attempts = 0;
+    mw_free(race->addrs);
+    race->addrs = NULL;
+}
@@ -20,6 +20,8 @@
 #include <openssl/evp.h>
 
 #include "ws_client.h"
+#include "ws_mask.h"
+#include "mqtt_wss_alloc.h"
 #include "common_internal.h"
 
 #ifdef MQTT_WEBSOCKETS_DEBUG
@@ -40,12 +42,16 @@ const char *websocket_upgrage_hdr = "GET /mqtt HTTP/1.1\x0D\x0A"
                               "Sec-WebSocket-Key: %s\x0D\x0A"
                               "Origin: http://example.com\x0D\x0A"
                               "Sec-WebSocket-Protocol: mqtt\x0D\x0A"
-                              "Sec-WebSocket-Version: 13\x0D\x0A\x0D\x0A";
+                              "Sec-WebSocket-Version: 13\x0D\x0A"
+                              "%s" // Sec-WebSocket-Extensions if any
+                              "\x0D\x0A";
 
 const char *mqtt_protoid = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
 
 #define DEFAULT_RINGBUFFER_SIZE (1024*128)
 #define ENTROPY_SOURCE "/dev/urandom"
+#define WS_MASK_SIZE sizeof(uint32_t)
+#define DEFAULT_MASK_POOL_SIZE (WS_MASK_SIZE * 1024)
 ws_client *ws_client_new(size_t buf_size, char **host, mqtt_wss_log_ctx_t log)
 {
     ws_client *client;
@@ -78,8 +84,13 @@ ws_client *ws_client_new(size_t buf_size, char **host, mqtt_wss_log_ctx_t log)
         goto cleanup_3;
     }
 
+    if (ws_client_set_mask_pool_size(client, DEFAULT_MASK_POOL_SIZE))
+        goto cleanup_4;
+
     return client;
 
+cleanup_4:
+    close(client->entropy_fd);
 cleanup_3:
     rbuf_free(client->buf_to_mqtt);
 cleanup_2:
@@ -99,7 +110,7 @@ void ws_client_free_headers(ws_client *client)
     while (ptr) {
         tmp = ptr;
         ptr = ptr->next;
-        mw_free(tmp);
+        mw_obj_free(tmp);
     }
 
     client->hs.headers = NULL;
@@ -113,6 +124,8 @@ void ws_client_destroy(ws_client *client)
     mw_free(client->hs.nonce_reply);
     mw_free(client->hs.http_reply_msg);
     close(client->entropy_fd);
+    mw_free(client->mask_pool);
+    ws_deflate_destroy(&client->deflate);
     rbuf_free(client->buf_read);
     rbuf_free(client->buf_write);
     rbuf_free(client->buf_to_mqtt);
@@ -132,6 +145,65 @@ void ws_client_reset(ws_client *client)
     client->state = WS_RAW;
     client->hs.hdr_state = WS_HDR_HTTP;
     client->rx.parse_state = WS_FIRST_2BYTES;
+    ws_deflate_reset(&client->deflate);
+}
+
+int ws_client_set_mask_pool_size(ws_client *client, size_t size)
+{
+    size -= size % WS_MASK_SIZE;
+    if (!size) {
+        ERROR("Mask pool must be able to hold at least one mask");
+        return 1;
+    }
+
+    char *pool = mw_realloc(client->mask_pool, size);
+    if (!pool) {
+        ERROR("OOM allocating mask pool");
+        return 1;
+    }
+
+    client->mask_pool = pool;
+    client->mask_pool_size = size;
+    // force refill on next use
+    client->mask_pool_used = size;
+    return 0;
+}
+
+void ws_client_set_allocator(ws_client *client, const struct mqtt_wss_allocator *allocator)
+{
+    __atomic_store_n(&client->alloc, allocator, __ATOMIC_RELAXED);
+}
+
+static inline const struct mqtt_wss_allocator *ws_client_alloc(ws_client *client)
+{
+    return __atomic_load_n(&client->alloc, __ATOMIC_RELAXED);
+}
+
+static int ws_client_refill_mask_pool(ws_client *client)
+{
+    size_t filled = 0;
+    while (filled < client->mask_pool_size) {
+        ssize_t rd = read(client->entropy_fd, &client->mask_pool[filled], client->mask_pool_size - filled);
+        if (rd <= 0) {
+            if (rd < 0 && errno == EINTR)
+                continue;
+            ERROR("Unable to refill mask pool from \"" ENTROPY_SOURCE "\"");
+            return 1;
+        }
+        filled += rd;
+    }
+    client->mask_pool_used = 0;
+    return 0;
+}
+
+static inline int ws_client_get_mask(ws_client *client, char *mask)
+{
+    if (client->mask_pool_used + WS_MASK_SIZE > client->mask_pool_size && ws_client_refill_mask_pool(client))
+        return 1;
+
+    memcpy(mask, &client->mask_pool[client->mask_pool_used], WS_MASK_SIZE);
+    client->mask_pool_used += WS_MASK_SIZE;
+    return 0;
 }
 
 #define MAX_HTTP_HDR_COUNT 128
@@ -153,6 +225,17 @@ int ws_client_add_http_header(ws_client *client, struct http_header *hdr)
     return 0;
 }
 
+void ws_client_set_rx_payload_cb(ws_client *client, ws_client_rx_payload_cb_t cb, void *ctx)
+{
+    client->rx_payload_cb = cb;
+    client->rx_payload_ctx = ctx;
+}
+
+int ws_client_set_deflate(ws_client *client, const struct mqtt_wss_deflate_params *params)
+{
+    return ws_deflate_set_params(&client->deflate, params, client->log);
+}
+
 int ws_client_want_write(ws_client *client)
 {
     return rbuf_bytes_available(client->buf_write);
@@ -185,6 +268,7 @@ int ws_client_start_handshake(ws_client *client)
     char nonce[WEBSOCKET_NONCE_SIZE];
     char nonce_b64[256];
     char second[TEMP_BUF_SIZE];
+    char extensions[256];
     unsigned int md_len;
     unsigned char *digest;
     EVP_MD_CTX *md_ctx;
@@ -195,11 +279,17 @@ int ws_client_start_handshake(ws_client *client)
         return 1;
     }
 
+    if (ws_deflate_offer(&client->deflate, extensions, sizeof(extensions))) {
+        ERROR("Couldn't generate Sec-WebSocket-Extensions header");
+        return 1;
+    }
+
     ws_client_get_nonce(client, nonce, WEBSOCKET_NONCE_SIZE);
     EVP_EncodeBlock((unsigned char *)nonce_b64, (const unsigned char *)nonce, WEBSOCKET_NONCE_SIZE);
     snprintf(second, TEMP_BUF_SIZE, websocket_upgrage_hdr,
         *client->host,
-        nonce_b64);
+        nonce_b64,
+        extensions);
     if(rbuf_bytes_free(client->buf_write) < strlen(second)) {
         ERROR("Write buffer capacity too low.");
         return 1;
@@ -267,6 +357,7 @@ int ws_client_start_handshake(ws_client *client)
 #define HTTP_SC_LENGTH 4 // "XXX " http status code as C string
 #define WS_CLIENT_HTTP_HDR "HTTP/1.1 "
 #define WS_CONN_ACCEPT "sec-websocket-accept"
+#define WS_EXTENSIONS "sec-websocket-extensions"
 #define HTTP_HDR_SEPARATOR ": "
 #define WS_NONCE_STRLEN_B64 28
 #define WS_HTTP_NEWLINE "\r\n"
@@ -284,6 +375,21 @@ int ws_client_start_handshake(ws_client *client)
     return WS_CLIENT_PROTOCOL_ERROR; \
 }
 
+static int ws_client_negotiate_extensions(ws_client *client)
+{
+    const char *extensions = NULL;
+    for (struct http_header *hdr = client->hs.headers; hdr; hdr = hdr->next) {
+        if (strcmp(hdr->key, WS_EXTENSIONS))
+            continue;
+        if (extensions) {
+            ERROR("Multiple " WS_EXTENSIONS " headers received, we offered single extension");
+            return 1;
+        }
+        extensions = hdr->value;
+    }
+    return ws_deflate_accept(&client->deflate, extensions, client->log);
+}
+
 int ws_client_parse_handshake_resp(ws_client *client)
 {
     char buf[HTTP_SC_LENGTH];
@@ -357,7 +463,12 @@ int ws_client_parse_handshake_resp(ws_client *client)
                 return WS_CLIENT_PROTOCOL_ERROR;
             }
 
-            struct http_header *hdr = mw_calloc(1, sizeof(struct http_header) + idx_crlf); //idx_crlf includes ": " that will be used as 2 \0 bytes
+            struct http_header *hdr = mw_obj_malloc(ws_client_alloc(client), sizeof(struct http_header) + idx_crlf); //idx_crlf includes ": " that will be used as 2 \0 bytes
+            if (!hdr) {
+                ERROR("OOM allocating HTTP header");
+                return WS_CLIENT_INTERNAL_ERROR;
+            }
+            memset(hdr, 0, sizeof(struct http_header) + idx_crlf);
             hdr->key = ((char*)hdr) + sizeof(struct http_header);
             hdr->value = hdr->key + idx_sep + 1;
 
@@ -372,8 +483,10 @@ int ws_client_parse_handshake_resp(ws_client *client)
 
 //            DEBUG("HTTP header \"%s\" received. Value \"%s\"", hdr->key, hdr->value);
 
-            if (ws_client_add_http_header(client, hdr))
+            if (ws_client_add_http_header(client, hdr)) {
+                mw_obj_free(hdr);
                 return WS_CLIENT_PROTOCOL_ERROR;
+            }
 
             if (!strcmp(hdr->key, WS_CONN_ACCEPT)) {
                 if (strcmp(client->hs.nonce_reply, hdr->value)) {
@@ -393,6 +506,8 @@ int ws_client_parse_handshake_resp(ws_client *client)
                 ERROR("HTTP return code not 101. Received %d with msg \"%s\".", client->hs.http_code, client->hs.http_reply_msg);
                 return WS_CLIENT_PROTOCOL_ERROR;
             }
+            if (ws_client_negotiate_extensions(client))
+                return WS_CLIENT_PROTOCOL_ERROR;
 
             client->state = WS_ESTABLISHED;
             client->hs.hdr_state = WS_HDR_ALL_DONE;
@@ -420,18 +535,113 @@ static inline size_t get_ws_hdr_size(size_t payload_size)
 }
 
 #define MAX_POSSIBLE_HDR_LEN 14
-int ws_client_send(ws_client *client, enum websocket_opcode frame_type, const char *data, size_t size)
+// copies data into write ringbuffer masking it on the fly
+// mask_idx keeps the mask phase so frame payload can be pushed
+// in multiple chunks (e.g. from multiple iovecs)
+static size_t ws_client_push_masked(ws_client *client, const char *data, size_t size, const char *mask, size_t *mask_idx)
+{
+    size_t size_written = 0;
+
+    while (size - size_written) {
+        size_t writable_bytes;
+        char *w_ptr = rbuf_get_linear_insert_range(client->buf_write, &writable_bytes);
+        if(!writable_bytes)
+            break;
+
+        writable_bytes = (writable_bytes > size - size_written) ? (size - size_written) : writable_bytes;
+
+        *mask_idx = ws_mask_copy(w_ptr, &data[size_written], writable_bytes, mask, *mask_idx);
+        rbuf_bump_head(client->buf_write, writable_bytes);
+
+        size_written += writable_bytes;
+    }
+    return size_written;
+}
+
+#define WS_RSV1 0x40
+#define WS_RSV_MASK 0x70
+#define WS_OPCODE_MASK 0x0F
+
+// generates frame header, mask is left to be filled in at last WS_MASK_SIZE bytes
+// @return header length
+static size_t ws_client_gen_frame_hdr(char *hdr, char first_byte, size_t size)
+{
+    char *ptr = hdr;
+    *ptr++ = first_byte;
+
+    //generate length
+    *ptr = WS_PAYLOAD_MASKED;
+    if (size > 65535) {
+        *ptr++ |= 0x7f;
+        uint64_t be = htobe64(size);
+        memcpy(ptr, (void *)&be, sizeof(be));
+        ptr += sizeof(be);
+    } else if (size > 125) {
+        *ptr++ |= 0x7e;
+        uint16_t be = htobe16(size);
+        memcpy(ptr, (void *)&be, sizeof(be));
+        ptr += sizeof(be);
+    } else
+        *ptr++ |= size;
+
+    return ptr - hdr + WS_MASK_SIZE;
+}
+
+// message is compressed first as header needs its final length
+// returns number of uncompressed bytes consumed as caller cares about those
+static int ws_client_sendv_deflate(ws_client *client, const struct iovec *iov, int iovcnt, size_t size)
+{
+    char hdr[MAX_POSSIBLE_HDR_LEN];
+    size_t j = 0;
+
+    size_t w_buff_free = rbuf_bytes_free(client->buf_write);
+    if (w_buff_free < MAX_POSSIBLE_HDR_LEN * 2)
+        return 0;
+
+    // deflate context can't be rolled back, only take as much
+    // as is guaranteed to fit into the buffer once compressed
+    size_t max_input = ws_deflate_max_input(&client->deflate, w_buff_free - MAX_POSSIBLE_HDR_LEN);
+    if (!max_input)
+        return 0;
+    if (size > max_input)
+        size = max_input;
+
+    ssize_t compressed = ws_deflate_compress(&client->deflate, iov, iovcnt, size, client->log);
+    if (compressed < 0)
+        return -2;
+
+    size_t hdr_len = ws_client_gen_frame_hdr(hdr, WS_OP_BINARY_FRAME | WS_FINAL_FRAG | WS_RSV1, compressed);
+    char *mask = &hdr[hdr_len - WS_MASK_SIZE];
+    if (ws_client_get_mask(client, mask)) {
+        ERROR("Unable to get mask for WebSocket frame");
+        return -2;
+    }
+
+    rbuf_push(client->buf_write, hdr, hdr_len);
+    ws_client_push_masked(client, client->deflate.tx_buf, compressed, mask, &j);
+    return size;
+}
+
+int ws_client_sendv(ws_client *client, enum websocket_opcode frame_type, const struct iovec *iov, int iovcnt)
 {
     // TODO maybe? implement fragmenting, it is not necessary though
     // as both tested MQTT brokers have no reuirement of one MQTT envelope
     // be equal to one WebSockets envelope. Therefore there is no need to send
     // one big MQTT message as single fragmented WebSocket envelope
     char hdr[MAX_POSSIBLE_HDR_LEN];
-    char *ptr = hdr;
     char *mask;
-    int size_written = 0;
+    size_t size = 0;
+    size_t size_written = 0;
     size_t j = 0;
 
+    for (int i = 0; i < iovcnt; i++)
+        size += iov[i].iov_len;
+
+    // control frames must not be compressed [RFC7692 6.1]
+    // empty message would produce no sync flush output from zlib, send it as is
+    if (client->deflate.active && frame_type == WS_OP_BINARY_FRAME && size && size >= client->deflate.params.threshold)
+        return ws_client_sendv_deflate(client, iov, iovcnt, size);
+
     size_t w_buff_free = rbuf_bytes_free(client->buf_write);
     size_t hdr_len = get_ws_hdr_size(size);
 
@@ -447,7 +657,6 @@ int ws_client_send(ws_client *client, enum websocket_opcode frame_type, const ch
         DEBUG("Can't write whole MQTT packet of %d bytes into the buffer. Will do partial send of %d.", size, w_buff_free - hdr_len);
 #endif
         size = w_buff_free - hdr_len;
-        hdr_len = get_ws_hdr_size(size);
         // the actual needed header size might decrease if we cut number of bytes
         // if decrease of size crosses 65535 or 125 boundary
         // but I can live with that at least for now
@@ -455,53 +664,35 @@ int ws_client_send(ws_client *client, enum websocket_opcode frame_type, const ch
         // no bigus dealus
     }
 
-    *ptr++ = frame_type | WS_FINAL_FRAG;
+    hdr_len = ws_client_gen_frame_hdr(hdr, frame_type | WS_FINAL_FRAG, size);
 
-    //generate length
-    *ptr = WS_PAYLOAD_MASKED;
-    if (size > 65535) {
-        *ptr++ |= 0x7f;
-        uint64_t be = htobe64(size);
-        memcpy(ptr, (void *)&be, sizeof(be));
-        ptr += sizeof(be);
-    } else if (size > 125) {
-        *ptr++ |= 0x7e;
-        uint16_t be = htobe16(size);
-        memcpy(ptr, (void *)&be, sizeof(be));
-        ptr += sizeof(be);
-    } else
-        *ptr++ |= size;
-    
-    mask = ptr;
-    if (read(client->entropy_fd, mask, sizeof(uint32_t)) < (ssize_t)sizeof(uint32_t)) {
-        ERROR("Unable to get mask from \"" ENTROPY_SOURCE "\"");
+    mask = &hdr[hdr_len - WS_MASK_SIZE];
+    if (ws_client_get_mask(client, mask)) {
+        ERROR("Unable to get mask for WebSocket frame");
         return -2;
     }
 
     rbuf_push(client->buf_write, hdr, hdr_len);
 
-    if (!size)
-        return 0;
-
     // copy and mask data in the write ringbuffer
-    while (size - size_written) {
-        size_t writable_bytes;
-        char *w_ptr = rbuf_get_linear_insert_range(client->buf_write, &writable_bytes);
-        if(!writable_bytes)
-            break;
-
-        writable_bytes = (writable_bytes > size) ? (size - size_written) : writable_bytes;
-
-        memcpy(w_ptr, &data[size_written], writable_bytes);
-        rbuf_bump_head(client->buf_write, writable_bytes);
-
-        for (size_t i = 0; i < writable_bytes; i++, j++)
-            w_ptr[i] ^= mask[j % 4];
-        size_written += writable_bytes;
+    for (int i = 0; i < iovcnt && size_written < size; i++) {
+        size_t chunk = iov[i].iov_len;
+        if (chunk > size - size_written)
+            chunk = size - size_written;
+        size_written += ws_client_push_masked(client, iov[i].iov_base, chunk, mask, &j);
     }
     return size_written;
 }
 
+int ws_client_send(ws_client *client, enum websocket_opcode frame_type, const char *data, size_t size)
+{
+    struct iovec iov = {
+        .iov_base = (void *)data,
+        .iov_len = size
+    };
+    return ws_client_sendv(client, frame_type, &iov, 1);
+}
+
 static int check_opcode(ws_client *client,enum websocket_opcode oc)
 {
     switch(oc) {
@@ -527,7 +718,7 @@ static inline void ws_client_rx_post_hdr_state(ws_client *client)
 {
     switch(client->rx.opcode) {
         case WS_OP_BINARY_FRAME:
-            client->rx.parse_state = WS_PAYLOAD_DATA;
+            client->rx.parse_state = client->rx.compressed ? WS_PAYLOAD_DEFLATED_DATA : WS_PAYLOAD_DATA;
             return;
         case WS_OP_CONNECTION_CLOSE:
             client->rx.parse_state = WS_PAYLOAD_CONNECTION_CLOSE;
@@ -541,22 +732,95 @@ static inline void ws_client_rx_post_hdr_state(ws_client *client)
     }
 }
 
+// passes inflated data to consumer right away so that message
+// bigger than buf_to_mqtt once inflated can still be received
+static int ws_client_rx_deliver_staged(ws_client *client)
+{
+    size_t avail;
+    if (!client->rx_payload_cb)
+        return 0;
+    while ((avail = rbuf_bytes_available(client->buf_to_mqtt))) {
+        ssize_t consumed = client->rx_payload_cb(client->rx_payload_ctx, client->buf_to_mqtt, avail);
+        if (consumed < 0)
+            return WS_CLIENT_CONSUMER_ERROR;
+        if (!consumed)
+            break;
+    }
+    return 0;
+}
+
+// inflates compressed payload from buf_read into buf_to_mqtt
+static int ws_client_rx_inflate(ws_client *client)
+{
+    struct ws_deflate *deflate = &client->deflate;
+
+    while (!ws_deflate_rx_msg_complete(deflate)) {
+        size_t remaining = client->rx.payload_length - client->rx.payload_processed;
+        size_t in_len = 0;
+        const char *in = NULL;
+        if (remaining) {
+            in = rbuf_get_linear_read_range(client->buf_read, &in_len);
+            if (!in_len)
+                return WS_CLIENT_NEED_MORE_BYTES;
+            if (in_len > remaining)
+                in_len = remaining;
+        }
+
+        size_t out_len;
+        char *out = rbuf_get_linear_insert_range(client->buf_to_mqtt, &out_len);
+        if (!out || !out_len) {
+#ifdef DEBUG_ULTRA_VERBOSE
+            DEBUG("BUFFER TOO FULL to inflate into");
+#endif
+            return WS_CLIENT_BUFFER_FULL;
+        }
+
+        size_t in_requested = in_len;
+        if (ws_deflate_inflate(deflate, in, &in_len, out, &out_len)) {
+            ERROR("Error inflating compressed message: %s", deflate->rx.msg ? deflate->rx.msg : "unknown");
+            return WS_CLIENT_PROTOCOL_ERROR;
+        }
+        if (in_requested && !in_len && !out_len) {
+            ERROR("Inflate doesn't progress");
+            return WS_CLIENT_PROTOCOL_ERROR;
+        }
+        if (in_len) {
+            rbuf_bump_tail(client->buf_read, in_len);
+            client->rx.payload_processed += in_len;
+        }
+        if (out_len)
+            rbuf_bump_head(client->buf_to_mqtt, out_len);
+
+        if (ws_client_rx_deliver_staged(client))
+            return WS_CLIENT_CONSUMER_ERROR;
+    }
+    return 0;
+}
+
 #define LONGEST_POSSIBLE_HDR_PART 8
 int ws_client_process_rx_ws(ws_client *client)
 {
     char buf[LONGEST_POSSIBLE_HDR_PART];
     size_t size;
+    int ret;
     switch (client->rx.parse_state) {
         case WS_FIRST_2BYTES:
             BUF_READ_CHECK_AT_LEAST(2);
             rbuf_pop(client->buf_read, buf, 2);
-            client->rx.opcode = buf[0] & (char)~BYTE_MSB;
+            client->rx.opcode = buf[0] & WS_OPCODE_MASK;
 
-            if (!(buf[0] & (char)~WS_FINAL_FRAG)) {
+            if (!client->rx.opcode) {
                 ERROR("Not supporting fragmented messages yet!");
                 return WS_CLIENT_PROTOCOL_ERROR;
             }
 
+            // RSV1 marks compressed message, only data frames can be compressed [RFC7692 6]
+            client->rx.compressed = !!(buf[0] & WS_RSV1);
+            if ((buf[0] & WS_RSV_MASK & ~WS_RSV1) || (client->rx.compressed && (!client->deflate.active || client->rx.opcode != WS_OP_BINARY_FRAME))) {
+                ERROR("WebSocket frame with unexpected RSV bits set (0x%02X)", (unsigned char)buf[0]);
+                return WS_CLIENT_PROTOCOL_ERROR;
+            }
+
             if (check_opcode(client, client->rx.opcode) == WS_CLIENT_PROTOCOL_ERROR)
                 return WS_CLIENT_PROTOCOL_ERROR;
 
@@ -593,8 +857,23 @@ int ws_client_process_rx_ws(ws_client *client)
             // TODO not pretty?
             while (client->rx.payload_processed < client->rx.payload_length) {
                 size_t remaining = client->rx.payload_length - client->rx.payload_processed;
-                if (!rbuf_bytes_available(client->buf_read))
+                size_t avail = rbuf_bytes_available(client->buf_read);
+                if (!avail)
                     return WS_CLIENT_NEED_MORE_BYTES;
+                // staged data has to be consumed first to keep the stream in order
+                if (client->rx_payload_cb && !rbuf_bytes_available(client->buf_to_mqtt)) {
+                    ssize_t consumed = client->rx_payload_cb(client->rx_payload_ctx, client->buf_read, avail < remaining ? avail : remaining);
+                    if (consumed < 0)
+                        return WS_CLIENT_CONSUMER_ERROR;
+                    if (consumed) {
+                        client->rx.payload_processed += consumed;
+                        continue;
+                    }
+                    // consumer needs more than is available, wait for rest of the frame
+                    // if it can still fit, otherwise stage the data in buf_to_mqtt
+                    if (avail < remaining && rbuf_bytes_free(client->buf_read))
+                        return WS_CLIENT_NEED_MORE_BYTES;
+                }
                 char *insert = rbuf_get_linear_insert_range(client->buf_to_mqtt, &size);
                 if (!insert) {
 #ifdef DEBUG_ULTRA_VERBOSE
@@ -609,6 +888,13 @@ int ws_client_process_rx_ws(ws_client *client)
             }
             client->rx.parse_state = WS_PACKET_DONE;
             break;
+        case WS_PAYLOAD_DEFLATED_DATA:
+            ret = ws_client_rx_inflate(client);
+            if (ret)
+                return ret;
+            ws_deflate_rx_msg_done(&client->deflate);
+            client->rx.parse_state = WS_PACKET_DONE;
+            break;
         case WS_PAYLOAD_CONNECTION_CLOSE:
             // for WS_OP_CONNECTION_CLOSE allowed is
             // a) empty payload
@@ -672,11 +958,17 @@ int ws_client_process_rx_ws(ws_client *client)
                 return WS_CLIENT_INTERNAL_ERROR;
             }
             BUF_READ_CHECK_AT_LEAST(client->rx.payload_length);
-            client->rx.specific_data.ping_msg = mw_malloc(client->rx.payload_length);
+            client->rx.specific_data.ping_msg = mw_obj_malloc(ws_client_alloc(client), client->rx.payload_length);
+            if (!client->rx.specific_data.ping_msg) {
+                ERROR("OOM allocating PING payload");
+                return WS_CLIENT_INTERNAL_ERROR;
+            }
             rbuf_pop(client->buf_read, client->rx.specific_data.ping_msg, client->rx.payload_length);
             // TODO schedule this instead of sending right away
             // then attempt to send as soon as buffer space clears up
             size = ws_client_send(client, WS_OP_PONG, client->rx.specific_data.ping_msg, client->rx.payload_length);
+            mw_obj_free(client->rx.specific_data.ping_msg);
+            client->rx.specific_data.ping_msg = NULL;
             if (size != client->rx.payload_length) {
                 ERROR("Unable to send the PONG as one packet back. Closing connection.");
                 return WS_CLIENT_PROTOCOL_ERROR;
@@ -0,0 +1,449 @@
+// SPDX-License-Identifier: GPL-3.0-only
+//
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free Software Foundation, version 3.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+// See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with this program.
+// If not, see <https://www.gnu.org/licenses/>.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <limits.h>
+
+#include "ws_deflate.h"
+#include "common_internal.h"
+
+#define UNIT_LOG_PREFIX "ws_deflate: "
+#define ERROR(fmt, ...) mws_error(log, UNIT_LOG_PREFIX fmt, ##__VA_ARGS__)
+#define INFO(fmt, ...)  mws_info (log, UNIT_LOG_PREFIX fmt, ##__VA_ARGS__)
+
+#define WINDOW_BITS_MAX 15
+// zlib doesn't support window of 256 bytes for raw deflate (silently uses 512)
+#define TX_WINDOW_BITS_MIN 9
+#define RX_WINDOW_BITS_MIN 8
+#define DEFAULT_MEM_LEVEL 8
+
+// Z_SYNC_FLUSH appends empty stored block which deflateBound doesn't count
+#define SYNC_FLUSH_SLACK 16
+
+static const char deflate_trailer[WS_DEFLATE_TRAILER_SIZE] = { 0x00, 0x00, (char)0xFF, (char)0xFF };
+
+static voidpf ws_deflate_zalloc(voidpf opaque, uInt items, uInt size)
+{
+    (void)opaque;
+    return mw_calloc(items, size);
+}
+
+static void ws_deflate_zfree(voidpf opaque, voidpf ptr)
+{
+    (void)opaque;
+    mw_free(ptr);
+}
+
+int ws_deflate_set_params(struct ws_deflate *d, const struct mqtt_wss_deflate_params *params, mqtt_wss_log_ctx_t log)
+{
+    if (params->client_max_window_bits && (params->client_max_window_bits < TX_WINDOW_BITS_MIN || params->client_max_window_bits > WINDOW_BITS_MAX)) {
+        ERROR("client_max_window_bits must be between %d and %d", TX_WINDOW_BITS_MIN, WINDOW_BITS_MAX);
+        return 1;
+    }
+    if (params->server_max_window_bits && (params->server_max_window_bits < RX_WINDOW_BITS_MIN || params->server_max_window_bits > WINDOW_BITS_MAX)) {
+        ERROR("server_max_window_bits must be between %d and %d", RX_WINDOW_BITS_MIN, WINDOW_BITS_MAX);
+        return 1;
+    }
+    if (params->level < 0 || params->level > 9 || params->mem_level < 0 || params->mem_level > 9) {
+        ERROR("Compression level and memory level must be between 0 and 9");
+        return 1;
+    }
+    d->params = *params;
+    return 0;
+}
+
+int ws_deflate_offer(struct ws_deflate *d, char *buf, size_t size)
+{
+    const struct mqtt_wss_deflate_params *p = &d->params;
+    char client_bits[32] = "";
+    char server_bits[32] = "";
+
+    if (!p->enabled) {
+        if (size)
+            *buf = 0;
+        return size == 0;
+    }
+
+    // client_max_window_bits without value tells server we can honor its limit
+    if (p->client_max_window_bits)
+        snprintf(client_bits, sizeof(client_bits), "=%d", p->client_max_window_bits);
+    if (p->server_max_window_bits)
+        snprintf(server_bits, sizeof(server_bits), "; server_max_window_bits=%d", p->server_max_window_bits);
+
+    int len = snprintf(buf, size, "Sec-WebSocket-Extensions: " WS_DEFLATE_EXT_NAME "; client_max_window_bits%s%s%s%s\r\n",
+        client_bits,
+        server_bits,
+        p->client_no_context_takeover ? "; client_no_context_takeover" : "",
+        p->server_no_context_takeover ? "; server_no_context_takeover" : "");
+    return len < 0 || (size_t)len >= size;
+}
+
+static char *trim(char *str)
+{
+    while (isspace((unsigned char)*str))
+        str++;
+    char *end = str + strlen(str);
+    while (end > str && isspace((unsigned char)end[-1]))
+        *--end = 0;
+    return str;
+}
+
+// parses "N" or "\"N\"" [RFC7692 7.1.2]
+static int parse_window_bits(char *value, int min)
+{
+    if (!value)
+        return -1;
+    size_t len = strlen(value);
+    if (len >= 2 && value[0] == '"' && value[len - 1] == '"') {
+        value[len - 1] = 0;
+        value++;
+    }
+    if (!*value || strspn(value, "0123456789") != strlen(value))
+        return -1;
+    int bits = atoi(value);
+    if (bits < min || bits > WINDOW_BITS_MAX)
+        return -1;
+    return bits;
+}
+
+#define PARAM_SEEN_CLIENT_NCT  0x1
+#define PARAM_SEEN_SERVER_NCT  0x2
+#define PARAM_SEEN_CLIENT_BITS 0x4
+#define PARAM_SEEN_SERVER_BITS 0x8
+static int parse_reply(struct ws_deflate *d, char *hdr, mqtt_wss_log_ctx_t log)
+{
+    if (strchr(hdr, ',')) {
+        ERROR("Server accepted more than one extension, we offered only " WS_DEFLATE_EXT_NAME);
+        return 1;
+    }
+
+    char *saveptr;
+    char *token = strtok_r(hdr, ";", &saveptr);
+    if (!token || strcasecmp(trim(token), WS_DEFLATE_EXT_NAME)) {
+        ERROR("Server accepted unknown extension \"%s\"", token ? token : "");
+        return 1;
+    }
+
+    int seen = 0;
+    while ((token = strtok_r(NULL, ";", &saveptr))) {
+        char *value = strchr(token, '=');
+        if (value) {
+            *value++ = 0;
+            value = trim(value);
+        }
+        token = trim(token);
+
+        int flag;
+        if (!strcasecmp(token, "client_no_context_takeover")) {
+            flag = PARAM_SEEN_CLIENT_NCT;
+            d->tx_no_context_takeover = 1;
+        } else if (!strcasecmp(token, "server_no_context_takeover")) {
+            flag = PARAM_SEEN_SERVER_NCT;
+            d->rx_no_context_takeover = 1;
+        } else if (!strcasecmp(token, "client_max_window_bits")) {
+            flag = PARAM_SEEN_CLIENT_BITS;
+            int bits = parse_window_bits(value, RX_WINDOW_BITS_MIN);
+            if (bits < 0) {
+                ERROR("Invalid client_max_window_bits value");
+                return 1;
+            }
+            if (bits < TX_WINDOW_BITS_MIN) {
+                ERROR("Server requires compression window of %d bits which is not supported", bits);
+                return 1;
+            }
+            if (bits < d->tx_window_bits)
+                d->tx_window_bits = bits;
+        } else if (!strcasecmp(token, "server_max_window_bits")) {
+            flag = PARAM_SEEN_SERVER_BITS;
+            int bits = parse_window_bits(value, RX_WINDOW_BITS_MIN);
+            if (bits < 0 || (d->params.server_max_window_bits && bits > d->params.server_max_window_bits)) {
+                ERROR("Invalid server_max_window_bits value");
+                return 1;
+            }
+            d->rx_window_bits = bits;
+        } else {
+            ERROR("Unknown " WS_DEFLATE_EXT_NAME " parameter \"%s\"", token);
+            return 1;
+        }
+
+        if (seen & flag) {
+            ERROR("Duplicate " WS_DEFLATE_EXT_NAME " parameter \"%s\"", token);
+            return 1;
+        }
+        seen |= flag;
+        if (value && (flag == PARAM_SEEN_CLIENT_NCT || flag == PARAM_SEEN_SERVER_NCT)) {
+            ERROR(WS_DEFLATE_EXT_NAME " parameter \"%s\" can't have value", token);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int ws_deflate_accept(struct ws_deflate *d, const char *ext_hdr, mqtt_wss_log_ctx_t log)
+{
+    ws_deflate_reset(d);
+
+    if (!ext_hdr)
+        return 0;
+
+    if (!d->params.enabled) {
+        ERROR("Server accepted extension \"%s\" we didn't offer", ext_hdr);
+        return 1;
+    }
+
+    d->tx_no_context_takeover = d->params.client_no_context_takeover;
+    d->tx_window_bits = d->params.client_max_window_bits ? d->params.client_max_window_bits : WINDOW_BITS_MAX;
+    // inflate with full window can decode anything, window is limited only if server confirms it
+    d->rx_window_bits = WINDOW_BITS_MAX;
+
+    char *hdr = mw_strdup(ext_hdr);
+    if (!hdr) {
+        ERROR("OOM parsing extension header");
+        return 1;
+    }
+    int rc = parse_reply(d, hdr, log);
+    mw_free(hdr);
+    if (rc)
+        return 1;
+
+    d->tx.zalloc = d->rx.zalloc = ws_deflate_zalloc;
+    d->tx.zfree = d->rx.zfree = ws_deflate_zfree;
+    d->tx.opaque = d->rx.opaque = Z_NULL;
+
+    // negative window bits select raw deflate (no zlib header and checksum)
+    if (deflateInit2(&d->tx, d->params.level ? d->params.level : Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                     -d->tx_window_bits, d->params.mem_level ? d->params.mem_level : DEFAULT_MEM_LEVEL,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+        ERROR("deflateInit2 failed");
+        return 1;
+    }
+    d->tx_init = 1;
+
+    // zlib based servers asked for 8 bits use 9 anyway, bigger inflate window is always safe
+    if (inflateInit2(&d->rx, -(d->rx_window_bits < TX_WINDOW_BITS_MIN ? TX_WINDOW_BITS_MIN : d->rx_window_bits)) != Z_OK) {
+        ERROR("inflateInit2 failed");
+        ws_deflate_reset(d);
+        return 1;
+    }
+    d->rx_init = 1;
+
+    d->active = 1;
+    INFO(WS_DEFLATE_EXT_NAME " negotiated (client window %d bits%s, server window %d bits%s)",
+        d->tx_window_bits, d->tx_no_context_takeover ? ", no context takeover" : "",
+        d->rx_window_bits, d->rx_no_context_takeover ? ", no context takeover" : "");
+    return 0;
+}
+
+void ws_deflate_reset(struct ws_deflate *d)
+{
+    if (d->tx_init)
+        deflateEnd(&d->tx);
+    if (d->rx_init)
+        inflateEnd(&d->rx);
+    memset(&d->tx, 0, sizeof(d->tx));
+    memset(&d->rx, 0, sizeof(d->rx));
+    d->tx_init = 0;
+    d->rx_init = 0;
+    d->active = 0;
+    d->tx_no_context_takeover = 0;
+    d->rx_no_context_takeover = 0;
+    d->rx_trailer_fed = 0;
+    d->rx_output_pending = 0;
+}
+
+void ws_deflate_destroy(struct ws_deflate *d)
+{
+    ws_deflate_reset(d);
+    mw_free(d->tx_buf);
+    d->tx_buf = NULL;
+    d->tx_buf_size = 0;
+}
+
+static inline size_t compressed_bound(struct ws_deflate *d, size_t size)
+{
+    return deflateBound(&d->tx, size) + SYNC_FLUSH_SLACK;
+}
+
+size_t ws_deflate_max_input(struct ws_deflate *d, size_t out_space)
+{
+    size_t size = out_space;
+    if (size > UINT_MAX / 2)
+        size = UINT_MAX / 2;
+    // bound grows slower than input, stepping down by the excess converges quickly
+    while (size) {
+        size_t bound = compressed_bound(d, size);
+        if (bound <= out_space)
+            break;
+        size = size > bound - out_space ? size - (bound - out_space) : 0;
+    }
+    return size;
+}
+
+ssize_t ws_deflate_compress(struct ws_deflate *d, const struct iovec *iov, int iovcnt, size_t size, mqtt_wss_log_ctx_t log)
+{
+    size_t bound = compressed_bound(d, size);
+    if (bound > d->tx_buf_size) {
+        char *buf = mw_realloc(d->tx_buf, bound);
+        if (!buf) {
+            ERROR("OOM allocating compression buffer");
+            return -1;
+        }
+        d->tx_buf = buf;
+        d->tx_buf_size = bound;
+    }
+
+    d->tx.next_out = (Bytef *)d->tx_buf;
+    d->tx.avail_out = d->tx_buf_size;
+
+    size_t left = size;
+    for (int i = 0; i < iovcnt && left; i++) {
+        size_t chunk = iov[i].iov_len < left ? iov[i].iov_len : left;
+        left -= chunk;
+        d->tx.next_in = (Bytef *)iov[i].iov_base;
+        d->tx.avail_in = chunk;
+        // Z_NO_FLUSH never fails with enough output space, see compressed_bound
+        if (deflate(&d->tx, left ? Z_NO_FLUSH : Z_SYNC_FLUSH) == Z_STREAM_ERROR || d->tx.avail_in) {
+            ERROR("deflate failed");
+            return -1;
+        }
+    }
+
+    size_t len = d->tx_buf_size - d->tx.avail_out;
+    if (len < WS_DEFLATE_TRAILER_SIZE || memcmp(&d->tx_buf[len - WS_DEFLATE_TRAILER_SIZE], deflate_trailer, WS_DEFLATE_TRAILER_SIZE)) {
+        ERROR("deflate output doesn't end with sync flush marker");
+        return -1;
+    }
+
+    if (d->tx_no_context_takeover)
+        deflateReset(&d->tx);
+
+    return len - WS_DEFLATE_TRAILER_SIZE;
+}
+
+int ws_deflate_inflate(struct ws_deflate *d, const char *in, size_t *in_len, char *out, size_t *out_len)
+{
+    size_t in_avail = *in_len > UINT_MAX ? UINT_MAX : *in_len;
+    size_t out_avail = *out_len > UINT_MAX ? UINT_MAX : *out_len;
+
+    int trailer = 0;
+
+    // whole message received, only the trailer is left to be fed
+    if (!in_avail && d->rx_trailer_fed < WS_DEFLATE_TRAILER_SIZE) {
+        trailer = 1;
+        in = &deflate_trailer[d->rx_trailer_fed];
+        in_avail = WS_DEFLATE_TRAILER_SIZE - d->rx_trailer_fed;
+    }
+
+    d->rx.next_in = (Bytef *)in;
+    d->rx.avail_in = in_avail;
+    d->rx.next_out = (Bytef *)out;
+    d->rx.avail_out = out_avail;
+
+    int rc = inflate(&d->rx, Z_SYNC_FLUSH);
+
+    size_t consumed = in_avail - d->rx.avail_in;
+    if (trailer) {
+        d->rx_trailer_fed += consumed;
+        *in_len = 0;
+    } else
+        *in_len = consumed;
+    *out_len = out_avail - d->rx.avail_out;
+    // inflate might have more output than there was space for
+    d->rx_output_pending = !d->rx.avail_out;
+
+    switch (rc) {
+        case Z_STREAM_END:
+            // sender finished the stream with BFINAL block [RFC7692 7.2.3.4]
+            // rest of the payload (and the trailer) is inflated as a new stream
+            // so that whole frame is consumed, empty stored block it typically
+            // is followed by doesn't produce any output
+            inflateReset(&d->rx);
+            if (trailer)
+                d->rx_trailer_fed = WS_DEFLATE_TRAILER_SIZE;
+            return 0;
+        case Z_OK:
+        case Z_BUF_ERROR:
+            return 0;
+        default:
+            return 1;
+    }
+}
+
+void ws_deflate_rx_msg_done(struct ws_deflate *d)
+{
+    d->rx_trailer_fed = 0;
+    d->rx_output_pending = 0;
+    if (d->rx_no_context_takeover)
+        inflateReset(&d->rx);
+}
+
+#ifdef TESTS
+// inflates payload the way ws_client does, checks all of it is consumed
+static int test_inflate_msg(struct ws_deflate *d, const char *in, size_t in_len, const char *expected)
+{
+    char out[64];
+    size_t out_total = 0;
+    while (!ws_deflate_rx_msg_complete(d)) {
+        size_t consumed = in_len;
+        size_t produced = sizeof(out) - out_total;
+        if (!produced || ws_deflate_inflate(d, in, &consumed, &out[out_total], &produced))
+            return 1;
+        in += consumed;
+        in_len -= consumed;
+        out_total += produced;
+    }
+    ws_deflate_rx_msg_done(d);
+    return in_len || out_total != strlen(expected) || memcmp(out, expected, out_total);
+}
+
+int test_ws_deflate()
+{
+    // examples of RFC7692 7.2.3 received in order over single connection
+    static const char stored[] = { 0x00, 0x05, 0x00, (char)0xfa, (char)0xff, 0x48, 0x65, 0x6c, 0x6c, 0x6f, 0x00 };
+    static const char shared[] = { (char)0xf2, 0x00, 0x11, 0x00, 0x00 };
+    static const char bfinal[] = { (char)0xf3, 0x48, (char)0xcd, (char)0xc9, (char)0xc9, 0x07, 0x00, 0x00 };
+    static const char compressed[] = { (char)0xf2, 0x48, (char)0xcd, (char)0xc9, (char)0xc9, 0x07, 0x00 };
+    static const struct {
+        const char *name;
+        const char *payload;
+        size_t len;
+    } msgs[] = {
+        { "7.2.3.3 stored block",        stored,     sizeof(stored) },
+        { "7.2.3.2 sharing LZ77 window", shared,     sizeof(shared) },
+        { "7.2.3.4 BFINAL block",        bfinal,     sizeof(bfinal) },
+        // BFINAL reset the window, so it must not be needed by what follows
+        { "7.2.3.1 after BFINAL",        compressed, sizeof(compressed) },
+        { "7.2.3.4 BFINAL block again",  bfinal,     sizeof(bfinal) }
+    };
+
+    struct ws_deflate d;
+    memset(&d, 0, sizeof(d));
+    struct mqtt_wss_deflate_params params = { .enabled = 1 };
+    mqtt_wss_log_ctx_t log = mqtt_wss_log_ctx_create("test_ws_deflate", NULL);
+    int rc = ws_deflate_set_params(&d, &params, log) || ws_deflate_accept(&d, WS_DEFLATE_EXT_NAME, log);
+    if (rc)
+        fprintf(stderr, "ws_deflate_accept: Failed\n");
+
+    for (size_t i = 0; !rc && i < sizeof(msgs) / sizeof(msgs[0]); i++) {
+        if ((rc = test_inflate_msg(&d, msgs[i].payload, msgs[i].len, "Hello")))
+            fprintf(stderr, "ws_deflate_inflate(%s): Wrong output or payload not fully consumed\n", msgs[i].name);
+    }
+
+    ws_deflate_destroy(&d);
+    mqtt_wss_log_ctx_destroy(log);
+    return rc;
+}
+#endif /* TESTS */
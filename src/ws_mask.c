@@ -0,0 +1,231 @@
+// SPDX-License-Identifier: GPL-3.0-only
+//
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free Software Foundation, version 3.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+// See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with this program.
+// If not, see <https://www.gnu.org/licenses/>.
+
+#include <stdint.h>
+#include <string.h>
+
+#include "ws_mask.h"
+
+#ifndef MQTT_WSS_NO_SIMD
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define WS_MASK_X86
+#include <immintrin.h>
+#elif defined(__aarch64__) || (defined(__ARM_NEON) && defined(__GNUC__))
+#define WS_MASK_NEON
+#include <arm_neon.h>
+#endif
+#endif
+
+// all kernels expect mask already rotated so that mask[0]
+// applies to src[0]
+typedef void (*ws_mask_fnc_t)(uint8_t *dst, const uint8_t *src, size_t len, const uint8_t *mask);
+
+static inline void ws_mask_bytes(uint8_t *dst, const uint8_t *src, size_t len, const uint8_t *mask)
+{
+    for (size_t i = 0; i < len; i++)
+        dst[i] = src[i] ^ mask[i & 0x3];
+}
+
+// portable version working 8 bytes at a time
+// memcpy is used for loads/stores as buffers are not necessarily aligned
+// (compilers turn those into plain unaligned moves)
+static void ws_mask_word(uint8_t *dst, const uint8_t *src, size_t len, const uint8_t *mask)
+{
+    uint32_t m32;
+    memcpy(&m32, mask, sizeof(m32));
+    // both halves are the same so this is endianness agnostic
+    uint64_t m64 = ((uint64_t)m32 << 32) | m32;
+
+    while (len >= sizeof(m64)) {
+        uint64_t v;
+        memcpy(&v, src, sizeof(v));
+        v ^= m64;
+        memcpy(dst, &v, sizeof(v));
+        src += sizeof(v);
+        dst += sizeof(v);
+        len -= sizeof(v);
+    }
+    // 8 is multiple of mask size, phase is unchanged
+    ws_mask_bytes(dst, src, len, mask);
+}
+
+#ifdef WS_MASK_X86
+__attribute__((target("sse2")))
+static void ws_mask_sse2(uint8_t *dst, const uint8_t *src, size_t len, const uint8_t *mask)
+{
+    int32_t m32;
+    memcpy(&m32, mask, sizeof(m32));
+    __m128i m = _mm_set1_epi32(m32);
+
+    while (len >= sizeof(__m128i)) {
+        __m128i v = _mm_loadu_si128((const __m128i *)src);
+        _mm_storeu_si128((__m128i *)dst, _mm_xor_si128(v, m));
+        src += sizeof(__m128i);
+        dst += sizeof(__m128i);
+        len -= sizeof(__m128i);
+    }
+    ws_mask_word(dst, src, len, mask);
+}
+
+__attribute__((target("avx2")))
+static void ws_mask_avx2(uint8_t *dst, const uint8_t *src, size_t len, const uint8_t *mask)
+{
+    int32_t m32;
+    memcpy(&m32, mask, sizeof(m32));
+    __m256i m = _mm256_set1_epi32(m32);
+
+    while (len >= sizeof(__m256i)) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)src);
+        _mm256_storeu_si256((__m256i *)dst, _mm256_xor_si256(v, m));
+        src += sizeof(__m256i);
+        dst += sizeof(__m256i);
+        len -= sizeof(__m256i);
+    }
+    ws_mask_sse2(dst, src, len, mask);
+}
+#endif
+
+#ifdef WS_MASK_NEON
+static void ws_mask_neon(uint8_t *dst, const uint8_t *src, size_t len, const uint8_t *mask)
+{
+    uint32_t m32;
+    memcpy(&m32, mask, sizeof(m32));
+    uint8x16_t m = vreinterpretq_u8_u32(vdupq_n_u32(m32));
+
+    while (len >= sizeof(uint8x16_t)) {
+        vst1q_u8(dst, veorq_u8(vld1q_u8(src), m));
+        src += sizeof(uint8x16_t);
+        dst += sizeof(uint8x16_t);
+        len -= sizeof(uint8x16_t);
+    }
+    ws_mask_word(dst, src, len, mask);
+}
+#endif
+
+struct ws_mask_impl {
+    const char *name;
+    ws_mask_fnc_t fnc;
+};
+
+static const struct ws_mask_impl ws_mask_impls[] = {
+#ifdef WS_MASK_X86
+    { .name = "avx2", .fnc = ws_mask_avx2 },
+    { .name = "sse2", .fnc = ws_mask_sse2 },
+#endif
+#ifdef WS_MASK_NEON
+    { .name = "neon", .fnc = ws_mask_neon },
+#endif
+    { .name = "word", .fnc = ws_mask_word },
+    { .name = NULL,   .fnc = NULL }
+};
+
+static int ws_mask_impl_supported(const struct ws_mask_impl *impl)
+{
+#ifdef WS_MASK_X86
+    if (impl->fnc == ws_mask_avx2)
+        return __builtin_cpu_supports("avx2");
+    if (impl->fnc == ws_mask_sse2)
+        return __builtin_cpu_supports("sse2");
+#endif
+    (void)impl;
+    return 1;
+}
+
+static const struct ws_mask_impl *ws_mask_selected = NULL;
+
+static const struct ws_mask_impl *ws_mask_get_impl(void)
+{
+    const struct ws_mask_impl *impl = __atomic_load_n(&ws_mask_selected, __ATOMIC_ACQUIRE);
+    if (impl)
+        return impl;
+
+#ifdef WS_MASK_X86
+    __builtin_cpu_init();
+#endif
+    // the list is ordered by preference and ends with portable
+    // version which is always supported
+    for (impl = ws_mask_impls; !ws_mask_impl_supported(impl); impl++);
+
+    // racing threads would select the same thing, no need to lock
+    __atomic_store_n(&ws_mask_selected, impl, __ATOMIC_RELEASE);
+    return impl;
+}
+
+size_t ws_mask_copy(char *dst, const char *src, size_t len, const char *mask, size_t offset)
+{
+    uint8_t rotated[WS_MASK_KEY_SIZE];
+    for (int i = 0; i < WS_MASK_KEY_SIZE; i++)
+        rotated[i] = mask[(offset + i) % WS_MASK_KEY_SIZE];
+
+    ws_mask_get_impl()->fnc((uint8_t *)dst, (const uint8_t *)src, len, rotated);
+    return offset + len;
+}
+
+const char *ws_mask_impl_name(void)
+{
+    return ws_mask_get_impl()->name;
+}
+
+#ifdef TESTS
+#include <stdio.h>
+#define WS_MASK_TEST_MAXLEN 300
+
+// checks every implementation runnable on this CPU against
+// plain bytewise masking for all lengths, mask phases and misalignments
+int test_ws_mask()
+{
+    const uint8_t mask[WS_MASK_KEY_SIZE] = { 0x12, 0x34, 0xAB, 0xCD };
+    uint8_t src[WS_MASK_TEST_MAXLEN + 8];
+    uint8_t expected[WS_MASK_TEST_MAXLEN + 8];
+    uint8_t result[WS_MASK_TEST_MAXLEN + 8];
+
+    for (size_t i = 0; i < sizeof(src); i++)
+        src[i] = (uint8_t)(i * 31 + 7);
+
+    for (const struct ws_mask_impl *impl = ws_mask_impls; impl->name; impl++) {
+        if (!ws_mask_impl_supported(impl))
+            continue;
+        for (size_t align = 0; align < 8; align++) {
+            for (size_t len = 0; len <= WS_MASK_TEST_MAXLEN; len++) {
+                for (size_t phase = 0; phase < WS_MASK_KEY_SIZE; phase++) {
+                    uint8_t rotated[WS_MASK_KEY_SIZE];
+                    for (int i = 0; i < WS_MASK_KEY_SIZE; i++)
+                        rotated[i] = mask[(phase + i) % WS_MASK_KEY_SIZE];
+
+                    ws_mask_bytes(expected, &src[align], len, rotated);
+                    memset(result, 0, sizeof(result));
+                    impl->fnc(result, &src[align], len, rotated);
+                    if (memcmp(expected, result, len) || result[len]) {
+                        fprintf(stderr, "ws_mask(impl:%s, align:%zu, len:%zu, phase:%zu): Wrong output\n", impl->name, align, len, phase);
+                        return 1;
+                    }
+                }
+            }
+        }
+    }
+
+    // chunked processing has to keep the phase
+    size_t offset = 0;
+    ws_mask_bytes(expected, src, WS_MASK_TEST_MAXLEN, mask);
+    for (size_t chunk = 1; offset < WS_MASK_TEST_MAXLEN; chunk += 3) {
+        if (chunk > WS_MASK_TEST_MAXLEN - offset)
+            chunk = WS_MASK_TEST_MAXLEN - offset;
+        offset = ws_mask_copy((char *)&result[offset], (const char *)&src[offset], chunk, (const char *)mask, offset);
+    }
+    if (memcmp(expected, result, WS_MASK_TEST_MAXLEN)) {
+        fprintf(stderr, "ws_mask_copy(impl:%s): Chunked output wrong\n", ws_mask_impl_name());
+        return 1;
+    }
+
+    return 0;
+}
+#endif /* TESTS */